@@ -0,0 +1,22 @@
+#ifndef ASID_H
+#define ASID_H
+
+#include <atomic>
+#include <cstdint>
+
+/* Address space identifier for a userspace address space.
+
+    id holds the ASID in its low 16 bits and the generation it was allocated
+    in above that.  When the ASIDs run out the generation is bumped and every
+    address space is given a new ASID on its next switch in, with each core
+    flushing its TLB once at that point rather than on every change of ttbr0. */
+struct asid_context
+{
+    std::atomic<uint64_t> id = 0;
+};
+
+/* Returns ttbr0 with the ASID for ctx in bits 63:48, allocating one first if
+    necessary.  Call with interrupts disabled on the core that will load it. */
+uint64_t asid_ttbr0(asid_context *ctx, uint64_t ttbr0);
+
+#endif
@@ -5,14 +5,16 @@
 #include <map>
 #include <memory>
 #include <limits>
+#include "gap_index.h"
 
 /* Defines an allocator with base and length that does not allow blocks to
     overlap.
 
     Requires external synchronization.
 
-    Provides AllocFixed and AllocAny methods which return an iterator to
-    a map entry.
+    Provides AllocFixed, AllocAny and AllocBest methods which return an
+    iterator to a map entry.  The free gaps are kept in a GapIndex so that
+    AllocAny and AllocBest are O(log n) rather than a walk of the map.
     
     Provides IsAllocated which returns an iterator if the given
     address is allocated.
@@ -65,18 +67,88 @@ template<typename KeyT, typename AddrT = uintptr_t> class BlockAllocator
         }
 
         BlockAddress addrspace;
+        GapIndex<AddrT> gaps;
+
+        // end of the block before pos, or the start of the address space
+        AddrT prev_end(iterator pos)
+        {
+            return pos == l.begin() ? addrspace.start : std::prev(pos)->first.end();
+        }
+
+        // start of pos, or the end of the address space
+        AddrT next_start(iterator pos)
+        {
+            return pos == l.end() ? addrspace.end() : pos->first.start;
+        }
+
+        // the free gap between two addresses, within the address space
+        void gap_between(AddrT from, AddrT to, AddrT *start, AddrT *len)
+        {
+            if(from < addrspace.start)
+                from = addrspace.start;
+            if(to > addrspace.end())
+                to = addrspace.end();
+            *start = from;
+            *len = (to > from) ? to - from : 0;
+        }
+
+        void gap_erase(AddrT from, AddrT to)
+        {
+            AddrT gs, gl;
+            gap_between(from, to, &gs, &gl);
+            if(gl)
+                gaps.erase(gs);
+        }
+
+        void gap_insert(AddrT from, AddrT to)
+        {
+            AddrT gs, gl;
+            gap_between(from, to, &gs, &gl);
+            gaps.insert(gs, gl);
+        }
+
+        // pos has just been inserted into what was a single gap
+        void gaps_inserted(iterator pos)
+        {
+            auto pe = prev_end(pos);
+            auto ns = next_start(std::next(pos));
+            gap_erase(pe, ns);
+            gap_insert(pe, pos->first.start);
+            gap_insert(pos->first.end(), ns);
+        }
+
+        // pos is about to be erased, merging the gaps either side
+        void gaps_erasing(iterator pos)
+        {
+            auto pe = prev_end(pos);
+            auto ns = next_start(std::next(pos));
+            gap_erase(pe, pos->first.start);
+            gap_erase(pos->first.end(), ns);
+            gap_insert(pe, ns);
+        }
+
+        iterator insert_block(BlockAddress region, KeyT &&val)
+        {
+            auto iter = l.insert_or_assign(region, std::move(val)).first;
+            gaps_inserted(iter);
+            return iter;
+        }
 
     public:
         BlockAllocator(BlockAddress _addrspace =
             {
                 std::numeric_limits<AddrT>::min(),
                 std::numeric_limits<AddrT>::max()
-            }) : addrspace(_addrspace) { }
+            }) : addrspace(_addrspace)
+        {
+            gaps.insert(addrspace.start, addrspace.length);
+        }
 
         BlockAllocator(AddrT start, AddrT length)
         {
             addrspace.start = start;
             addrspace.length = length;
+            gaps.insert(addrspace.start, addrspace.length);
         }
 
         iterator AllocFixed(BlockAddress region, KeyT &&val = KeyT{})
@@ -126,107 +198,39 @@ template<typename KeyT, typename AddrT = uintptr_t> class BlockAllocator
                 return l.end();
             }
 
+            gaps_inserted(cloc.first);
             return cloc.first;
         }
 
         iterator AllocAny(AddrT len, KeyT &&val = KeyT{}, bool lowest_first = true)
         {
-            BlockAddress region { .start = 0, .length = len };
-
-            // The following logic does not work with an empty map, special case this
-            if(l.size() == 0)
-            {
-                if(len > addrspace.length)
-                {
-                    return l.end();
-                }
-                if(lowest_first)
-                {
-                    region.start = addrspace.start;
-                }
-                else
-                {
-                    region.start = addrspace.end() - len;
-                }
-                return l.insert_or_assign(region, val).first;
-            }
-
-            // for a map with 'n' used entries, there are potentially 'n+1' empty spaces
-            //  either side/between the used entries.  Iterate to check all of them
+            AddrT gstart, glen;
             if(lowest_first)
             {
-                for(auto iter = l.begin(); iter != l.end(); iter++)
-                {
-                    // if begin, check from base to us, and from us to next
-                    //  otherwise, just check from us to next
-
-                    if (iter == l.begin())
-                    {
-                        auto prev = nullptr;
-                        auto next = &iter->first;
-
-                        auto [ fr, baddr ] = fits(len, prev, next);
-                        if (fr)
-                        {
-                            region.start = baddr.start;
-                            return l.insert_or_assign(region, val).first;
-                        }
-                    }
-                    else
-                    {
-                        auto prev = &iter->first;
-                        auto niter = std::next(iter);
-                        auto next = (niter == l.end()) ? nullptr :
-                            &niter->first;
-
-                        auto [ fr, baddr ] = fits(len, prev, next);
-                        if (fr)
-                        {
-                            region.start = baddr.start;
-                            return l.insert_or_assign(region, val).first;
-                        }
-                    }
-                }
+                if(!gaps.first_fit(len, &gstart, &glen))
+                    return l.end();
+                return insert_block(BlockAddress { gstart, len }, std::move(val));
             }
             else
             {
-                for(auto iter = l.rbegin(); iter != l.rend(); iter++)
-                {
-                    // if rbegin, check from us to end, and from rnext to us
-                    //  otherwise, just check from rnext to us
-
-                    if (iter == l.rbegin())
-                    {
-                        auto next = nullptr;
-                        auto prev = &iter->first;
-
-                        auto [ fr, baddr ] = fits(len, prev, next);
-                        if (fr)
-                        {
-                            region.start = baddr.end() - len;
-                            return l.insert_or_assign(region, val).first;
-                        }
-                    }
-                    else
-                    {
-                        auto next = &iter.base()->first;
-                        auto piter = std::next(iter);
-                        auto prev = (piter == l.rend()) ? nullptr :
-                            &piter.base()->first;
-
-                        auto [ fr, baddr ] = fits(len, prev, next);
-                        if (fr)
-                        {
-                            region.start = baddr.end() - len;
-                            return l.insert_or_assign(region, val).first;
-                        }
-                    }
-                }
+                if(!gaps.last_fit(len, &gstart, &glen))
+                    return l.end();
+                return insert_block(BlockAddress { gstart + glen - len, len }, std::move(val));
             }
+        }
 
-            return l.end();
+        /* Place in the smallest gap that fits, to keep large gaps for large requests */
+        iterator AllocBest(AddrT len, KeyT &&val = KeyT{})
+        {
+            AddrT gstart, glen;
+            if(!gaps.best_fit(len, &gstart, &glen))
+                return l.end();
+            return insert_block(BlockAddress { gstart, len }, std::move(val));
         }
 
+        /* Largest free gap, for diagnostics */
+        AddrT LargestFree() const { return gaps.largest(); }
+
         iterator IsAllocated(AddrT addr)
         {
             BlockAddress test { .start = addr, .length = 0 };
@@ -324,6 +328,7 @@ template<typename KeyT, typename AddrT = uintptr_t> class BlockAllocator
 
         iterator Dealloc(iterator pos)
         {
+            gaps_erasing(pos);
             return l.erase(pos);
         }
 
@@ -331,17 +336,21 @@ template<typename KeyT, typename AddrT = uintptr_t> class BlockAllocator
         {
             auto iter = IsAllocated(addr);
             if(iter != l.end())
-                return l.erase(iter);
+                return Dealloc(iter);
             else
                 return l.end();
         }
 
-        /* Allows the key in the underlying map to be changed */
+        /* Allows the key in the underlying map to be changed.  The new address must not
+            overlap any other block. */
         iterator ChangeAddress(iterator iter, BlockAddress addr)
         {
+            gaps_erasing(iter);
             auto node = l.extract(iter);
             node.key() = addr;
-            return l.insert(std::move(node)).position;
+            auto ret = l.insert(std::move(node)).position;
+            gaps_inserted(ret);
+            return ret;
         }
 
         iterator begin() { return l.begin(); }
@@ -352,7 +361,7 @@ template<typename KeyT, typename AddrT = uintptr_t> class BlockAllocator
         iterator cend() { return l.cend(); }
         iterator crbegin() { return l.crbegin(); }
         iterator crend() { return l.crend(); }   
-        iterator erase(iterator i) { return l.erase(i); }     
+        iterator erase(iterator i) { return Dealloc(i); }
 };
 
 #endif
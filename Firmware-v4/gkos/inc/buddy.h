@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <atomic>
 
 #ifndef __GK_UNIT_TEST__
 #include "osmutex.h"
@@ -17,8 +18,8 @@ protected:
     std::atomic<bool> is_locked = false;
 
 public:
-    void lock() { while (is_locked); is_locked = true; }
-    void unlock() { is_locked = false; }
+    void lock() { while (is_locked.exchange(true, std::memory_order_acquire)); }
+    void unlock() { is_locked.store(false, std::memory_order_release); }
 };
 
 #define klog printf
@@ -30,11 +31,24 @@ static int DisableInterrupts()
 
 static void RestoreInterrupts(int) {}
 
+// tests set this per host thread to stand in for the core id
+inline thread_local unsigned int unit_test_core_id = 0;
+static unsigned int get_core_id()
+{
+    return unit_test_core_id;
+}
+
+#if defined(_MSC_VER)
 #include <bit>
 static int __builtin_clzll(uint64_t x)
 {
     return std::countl_zero(x);
 }
+static int __builtin_ctzll(uint64_t x)
+{
+    return std::countr_zero(x);
+}
+#endif
 
 #endif
 
@@ -51,8 +65,17 @@ constexpr static bool is_multiple_of(uint64_t num, uint64_t denom)
     return (num % denom) == 0;
 }
 
+/* Each level has a bitmap of free blocks, plus a summary bitmap with one bit per
+    non-zero qword of it and a count of free blocks so that finding a free block
+    is a couple of bit scans per level rather than a scan of the whole bitmap.
+
+    If ncaches is non-zero then single min_buddy_size blocks are also held in a
+    per-core cache, refilled from and drained to the bitmaps pcp_batch blocks at
+    a time so that the common single page allocation does not take the global
+    lock.  Cached blocks are still counted as free, and the caches are drained
+    back into the bitmaps if a larger allocation fails so that they can coalesce. */
 template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
-    typename Ret_T = MemRegion> class BuddyAllocator
+    typename Ret_T = MemRegion, unsigned int ncaches = 0> class BuddyAllocator
 {
     public:
 
@@ -85,6 +108,15 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
             return ret;            
         }
 
+        constexpr static uint64_t summary_qwords_for_level(uint64_t level_id, uint64_t total_length)
+        {
+            auto qfl = qwords_for_level(level_id, total_length);
+            uint64_t ret = qfl / 64;
+            if(qfl % 64)
+                ret++;
+            return ret;
+        }
+
         constexpr static uint64_t num_levels()
         {
             uint64_t nlevels = 1;
@@ -104,6 +136,7 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
             for(uint64_t i = 0; i < num_levels(); i++)
             {
                 nwords += qwords_for_level(i, total_length);
+                nwords += summary_qwords_for_level(i, total_length);
             }
 
             return nwords;
@@ -134,78 +167,123 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
 
         uint64_t level_starts[num_levels()];
         uint64_t level_qword_counts[num_levels()];
+        uint64_t summary_starts[num_levels()];
+        uint64_t summary_qword_counts[num_levels()];
+        uint64_t level_nfree[num_levels()];
         uint64_t *b;
         Spinlock sl;
-        uint64_t free_space;
+        std::atomic<uint64_t> free_space;
 
-        void release_at_level(uint64_t level, uint64_t bitidx)
+        static constexpr unsigned int pcp_batch = 16;
+        static constexpr unsigned int pcp_high = pcp_batch * 2;
+        static constexpr uint64_t invalid_bitidx = 0xffffffffffffffffULL;
+
+        struct page_cache
+        {
+            Spinlock sl;        // only contended when draining
+            unsigned int n = 0;
+            uint64_t bitidx[pcp_high];
+        };
+        page_cache pcp[ncaches ? ncaches : 1];
+
+        bool is_free(uint64_t level, uint64_t bitidx) const
+        {
+            return (b[level_starts[level] + bitidx / 64ULL] >> (bitidx % 64ULL)) & 1ULL;
+        }
+
+        void set_free(uint64_t level, uint64_t bitidx)
+        {
+            auto qwordidx = bitidx / 64ULL;
+            auto &w = b[level_starts[level] + qwordidx];
+            if(!w)
+                b[summary_starts[level] + qwordidx / 64ULL] |= 1ULL << (qwordidx % 64ULL);
+            w |= 1ULL << (bitidx % 64ULL);
+            level_nfree[level]++;
+        }
+
+        void clear_free(uint64_t level, uint64_t bitidx)
         {
             auto qwordidx = bitidx / 64ULL;
-            auto bit_within_qwordidx = bitidx % 64ULL;
-            auto comp_bit = (bit_within_qwordidx & 1ULL) ? (bit_within_qwordidx - 1ULL) :
-                (bit_within_qwordidx + 1ULL);
+            auto &w = b[level_starts[level] + qwordidx];
+            w &= ~(1ULL << (bitidx % 64ULL));
+            if(!w)
+                b[summary_starts[level] + qwordidx / 64ULL] &= ~(1ULL << (qwordidx % 64ULL));
+            level_nfree[level]--;
+        }
+
+        // level_nfree[level] must be non-zero
+        uint64_t find_free_qword(uint64_t level) const
+        {
+            auto sstart = summary_starts[level];
+            for(uint64_t i = 0; i < summary_qword_counts[level]; i++)
+            {
+                auto sw = b[sstart + i];
+                if(sw)
+                    return i * 64ULL + __builtin_ctzll(sw);
+            }
+            return invalid_bitidx;
+        }
+
+        void release_at_level(uint64_t level, uint64_t bitidx)
+        {
+            auto comp_bitidx = bitidx ^ 1ULL;
 
-            auto wptr = &b[level_starts[level] + qwordidx];
-            if(*wptr & (1ULL << bit_within_qwordidx))
+            if(is_free(level, bitidx))
             {
                 klog("buddy: attempt to release memory that is not allocated level %llu at %llu:%llu\n",
-                    level, qwordidx, bit_within_qwordidx);
+                    level, bitidx / 64ULL, bitidx % 64ULL);
+                return;
             }
-            if(*wptr & (1ULL << comp_bit) && level < (num_levels() - 1))
+            if(is_free(level, comp_bitidx) && level < (num_levels() - 1))
             {
                 // can release at higher level
                 // first unset complementary bit
-                *wptr &= ~(1ULL << comp_bit);
+                clear_free(level, comp_bitidx);
                 
                 release_at_level(level + 1, bitidx / 2);
             }
             else
             {
                 // just release at this level
-                *wptr |= (1ULL << bit_within_qwordidx);
+                set_free(level, bitidx);
             }
         }
 
         uint64_t acquire_at_level(uint64_t level)
         {
             // first see if we can acquire a value at this level
-            uint64_t nqwords = level_qword_counts[level];
             uint64_t lstart = level_starts[level];
-            for(uint64_t i = 0; i < nqwords; i++)
+            if(level_nfree[level])
             {
+                auto i = find_free_qword(level);
                 auto wptr = &b[lstart + i];
-                if(*wptr)
-                {
-                    // we have a valid value here - return it
-                    auto bval = 63ULL - __builtin_clzll(*wptr);
+
+                // we have a valid value here - return it
+                auto bval = 63ULL - __builtin_clzll(*wptr);
 #if DEBUG_BUDDY
-                    klog("buddy: found free level %llu at %llu:%llu, old qword=%llx & %llx\n", level, i, bval, *wptr, (uintptr_t)wptr);
+                klog("buddy: found free level %llu at %llu:%llu, old qword=%llx & %llx\n", level, i, bval, *wptr, (uintptr_t)wptr);
 #endif
-                    *wptr &= ~(1ULL << bval);
+                clear_free(level, bval + i * 64ULL);
 #if DEBUG_BUDDY
-                    klog("buddy: found free level %llu at %llu:%llu, new qword=%llx & %llx\n", level, i, bval, *wptr, (uintptr_t)wptr);
+                klog("buddy: found free level %llu at %llu:%llu, new qword=%llx & %llx\n", level, i, bval, *wptr, (uintptr_t)wptr);
 #endif
-                    return bval + i * 64ULL;
-                }
+                return bval + i * 64ULL;
             }
 
             // we didn't manage to find a free bit at this level, check higher if possible
             if(level < (num_levels() - 1))
             {
                 auto bval = acquire_at_level(level + 1);
-                if(bval != 0xffffffffffffffffULL)
+                if(bval != invalid_bitidx)
                 {
                     // valid bit, in the current level it is going to be doubled
                     bval <<= 1;
 
-                    auto qword_idx = bval / 64;
-                    auto bit_idx = bval % 64;
-
                     // set the complementary bit
-                    auto wptr = &b[lstart + qword_idx];
-                    *wptr |= (1ULL << (bit_idx + 1));
+                    set_free(level, bval + 1);
 #if DEBUG_BUDDY
-                    klog("buddy: complementary bit set level %llu at %llu:%llu, new qword=%llx @ %llx\n", level, qword_idx, bit_idx, *wptr, (uintptr_t)wptr);
+                    klog("buddy: complementary bit set level %llu at %llu:%llu, new qword=%llx\n", level,
+                        bval / 64, bval % 64 + 1, b[lstart + bval / 64]);
 #endif
                     // return our bitindex
                     return bval;
@@ -213,7 +291,74 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
             }
 
             // fail
-            return 0xffffffffffffffffULL;
+            return invalid_bitidx;
+        }
+
+        uint64_t acquire_cached()
+        {
+            auto cpsr = DisableInterrupts();
+            auto &pc = pcp[get_core_id() % ncaches];
+            pc.sl.lock();
+            if(pc.n == 0)
+            {
+                sl.lock();
+                while(pc.n < pcp_batch)
+                {
+                    auto bitidx = acquire_at_level(0);
+                    if(bitidx == invalid_bitidx)
+                        break;
+                    pc.bitidx[pc.n++] = bitidx;
+                }
+                sl.unlock();
+            }
+            auto ret = pc.n ? pc.bitidx[--pc.n] : invalid_bitidx;
+            pc.sl.unlock();
+            RestoreInterrupts(cpsr);
+            return ret;
+        }
+
+        void release_cached(uint64_t bitidx)
+        {
+            auto cpsr = DisableInterrupts();
+            auto &pc = pcp[get_core_id() % ncaches];
+            pc.sl.lock();
+            if(pc.n == pcp_high)
+            {
+                // return the oldest batch, keeping the most recently freed (cache hot) pages
+                sl.lock();
+                for(unsigned int i = 0; i < pcp_batch; i++)
+                    release_at_level(0, pc.bitidx[i]);
+                sl.unlock();
+                for(unsigned int i = pcp_batch; i < pcp_high; i++)
+                    pc.bitidx[i - pcp_batch] = pc.bitidx[i];
+                pc.n -= pcp_batch;
+            }
+            pc.bitidx[pc.n++] = bitidx;
+            pc.sl.unlock();
+            RestoreInterrupts(cpsr);
+        }
+
+        // returns true if anything was drained
+        bool drain_caches()
+        {
+            bool ret = false;
+            for(auto &pc : pcp)
+            {
+                auto cpsr = DisableInterrupts();
+                pc.sl.lock();
+                if(pc.n)
+                {
+                    sl.lock();
+                    for(unsigned int i = 0; i < pc.n; i++)
+                        release_at_level(0, pc.bitidx[i]);
+                    sl.unlock();
+                    pc.n = 0;
+                    ret = true;
+                }
+                pc.sl.unlock();
+                RestoreInterrupts(cpsr);
+            }
+            return ret;
         }
 
         uint64_t get_smallest_buddy_size_for_block(uint64_t *addr)
@@ -261,47 +406,64 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
                 }
 
                 auto level = buddy_size_to_level(length);
+                auto bitidx = addr_to_bitidx_at_level(level, be.base - base_addr);
+
+                if constexpr(ncaches > 0)
+                {
+                    if(level == 0)
+                    {
+                        release_cached(bitidx);
+                        free_space += length;
+                        return;
+                    }
+                }
 
                 cpsr = lock();
-                release_at_level(level,
-                    addr_to_bitidx_at_level(level, be.base - base_addr));
+                release_at_level(level, bitidx);
                 free_space += length;
             }
             else
             {
                 // block is not aligned with a buddy level
-                uint64_t cur_addr = be.base - base_addr;
-                uint64_t max_addr = be.base - base_addr + be.length;
+                release_range(be.base, be.length);
+                return;
+            }
 
-                cpsr = lock();
-                while(true)
-                {
-                    uint64_t cur_buddy_size = get_smallest_buddy_size_for_block(&cur_addr);
+            unlock(cpsr);
+        }
 
-                    if(cur_addr >= max_addr || max_addr - cur_addr < min_buddy_size)
-                    {
-                        unlock(cpsr);
-                        return;
-                    }
+        /* Release [base, base + length), which need not be a single buddy block, as the
+            largest aligned blocks that fit */
+        void release_range(uint64_t base, uint64_t length)
+        {
+            uint64_t cur_addr = base - base_addr;
+            uint64_t max_addr = base - base_addr + length;
 
-                    while((cur_addr + cur_buddy_size) > max_addr)
-                    {
-                        cur_buddy_size >>= 1;
-                    }
-                    if(cur_buddy_size < min_buddy_size)
-                    {
-                        unlock(cpsr);
-                        return;
-                    }
-                    
-                    auto level = buddy_size_to_level(cur_buddy_size);
-                    release_at_level(level, addr_to_bitidx_at_level(level, cur_addr));
-                    free_space += cur_buddy_size;
+            auto cpsr = lock();
+            while(true)
+            {
+                uint64_t cur_buddy_size = get_smallest_buddy_size_for_block(&cur_addr);
 
-                    cur_addr += cur_buddy_size;
+                if(cur_addr >= max_addr || max_addr - cur_addr < min_buddy_size)
+                {
+                    break;
                 }
-            }
 
+                while((cur_addr + cur_buddy_size) > max_addr)
+                {
+                    cur_buddy_size >>= 1;
+                }
+                if(cur_buddy_size < min_buddy_size)
+                {
+                    break;
+                }
+                
+                auto level = buddy_size_to_level(cur_buddy_size);
+                release_at_level(level, addr_to_bitidx_at_level(level, cur_addr));
+                free_space += cur_buddy_size;
+
+                cur_addr += cur_buddy_size;
+            }
             unlock(cpsr);
         }
 
@@ -329,11 +491,38 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
                 return ret;
             }
 
-            auto cpsr = lock();
-            auto bitret = acquire_at_level(level);
-            unlock(cpsr);
+            auto bitret = invalid_bitidx;
+            bool cached = false;
+            if constexpr(ncaches > 0)
+            {
+                if(level == 0)
+                {
+                    cached = true;
+                    bitret = acquire_cached();
+                    if(bitret == invalid_bitidx && drain_caches())
+                        bitret = acquire_cached();
+                }
+            }
+
+            if(!cached)
+            {
+                auto cpsr = lock();
+                bitret = acquire_at_level(level);
+                unlock(cpsr);
+
+                if constexpr(ncaches > 0)
+                {
+                    // pages sat in the per-core caches may be stopping buddies from coalescing
+                    if(bitret == invalid_bitidx && drain_caches())
+                    {
+                        cpsr = lock();
+                        bitret = acquire_at_level(level);
+                        unlock(cpsr);
+                    }
+                }
+            }
 
-            if(bitret == 0xffffffffffffffffULL)
+            if(bitret == invalid_bitidx)
             {
                 // failed
                 ret.base = 0ULL;
@@ -351,14 +540,30 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
             return ret;
         }
 
-        uint64_t get_free_space()
+        /* A physically contiguous block of length (rounded up to min_buddy_size only)
+            starting on an align boundary, so that it can be mapped with large pages.
+            The part of the underlying buddy block past length is given straight back.
+            The result is not generally a buddy block: free it a page at a time or with
+            release_range(). */
+        Ret_T acquire_aligned(uint64_t length, uint64_t align)
         {
-            auto cpsr = lock();
-            auto ret = free_space;
-            unlock(cpsr);
+            length = (length + min_buddy_size - 1) & ~(min_buddy_size - 1);
+            auto block_len = (length > align) ? length : align;
+
+            auto ret = acquire(block_len);
+            if(ret.valid && ret.length > length)
+            {
+                release_range(ret.base + length, ret.length - length);
+                ret.length = length;
+            }
             return ret;
         }
 
+        uint64_t get_free_space()
+        {
+            return free_space;
+        }
+
         void init(void *mem, uint64_t total_length)
         {
             // init buddy to zero, get start values
@@ -376,6 +581,14 @@ template <uint64_t min_buddy_size, uint64_t max_buddy_size, uint64_t base_addr,
                 level_qword_counts[i] = qword_count;
                 cur_start += qword_count;
             }
+            for(uint64_t i = 0; i < num_levels(); i++)
+            {
+                summary_starts[i] = cur_start;
+                auto qword_count = summary_qwords_for_level(i, total_length);
+                summary_qword_counts[i] = qword_count;
+                cur_start += qword_count;
+                level_nfree[i] = 0;
+            }
         }
 
         constexpr uint64_t MinBuddySize() { return min_buddy_size; };
@@ -23,6 +23,12 @@ int gk_ext4_unlink(const char *pathname, int *_errno);
 int gk_ext4_unmount(int *_errno);
 int gk_ext4_link(const char *oldpath, const char *newpath, int *_errno);
 
+/* There is a single mount, so the inode number identifies the file */
+static inline uint64_t lwext_pagecache_id(const ext4_file &e4f)
+{
+    return ((uint64_t)FT_Lwext << 32) | e4f.inode;
+}
+
 class LwextFile : public File
 {
     public:
@@ -40,6 +46,8 @@ class LwextFile : public File
 
         size_t Flen(int *_errno);
 
+        bool PageCacheId(uint64_t *id);
+
         LwextFile(ext4_file fildes, std::string fname);
         ext4_file f;
         ext4_dir d;
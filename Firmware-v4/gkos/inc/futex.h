@@ -0,0 +1,27 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <cstdint>
+#include <sys/types.h>
+
+class Thread;
+
+/* What futex waiters are matched on.  Memory private to a process is keyed on its
+    virtual address, as zram and madvise can move or drop the page behind it while
+    threads wait.  Memory shared between processes has pages which stay put, so is
+    keyed on the physical address to match across processes. */
+struct futex_key
+{
+    uintptr_t addr = 0;
+    id_t pid = 0;           // 0 if addr is physical
+
+    bool operator==(const futex_key &other) const
+    {
+        return addr == other.addr && pid == other.pid;
+    }
+};
+
+/* Remove a thread that died while waiting on a futex from its wait queue */
+void futex_cancel(Thread *t);
+
+#endif
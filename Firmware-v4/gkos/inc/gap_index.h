@@ -0,0 +1,251 @@
+#ifndef GAP_INDEX_H
+#define GAP_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <utility>
+#include <vector>
+
+/* Index of the free gaps of an address space allocator, so that placement does not
+    have to walk every allocated block.
+
+    Gaps are held in a treap ordered by start address where each node also records
+    the largest gap in its subtree.  This gives O(log n) lowest and highest first fit,
+    by descending only into subtrees that contain a large enough gap.  A second set
+    ordered by (length, start) gives O(log n) best fit.
+
+    Nodes live in a vector with a free list, so that the index copies and moves with
+    its owning allocator.  The owner keeps it in step with its blocks: each gap is
+    inserted and erased by start address and gaps never overlap.
+
+    Requires external synchronization. */
+
+template <typename AddrT = uintptr_t> class GapIndex
+{
+    protected:
+        static constexpr uint32_t nil = ~0U;
+
+        struct node
+        {
+            AddrT start, len, max_len;
+            uint32_t prio;
+            uint32_t left = nil, right = nil;
+        };
+
+        std::vector<node> nodes;
+        uint32_t free_head = nil;
+        uint32_t root = nil;
+        uint32_t rng = 0x9e3779b9U;
+        std::set<std::pair<AddrT, AddrT>> by_len;
+
+        uint32_t next_prio()
+        {
+            // xorshift, only needs to be well spread
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            return rng;
+        }
+
+        AddrT max_of(uint32_t n) const { return n == nil ? 0 : nodes[n].max_len; }
+
+        void update(uint32_t n)
+        {
+            auto &nd = nodes[n];
+            auto m = nd.len;
+            if(max_of(nd.left) > m)
+                m = max_of(nd.left);
+            if(max_of(nd.right) > m)
+                m = max_of(nd.right);
+            nd.max_len = m;
+        }
+
+        uint32_t new_node(AddrT start, AddrT len)
+        {
+            uint32_t n;
+            if(free_head != nil)
+            {
+                n = free_head;
+                free_head = nodes[n].left;
+            }
+            else
+            {
+                n = (uint32_t)nodes.size();
+                nodes.emplace_back();
+            }
+            nodes[n] = node { start, len, len, next_prio() };
+            return n;
+        }
+
+        void free_node(uint32_t n)
+        {
+            nodes[n].left = free_head;
+            free_head = n;
+        }
+
+        // split t into keys < start and keys >= start
+        void split(uint32_t t, AddrT start, uint32_t &l, uint32_t &r)
+        {
+            if(t == nil)
+            {
+                l = r = nil;
+                return;
+            }
+            if(nodes[t].start < start)
+            {
+                split(nodes[t].right, start, nodes[t].right, r);
+                l = t;
+            }
+            else
+            {
+                split(nodes[t].left, start, l, nodes[t].left);
+                r = t;
+            }
+            update(t);
+        }
+
+        // every key in l is below every key in r
+        uint32_t merge(uint32_t l, uint32_t r)
+        {
+            if(l == nil)
+                return r;
+            if(r == nil)
+                return l;
+            if(nodes[l].prio > nodes[r].prio)
+            {
+                nodes[l].right = merge(nodes[l].right, r);
+                update(l);
+                return l;
+            }
+            else
+            {
+                nodes[r].left = merge(l, nodes[r].left);
+                update(r);
+                return r;
+            }
+        }
+
+        uint32_t insert_at(uint32_t t, uint32_t n)
+        {
+            if(t == nil)
+                return n;
+            if(nodes[n].prio > nodes[t].prio)
+            {
+                split(t, nodes[n].start, nodes[n].left, nodes[n].right);
+                update(n);
+                return n;
+            }
+            if(nodes[n].start < nodes[t].start)
+                nodes[t].left = insert_at(nodes[t].left, n);
+            else
+                nodes[t].right = insert_at(nodes[t].right, n);
+            update(t);
+            return t;
+        }
+
+        uint32_t erase_at(uint32_t t, AddrT start, AddrT *len)
+        {
+            if(t == nil)
+                return nil;
+            if(nodes[t].start == start)
+            {
+                *len = nodes[t].len;
+                auto ret = merge(nodes[t].left, nodes[t].right);
+                free_node(t);
+                return ret;
+            }
+            if(start < nodes[t].start)
+                nodes[t].left = erase_at(nodes[t].left, start, len);
+            else
+                nodes[t].right = erase_at(nodes[t].right, start, len);
+            update(t);
+            return t;
+        }
+
+    public:
+        void insert(AddrT start, AddrT len)
+        {
+            if(!len)
+                return;
+            root = insert_at(root, new_node(start, len));
+            by_len.emplace(len, start);
+        }
+
+        /* Returns false if there is no gap starting at start */
+        bool erase(AddrT start)
+        {
+            AddrT len = 0;
+            root = erase_at(root, start, &len);
+            if(!len)
+                return false;
+            by_len.erase(std::make_pair(len, start));
+            return true;
+        }
+
+        /* Lowest gap of at least len */
+        bool first_fit(AddrT len, AddrT *start, AddrT *gap_len) const
+        {
+            auto t = root;
+            if(t == nil || max_of(t) < len)
+                return false;
+            while(true)
+            {
+                auto &nd = nodes[t];
+                if(max_of(nd.left) >= len)
+                    t = nd.left;
+                else if(nd.len >= len)
+                    break;
+                else
+                    t = nd.right;
+            }
+            *start = nodes[t].start;
+            *gap_len = nodes[t].len;
+            return true;
+        }
+
+        /* Highest gap of at least len */
+        bool last_fit(AddrT len, AddrT *start, AddrT *gap_len) const
+        {
+            auto t = root;
+            if(t == nil || max_of(t) < len)
+                return false;
+            while(true)
+            {
+                auto &nd = nodes[t];
+                if(max_of(nd.right) >= len)
+                    t = nd.right;
+                else if(nd.len >= len)
+                    break;
+                else
+                    t = nd.left;
+            }
+            *start = nodes[t].start;
+            *gap_len = nodes[t].len;
+            return true;
+        }
+
+        /* Smallest gap of at least len, the lowest of those if several */
+        bool best_fit(AddrT len, AddrT *start, AddrT *gap_len) const
+        {
+            auto iter = by_len.lower_bound(std::make_pair(len, (AddrT)0));
+            if(iter == by_len.end())
+                return false;
+            *gap_len = iter->first;
+            *start = iter->second;
+            return true;
+        }
+
+        AddrT largest() const { return max_of(root); }
+        size_t size() const { return by_len.size(); }
+
+        void clear()
+        {
+            nodes.clear();
+            by_len.clear();
+            free_head = nil;
+            root = nil;
+        }
+};
+
+#endif
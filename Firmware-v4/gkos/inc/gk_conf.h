@@ -18,6 +18,7 @@
 
 #define GK_ENABLE_PWR_DUMP          0
 #define GK_ENABLE_MEM_DUMP          0
+#define GK_ENABLE_SCHED_DUMP        0
 
 #define GK_ALLOW_USERSPACE_CACHE_MAINTENANCE    1
 #define GK_CHECK_USER_ADDRESSES     1
@@ -32,15 +33,37 @@
 #define GK_GPU_SHOW_FPS             0
 #define GK_COUNT_SYSCALLS           0
 #define GK_PROFILE_SYSCALLS         0
-#define GK_TICKLESS                 0
+#define GK_TICKLESS                 1
 #define GK_CUR_THREAD_IN_SYSRAM     1
 #define GK_THREAD_LIST_IN_SYSRAM    0
 #define GK_DYNAMIC_SYSTICK          1
 #define GK_MAXTIMESLICE_US          200000
+#define GK_MUTEX_SPIN_US            20
 #define GK_MEMBLK_STATS             1
 #define GK_ENABLE_PROFILE           0
 #define GK_AUDIO_LATENCY_LIMIT_MS   50
 #define GK_PIPESIZE                 65536
+#define GK_KSTACK_INITIAL           (128*1024)  // mapped kernel stack for user threads
+#define GK_KSTACK_HEADROOM          (64*1024)   // kept free below sp at syscall/exception entry
+#define GK_KSTACK_KERNEL            (256*1024)  // mapped kernel stack for privileged threads
+#define GK_KSTACK_IDLE              (GK_KSTACK_INITIAL + GK_KSTACK_HEADROOM)    // idle loop + zeropage fill + irq
+#define GK_KSTACK_POOL_SIZE         16
+#define GK_KHEAP_SLAB               1           // per-core slab caches for small kmallocs
+#define GK_ZEROPAGE_POOL            64          // pre-zeroed pages kept by the idle threads
+#define GK_ZEROPAGE_MIN_FREE        (32ULL*1024*1024)   // stop topping up the pool below this
+#define GK_ENABLE_PAGECACHE         1
+#define GK_PAGECACHE_MAX_PAGES      2048        // 128 MiB of file pages kept once unmapped
+#define GK_ENABLE_ZRAM              1
+#define GK_ZRAM_SLOTS               16384       // compressed pages, slot table is 32 bytes each
+#define GK_RECLAIM_LOW_WATER        (16ULL*1024*1024)   // page faults reclaim below this
+#define GK_RECLAIM_BATCH            16          // pages reclaimed per low memory fault
+#define GK_ZRAM_SCAN_RATIO          32          // pages scanned per page to reclaim
+#define GK_FAULT_AROUND_PAGES       4           // pages mapped per first touch fault, 1 disables
+#define GK_FAULT_AROUND_MAX         16          // grown to on sequential faults
+#define GK_MEM_SOFT_LIMIT           0           // default per-process limits in pages, 0 for none
+#define GK_MEM_HARD_LIMIT           0
+#define GK_MEM_PRESSURE_LOW_WATER   (64ULL*1024*1024)   // supervisor is told below this
+#define GK_MADVISE_QUEUE            16          // outstanding madvise(WILLNEED) requests
 #define GK_SCREEN_WIDTH             800
 #define GK_SCREEN_HEIGHT            480
 #define GK_MAX_SCREEN_WIDTH         1024
@@ -55,7 +78,7 @@
 #define GK_DMABUF_MAXSIZE           0x400000
 #define GK_DMAFENCE_BUSYWAIT_US     1000
 
-#define GK_TLBI_AFTER_TTBR_CHANGE   1
+#define GK_TLBI_AFTER_TTBR_CHANGE   0       // not required with ASIDs - see asid.cpp
 
 #define GK_DEBUG_BLOCKING           1
 
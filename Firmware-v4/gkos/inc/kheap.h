@@ -5,5 +5,6 @@
 
 void init_kheap();
 uintptr_t kheap_size();
+void kheap_log_stats();
 
 #endif
@@ -0,0 +1,47 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include <cstdint>
+#include <cstddef>
+#include "ostypes.h"
+
+/* Kernel thread stacks reserve VBLOCK_4M of address space but only map the top
+    part of it.  Exceptions are taken on the same stack, so a fault on an unmapped
+    stack page cannot be recovered from.  Instead the stack is grown ahead of use at
+    the points where a thread is about to go deep (syscall and exception entry) by
+    kstack_check_headroom().  The lowest page of the reservation is never mapped, so
+    running off the end of a stack always faults rather than reaching whatever lies
+    below it.
+
+    Privileged threads do not go through syscall entry for most of their work, so
+    get a fixed GK_KSTACK_KERNEL (or what their creator asks for), and idle threads
+    GK_KSTACK_IDLE as they cannot grow their stack from interrupt context.  Mapped
+    pages are zeroed, so kstack_high_water() can report how much each has needed
+    (GK_ENABLE_SCHED_DUMP) to tune these.
+
+    Freed stacks are kept in a small pool, trimmed back to GK_KSTACK_INITIAL, so
+    that thread creation usually needs neither vblock_alloc nor vmem_map. */
+
+struct KernelStack
+{
+    VMemBlock vb = InvalidVMemBlock();
+    uintptr_t bottom = 0;       // lowest mapped address
+
+    uintptr_t top() const { return vb.data_end(); }
+    size_t committed() const { return vb.valid ? top() - bottom : 0; }
+};
+
+/* Returns a stack with at least commit bytes mapped (capped to the reservation) */
+KernelStack kstack_alloc(size_t commit);
+void kstack_free(KernelStack &ks);
+
+/* Map pages so that everything from addr to the top of the stack is backed */
+int kstack_grow(KernelStack &ks, uintptr_t addr);
+
+/* Ensure the current thread has at least GK_KSTACK_HEADROOM below sp */
+void kstack_check_headroom();
+
+/* Bytes below the top of the stack that have ever been written */
+size_t kstack_high_water(const KernelStack &ks);
+
+#endif
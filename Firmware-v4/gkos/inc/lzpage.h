@@ -0,0 +1,242 @@
+#ifndef LZPAGE_H
+#define LZPAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* LZ77 page compressor using the LZ4 block layout: each sequence is a token
+    (literal length in the high nibble, match length - 4 in the low nibble, 15
+    meaning further length bytes follow), the literals, then a 16-bit little endian
+    match offset.  The final sequence has literals only.
+
+    Matches are found with a single-entry hash table of 4 byte sequences, so
+    compression is fast rather than tight.  Inputs are limited to 64 kiB (one page)
+    so that positions and offsets fit in 16 bits. */
+
+static constexpr size_t lzpage_max_input = 65536;
+
+namespace lzpage_detail
+{
+    static constexpr unsigned int hash_bits = 12;
+    static constexpr size_t min_match = 4;
+    static constexpr size_t last_literals = 5;      // never start a match this close to the end
+
+    static inline uint32_t load32(const uint8_t *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint64_t load64(const uint8_t *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // length of the common prefix of a and b, at most limit, a word at a time
+    static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t limit)
+    {
+        size_t n = 0;
+        while(n + 8 <= limit)
+        {
+            auto diff = load64(&a[n]) ^ load64(&b[n]);
+            if(diff)
+                return n + (__builtin_ctzll(diff) >> 3);
+            n += 8;
+        }
+        while(n < limit && a[n] == b[n])
+            n++;
+        return n;
+    }
+
+    static inline uint32_t hash(uint32_t v)
+    {
+        return (v * 2654435761U) >> (32 - hash_bits);
+    }
+
+    static inline bool put_length(uint8_t *dst, size_t cap, size_t &op, size_t len)
+    {
+        while(len >= 255)
+        {
+            if(op >= cap)
+                return false;
+            dst[op++] = 255;
+            len -= 255;
+        }
+        if(op >= cap)
+            return false;
+        dst[op++] = (uint8_t)len;
+        return true;
+    }
+
+    static inline bool put_sequence(const uint8_t *src, size_t anchor, size_t litlen,
+        size_t offset, size_t mlen, uint8_t *dst, size_t cap, size_t &op)
+    {
+        if(op >= cap)
+            return false;
+        auto token_op = op++;
+        uint8_t token = (uint8_t)((litlen >= 15 ? 15 : litlen) << 4);
+        if(litlen >= 15 && !put_length(dst, cap, op, litlen - 15))
+            return false;
+        if(cap - op < litlen)
+            return false;
+        memcpy(&dst[op], &src[anchor], litlen);
+        op += litlen;
+
+        if(mlen)
+        {
+            if(cap - op < 2)
+                return false;
+            dst[op++] = (uint8_t)(offset & 0xff);
+            dst[op++] = (uint8_t)(offset >> 8);
+            auto ml = mlen - min_match;
+            token |= (uint8_t)(ml >= 15 ? 15 : ml);
+            if(ml >= 15 && !put_length(dst, cap, op, ml - 15))
+                return false;
+        }
+        dst[token_op] = token;
+        return true;
+    }
+}
+
+/* Returns the compressed length, or 0 if the output would not fit in dst_cap */
+static inline size_t lzpage_compress(const void *_src, size_t len, void *_dst, size_t dst_cap)
+{
+    using namespace lzpage_detail;
+
+    auto src = (const uint8_t *)_src;
+    auto dst = (uint8_t *)_dst;
+    if(len > lzpage_max_input)
+        return 0;
+
+    uint16_t table[1U << hash_bits];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0, op = 0;
+    if(len > min_match + last_literals)
+    {
+        auto match_limit = len - last_literals;
+        auto search_limit = match_limit - min_match;
+        unsigned int misses = 0;
+
+        while(ip < search_limit)
+        {
+            auto seq = load32(&src[ip]);
+            auto h = hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint16_t)ip;
+
+            if(ref < ip && load32(&src[ref]) == seq)
+            {
+                // extend backwards over pending literals, then forwards
+                while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+                {
+                    ip--;
+                    ref--;
+                }
+                auto mlen = min_match + match_length(&src[ip + min_match], &src[ref + min_match],
+                    match_limit - ip - min_match);
+
+                if(!put_sequence(src, anchor, ip - anchor, ip - ref, mlen, dst, dst_cap, op))
+                    return 0;
+
+                ip += mlen;
+                anchor = ip;
+                misses = 0;
+            }
+            else
+            {
+                // step faster through incompressible data
+                ip += 1 + (misses++ >> 5);
+            }
+        }
+    }
+
+    if(!put_sequence(src, anchor, len - anchor, 0, 0, dst, dst_cap, op))
+        return 0;
+    return op;
+}
+
+/* Returns true if src decompressed to exactly len bytes */
+static inline bool lzpage_decompress(const void *_src, size_t clen, void *_dst, size_t len)
+{
+    using namespace lzpage_detail;
+
+    auto src = (const uint8_t *)_src;
+    auto dst = (uint8_t *)_dst;
+    size_t ip = 0, op = 0;
+
+    auto get_length = [&](size_t &l) -> bool
+    {
+        while(true)
+        {
+            if(ip >= clen)
+                return false;
+            auto b = src[ip++];
+            l += b;
+            if(b != 255)
+                return true;
+        }
+    };
+
+    while(ip < clen)
+    {
+        auto token = src[ip++];
+        size_t litlen = token >> 4;
+        if(litlen == 15 && !get_length(litlen))
+            return false;
+        if(clen - ip < litlen || len - op < litlen)
+            return false;
+        memcpy(&dst[op], &src[ip], litlen);
+        ip += litlen;
+        op += litlen;
+
+        if(ip == clen)
+            break;
+
+        if(clen - ip < 2)
+            return false;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        size_t mlen = token & 0xf;
+        if(mlen == 15 && !get_length(mlen))
+            return false;
+        mlen += min_match;
+        if(offset == 0 || offset > op || len - op < mlen)
+            return false;
+
+        // may overlap, in which case byte at a time
+        auto mp = &dst[op - offset];
+        if(offset >= mlen)
+        {
+            memcpy(&dst[op], mp, mlen);
+        }
+        else
+        {
+            for(size_t i = 0; i < mlen; i++)
+                dst[op + i] = mp[i];
+        }
+        op += mlen;
+    }
+
+    return op == len;
+}
+
+/* Returns true if the page consists of one repeated 64-bit value, stored in *fill */
+static inline bool lzpage_same_filled(const void *_src, size_t len, uint64_t *fill)
+{
+    auto src = (const uint64_t *)_src;
+    auto v = src[0];
+    for(size_t i = 1; i < len / sizeof(uint64_t); i++)
+    {
+        if(src[i] != v)
+            return false;
+    }
+    *fill = v;
+    return true;
+}
+
+#endif
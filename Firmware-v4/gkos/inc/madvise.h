@@ -0,0 +1,23 @@
+#ifndef MADVISE_H
+#define MADVISE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include "process.h"
+
+/* WILLNEED requests are queued to a kernel thread, which maps the file backed pages
+    of the range a few at a time so that the process can keep running, and taking
+    faults, in the meantime. */
+void init_madvise();
+
+/* Returns false if the queue is full, in which case the advice is dropped */
+bool madvise_willneed(id_t pid, uintptr_t start, size_t len);
+
+/* Map the untouched pages of mb from vaddr, up to npages, with read-only permissions
+    as for a read fault.  Returns the number mapped, 0 if vaddr is already mapped or
+    fewer than two pages could be.  Called with umem.m held.  In exceptions.cpp. */
+size_t pf_prefault(Process &p, Process::userspace_mem_t &umem, MemBlock &mb,
+    uintptr_t vaddr, size_t npages);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef MEM_LIMITS_H
+#define MEM_LIMITS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Soft and hard limits on a process' resident pages, 0 for none.
+
+    Pages are charged before they are allocated and the charge held as a reservation
+    until they show up in the resident count (or the allocation fails), so that
+    concurrent faults, and fault-around windows sized from headroom(), cannot together
+    take the process over its hard limit.
+
+    Crossing either limit reports a pressure level once, and not again until usage
+    has fallen an eighth below that limit.  Requires external synchronization - each
+    Process keeps one under owned_pages.sl. */
+struct mem_limits_t
+{
+    enum class pressure { None, Soft, Hard };
+
+    size_t soft = 0;
+    size_t hard = 0;
+    bool soft_signalled = false;
+    bool hard_signalled = false;
+    size_t reserved = 0;
+
+    /* Reserve npages on top of resident pages.  Returns false, reserving nothing, if
+        that would exceed the hard limit.  *level is set to any pressure to report, and
+        *total to the usage it was reported at. */
+    bool charge(size_t resident, size_t npages, pressure *level, size_t *total)
+    {
+        *level = pressure::None;
+        *total = resident + reserved + npages;
+
+        bool ret = true;
+        if(hard && *total > hard)
+        {
+            ret = false;
+            if(!hard_signalled)
+            {
+                hard_signalled = true;
+                *level = pressure::Hard;
+            }
+        }
+        else if(soft && *total > soft)
+        {
+            if(!soft_signalled)
+            {
+                soft_signalled = true;
+                *level = pressure::Soft;
+            }
+        }
+
+        if(*total < soft - soft / 8)
+            soft_signalled = false;
+        if(*total < hard - hard / 8)
+            hard_signalled = false;
+
+        if(ret)
+            reserved += npages;
+        return ret;
+    }
+
+    /* Drop a reservation made by a successful charge() */
+    void uncharge(size_t npages)
+    {
+        reserved = npages < reserved ? reserved - npages : 0;
+    }
+
+    /* Pages that can still be charged, SIZE_MAX if there is no hard limit */
+    size_t headroom(size_t resident) const
+    {
+        if(!hard)
+            return SIZE_MAX;
+        auto total = resident + reserved;
+        return total < hard ? hard - total : 0;
+    }
+};
+
+#endif
@@ -52,6 +52,10 @@ class File
 
         virtual int Ioctl(unsigned int id, void *ptr, size_t len, int *_errno);
 
+        /* Identifies the underlying file for the page cache.  Returns false if its
+            pages should not be cached (the default). */
+        virtual bool PageCacheId(uint64_t *id);
+
         FileType GetType() const;    // support type checking without rtti
 
         uint32_t opts = 0;
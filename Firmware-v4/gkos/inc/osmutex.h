@@ -10,6 +10,7 @@
 #include <memory>
 #include <vector>
 #include <limits>
+#include <atomic>
 
 class Thread;
 using PThread = std::shared_ptr<Thread>;
@@ -26,9 +27,22 @@ class Mutex
         int lockcount = 0;
         ticket_t owning_ticket = kernel_time_invalid();
 
+        /* Spin for up to GK_MUTEX_SPIN_US while the owner is running on another core,
+            as it is likely to release the mutex sooner than we could block and be woken */
+        void spin_while_owner_running(id_t self);
+
     public:
         Spinlock sl;
         id_t id;
+
+        /* Contention statistics, updated without the lock so only approximate */
+        struct stats_t
+        {
+            std::atomic<uint32_t> contended = 0;        // found owned by another thread
+            std::atomic<uint32_t> spin_acquired = 0;    // released while spinning
+            std::atomic<uint32_t> blocked = 0;          // had to sleep
+        } stats;
+
         Mutex(bool recursive = false, bool error_check = false);
         int lock(ticket_t new_ticket = kernel_time_invalid(), bool allow_deadlk = false);
         bool try_lock(int *reason = nullptr, bool block = true, kernel_time tout = kernel_time(),
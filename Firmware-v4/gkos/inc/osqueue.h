@@ -4,7 +4,6 @@
 #include "scheduler.h"
 #include "osmutex.h"
 #include "thread.h"
-#include "ipi.h"
 #include <queue>
 #include <cstring>
 #include <clocks.h>
@@ -45,7 +44,6 @@ template <typename T> class BaseQueue
                 if(btp)
                 {
                     btp->blocking.unblock();
-                    signal_thread_woken(btp);
                 }
             }
             waiting_threads.clear();
@@ -2,6 +2,7 @@
 #define OSTYPES_H
 
 #include <cstdint>
+#include <cstddef>
 #include <memory>
 #include "gkos_vmem.h"
 
@@ -18,9 +19,12 @@ struct pidtid
 using PProcess = std::shared_ptr<Process>;
 using PThread = std::shared_ptr<Thread>;
 
+/* Passed to and from the swap actions of a MemBlock: Sync returns the zram slot the
+    page was stored in, FillSubsequent is given the slot to load from */
 struct SwapFileIndex
 {
-    // TODO
+    uint32_t slot = 0;
+    id_t owner = 0;
 };
 
 struct MemRegion
@@ -89,12 +93,20 @@ struct thread_saved_state
     uint64_t ttbr0;
     uint64_t tpidr_el0;
 
-    uint64_t res1, res2;    // for 32-byte alignment for q registers
+    uint64_t fp_flags;      // THREAD_FP_USED | THREAD_FP_SAVED | core, tested by bit number in switcher.s
+    uint64_t fpcr_fpsr;     // fpcr << 32 | fpsr, valid if THREAD_FP_SAVED
 
     // FP registers - 8*128 bits (q0-q7, q16-31 already saved)
     uint64_t fpu_regs[16];
 };
 
+#define THREAD_FP_USED      0x1ULL      // has used fp/simd at el0 - cpacr_el1 does not trap it
+#define THREAD_FP_SAVED     0x2ULL      // fpu_regs/fpcr_fpsr hold state to restore on switch in
+#define THREAD_FP_CPU_SHIFT 8           // 1 + core whose registers last matched fpu_regs, or 0
+#define THREAD_FP_CPU_MASK  (0xffULL << THREAD_FP_CPU_SHIFT)
+
 static_assert(sizeof(thread_saved_state) == 256);
+static_assert(offsetof(thread_saved_state, fp_flags) == 112);
+static_assert(offsetof(thread_saved_state, fpu_regs) == 128);
 
 #endif
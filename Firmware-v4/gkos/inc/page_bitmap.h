@@ -0,0 +1,119 @@
+#ifndef PAGE_BITMAP_H
+#define PAGE_BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "summary_bitmap.h"
+
+/* Set of physical pages within [base_addr, base_addr + nleaves * 512 MiB).
+
+    Each 512 MiB of the range is a summary_bitmap of its pages which is only
+    allocated when the first page within it is added, so insert and erase are a
+    couple of bit operations with no allocation in the steady state.  Iterating
+    in address order gives runs of contiguous pages which can be released to the
+    buddy allocator as ranges.
+
+    Requires external synchronization. */
+template <uint64_t base_addr, unsigned int nleaves = 8, uint64_t page_size = 65536> class page_bitmap
+{
+    protected:
+        static constexpr unsigned int leaf_pages = 8192;
+        static constexpr uint64_t leaf_size = leaf_pages * page_size;
+
+        using leaf = summary_bitmap<leaf_pages>;
+        std::unique_ptr<leaf> leaves[nleaves];
+        size_t n = 0;
+
+        static bool index(uint64_t addr, unsigned int *l, unsigned int *bit)
+        {
+            if(addr < base_addr || addr >= base_addr + nleaves * leaf_size)
+                return false;
+            addr -= base_addr;
+            *l = (unsigned int)(addr / leaf_size);
+            *bit = (unsigned int)((addr % leaf_size) / page_size);
+            return true;
+        }
+
+    public:
+        static bool in_range(uint64_t addr)
+        {
+            unsigned int l, bit;
+            return index(addr, &l, &bit);
+        }
+
+        /* Returns false if addr is outside the range covered */
+        bool insert(uint64_t addr)
+        {
+            unsigned int l, bit;
+            if(!index(addr, &l, &bit))
+                return false;
+            if(!leaves[l])
+                leaves[l] = std::make_unique<leaf>();
+            if(!leaves[l]->test(bit))
+            {
+                leaves[l]->set(bit);
+                n++;
+            }
+            return true;
+        }
+
+        /* Returns false if addr was not present */
+        bool erase(uint64_t addr)
+        {
+            unsigned int l, bit;
+            if(!index(addr, &l, &bit) || !leaves[l] || !leaves[l]->test(bit))
+                return false;
+            leaves[l]->clear(bit);
+            n--;
+            return true;
+        }
+
+        bool contains(uint64_t addr) const
+        {
+            unsigned int l, bit;
+            return index(addr, &l, &bit) && leaves[l] && leaves[l]->test(bit);
+        }
+
+        size_t size() const { return n; }
+
+        /* Calls f(start, length) for each run of contiguous pages, in address order */
+        template <typename F> void for_each_run(F f) const
+        {
+            uint64_t run_start = 0, run_end = 0;
+            for(auto l = 0U; l < nleaves; l++)
+            {
+                if(!leaves[l])
+                    continue;
+                auto lbase = base_addr + l * leaf_size;
+                for(auto bit = leaves[l]->find_next(0); bit < leaf_pages;)
+                {
+                    auto end = bit + 1;
+                    while(end < leaf_pages && leaves[l]->test(end))
+                        end++;
+
+                    auto start_addr = lbase + bit * page_size;
+                    if(run_end != start_addr)
+                    {
+                        if(run_end != run_start)
+                            f(run_start, run_end - run_start);
+                        run_start = start_addr;
+                    }
+                    run_end = lbase + end * page_size;
+
+                    bit = leaves[l]->find_next(end);
+                }
+            }
+            if(run_end != run_start)
+                f(run_start, run_end - run_start);
+        }
+
+        void clear()
+        {
+            for(auto &l : leaves)
+                l = nullptr;
+            n = 0;
+        }
+};
+
+#endif
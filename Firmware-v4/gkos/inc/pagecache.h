@@ -0,0 +1,60 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/* Global cache of read-only file pages, shared between every process that maps the
+    same part of the same file (ELF text/rodata, read-only mmaps).
+
+    Pages are keyed on a file identity from File::PageCacheId() plus the offset and
+    length read, and are reference counted through shared_ptr: the cache holds one
+    reference and each process mapping holds another in its owned_pages.other_pages.
+    The physical page is returned to Pmem when the last reference goes.
+
+    Pages that no process maps are reclaimed in second-chance order when the cache
+    grows past GK_PAGECACHE_MAX_PAGES or the page fault handler finds memory short.
+    Writing to or truncating a file drops its pages from the cache; processes that
+    already map them keep the old contents, as with a private mapping. */
+
+class MemBlock;
+
+class shared_page
+{
+    public:
+        uintptr_t paddr = 0;
+        std::atomic<bool> referenced = true;
+
+        ~shared_page();
+};
+
+using PSharedPage = std::shared_ptr<shared_page>;
+
+/* Returns the cached page for (file_id, offset, len), filling a new one with
+    mb.FillFirst(page_vaddr) on a miss.  Returns nullptr if out of memory or the fill
+    failed. */
+PSharedPage pagecache_get(uint64_t file_id, size_t offset, size_t len,
+    MemBlock &mb, uintptr_t page_vaddr);
+
+/* Fill the cache for the pages of mb from page_vaddr that are not yet cached, up to
+    npages, with a single read.  Returns the number of pages read. */
+size_t pagecache_readahead(MemBlock &mb, uintptr_t page_vaddr, size_t npages);
+
+void pagecache_invalidate(uint64_t file_id);
+void pagecache_invalidate_all();
+
+/* Drop up to npages pages that are not mapped anywhere, returns the number dropped */
+size_t pagecache_reclaim(size_t npages);
+
+struct pagecache_stats_t
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t reclaimed;
+    size_t pages;
+};
+pagecache_stats_t pagecache_stats();
+
+#endif
@@ -3,8 +3,11 @@
 
 #include "ostypes.h"
 #include "buddy.h"
+#include "gk_conf.h"
 
-using PmemAllocator = BuddyAllocator<65536, 0x20000000, 0x80000000, PMemBlock>;
+#define PMEM_BASE       0x80000000ULL
+
+using PmemAllocator = BuddyAllocator<65536, 0x20000000, PMEM_BASE, PMemBlock, GK_NUM_CORES>;
 extern PmemAllocator Pmem;
 
 void init_pmem(uint64_t ddr_start, uint64_t ddr_end);
@@ -29,7 +29,8 @@
     The backing store needs to handle:
         First-time reads/writes of a page within a region
          - either load with zero or part of a file 
-        Subsequent reads/writes of a page that may have been swapped out (swapping TODO)
+        Subsequent reads/writes of a page that may have been swapped out to zram (see
+         action_swapfill/action_swapsync and zram_reclaim)
 
         Thus, a zero backed region (e.g. heap) may have some pages that read as 0, and
          some that read as part of swap space.  We need to handle this somehow.
@@ -44,8 +45,9 @@
          When we come to swap out a page (or indeed msync() a page back to the backing file),
          we only need to write those pages within the region that have the writeable bit set.
 
-         Swapped out pages (thay will need to be reloaded on access) are then set as
-         writeable bit set, present bit not set.
+         Swapped out pages (thay will need to be reloaded on access) have their entry
+         replaced with a PTE_SWAP entry, which keeps the permissions and holds the zram
+         slot (see zram.h).
 
 
          Therefore 3 functions are required: FillFirst, FillSubsequent and Sync:
@@ -55,16 +57,16 @@
                 Sync = Null
             ZeroBackedReadWriteMemory: (heap/stack/bss, mmap anon regions)
                 FillFirst = FillZero
-                FillSubsequent = ReadSwap
-                Sync = WriteSwap
+                FillSubsequent = ReadSwap (action_swapfill)
+                Sync = WriteSwap (action_swapsync)
             FileBackedReadOnlyMemory: (text, rodata, mmap ro regions)
                 FillFirst = FileRead
                 FillSubsequent = Null (won't be called because write bit will never be set)
                 Sync = Null
             FileBackedReadWriteMemory (data, mmap rw regions)
                 FillFist = FileRead
-                FillSubsequent = ReadSwap
-                Sync = WriteSwap
+                FillSubsequent = ReadSwap (action_swapfill)
+                Sync = WriteSwap (action_swapsync)
 
 
     The page fault handler therefore has a lot to do, and may be required to switch processes
@@ -80,6 +82,7 @@
 #include <list>
 #include <map>
 #include "ostypes.h"
+#include "gap_index.h"
 
 #if __GK_UNIT_TEST__
 #include "unit_test.h"
@@ -94,6 +97,7 @@
 /* Define a block of memory */
 
 class drm_gem_object;
+class shared_page;
 class MemBlock
 {
     public:
@@ -114,6 +118,10 @@ class MemBlock
         bool pmem_is_shared = false;
         bool pmem_is_drm_object = false;
 
+        /* Access pattern given by madvise, which sets the fault-around window */
+        enum class access_hint_t { Normal, Random, Sequential };
+        access_hint_t access_hint = access_hint_t::Normal;
+
         static MemBlock ZeroBackedReadOnlyMemory(uintptr_t base,
             uintptr_t length,
             bool user, bool exec, unsigned int guard_type = 0, unsigned int mt = MT_NORMAL);
@@ -134,6 +142,22 @@ class MemBlock
             bool user, bool exec, unsigned int guard_type = 0, unsigned int mt = MT_NORMAL);
         static MemBlock TLSMemory(uintptr_t length, uintptr_t src_addr);
 
+        /* FillFirst just zeroes the page, so an already zeroed page can be mapped as is */
+        bool IsZeroFill() const;
+
+        /* Written pages can be compressed out to zram by Sync and read back by FillSubsequent */
+        bool IsSwapBacked() const;
+
+        /* For read-only file backed memory, the page cache page for page_vaddr, else nullptr */
+        std::shared_ptr<shared_page> CachedPage(uintptr_t page_vaddr);
+
+        /* For read-only file backed memory, the identity of page_vaddr in the page cache */
+        bool PageCacheKey(uintptr_t page_vaddr, uint64_t *file_id, size_t *offset, size_t *len);
+
+        /* FillFirst for npages pages from page_vaddr into the contiguous block at paddr.
+            File backed memory is read with a single request rather than one per page. */
+        int FillFirstRange(uintptr_t page_vaddr, uintptr_t paddr, size_t npages);
+
 };
 
 /* Define the allocator interface
@@ -142,6 +166,7 @@ class MemBlock
         Split an already allocated region into two or three (to allow mprotect on part of a region)
         Allocation of a fixed size region at any address, either lowest first, highest first or anywhere
         For a given address, return whether it is within an allocated region or not
+        For a given address, the first region ending after it (for the zram clock scan)
         In-order traversal for dump()ing purposes.
         Deletion of allocation
 */
@@ -157,6 +182,7 @@ class VBlockAllocator
         virtual MemBlock &Split(uintptr_t address) = 0;
         virtual VMemBlock AllocAny(MemBlock region, bool lowest_first = true) = 0;
         virtual MemBlock &IsAllocated(uintptr_t address) = 0;
+        virtual MemBlock *NextFrom(uintptr_t address) = 0;
         virtual int Traverse(traversal_function_t tf) = 0;
         virtual int Dealloc(VMemBlock& region) = 0;
         virtual int Dealloc(MemBlock& region);
@@ -172,20 +198,31 @@ class MapVBlockAllocator : public VBlockAllocator
         std::map<uintptr_t, MemBlock> l;
         Mutex m;
 
-        std::tuple<bool, uintptr_t, uintptr_t> fits(uintptr_t len,
-            MemBlock *prev,
-            MemBlock *next);
+        /* Free gaps between the blocks of l, built on first use as base and length can be
+            changed after construction */
+        GapIndex<uintptr_t> gaps;
+        bool gaps_valid = false;
+
+        void gaps_build();
+        void gaps_inserted(std::map<uintptr_t, MemBlock>::iterator pos);
+        void gaps_erasing(std::map<uintptr_t, MemBlock>::iterator pos);
+        uintptr_t prev_end(std::map<uintptr_t, MemBlock>::iterator pos);
+        uintptr_t next_start(std::map<uintptr_t, MemBlock>::iterator pos);
 
     public:
         VMemBlock AllocFixed(MemBlock region);
         MemBlock &Split(uintptr_t address);
         VMemBlock AllocAny(MemBlock region, bool lowest_first = true);
         MemBlock &IsAllocated(uintptr_t address);
+        MemBlock *NextFrom(uintptr_t address);
         int Traverse(traversal_function_t tf);
         int Dealloc(VMemBlock &region);
 
         using VBlockAllocator::Dealloc;
 
+        /* Largest free gap, for diagnostics */
+        uintptr_t LargestFree();
+
         MapVBlockAllocator() : VBlockAllocator() {}
         MapVBlockAllocator(uintptr_t _base, uintptr_t _length) : VBlockAllocator(_base, _length) {}
 };
@@ -9,6 +9,7 @@
 #include "vblock.h"
 #include "ostypes.h"
 #include "osmutex.h"
+#include "asid.h"
 #include <unordered_set>
 #include <map>
 #include "sync_primitive_locks.h"
@@ -18,6 +19,9 @@
 #include "proc_vmem.h"
 #include "block_allocator.h"
 #include "vmem.h"
+#include "pmem.h"
+#include "page_bitmap.h"
+#include "mem_limits.h"
 
 class Thread;
 class Process;
@@ -28,6 +32,8 @@ using WPProcess = std::weak_ptr<Process>;
 
 class shared_page;
 
+enum class owned_page_kind { Anonymous, PageTable, Gpu };
+
 class Process
 {
     public:
@@ -49,21 +55,47 @@ class Process
 
                 /* The majority of pages (unshared, page size) go in 'p' for quick access etc.
                     Larger blocks of pages, or those that are shared or accessed by the gpu,
-                    go in other_pages or gpu_pages respectively.*/
-                std::unordered_set<uint32_t> p{};
+                    go in other_pages or gpu_pages respectively.  Shared pages (from the
+                    page cache) hold a reference in other_pages rather than being owned.
+                    'p' is a bitmap over the Pmem range so adding a page on each fault does
+                    not allocate, and release_all frees contiguous runs in one go.  Page
+                    table pages are kept apart in 'pt' so that they can be accounted. */
+                page_bitmap<PMEM_BASE> p{};
+                page_bitmap<PMEM_BASE> pt{};
 
                 struct owned_page_list
                 {
                     BlockAllocator<std::shared_ptr<shared_page>> p{};
                     uintptr_t npages = 0;
+                    uintptr_t nshared = 0;      // of npages, references to page cache pages
                     void dump();
                 };
                 owned_page_list other_pages, gpu_pages;
 
-                void add(const PMemBlock &b, bool is_gpu = false);
-                void release(const PMemBlock &b);
+                void add(const PMemBlock &b, owned_page_kind kind = owned_page_kind::Anonymous);
+                bool add_shared(const std::shared_ptr<shared_page> &sp);
+
+                /* Returns false if b was a shared page, which must not be returned to Pmem */
+                bool release(const PMemBlock &b);
                 void release_all();
+                bool is_shared(uintptr_t addr);
                 bool contains(uintptr_t addr, uintptr_t size = PAGE_SIZE);
+
+                /* Pages the kernel or a device is using by physical address, which reclaim
+                    must leave in place.  Counted, as a page can be pinned more than once. */
+                std::map<uintptr_t, unsigned int> pinned{};
+                void pin(uintptr_t addr);
+                void unpin(uintptr_t addr);
+                bool is_pinned(uintptr_t addr) const;
+
+                /* Resident pages by kind.  File pages are those shared from the page
+                    cache, private copies of file data count as anonymous. */
+                struct usage_t
+                {
+                    size_t anon, file, gpu, pt;
+                    size_t total() const { return anon + file + gpu + pt; }
+                };
+                usage_t usage() const;
         };
 
         class userspace_mem_t
@@ -71,7 +103,23 @@ class Process
             public:
                 Mutex m = Mutex(true);
                 uintptr_t ttbr0;
+                asid_context asid;
                 MapVBlockAllocator vblocks;
+                uintptr_t zram_clock = 0;   // next address for the zram reclaim scan
+
+                /* Fault-around: the window doubles while faults follow on from the last
+                    run mapped, and drops back to GK_FAULT_AROUND_PAGES otherwise */
+                uintptr_t fa_next = 0;
+                size_t fa_window = GK_FAULT_AROUND_PAGES;
+
+                struct
+                {
+                    uint64_t faults = 0;        // lower half translation/access flag faults
+                    uint64_t af = 0;            // of which access flag only
+                    uint64_t swapins = 0;       // pages read back from zram
+                    uint64_t around = 0;        // extra pages mapped by fault-around
+                    uint64_t readahead = 0;     // file pages read in multi-page requests
+                } fault_stats;
         };
 
         class environ_t
@@ -186,6 +234,26 @@ class Process
 
         open_files_t open_files{};
         owned_pages_t owned_pages{};
+
+        /* Limits on resident pages (owned_pages.usage().total()), see mem_limits.h.
+            Above the soft limit a MemoryPressure event is sent to the process and the
+            supervisor, as it is for the hard limit, faults above which first try to
+            swap out the process' own pages.  Protected by owned_pages.sl */
+        mem_limits_t mem_limits{ GK_MEM_SOFT_LIMIT, GK_MEM_HARD_LIMIT };
+
+        /* Reserves npages against the hard limit, returns false if they would exceed it.
+            Prefer MemChargeGuard, which drops the reservation once the pages are owned */
+        bool MemCharge(size_t npages);
+        void MemUncharge(size_t npages);
+        /* Pages that can be charged before the hard limit, SIZE_MAX if there is none */
+        size_t MemHeadroom();
+
+        /* Pin the page mapped at lower half vaddr so that it is not reclaimed while accessed
+            by physical address.  Returns the paddr of vaddr, or 0 (pinning nothing) if it is
+            not mapped.  Each non-zero return needs a matching UnpinUserPage. */
+        uintptr_t PinUserPage(uintptr_t vaddr);
+        void UnpinUserPage(uintptr_t paddr);
+
         environ_t env{};
         heap_t heap{};
         screen_t screen{};
@@ -239,8 +307,40 @@ class Process
 
 extern PProcess p_kernel;
 
+/* Pages charged to a process for the guard's lifetime, which should last until they
+    have been added to its owned_pages */
+class MemChargeGuard
+{
+    protected:
+        Process *p;
+        size_t n = 0;
+
+    public:
+        MemChargeGuard(Process *_p) : p(_p) {}
+        MemChargeGuard(const MemChargeGuard &) = delete;
+
+        /* Add npages to the charge, false if they would exceed the hard limit */
+        bool charge(size_t npages)
+        {
+            if(!p->MemCharge(npages))
+                return false;
+            n += npages;
+            return true;
+        }
+
+        ~MemChargeGuard()
+        {
+            if(n)
+                p->MemUncharge(n);
+        }
+};
+
 PProcess GetFocusProcess();
 id_t GetFocusPid();
 int SetFocusProcess(PProcess p);
 
+/* Sends a MemoryPressure event to the supervisor when free Pmem falls below
+    GK_MEM_PRESSURE_LOW_WATER.  Cheap enough to call on each allocating fault. */
+void mem_pressure_poll();
+
 #endif
@@ -0,0 +1,232 @@
+#ifndef RCUTABLE_H
+#define RCUTABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/* Hash table keyed on an integer id with wait-free lookup.
+
+    Readers never take a lock: they register in one of two epoch counters, walk a
+    bucket chain and copy the value out.  Nodes are never modified once published -
+    an update publishes a modified copy in place of the old node and an erase
+    unlinks it, in both cases retiring the old node rather than freeing it.
+
+    Retired nodes are freed by reclaim() once both epoch counters have been seen
+    at zero after their retirement, at which point no reader can still hold them.
+    A reader that is delayed between reading the epoch and registering in its
+    counter is harmless, as it only reads the chains after registering and so
+    cannot find a node that had already been unlinked.
+
+    Writers (insert, update, erase, for_each, reclaim) must be serialised by the
+    caller.  reclaim() never waits for readers - if any are active it just leaves
+    the retired nodes for a later call. */
+
+template <class K, class V, size_t nbuckets = 256> class RcuTable
+{
+    static_assert(nbuckets && (nbuckets & (nbuckets - 1)) == 0);
+
+    public:
+        struct Node
+        {
+            K id;
+            V v;
+            std::atomic<Node *> next = nullptr;
+            Node *retired_next = nullptr;
+
+            Node(K _id, const V &_v) : id(_id), v(_v) {}
+        };
+
+    protected:
+        std::atomic<Node *> buckets[nbuckets] = {};
+        std::atomic<unsigned int> epoch = 0;
+        mutable std::atomic<unsigned int> readers[2] = {};
+        Node *retired[2] = {};
+        size_t count = 0;
+
+        static size_t bucket(K id) { return (size_t)id & (nbuckets - 1); }
+
+        class ReadGuard
+        {
+            std::atomic<unsigned int> &ctr;
+
+            public:
+                ReadGuard(const RcuTable *t) : ctr(t->readers[t->epoch.load(std::memory_order_relaxed) & 1U])
+                {
+                    ctr.fetch_add(1);
+                }
+                ~ReadGuard()
+                {
+                    ctr.fetch_sub(1, std::memory_order_release);
+                }
+        };
+
+        const Node *find(K id) const
+        {
+            auto n = buckets[bucket(id)].load(std::memory_order_acquire);
+            while(n && n->id != id)
+                n = n->next.load(std::memory_order_acquire);
+            return n;
+        }
+
+        // writer side - returns the link pointing at id, or nullptr
+        std::atomic<Node *> *find_link(K id)
+        {
+            auto link = &buckets[bucket(id)];
+            while(true)
+            {
+                auto n = link->load(std::memory_order_relaxed);
+                if(!n)
+                    return nullptr;
+                if(n->id == id)
+                    return link;
+                link = &n->next;
+            }
+        }
+
+        void retire(Node *n)
+        {
+            auto e = epoch.load(std::memory_order_relaxed) & 1U;
+            n->retired_next = retired[e];
+            retired[e] = n;
+        }
+
+        /* Move on to the next epoch if nobody is still reading in the previous one,
+            returning the nodes retired during the previous one */
+        Node *advance()
+        {
+            auto e = epoch.load(std::memory_order_relaxed) & 1U;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(readers[e ^ 1U].load(std::memory_order_acquire) != 0)
+                return nullptr;
+
+            auto ret = retired[e ^ 1U];
+            retired[e ^ 1U] = nullptr;
+            epoch.store(e ^ 1U, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return ret;
+        }
+
+    public:
+        /* Reader side - safe from any context without holding the writer lock */
+
+        V get(K id) const
+        {
+            ReadGuard rg(this);
+            auto n = find(id);
+            return n ? n->v : V();
+        }
+
+        bool exists(K id) const
+        {
+            ReadGuard rg(this);
+            return find(id) != nullptr;
+        }
+
+        /* Writer side */
+
+        size_t size() const { return count; }
+
+        void insert(K id, const V &v)
+        {
+            auto n = new Node(id, v);
+            if(auto link = find_link(id); link)
+            {
+                auto old = link->load(std::memory_order_relaxed);
+                n->next.store(old->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                link->store(n, std::memory_order_release);
+                retire(old);
+                return;
+            }
+
+            auto &b = buckets[bucket(id)];
+            n->next.store(b.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            b.store(n, std::memory_order_release);
+            count++;
+        }
+
+        /* Publish a copy of the value for id with f applied to it */
+        template <typename F> bool update(K id, F f)
+        {
+            auto link = find_link(id);
+            if(!link)
+                return false;
+            auto old = link->load(std::memory_order_relaxed);
+            auto n = new Node(id, old->v);
+            f(n->v);
+            n->next.store(old->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            link->store(n, std::memory_order_release);
+            retire(old);
+            return true;
+        }
+
+        bool erase(K id, V *old_v = nullptr)
+        {
+            auto link = find_link(id);
+            if(!link)
+                return false;
+            auto old = link->load(std::memory_order_relaxed);
+            if(old_v)
+                *old_v = old->v;
+            link->store(old->next.load(std::memory_order_relaxed), std::memory_order_release);
+            retire(old);
+            count--;
+            return true;
+        }
+
+        template <typename F> void for_each(F f) const
+        {
+            for(const auto &b : buckets)
+            {
+                for(auto n = b.load(std::memory_order_relaxed); n; n = n->next.load(std::memory_order_relaxed))
+                    f(n->id, n->v);
+            }
+        }
+
+        /* Returns a chain of nodes that are no longer visible to any reader, to be
+            passed to free_nodes().  Two epochs are tried so that with no readers
+            active everything retired so far is returned. */
+        Node *reclaim()
+        {
+            auto a = advance();
+            auto b = advance();
+            if(!a)
+                return b;
+            auto tail = a;
+            while(tail->retired_next)
+                tail = tail->retired_next;
+            tail->retired_next = b;
+            return a;
+        }
+
+        /* Can be called without the writer lock, so that the destructors of the
+            values do not run with it held */
+        static void free_nodes(Node *n)
+        {
+            while(n)
+            {
+                auto next = n->retired_next;
+                delete n;
+                n = next;
+            }
+        }
+
+        ~RcuTable()
+        {
+            for(auto &b : buckets)
+            {
+                auto n = b.load(std::memory_order_relaxed);
+                while(n)
+                {
+                    auto next = n->next.load(std::memory_order_relaxed);
+                    delete n;
+                    n = next;
+                }
+            }
+            free_nodes(retired[0]);
+            free_nodes(retired[1]);
+        }
+};
+
+#endif
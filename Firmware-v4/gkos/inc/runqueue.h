@@ -0,0 +1,129 @@
+#ifndef RUNQUEUE_H
+#define RUNQUEUE_H
+
+#include <cstdint>
+#include <cstddef>
+
+/* Intrusive per-priority run queue with an occupancy bitmap.
+
+    Only runnable threads (and threads donating their priority to a mutex owner)
+    are held here, so picking the next thread is a clz on the bitmap followed by
+    a list pop regardless of how many threads exist in the system.
+
+    The queue does no locking of its own - callers must hold the owning lock. */
+
+template <class T> struct RunQueueNode
+{
+    T *next = nullptr;
+    T *prev = nullptr;
+    int prio = -1;          // priority list currently on, -1 if not queued
+
+    bool queued() const { return prio >= 0; }
+};
+
+template <class T, int npriorities, RunQueueNode<T> T::*node = &T::rq> class RunQueue
+{
+    static_assert(npriorities > 0 && npriorities <= 32);
+
+    protected:
+        struct list_t
+        {
+            T *head = nullptr;
+            T *tail = nullptr;
+            size_t count = 0;
+        };
+
+        list_t lists[npriorities];
+        uint32_t bitmap = 0;
+        size_t total = 0;
+
+        static RunQueueNode<T> &n(T *t) { return t->*node; }
+
+    public:
+        /* Highest priority with a queued thread, or -1 if empty */
+        int highest() const
+        {
+            return bitmap ? 31 - __builtin_clz(bitmap) : -1;
+        }
+
+        /* Highest priority strictly below prio with a queued thread, or -1 */
+        int next_below(int prio) const
+        {
+            if(prio <= 0)
+                return -1;
+            auto masked = bitmap & ((1U << prio) - 1U);
+            return masked ? 31 - __builtin_clz(masked) : -1;
+        }
+
+        T *front(int prio) const { return lists[prio].head; }
+        static T *next(T *t) { return n(t).next; }
+        size_t size(int prio) const { return lists[prio].count; }
+        size_t size() const { return total; }
+        bool empty() const { return bitmap == 0; }
+
+        void push_back(T *t, int prio)
+        {
+            if(prio < 0) prio = 0;
+            if(prio >= npriorities) prio = npriorities - 1;
+
+            auto &l = lists[prio];
+            auto &tn = n(t);
+            tn.prio = prio;
+            tn.next = nullptr;
+            tn.prev = l.tail;
+            if(l.tail)
+                n(l.tail).next = t;
+            else
+                l.head = t;
+            l.tail = t;
+            l.count++;
+            total++;
+            bitmap |= 1U << prio;
+        }
+
+        void erase(T *t)
+        {
+            auto &tn = n(t);
+            if(!tn.queued())
+                return;
+
+            auto &l = lists[tn.prio];
+            if(tn.prev)
+                n(tn.prev).next = tn.next;
+            else
+                l.head = tn.next;
+            if(tn.next)
+                n(tn.next).prev = tn.prev;
+            else
+                l.tail = tn.prev;
+
+            l.count--;
+            total--;
+            if(!l.head)
+                bitmap &= ~(1U << tn.prio);
+
+            tn.next = nullptr;
+            tn.prev = nullptr;
+            tn.prio = -1;
+        }
+
+        T *pop_front(int prio)
+        {
+            auto t = lists[prio].head;
+            if(t)
+                erase(t);
+            return t;
+        }
+
+        /* Move to the back of its current list for round-robin */
+        void rotate(T *t)
+        {
+            auto prio = n(t).prio;
+            if(prio < 0)
+                return;
+            erase(t);
+            push_back(t, prio);
+        }
+};
+
+#endif
@@ -7,10 +7,16 @@
 #include "kernel_time.h"
 #include "gic.h"
 #include "threadproclist.h"
+#include "runqueue.h"
+#include "timeoutheap.h"
 
 #include <vector>
 #include <atomic>
 
+#if GK_TICKLESS && !GK_DYNAMIC_SYSTICK
+#error GK_TICKLESS requires GK_DYNAMIC_SYSTICK
+#endif
+
 class Scheduler
 {
     public:
@@ -19,20 +25,120 @@ class Scheduler
         std::atomic<double> cpu_usage[ncores];
         double CPUUsage(int core_id = -1);
 
-    protected:
-        struct IndexedThreadVector
+        /* Per-core counts of what caused the scheduler to run, to measure the effect
+            of GK_TICKLESS.  'idle' counts every return from wfi in the idle thread,
+            including IRQs which did not lead to a reschedule. */
+        struct wakeup_counts_t
+        {
+            std::atomic<uint64_t> timer;
+            std::atomic<uint64_t> sgi;
+            std::atomic<uint64_t> idle;
+        };
+        wakeup_counts_t wakeups[ncores];
+
+        /* Time from a thread being made runnable (unblock or timeout) to it running,
+            per priority */
+        struct latency_stats_t
         {
-            std::vector<PThread> v;
-            int index = -1;
-            Spinlock sl;
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total_us;
+            std::atomic<uint64_t> max_us;
         };
+        latency_stats_t latency[npriorities];
 
+    protected:
         PThread idle_threads[ncores];
         std::atomic<uint64_t> timeslice_start[ncores];
         uint64_t idle_thread_times[ncores];
         uint64_t non_idle_thread_times[ncores];
 
-        IndexedThreadVector tlist[npriorities];
+        /* All scheduled threads.  Holds a reference until Unschedule() */
+        std::vector<PThread> threads;
+        Spinlock sl_threads;
+
+        /* Per-core run queues.  Threads which can run now, plus those donating their priority
+            to a thread they are blocked on.  Threads running on a core are held in neither.
+            Each core's queues are protected by its own sl_rq[], so the cores only contend
+            when stealing work or waking a thread homed on the other core. */
+        RunQueue<Thread, npriorities> rq[ncores];
+
+        /* Switched-out threads blocked with a timeout, one min-heap per core and priority so
+            set_timeout() can peek at just those which would preempt the next thread */
+        TimeoutHeap<Thread, kernel_time> tq[ncores][npriorities];
+        void tq_insert(uint32_t core, Thread *t, kernel_time tout);
+        void tq_erase(uint32_t core, Thread *t);
+        void wake_timeouts(uint32_t ncore, kernel_time now);
+
+        /* Deadline (ns) each core programmed when it last picked its idle thread,
+            idle_no_deadline if its timer is stopped, or 0 if it is not idle.  Set before an
+            idle core's final steal attempt so a thread queued elsewhere concurrently is not missed. */
+        static constexpr uint64_t idle_no_deadline = ~0ULL;
+        std::atomic<uint64_t> idle_deadline_ns[ncores];
+
+        /* Send a reschedule SGI to core if it is idle and would otherwise sleep past when_ns */
+        void kick_idle(uint32_t core, uint64_t when_ns);
+
+        /* Base priority of the thread each core is running, -1 for idle and npriorities
+            for a golden thread */
+        std::atomic<int> running_prio[ncores];
+
+        /* Send a reschedule SGI to the core running the lowest priority thread that the newly
+            runnable t outranks, if any */
+        void preempt_for(const Thread *t, uint32_t home, bool include_self);
+
+        /* Set t's base priority, moving it between the queues of core (its home, with
+            sl_rq[core] held) as required.  Returns true if t is on a core, in which case
+            the caller deals with running_prio and any reschedule. */
+        bool set_priority_locked(Thread *t, unsigned int core, int old_p, int new_p);
+
+        /* Run f(core) with sl_rq held for the core whose queues currently hold t */
+        template <typename Func> void with_home_locked(Thread *t, Func f)
+        {
+            while(true)
+            {
+                unsigned int core = t->rq_core;
+                CriticalGuard cg(sl_rq[core]);
+                if(t->rq_core == core)
+                {
+                    f(core);
+                    return;
+                }
+            }
+        }
+
+        /* Best core for a thread to be homed on, preferring pref if allowed */
+        uint32_t pick_core(const Thread *t, uint32_t pref) const;
+
+        /* Place a thread onto the appropriate queue of its home core.  Needs sl_rq[t->rq_core] */
+        void enqueue(Thread *t);
+
+        /* Place a thread being switched out onto its home core's queues.  Needs sl_rq[t->rq_core] */
+        void requeue(Thread *t);
+
+        /* Mark a thread homed on core 'home' as chosen for core ncore.  Needs sl_rq[home] and
+            sl_cur_next[ncore] */
+        void claim(uint32_t ncore, uint32_t home, Thread *t);
+
+        /* Lock t's home and claim it for ncore if it is switched out and allowed to run there */
+        bool try_claim(uint32_t ncore, Thread *t, bool must_be_queued);
+
+        /* Take the highest priority runnable thread of at least min_prio from another core */
+        Thread *steal(uint32_t ncore, int min_prio);
+
+        /* Frame-paced threads.  Each is boosted to frame_boost_priority at the first vsync of
+            its period, and drops back once it submits a frame or uses its budget. */
+        static constexpr int frame_boost_priority = GK_PRIORITY_HIGH;
+        static constexpr unsigned int max_frame_threads = 8;
+        PThread frame_threads[max_frame_threads];
+        unsigned int n_frame_threads = 0;
+        Spinlock sl_frame;
+
+        /* Add CPU time to a frame-paced thread's budget, clearing its boost and returning true
+            once the budget is used up.  The caller then restores its priority.  Needs sl_frame */
+        bool frame_charge(Thread *t, uint64_t us);
+
+        /* Microseconds of budget remaining for a boosted thread, or ~0.  Needs sl_frame */
+        uint64_t frame_budget_left(const Thread *t, uint64_t running_us) const;
 
         /* Follows the chain of 'blocking_on' to allow priority escalation */
         std::pair<PThread, bool> get_blocker(PThread unlocked_t);
@@ -41,9 +147,10 @@ class Scheduler
         void report_chosen(PThread old_t, PThread new_t);
 
         /* Set new timeout value based upon high priority threads which will unblock before the current
-            scheduling interval */
-        kernel_time earliest_blockers[npriorities];
-        inline void set_timeout(const PThread new_t);
+            scheduling interval.  With GK_TICKLESS the idle thread sleeps until the next timeout, or
+            indefinitely if there is none. */
+        inline void set_timeout(uint32_t ncore, const PThread &new_t,
+            const PThread &old_t, kernel_time old_tout);
 
     public:
         Scheduler();
@@ -51,6 +158,9 @@ class Scheduler
 
         void Schedule(PThread t);
         void Unschedule(PThread t);
+
+        /* Called from blocking_t::unblock() to put a switched-out thread back on the run queue */
+        void Wake(Thread *t);
         Thread *GetNextThread(uint32_t ncore);
         PThread &GetCurThread(uint32_t ncore);
         void SetNextThread(uint32_t ncore, Thread *);
@@ -59,18 +169,52 @@ class Scheduler
 
         void ChangePriority(PThread t, int old_priority, int new_priority);
 
+        /* Set the priority a thread runs at outside any boost.  For a frame-paced thread
+            this is the priority it returns to at the end of its budget; while boosted it
+            keeps the boost until then. */
+        void SetBasePriority(PThread t, int new_priority);
+
         void SetGoldenThread(PThread t);
 
-        Spinlock sl_cur_next;
+        /* Restrict a thread to the cores in mask (bit n for core n).  Returns -1 if mask
+            contains no valid core */
+        int SetAffinity(PThread t, uint32_t mask);
+        uint32_t GetAffinity(PThread t);
+
+        /* Frame-paced scheduling class.  While it has budget_us of CPU time left in the current
+            period, t runs ahead of normal priority background work.  A period starts at the first
+            vsync after the previous one ends (period_us, or the owning process' screen refresh
+            if 0) and a deadline is missed if no frame was submitted during it.  budget_us == 0
+            removes t from the class.  Returns -1 on invalid arguments or if too many threads
+            are registered. */
+        int SetFramePacing(PThread t, unsigned int budget_us, unsigned int period_us);
+
+        /* Called from the LTDC line interrupt at each vsync */
+        void FrameTick();
+
+        /* Called when t submits a frame (screen flip) */
+        void FrameComplete(Thread *t);
+
+        /* Number of periods and missed deadlines since t was made frame-paced */
+        std::pair<uint64_t, uint64_t> GetFrameStats(PThread t);
+
+        /* Is thread id currently on a core other than the caller's?  Unlocked - only a hint,
+            for deciding whether to spin on a lock it holds */
+        bool IsRunningElsewhere(id_t id) const;
+
+        /* Id of the thread each core is running */
+        std::atomic<id_t> running_tid[ncores];
+
+        Spinlock sl_rq[ncores];
+
+        /* Protects current_thread[], next_thread[] and golden_thread[] for each core */
+        Spinlock sl_cur_next[ncores];
+        Spinlock sl_golden;
         PThread current_thread[ncores];
         PThread next_thread[ncores];
         PThread golden_thread[ncores];
 
         bool scheduler_running[ncores];
-
-#if GK_TICKLESS
-        volatile uint64_t block_until = 0ULL;
-#endif
 };
 
 void Schedule(PThread t);
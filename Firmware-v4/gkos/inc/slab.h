@@ -0,0 +1,238 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/* Size-class slab allocator with per-core magazines, for small kernel allocations.
+
+    Each core has a magazine of free objects per size class which it allocates from
+    and frees to without any locking.  Only when a magazine runs empty or fills up
+    is the depot for that class locked, to move half a magazine's worth of objects
+    at a time.  The depot in turn carves new objects from 64 kiB slabs taken from a
+    single reserved region.
+
+    The region is never shrunk, and slabs are not returned once handed to a size
+    class.  An allocation returns nullptr rather than failing hard if the region is
+    exhausted so that the caller can fall back to the general heap.  owns() tells
+    the two apart on free.
+
+    The caller must prevent migration between cores for the duration of each call,
+    and must not call in from an interrupt handler that could interrupt another
+    call on the same core. */
+
+template <class Lock, unsigned int ncores> class SlabAllocator
+{
+    public:
+        static constexpr size_t slab_size = 65536;
+        static constexpr unsigned int mag_size = 32;
+        static constexpr unsigned int nclasses = 16;
+        static constexpr size_t class_sizes[nclasses] =
+            { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+        static constexpr size_t max_size = class_sizes[nclasses - 1];
+
+        struct stats_t
+        {
+            uint64_t allocs = 0;        // from magazines, i.e. every allocation
+            uint64_t frees = 0;
+            uint64_t refills = 0;       // magazine empty - refilled from depot
+            uint64_t flushes = 0;       // magazine full - flushed to depot
+            uint64_t slabs = 0;         // slabs owned by this class
+            uint64_t depot_free = 0;    // objects held in the depot
+        };
+
+    protected:
+        struct free_obj
+        {
+            free_obj *next;
+        };
+
+        struct alignas(64) magazine
+        {
+            void *objs[mag_size * 2];
+            unsigned int n = 0;
+            uint64_t allocs = 0;
+            uint64_t frees = 0;
+        };
+
+        struct alignas(64) depot
+        {
+            Lock sl;
+            free_obj *free = nullptr;
+            size_t nfree = 0;
+            uintptr_t bump = 0;
+            uintptr_t bump_end = 0;
+            uint64_t refills = 0;
+            uint64_t flushes = 0;
+            uint64_t slabs = 0;
+        };
+
+        magazine mags[ncores][nclasses];
+        depot depots[nclasses];
+
+        uintptr_t base = 0;
+        uintptr_t end = 0;
+        std::atomic<uintptr_t> next_slab = 0;
+        uint8_t *slab_class = nullptr;      // size class of each slab in the region
+
+        static constexpr struct class_lut_t
+        {
+            uint8_t v[max_size / 16 + 1];
+
+            constexpr class_lut_t() : v()
+            {
+                unsigned int cls = 0;
+                for(size_t i = 0; i <= max_size / 16; i++)
+                {
+                    while(class_sizes[cls] < i * 16)
+                        cls++;
+                    v[i] = (uint8_t)cls;
+                }
+            }
+        } class_lut{};
+
+        static unsigned int size_to_class(size_t size)
+        {
+            return class_lut.v[(size + 15) / 16];
+        }
+
+        // depot lock held
+        bool new_slab(unsigned int cls, depot &d)
+        {
+            auto slab = next_slab.fetch_add(slab_size, std::memory_order_relaxed);
+            if(slab >= end || (end - slab) < slab_size)
+                return false;
+            slab_class[(slab - base) / slab_size] = (uint8_t)cls;
+            d.bump = slab;
+            d.bump_end = slab + slab_size - (slab_size % class_sizes[cls]);
+            d.slabs++;
+            return true;
+        }
+
+        // depot lock held, returns number of objects placed in m
+        unsigned int depot_get(unsigned int cls, depot &d, magazine &m)
+        {
+            unsigned int n = 0;
+            while(n < mag_size && d.free)
+            {
+                m.objs[m.n++] = d.free;
+                d.free = d.free->next;
+                d.nfree--;
+                n++;
+            }
+            while(n < mag_size)
+            {
+                if(d.bump >= d.bump_end && !new_slab(cls, d))
+                    break;
+                m.objs[m.n++] = (void *)d.bump;
+                d.bump += class_sizes[cls];
+                n++;
+            }
+            return n;
+        }
+
+    public:
+        /* Use [region, region + length) for slabs.  The first slab(s) hold the
+            size class map. */
+        void init(uintptr_t region, size_t length)
+        {
+            base = region;
+            end = region + length;
+            slab_class = (uint8_t *)region;
+            auto map_size = length / slab_size;
+            next_slab = region + ((map_size + slab_size - 1) & ~(slab_size - 1));
+        }
+
+        bool owns(const void *p) const
+        {
+            auto addr = (uintptr_t)p;
+            return addr >= base && addr < end;
+        }
+
+        /* Returns nullptr if size > max_size or the region is exhausted */
+        void *alloc(size_t size, unsigned int core)
+        {
+            if(size > max_size)
+                return nullptr;
+            auto cls = size_to_class(size);
+            auto &m = mags[core][cls];
+
+            if(m.n == 0)
+            {
+                auto &d = depots[cls];
+                d.sl.lock();
+                auto n = depot_get(cls, d, m);
+                d.refills++;
+                d.sl.unlock();
+                if(!n)
+                    return nullptr;
+            }
+
+            m.allocs++;
+            return m.objs[--m.n];
+        }
+
+        void free(void *p, unsigned int core)
+        {
+            auto cls = slab_class[((uintptr_t)p - base) / slab_size];
+            auto &m = mags[core][cls];
+
+            if(m.n == mag_size * 2)
+            {
+                // return the oldest half to the depot, keeping the most recently freed
+                auto &d = depots[cls];
+                free_obj *head = nullptr;
+                for(unsigned int i = 0; i < mag_size; i++)
+                {
+                    auto fo = (free_obj *)m.objs[i];
+                    fo->next = head;
+                    head = fo;
+                }
+                auto tail = (free_obj *)m.objs[0];
+                for(unsigned int i = mag_size; i < m.n; i++)
+                    m.objs[i - mag_size] = m.objs[i];
+                m.n -= mag_size;
+
+                d.sl.lock();
+                tail->next = d.free;
+                d.free = head;
+                d.nfree += mag_size;
+                d.flushes++;
+                d.sl.unlock();
+            }
+
+            m.frees++;
+            m.objs[m.n++] = p;
+        }
+
+        /* Usable size of an object from this allocator */
+        size_t usable_size(const void *p) const
+        {
+            return class_sizes[slab_class[((uintptr_t)p - base) / slab_size]];
+        }
+
+        /* Unlocked snapshot - counts may be slightly out of step with each other */
+        stats_t stats(unsigned int cls) const
+        {
+            stats_t ret;
+            for(unsigned int core = 0; core < ncores; core++)
+            {
+                ret.allocs += mags[core][cls].allocs;
+                ret.frees += mags[core][cls].frees;
+            }
+            ret.refills = depots[cls].refills;
+            ret.flushes = depots[cls].flushes;
+            ret.slabs = depots[cls].slabs;
+            ret.depot_free = depots[cls].nfree;
+            return ret;
+        }
+
+        size_t region_used() const
+        {
+            auto ns = next_slab.load(std::memory_order_relaxed);
+            return (ns > end ? end : ns) - base;
+        }
+};
+
+#endif
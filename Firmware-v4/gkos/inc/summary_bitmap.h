@@ -0,0 +1,115 @@
+#ifndef SUMMARY_BITMAP_H
+#define SUMMARY_BITMAP_H
+
+#include <cstdint>
+
+#if __GK_UNIT_TEST__
+/* Words examined by searches, so tests can check they stay bounded however full the
+    map is */
+inline uint64_t summary_bitmap_words_examined = 0;
+#define SUMMARY_BITMAP_EXAMINED(n)  (summary_bitmap_words_examined += (n))
+#else
+#define SUMMARY_BITMAP_EXAMINED(n)
+#endif
+
+/* Two level bitmap of up to 4096 * 64 slots.  Each summary bit records whether the
+    corresponding bitmap word has any bit set, so finding the next set bit from a
+    given position is a couple of ctz operations however sparse the map is.
+
+    Requires external synchronization. */
+template <unsigned int nbits> class summary_bitmap
+{
+    protected:
+        static constexpr unsigned int nwords = (nbits + 63) / 64;
+        static constexpr unsigned int nsum = (nwords + 63) / 64;
+
+        uint64_t w[nwords] = {};
+        uint64_t s[nsum] = {};
+
+        // first non-empty word at or after from, else nwords
+        unsigned int next_word(unsigned int from) const
+        {
+            for(auto si = from / 64; si < nsum; si++)
+            {
+                SUMMARY_BITMAP_EXAMINED(1);
+                auto m = s[si];
+                if(si == from / 64)
+                    m &= ~0ULL << (from % 64);
+                if(m)
+                    return si * 64 + __builtin_ctzll(m);
+            }
+            return nwords;
+        }
+
+    public:
+        void set(unsigned int i)
+        {
+            w[i / 64] |= 1ULL << (i % 64);
+            s[i / 4096] |= 1ULL << ((i / 64) % 64);
+        }
+
+        void clear(unsigned int i)
+        {
+            w[i / 64] &= ~(1ULL << (i % 64));
+            if(!w[i / 64])
+                s[i / 4096] &= ~(1ULL << ((i / 64) % 64));
+        }
+
+        void set(unsigned int i, bool v)
+        {
+            if(v)
+                set(i);
+            else
+                clear(i);
+        }
+
+        bool test(unsigned int i) const { return (w[i / 64] >> (i % 64)) & 1ULL; }
+
+        bool any() const
+        {
+            for(auto si = 0U; si < nsum; si++)
+            {
+                if(s[si])
+                    return true;
+            }
+            return false;
+        }
+
+        void reset()
+        {
+            for(auto &x : w)
+                x = 0;
+            for(auto &x : s)
+                x = 0;
+        }
+
+        /* Next set bit at or after start.  Returns nbits if there are none */
+        unsigned int find_next(unsigned int start) const
+        {
+            if(start >= nbits)
+                return nbits;
+            auto wi = start / 64;
+            SUMMARY_BITMAP_EXAMINED(1);
+            auto m = w[wi] & (~0ULL << (start % 64));
+            if(m)
+                return wi * 64 + __builtin_ctzll(m);
+            auto wn = next_word(wi + 1);
+            if(wn >= nwords)
+                return nbits;
+            SUMMARY_BITMAP_EXAMINED(1);
+            return wn * 64 + __builtin_ctzll(w[wn]);
+        }
+
+        /* Next set bit at or after start, wrapping around.  Returns nbits if none are set */
+        unsigned int find_from(unsigned int start) const
+        {
+            if(start >= nbits)
+                start = 0;
+            auto ret = find_next(start);
+            if(ret >= nbits && start)
+                ret = find_next(0);
+            return ret;
+        }
+};
+
+#endif
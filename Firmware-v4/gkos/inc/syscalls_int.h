@@ -95,13 +95,21 @@ int syscall_sem_getvalue(sem_t *sem, int *outval, int *_errno);
 int syscall_sem_post(sem_t *sem, int *_errno);
 int syscall_sem_trywait(sem_t *sem, int clock_id, const timespec *until, int *_errno);
 
+int syscall_futex_wait(uint32_t *uaddr, uint32_t val, int clock_id, const timespec *until, int *_errno);
+int syscall_futex_wake(uint32_t *uaddr, int n, int *_errno);
+
 int syscall_set_thread_priority(pthread_t thread, int priority, int *_errno);
 int syscall_get_thread_priority(pthread_t thread, int *_errno);
 int syscall_sched_get_priority_max(int policy, int *_errno);
 int syscall_sched_get_priority_min(int policy, int *_errno);
+int syscall_pthread_setaffinity_np(pthread_t thread, size_t cpusetsize, const void *cpuset, int *_errno);
+int syscall_pthread_getaffinity_np(pthread_t thread, size_t cpusetsize, void *cpuset, int *_errno);
+int syscall_set_frame_pacing(pthread_t thread, unsigned int budget_us, unsigned int period_us, int *_errno);
+int syscall_get_frame_stats(pthread_t thread, uint64_t *periods, uint64_t *misses, int *_errno);
 
 int syscall_memalloc(size_t len, void **retaddr, int is_sync, int *_errno);
 int syscall_memdealloc(size_t len, const void *addr, int *_errno);
+int syscall_madvise(void *addr, size_t len, int advice, int *_errno);
 int syscall_setprot(const void *addr, int is_read, int is_write, int is_exec, int *_errno);
 int syscall_mmapv4(size_t len, void **retaddr, int is_sync,
     int is_read, int is_write, int is_exec, int fd, int is_fixed, size_t foffset, int *_errno);
@@ -149,6 +157,8 @@ int syscall_get_pid_valid(pid_t pid, int *_errno);
 int syscall_setsupervisorvisible(int visible, int screen, int *_errno);
 int syscall_getscreenmodeforprocess(pid_t pid, size_t *w, size_t *h, unsigned int *pf, int *refresh, int *_errno);
 int syscall_getprocessname(pid_t pid, char *name, size_t len, int *_errno);
+int syscall_getprocessmemusage(pid_t pid, gk_mem_usage *usage, int *_errno);
+int syscall_setprocessmemlimits(pid_t pid, size_t soft, size_t hard, int *_errno);
 int syscall_setsupervisorvisibleex(int visible, const gk_supervisor_visible_region *regs, size_t nregs, int *_errno);
 int syscall_setbrightness(unsigned int bright, int *_errno);
 int syscall_wifienable(int en, int *_errno);
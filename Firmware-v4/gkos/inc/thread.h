@@ -11,6 +11,11 @@
 #include "syscalls.h"
 #include "sync_primitive_locks.h"
 #include "gk_conf.h"
+#include "futex.h"
+#include "runqueue.h"
+#include "timeoutheap.h"
+#include "asid.h"
+#include "kstack.h"
 
 static constexpr uint32_t thread_signal_lwext = 0x1;
 
@@ -23,7 +28,12 @@ class Thread
 
         class blocking_t
         {
+            protected:
+                Thread *parent;
+
             public:
+                blocking_t(Thread *_parent) : parent(_parent) {}
+
                 Spinlock sl{};
                 bool b_indefinite = false;
                 kernel_time b_until = kernel_time_invalid();
@@ -41,6 +51,10 @@ class Thread
 
                 bool is_blocking(kernel_time *tout = nullptr,
                     PThread *t = nullptr);
+                /* Unlocked snapshot for the scheduler.  Fields are only ever cleared by
+                    other cores, so this can report a stale block but never a stale wakeup. */
+                bool is_blocking_nolock(kernel_time *tout = nullptr,
+                    bool *on_thread = nullptr) const;
                 void unblock();
                 void block(PThread t, kernel_time tout = kernel_time_invalid());
                 void block(Condition *c, kernel_time tout = kernel_time_invalid());
@@ -53,7 +67,7 @@ class Thread
                 void block_indefinite();
         };
 
-        blocking_t blocking;
+        blocking_t blocking{this};
 
         // Generic spinlock for everything else (name, for_deletion etc)
         Spinlock sl{};
@@ -70,7 +84,7 @@ class Thread
         int base_priority;
         bool is_privileged;
 
-        VMemBlock mr_kernel_thread = InvalidVMemBlock();
+        KernelStack mr_kernel_thread;
         VMemBlock mr_user_thread = InvalidVMemBlock();
         VMemBlock mr_elf_tls = InvalidVMemBlock();
 
@@ -101,6 +115,51 @@ class Thread
         Spinlock sl_lower_half_user_thread{};
         id_t lower_half_user_thread = 0;
 
+        /* ASID for whichever lower half tss.ttbr0 points to, refreshed on each switch in */
+        asid_context *asid = nullptr;
+
+        /* Scheduler run queue state - protected by Scheduler::sl_rq[rq_core].  rq_core is the
+            core whose queues hold the thread, or which is running it if rq_on_cpu */
+        RunQueueNode<Thread> rq;
+        std::weak_ptr<Thread> rq_self;
+        std::atomic<unsigned int> rq_core = 0;
+        bool rq_scheduled = false;
+        bool rq_on_cpu = false;
+        std::atomic<uint64_t> rq_woken_us = 0;      // when last made runnable, for latency stats
+
+        /* Futex wait queue entry, see syscalls_futex.cpp.  Protected by the lock of the
+            bucket for key */
+        struct futex_node_t
+        {
+            Thread *next = nullptr;
+            Thread *prev = nullptr;
+            futex_key key;
+            bool queued = false;
+        };
+        futex_node_t futex;
+
+        /* Cores the thread may run on, bit n for core n.  Written under Scheduler::sl_rq[rq_core] */
+        uint32_t affinity = ~0U;
+
+        /* Scheduler timeout heap entry - protected by Scheduler::sl_rq[rq_core] */
+        TimeoutHeapNode<kernel_time> tq;
+
+        /* Frame-paced scheduling state, see Scheduler::SetFramePacing().  Protected by
+            Scheduler::sl_frame */
+        struct frame_pacing_t
+        {
+            unsigned int budget_us = 0;         // 0 if not frame paced
+            unsigned int period_us = 0;
+            int normal_priority = 0;            // priority when not boosted
+            bool boosted = false;
+            bool completed = false;             // frame submitted this period
+            uint64_t period_start_us = 0;
+            uint64_t used_us = 0;               // cpu time used this period
+            uint64_t periods = 0;
+            uint64_t misses = 0;
+        };
+        frame_pacing_t frame;
+
         /* system times */
         bool is_idle_thread = false;
         std::atomic<uint64_t> thread_time_us = 0;
@@ -111,7 +170,8 @@ class Thread
             void *p,
             bool is_priv, int priority,
             std::shared_ptr<Process> owning_process,
-            void *p2 = nullptr);
+            void *p2 = nullptr,
+            size_t kernel_stack_size = 0);
 
         static int Kill(id_t id, void *retval);
 
@@ -128,6 +188,22 @@ class Thread
         ~Thread();
 };
 
+/* Per-core lazy FP state owner, see FPTrap_Handler */
+extern "C" Thread *fp_owner[GK_NUM_CORES];
+
+#if GK_ENABLE_SCHED_DUMP
+/* Per-core counts of task switches and the q8-15 traffic they cause, laid out for switcher.s */
+struct fp_stats_t
+{
+    uint64_t switches;
+    uint64_t saves;
+    uint64_t restores;
+    uint64_t traps;
+};
+static_assert(sizeof(fp_stats_t) == 32);
+extern "C" fp_stats_t fp_stats[GK_NUM_CORES];
+#endif
+
 static inline Thread *GetCurrentKernelThreadForCore()
 {
     Thread *ret;
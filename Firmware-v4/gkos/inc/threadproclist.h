@@ -5,6 +5,7 @@
 #include <memory>
 #include <map>
 #include "ostypes.h"
+#include "rcutable.h"
 
 class Thread;
 class Process;
@@ -35,45 +36,44 @@ struct ProcessListMember : public ThreadProcListMember<Process, int>
 
 using ThreadListMember = ThreadProcListMember<Thread, void *>;
 
+/* Lookups (Get, Exists and their _ variants) are wait-free and may be made with
+    or without sl held.  Changes are serialised by sl and publish a new copy of the
+    entry, with the old one freed once no lookup can still be using it - see
+    rcutable.h. */
 template <class T> class IDList
 {    
     public:
-        std::map<id_t, T> list;
+        RcuTable<id_t, T> list;
         id_t next_id = 1;
 
-    public:
         Spinlock sl;
 
         id_t _register(T v)
         {
             auto ret = next_id;
-            list[next_id++] = v;
+            list.insert(next_id++, v);
             return ret;
         }
 
         id_t Register(T v)
         {
             CriticalGuard cg(sl);
-            return _register(v);
+            auto ret = _register(v);
+            auto dead = list.reclaim();
+            cg.unlock();
+            list.free_nodes(dead);
+            return ret;
         }
 
         T _get(id_t id)
         {
             if(!id)
                 return T();
-            auto iter = list.find(id);
-            if(iter == list.end())
-            {
-                return T();
-            }
-            return iter->second;
+            return list.get(id);
         }
 
         T Get(id_t id)
         {
-            if(!id)
-                return T();
-            CriticalGuard cg(sl);
             return _get(id);
         }
 
@@ -81,45 +81,29 @@ template <class T> class IDList
         {
             if(!id)
                 return false;
-            auto iter = list.find(id);
-            return iter != list.end();
+            return list.exists(id);
         }
 
         bool Exists(id_t id)
         {
-            if(!id)
-                return false;
-            CriticalGuard cg(sl);
             return _exists(id);
         }
 
         T _delete(id_t id)
         {
-            auto iter = this->list.find(id);
-            if(iter == this->list.end())
-            {
-                return T();
-            }
-            else
-            {
-                auto ret = iter->second;
-                this->list.erase(iter);
-                return ret;
-            }
+            T ret{};
+            list.erase(id, &ret);
+            return ret;
         }
 
         void Delete(id_t id)
         {
             CriticalGuard cg(this->sl);
-            auto iter = this->list.find(id);
-            if(iter == this->list.end())
-            {
-                return;
-            }
+            list.erase(id);
             // ensure the destructor is called outside the lock
-            auto val = iter->second;
-            this->list.erase(iter);
+            auto dead = list.reclaim();
             cg.unlock();
+            list.free_nodes(dead);
         }
 };
 
@@ -140,13 +124,11 @@ template <typename T> class TIDList : public IDList<T>
 
         void _setexitcode(id_t id, const T::return_type &ret)
         {
-            auto iter = this->list.find(id);
-            if(iter != this->list.end())
+            this->list.update(id, [&](T &v)
             {
-                //iter->second.v = nullptr;
-                iter->second.retval = ret;
-                iter->second.has_ended = true;
-            }
+                v.retval = ret;
+                v.has_ended = true;
+            });
         }
 
         void SetExitCode(id_t id, const T::return_type &ret)
@@ -160,17 +142,15 @@ template <typename T> class TIDList : public IDList<T>
         void Release(id_t id)
         {
             CriticalGuard cg(this->sl);
-            auto iter = this->list.find(id);
-            if(iter == this->list.end())
+            if(!this->list.update(id, [](T &v) { v.v = nullptr; }))
             {
                 return;
             }
 
             // delete member outside lock
-            PT member = nullptr;
-            std::swap(iter->second.v, member);
+            auto dead = this->list.reclaim();
             cg.unlock();
-            member = nullptr;
+            this->list.free_nodes(dead);
         }
 };
 
@@ -179,12 +159,10 @@ template <typename T> class PIDList : public TIDList<T>
     public:
         void _setppid(id_t id, id_t ppid)
         {
-            auto iter = this->list.find(id);
-            if(iter != this->list.end())
+            this->list.update(id, [&](T &v)
             {
-                //iter->second.v = nullptr;
-                iter->second.ppid = ppid;
-            }
+                v.ppid = ppid;
+            });
         }
 
         void SetPPID(id_t id, id_t ppid)
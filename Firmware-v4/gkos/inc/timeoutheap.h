@@ -0,0 +1,131 @@
+#ifndef TIMEOUTHEAP_H
+#define TIMEOUTHEAP_H
+
+#include <cstddef>
+#include <vector>
+
+/* Intrusive binary min-heap of objects keyed on a timeout.
+
+    Each object stores its own key and heap index, so removal of an arbitrary
+    entry (e.g. on an early wakeup) is O(log n) and the earliest timeout is an
+    O(1) peek.
+
+    The heap does no locking of its own - callers must hold the owning lock.
+    Call reserve() outside of hot paths so that insert() does not allocate. */
+
+template <class Key> struct TimeoutHeapNode
+{
+    static constexpr size_t npos = ~(size_t)0;
+
+    Key key{};
+    size_t index = npos;
+
+    bool queued() const { return index != npos; }
+};
+
+template <class T, class Key, TimeoutHeapNode<Key> T::*node = &T::tq> class TimeoutHeap
+{
+    protected:
+        std::vector<T *> heap;
+
+        static TimeoutHeapNode<Key> &n(T *t) { return t->*node; }
+
+        void set(size_t idx, T *t)
+        {
+            heap[idx] = t;
+            n(t).index = idx;
+        }
+
+        void sift_up(size_t idx)
+        {
+            auto t = heap[idx];
+            while(idx > 0)
+            {
+                auto parent = (idx - 1) / 2;
+                if(!(n(t).key < n(heap[parent]).key))
+                    break;
+                set(idx, heap[parent]);
+                idx = parent;
+            }
+            set(idx, t);
+        }
+
+        void sift_down(size_t idx)
+        {
+            auto t = heap[idx];
+            auto sz = heap.size();
+            while(true)
+            {
+                auto child = idx * 2 + 1;
+                if(child >= sz)
+                    break;
+                if(child + 1 < sz && n(heap[child + 1]).key < n(heap[child]).key)
+                    child++;
+                if(!(n(heap[child]).key < n(t).key))
+                    break;
+                set(idx, heap[child]);
+                idx = child;
+            }
+            set(idx, t);
+        }
+
+    public:
+        void reserve(size_t sz) { heap.reserve(sz); }
+        size_t size() const { return heap.size(); }
+        bool empty() const { return heap.empty(); }
+
+        /* Earliest entry, or nullptr if empty */
+        T *top() const { return heap.empty() ? nullptr : heap[0]; }
+
+        /* Insert, or update the key if already present */
+        void insert(T *t, const Key &key)
+        {
+            auto &tn = n(t);
+            if(tn.queued())
+            {
+                auto old_key = tn.key;
+                tn.key = key;
+                if(key < old_key)
+                    sift_up(tn.index);
+                else
+                    sift_down(tn.index);
+                return;
+            }
+
+            tn.key = key;
+            heap.push_back(t);
+            tn.index = heap.size() - 1;
+            sift_up(tn.index);
+        }
+
+        void erase(T *t)
+        {
+            auto &tn = n(t);
+            if(!tn.queued())
+                return;
+
+            auto idx = tn.index;
+            auto last = heap.back();
+            heap.pop_back();
+            tn.index = TimeoutHeapNode<Key>::npos;
+
+            if(last != t)
+            {
+                set(idx, last);
+                if(idx > 0 && n(last).key < n(heap[(idx - 1) / 2]).key)
+                    sift_up(idx);
+                else
+                    sift_down(idx);
+            }
+        }
+
+        T *pop()
+        {
+            auto t = top();
+            if(t)
+                erase(t);
+            return t;
+        }
+};
+
+#endif
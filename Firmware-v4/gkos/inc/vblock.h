@@ -2,8 +2,9 @@
 #define VBLOCK_H
 
 #include <cstdint>
-#include "buddy.h"
 #include "ostypes.h"
+#include "buddy.h"
+#include "summary_bitmap.h"
 
 #define VBLOCK_TAG_USER                     0x1
 #define VBLOCK_TAG_WRITE                    0x2
@@ -49,6 +50,12 @@ class VBlock
 {
     protected:
         uint64_t *level1 = nullptr;
+
+        /* Summaries of level 1: entries which are free, and entries pointing to a
+            level 2 which has a free 4 MiB slot or a level 3 with a free 64 kiB slot */
+        summary_bitmap<8192> l1_free{};
+        summary_bitmap<8192> l1_has_4M{};
+        summary_bitmap<8192> l1_has_64k{};
         
         // because levels 2 and 3 do not occupy a whole page, we can use a single page to store more than
         //  one.  Therefore if a request for a new page comes in, we can chop up the one here.
@@ -93,6 +100,9 @@ class VBlock
         uint64_t PmemAllocLevel2();
         uint64_t PmemAllocLevel3();
 
+        void Level2Changed(size_t level1_idx);
+        void Level3Changed(size_t level1_idx, size_t level2_idx);
+
         unsigned int level1_count = 0;
 
     public:
@@ -7,6 +7,8 @@
 
 #include <cstddef>
 
+class Process;
+
 #define PMEM_TO_VMEM(a) (((uintptr_t)(a) + UH_START))
 #define PMEM_TO_VMEM_DEVICE(a) (((uintptr_t)(a) + UH_DEVICE_START))
 #define PMEM_TO_VMEM_NC(a) (((uintptr_t)(a) + UH_NC_START))
@@ -19,15 +21,44 @@
 
 #define DEBUG_VTP  1
 
+/* A lower half page swapped out to zram keeps its permission bits with DT_PAGE clear.
+    Bit 55 is ignored by the MMU and marks the entry, the zram slot is held in the
+    address field. */
+#define PTE_SWAP                (1ULL << 55)
+#define PTE_SWAP_SLOT(pte)      ((uint32_t)(((pte) & PAGE_PADDR_MASK) >> 16))
+#define PTE_SWAP_ENTRY(slot, pte)   ((((uint64_t)(slot)) << 16) | ((pte) & (PAGE_PRIV_MASK | PAGE_XN)) | PTE_SWAP)
+
+/* Contiguous hint: an aligned run of VMEM_CONT_PAGES level 3 entries mapping physically
+    contiguous memory with identical attributes may be held in one TLB entry.  Only set
+    by vmem_map_range on upper half mappings. */
+#define PAGE_CONTIGUOUS         (1ULL << 52)
+#define VMEM_CONT_PAGES         32
+
+/* Page tables allocated for lower half mappings are charged to p, or to the current
+    process if nullptr */
 int vmem_map(uintptr_t vaddr, uintptr_t paddr, bool user, bool write, bool exec, uintptr_t ttbr0 = ~0ULL,
-    uintptr_t ttbr1 = ~0ULL, uintptr_t *paddr_out = nullptr, unsigned int mt = MT_NORMAL);
+    uintptr_t ttbr1 = ~0ULL, uintptr_t *paddr_out = nullptr, unsigned int mt = MT_NORMAL,
+    Process *p = nullptr);
 int vmem_map(const VMemBlock &vaddr, const PMemBlock &paddr, uintptr_t ttbr0 = ~0ULL, uintptr_t ttbr1 = ~0ULL);
+
+/* Map len bytes from vaddr to the physically contiguous memory at paddr, or for upper
+    half addresses with paddr 0 to newly allocated pages.  Each page table is walked
+    once and a single barrier ends the run, rather than one per page as with repeated
+    vmem_map calls. */
+int vmem_map_range(uintptr_t vaddr, uintptr_t paddr, size_t len, bool user, bool write, bool exec,
+    uintptr_t ttbr0 = ~0ULL, uintptr_t ttbr1 = ~0ULL, unsigned int mt = MT_NORMAL, Process *p = nullptr);
+
+/* Unmaps the whole range, with the TLB invalidated in batches rather than per page */
 int vmem_unmap(const VMemBlock &vaddr, uintptr_t ttbr0 = ~0ULL, uintptr_t ttbr1 = ~0ULL,
     bool release_page = true);
 void vmem_invlpg(uintptr_t vaddr, uintptr_t ttbr);
 uintptr_t vmem_vaddr_to_paddr(uintptr_t vaddr, uintptr_t ttbr0 = ~0ULL, uintptr_t ttbr1 = ~0ULL);
 uint64_t vmem_get_pte(uintptr_t vaddr, uintptr_t ttbr0 = ~0ULL, uintptr_t ttbr1 = ~0ULL);
 
+/* Level 3 entry for a lower half address, or nullptr if there is no page table for it.
+    The caller must hold the user_mem mutex of the owning process. */
+volatile uint64_t *vmem_get_pte_ptr(uintptr_t vaddr, uintptr_t ttbr0);
+
 static inline uintptr_t vmem_get_ttbr0()
 {
     uint64_t cur_ttbr0;
@@ -0,0 +1,29 @@
+#ifndef ZEROPAGE_H
+#define ZEROPAGE_H
+
+#include <cstdint>
+#include "ostypes.h"
+
+/* Pool of pre-zeroed 64 kiB pages, topped up by the idle threads so that zero
+    filling is kept off the page fault and dma_alloc paths.  Pages in the pool have
+    been cleaned and invalidated to the point of coherency so can be mapped with any
+    memory type. */
+
+/* Returns a zeroed page, or an invalid block if the pool is empty */
+PMemBlock zeropage_acquire();
+
+/* Zero one page into the pool if it is not full.  Called by the idle threads with
+    interrupts enabled, so preemptible throughout.  Returns false if there was
+    nothing to do. */
+bool zeropage_idle_fill();
+
+struct zeropage_stats_t
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t filled;
+    unsigned int cur;
+};
+zeropage_stats_t zeropage_stats();
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/* Compressed in-RAM swap.
+
+    Cold writeable user pages are compressed with lzpage_compress() into a buffer
+    from the kernel heap and their physical page given back to Pmem.  The page table
+    entry is left invalid with PTE_SWAP set and the slot number in its address field,
+    so that the next access faults and FillSubsequent (action_swapfill) decompresses
+    it into a fresh page.
+
+    Pages consisting of one repeated 64-bit value (most often zero) only store the
+    value.  Pages that do not compress to within max_stored are left resident.
+
+    ZramStore is the slot table only.  It does no allocation or compression itself
+    and must be serialised by the caller, so that the kernel can do both outside its
+    spinlock. */
+
+class ZramStore
+{
+    public:
+        static constexpr size_t page_size = 65536;
+        static constexpr size_t max_stored = page_size * 3 / 4;
+
+        struct slot_t
+        {
+            void *data = nullptr;       // nullptr for same-filled pages
+            uint32_t clen = 0;
+            uint32_t owner = 0;
+            uint64_t fill = 0;
+            uint32_t next_free = 0;
+            bool used = false;
+        };
+
+        struct stats_t
+        {
+            uint64_t stores = 0;
+            uint64_t loads = 0;
+            uint64_t rejects = 0;           // incompressible or no free slot
+            uint64_t same_filled = 0;       // currently stored as a single value
+            uint64_t stored_pages = 0;
+            uint64_t compressed_bytes = 0;
+        };
+
+    protected:
+        slot_t *slots = nullptr;
+        uint32_t nslots = 0;
+        uint32_t free_head = 0;
+        stats_t st;
+
+    public:
+        /* Slot 0 is never handed out so that it can mean failure */
+        bool init(uint32_t _nslots)
+        {
+            slots = new (std::nothrow) slot_t[_nslots];
+            if(!slots)
+                return false;
+            nslots = _nslots;
+            free_head = 0;
+            for(uint32_t i = nslots - 1; i > 0; i--)
+            {
+                slots[i].next_free = free_head;
+                free_head = i;
+            }
+            return true;
+        }
+
+        bool is_init() const { return slots != nullptr; }
+
+        /* Takes ownership of data (nullptr for a same-filled page), returns the slot or 0 */
+        uint32_t insert(void *data, uint32_t clen, uint64_t fill, uint32_t owner)
+        {
+            if(!free_head)
+            {
+                st.rejects++;
+                return 0;
+            }
+            auto slot = free_head;
+            auto &s = slots[slot];
+            free_head = s.next_free;
+
+            s.data = data;
+            s.clen = clen;
+            s.fill = fill;
+            s.owner = owner;
+            s.used = true;
+
+            st.stores++;
+            st.stored_pages++;
+            st.compressed_bytes += clen;
+            if(!data)
+                st.same_filled++;
+            return slot;
+        }
+
+        void reject() { st.rejects++; }
+
+        /* The returned slot stays valid until erased */
+        const slot_t *get(uint32_t slot)
+        {
+            if(slot == 0 || slot >= nslots || !slots[slot].used)
+                return nullptr;
+            st.loads++;
+            return &slots[slot];
+        }
+
+        /* Returns the data buffer for the caller to free */
+        void *erase(uint32_t slot)
+        {
+            if(slot == 0 || slot >= nslots || !slots[slot].used)
+                return nullptr;
+            auto &s = slots[slot];
+            auto ret = s.data;
+
+            st.stored_pages--;
+            st.compressed_bytes -= s.clen;
+            if(!s.data)
+                st.same_filled--;
+
+            s = slot_t();
+            s.next_free = free_head;
+            free_head = slot;
+            return ret;
+        }
+
+        /* Erase every slot belonging to owner, passing each data buffer to free_fn */
+        template <typename F> unsigned int release_owner(uint32_t owner, F free_fn)
+        {
+            unsigned int n = 0;
+            for(uint32_t i = 1; i < nslots; i++)
+            {
+                if(slots[i].used && slots[i].owner == owner)
+                {
+                    if(auto d = erase(i); d)
+                        free_fn(d);
+                    n++;
+                }
+            }
+            return n;
+        }
+
+        unsigned int owner_pages(uint32_t owner) const
+        {
+            unsigned int n = 0;
+            for(uint32_t i = 1; i < nslots; i++)
+            {
+                if(slots[i].used && slots[i].owner == owner)
+                    n++;
+            }
+            return n;
+        }
+
+        const stats_t &stats() const { return st; }
+
+        ~ZramStore()
+        {
+            if(!slots)
+                return;
+            for(uint32_t i = 1; i < nslots; i++)
+            {
+                if(slots[i].used && slots[i].data)
+                    std::free(slots[i].data);
+            }
+            delete[] slots;
+        }
+};
+
+#if !__GK_UNIT_TEST__
+class Process;
+
+/* Compress the page at paddr into a new slot, returns 0 if it is not worth storing */
+uint32_t zram_store_page(uintptr_t paddr, uint32_t owner);
+
+/* Decompress slot into the page at paddr, leaving the slot allocated */
+int zram_load_page(uint32_t slot, uintptr_t paddr);
+
+void zram_free(uint32_t slot);
+void zram_release_owner(uint32_t owner);
+size_t zram_owner_pages(uint32_t owner);
+ZramStore::stats_t zram_stats();
+
+/* Swap out up to npages cold pages of p, returning the number freed.  Must be
+    called with p.user_mem->m held. */
+size_t zram_reclaim(Process &p, size_t npages);
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#include "asid.h"
+#include "scheduler.h"
+#include "osmutex.h"
+#include "gk_conf.h"
+
+#include <cstring>
+
+/* Generation based ASID allocation, as per Linux arch/arm64/mm/context.c
+
+    ASID 0 is never handed out - it is what ttbr0 holds for threads without a
+    lower half.  The ASIDs running on each core at rollover are carried over
+    into the new generation (as 'reserved') so that those address spaces do not
+    have to change ASID while in use. */
+
+static constexpr unsigned int asid_bits = 16;
+static constexpr uint64_t nasids = 1ULL << asid_bits;
+static constexpr uint64_t asid_mask = nasids - 1ULL;
+
+static Spinlock sl_asid;
+static std::atomic<uint64_t> asid_generation = nasids;
+static uint64_t asid_map[nasids / 64] = { 1ULL };
+static unsigned int asid_cur_idx = 1;
+
+static std::atomic<uint64_t> active_asids[GK_NUM_CORES];
+static uint64_t reserved_asids[GK_NUM_CORES];
+static std::atomic<unsigned int> tlb_flush_pending = 0;
+
+static bool asid_test_and_set(uint64_t asid)
+{
+    auto &w = asid_map[asid / 64];
+    auto bit = 1ULL << (asid % 64);
+    auto ret = (w & bit) != 0;
+    w |= bit;
+    return ret;
+}
+
+static uint64_t asid_find_free(uint64_t from)
+{
+    for(auto i = from / 64; i < nasids / 64; i++)
+    {
+        auto w = asid_map[i];
+        if(i == from / 64)
+            w |= (1ULL << (from % 64)) - 1ULL;
+        if(w != ~0ULL)
+            return i * 64 + __builtin_ctzll(~w);
+    }
+    return 0;
+}
+
+// sl_asid held
+static void asid_flush_context()
+{
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1ULL;
+
+    for(unsigned int core = 0; core < GK_NUM_CORES; core++)
+    {
+        auto asid = active_asids[core].exchange(0);
+
+        /* If this core has already had a rollover with no switch since then it
+            will have 0 here, so keep the previous reservation */
+        if(asid == 0)
+            asid = reserved_asids[core];
+        asid_map[(asid & asid_mask) / 64] |= 1ULL << ((asid & asid_mask) % 64);
+        reserved_asids[core] = asid;
+    }
+
+    tlb_flush_pending.store((1U << GK_NUM_CORES) - 1U);
+}
+
+// sl_asid held
+static bool asid_check_update_reserved(uint64_t asid, uint64_t newasid)
+{
+    bool hit = false;
+    for(unsigned int core = 0; core < GK_NUM_CORES; core++)
+    {
+        if(reserved_asids[core] == asid)
+        {
+            hit = true;
+            reserved_asids[core] = newasid;
+        }
+    }
+    return hit;
+}
+
+// sl_asid held
+static uint64_t asid_new_context(asid_context *ctx)
+{
+    auto asid = ctx->id.load(std::memory_order_relaxed);
+    auto generation = asid_generation.load();
+
+    if(asid != 0)
+    {
+        // try and keep the same ASID in the new generation
+        auto newasid = generation | (asid & asid_mask);
+        if(asid_check_update_reserved(asid, newasid))
+            return newasid;
+        if(!asid_test_and_set(asid & asid_mask))
+            return newasid;
+    }
+
+    auto idx = asid_find_free(asid_cur_idx);
+    if(idx == 0)
+    {
+        // rollover
+        generation = asid_generation.fetch_add(nasids) + nasids;
+        asid_flush_context();
+        idx = asid_find_free(1);
+    }
+
+    asid_test_and_set(idx);
+    asid_cur_idx = idx;
+    return generation | idx;
+}
+
+uint64_t asid_ttbr0(asid_context *ctx, uint64_t ttbr0)
+{
+    auto core = GetCoreID();
+    auto asid = ctx->id.load(std::memory_order_relaxed);
+
+    /* Fast path - the ASID is from the current generation and we are not racing
+        with a rollover (which zeros active_asids) */
+    auto old_active = active_asids[core].load(std::memory_order_relaxed);
+    if(old_active && ((asid ^ asid_generation.load()) >> asid_bits) == 0 &&
+        active_asids[core].compare_exchange_strong(old_active, asid))
+    {
+        return (ttbr0 & 0xffffffffffffULL) | ((asid & asid_mask) << 48);
+    }
+
+    {
+        CriticalGuard cg(sl_asid);
+        asid = ctx->id.load(std::memory_order_relaxed);
+        if((asid ^ asid_generation.load()) >> asid_bits)
+        {
+            asid = asid_new_context(ctx);
+            ctx->id.store(asid, std::memory_order_relaxed);
+        }
+
+        auto core_bit = 1U << core;
+        if(tlb_flush_pending.load() & core_bit)
+        {
+            tlb_flush_pending.fetch_and(~core_bit);
+
+            // ASIDs from the old generation may now be reused - local flush only
+            __asm__ volatile(
+                "dsb nshst\n"
+                "tlbi vmalle1\n"
+                "dsb nsh\n"
+                "isb\n"
+                ::: "memory");
+        }
+
+        active_asids[core].store(asid);
+    }
+
+    return (ttbr0 & 0xffffffffffffULL) | ((asid & asid_mask) << 48);
+}
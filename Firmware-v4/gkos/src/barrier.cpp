@@ -21,7 +21,6 @@ int Barrier::Wait()
             if(pwt)
             {
                 pwt->blocking.unblock();
-                signal_thread_woken(pwt);
             }
         }
 
@@ -52,7 +51,6 @@ Barrier::~Barrier()
         if(pwt)
         {
             pwt->blocking.unblock();
-            signal_thread_woken(pwt);
         }
     }
 }
@@ -54,10 +54,11 @@ void *cleanup_thread(void *)
                             bool has_finished = false;
                             if(ct.v)
                             {
-                                CriticalGuard cg(ct.v->sl, sched.sl_cur_next);
+                                CriticalGuard cg(ct.v->sl);
                                 bool is_running = false;
                                 for(auto ccore = 0u; ccore < GK_NUM_CORES; ccore++)
                                 {
+                                    CriticalGuard cg_cur(sched.sl_cur_next[ccore]);
                                     if(sched.current_thread[ccore] == ct.v || sched.next_thread[ccore] == ct.v)
                                     {
                                         is_running = true;
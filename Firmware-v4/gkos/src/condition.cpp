@@ -1,6 +1,5 @@
 #include "osmutex.h"
 #include "scheduler.h"
-#include "ipi.h"
 #include "clocks.h"
 
 #define DEBUG_COND 0
@@ -39,7 +38,6 @@ Condition::~Condition()
         if(pwt)
         {
             pwt->blocking.unblock();
-            signal_thread_woken(pwt);
         }
     }
 }
@@ -88,7 +86,6 @@ void Condition::Signal(bool signal_all)
 #endif
 
                     pwt->blocking.unblock();
-                    signal_thread_woken(pwt);
                 }
             }
         }
@@ -131,7 +128,6 @@ void Condition::Signal(bool signal_all)
 #endif
 
                     pwt->blocking.unblock();
-                    signal_thread_woken(pwt);
                     break;
                 }
                 else
@@ -6,6 +6,7 @@
 #include "vblock.h"
 #include "process.h"
 #include "cache.h"
+#include "zeropage.h"
 
 void *dma_alloc(drm_device *dev, size_t size,
 				 dma_addr_t *dma_addr, gfp_t gfp, unsigned int mt, size_t *vsize,
@@ -20,9 +21,29 @@ void *dma_alloc(drm_device *dev, size_t size,
     auto p = GetCurrentProcessForCore();
     if(!p)
         return nullptr;
+    MemChargeGuard mcg(p);
+    if(!(gfp & GFP_KERNEL) && !mcg.charge((size + PAGE_SIZE - 1) / PAGE_SIZE))
+    {
+        klog("dma_alloc_wc: %s over memory limit\n", p->name.c_str());
+        return nullptr;
+    }
 
-    // get pmem first
-    auto pmem = Pmem.acquire(size);
+    // get pmem first - single pages can come from the pre-zeroed pool
+    auto pmem = InvalidPMemBlock();
+    if(size <= PAGE_SIZE)
+        pmem = zeropage_acquire();
+    bool pre_zeroed = pmem.valid;
+    if(!pmem.valid)
+    {
+        /* Aligned for the largest pages vmem_map_range can use over it, without rounding
+            the length up to a power of two */
+        size_t align = PAGE_SIZE;
+        if(size >= VBLOCK_512M)
+            align = VBLOCK_512M;
+        else if(size >= VMEM_CONT_PAGES * PAGE_SIZE)
+            align = VMEM_CONT_PAGES * PAGE_SIZE;
+        pmem = Pmem.acquire_aligned(size, align);
+    }
     if(!pmem.valid)
     {
         klog("dma_alloc_wc: unable to allocate pmem of length %llu\n", size);
@@ -47,7 +68,7 @@ void *dma_alloc(drm_device *dev, size_t size,
     }
     if(!vmem.valid)
     {
-        Pmem.release(pmem);
+        Pmem.release_range(pmem.base, pmem.length);
         klog("dma_alloc_wc: unable to allocate vmem of length %llu\n", pmem.length);
         return nullptr;
     }
@@ -62,13 +83,16 @@ void *dma_alloc(drm_device *dev, size_t size,
     }
 
     // then map
+    vmem_map_range(vmem.base, pmem.base, pmem.length, (gfp & GFP_HIGHUSER) != 0, true, false, ttbr0, ~0ULL, mt, p);
+
     for(auto i = 0ul; i < pmem.length; i += PAGE_SIZE)
     {
-        //klog("dma_alloc_wc: map %p phys to %p virt\n", (void *)(pmem.base + i), (void *)(vmem.base + i));
-        vmem_map(vmem.base + i, pmem.base + i, (gfp & GFP_HIGHUSER) != 0, true, false, ttbr0, ~0ULL, nullptr, mt);
-
         // and zero
-        if(mt == MT_NORMAL_NC || mt == MT_DEVICE || mt == MT_DEVICE_NGNRE)
+        if(pre_zeroed)
+        {
+            // already zero
+        }
+        else if(mt == MT_NORMAL_NC || mt == MT_DEVICE || mt == MT_DEVICE_NGNRE)
         {
             memset((void *)(vmem.base + i), 0, PAGE_SIZE);
         }
@@ -86,7 +110,7 @@ void *dma_alloc(drm_device *dev, size_t size,
     if(!(gfp & GFP_KERNEL))
     {
         CriticalGuard cg(p->owned_pages.sl);
-        p->owned_pages.add(pmem, true);
+        p->owned_pages.add(pmem, owned_page_kind::Gpu);
     }
 
 #if DMA_DEBUG > 1
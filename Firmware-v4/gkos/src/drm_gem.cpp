@@ -41,6 +41,12 @@ int drm_gem_object_init(struct drm_device *dev, std::shared_ptr<drm_gem_object>
     {
         drm->vaddr = 0;
         drm->vsize = 0;
+
+        MemChargeGuard mcg(p);
+        if(!mcg.charge((size + PAGE_SIZE - 1) / PAGE_SIZE))
+        {
+            return -1;
+        }
         
         auto pb = Pmem.acquire(size);
         if(!pb.valid)
@@ -55,7 +61,7 @@ int drm_gem_object_init(struct drm_device *dev, std::shared_ptr<drm_gem_object>
         
         {
             CriticalGuard cg(p->owned_pages.sl);
-            p->owned_pages.add(pb, true);
+            p->owned_pages.add(pb, owned_page_kind::Gpu);
         }
     }
     drm->handle = 0;
@@ -223,11 +229,8 @@ int dri_mmap(size_t len, void **retaddr, int is_sync,
     obj->sgt.push_back(sge);
 
     // Now map all the physical bits we have
-    for(auto i = 0ull; i < map_len; i += PAGE_SIZE)
-    {
-        vmem_map(vb.data_start() + i, obj->dma_addr + i, true, is_write != 0, false, p->user_mem->ttbr0, ~0ULL,
-            nullptr, obj->mt);
-    }
+    vmem_map_range(vb.data_start(), obj->dma_addr, map_len, true, is_write != 0, false, p->user_mem->ttbr0, ~0ULL,
+        obj->mt, p);
 
     return 0;
 }
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
 #include "logger.h"
 #include "gic.h"
 #include "vblock.h"
@@ -10,10 +12,19 @@
 #include "pmem.h"
 #include "syscalls_int.h"
 #include "klog_buffer.h"
+#include "kstack.h"
+#include "zeropage.h"
+#include "zram.h"
+#include "pagecache.h"
+#include "madvise.h"
 
 #define DEBUG_PF        0
 
 static uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t address, uint64_t el);
+static size_t pf_reclaim(Process &p, bool can_swap, size_t npages);
+static size_t pf_fault_window(Process::userspace_mem_t &umem, const MemBlock &mb, uintptr_t page_vaddr);
+static size_t pf_fault_around(Process &p, Process::userspace_mem_t &umem, MemBlock &mb,
+    uintptr_t vaddr, size_t npages, bool write);
 
 extern "C" uint64_t Exception_Handler(uint64_t esr, uint64_t far,
     uint64_t etype, exception_regs *regs, uint64_t lr)
@@ -24,6 +35,7 @@ extern "C" uint64_t Exception_Handler(uint64_t esr, uint64_t far,
     {
         // syscalls run with interrupts enabled
         __asm__ volatile("msr daifclr, #0b0010\n" ::: "memory");
+        kstack_check_headroom();
         SyscallHandler((syscall_no)regs->x0, (void *)regs->x1, (void *)regs->x2, (void *)regs->x3,
             regs->lr, regs);
         return 0;
@@ -39,9 +51,9 @@ extern "C" uint64_t Exception_Handler(uint64_t esr, uint64_t far,
             // data/instruction abort - fake dfsc for instruction faults
             auto dfsc = (ec == 0b100000 || ec == 0b100001) ? 7ULL : (iss & 0x3fULL);
 
-            if((dfsc >= 4 && dfsc <= 7) || (dfsc >= 12 && dfsc <= 15))
+            if(dfsc >= 4 && dfsc <= 15)
             {
-                // page/permission fault
+                // page/access flag/permission fault
 
                 bool user = (etype > 0x201) || (ec == 0b100100) || (ec == 0b100000);
                 bool write = (iss & (1ULL << 6)) != 0;
@@ -52,6 +64,9 @@ extern "C" uint64_t Exception_Handler(uint64_t esr, uint64_t far,
                     etype, esr, far, lr, (uint64_t)regs, regs->saved_elr_el1);
 #endif
 
+                // filling the page may need to read from disk
+                kstack_check_headroom();
+
                 userspace_fault_code = TranslationFault_Handler(user, write, exec, far, lr);
                 if(userspace_fault_code == 0)
                     return userspace_fault_code;
@@ -145,6 +160,55 @@ extern "C" uint64_t Exception_Handler(uint64_t esr, uint64_t far,
     return 0;
 }
 
+/* Thread whose q8-15, fpcr and fpsr each core's registers currently hold, if they
+    also match its saved copy.  Maintained by switcher.s and FPTrap_Handler. */
+extern "C" { Thread *fp_owner[GK_NUM_CORES]; }
+
+#if GK_ENABLE_SCHED_DUMP
+extern "C" { fp_stats_t fp_stats[GK_NUM_CORES]; }
+#endif
+
+extern "C" thread_saved_state *FPTrap_Handler(exception_regs *regs)
+{
+    /* EL0 FP/SIMD access with the unit trapped.  Either the thread's first use, in
+        which case it starts from zero rather than with whatever another thread left
+        behind, or a thread that has used FP before but whose state was not live on
+        this core when it was switched in.  Either way stop trapping it for the rest
+        of the timeslice.  vtors.s loads q8-15 and the control registers from the
+        returned state, or zeroes them if nullptr. */
+    auto t = GetCurrentThreadForCore();
+    thread_saved_state *ret = nullptr;
+    if(t)
+    {
+        auto core = GetCoreID();
+        if(t->tss.fp_flags & THREAD_FP_USED)
+        {
+            if(t->tss.fp_flags & THREAD_FP_SAVED)
+                ret = &t->tss;
+        }
+        else
+        {
+            t->tss.fp_flags |= THREAD_FP_USED;
+            memset(regs->fpu_regs, 0, sizeof(regs->fpu_regs));
+        }
+        t->tss.fp_flags = (t->tss.fp_flags & ~THREAD_FP_CPU_MASK) |
+            ((uint64_t)(core + 1) << THREAD_FP_CPU_SHIFT);
+        fp_owner[core] = t;
+#if GK_ENABLE_SCHED_DUMP
+        fp_stats[core].traps++;
+        if(ret)
+            fp_stats[core].restores++;
+#endif
+    }
+    else
+    {
+        memset(regs->fpu_regs, 0, sizeof(regs->fpu_regs));
+    }
+    __asm__ volatile("msr cpacr_el1, %[fpen]\n"
+        "isb\n" : : [fpen] "r" (0x3ULL << 20) : "memory");
+    return ret;
+}
+
 static void DumpThreadFault()
 {
     auto [t, p] = GetCurrentThreadProcessForCore();
@@ -288,6 +352,18 @@ uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t far
         // Do we have a pte for the page?
         auto pte = vmem_get_pte(far, umem->ttbr0);
         uintptr_t paddr = 0;
+        bool pre_filled = false;
+        umem->fault_stats.faults++;
+
+        if((pte & (DT_PAGE | PAGE_ACCESS)) == DT_PAGE)
+        {
+            umem->fault_stats.af++;
+            // access flag cleared by the zram clock scan - mark as recently used
+            auto ptep = vmem_get_pte_ptr(far, umem->ttbr0);
+            *ptep = pte | PAGE_ACCESS;
+            __asm__ volatile("dsb ishst\n" "isb\n" ::: "memory");
+            return 0;
+        }
 
         if((pte & DT_PAGE) == DT_PAGE)
         {
@@ -320,27 +396,132 @@ uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t far
                 return 0;
             }
 
+            // A shared page cache page made writeable by mprotect needs a private copy
+            auto cow_old = InvalidPMemBlock();
+            if(write)
+            {
+                bool is_shared;
+                {
+                    CriticalGuard cg(p->owned_pages.sl);
+                    is_shared = p->owned_pages.is_shared(paddr);
+                }
+                if(is_shared)
+                {
+                    auto pmemret = Pmem.acquire(VBLOCK_64k);
+                    if(!pmemret.valid)
+                    {
+                        klog("pf: OOM\n");
+                        return user ? UserThreadFault() : SupervisorThreadFault();
+                    }
+                    quick_copy_64((void *)PMEM_TO_VMEM(pmemret.base), (const void *)PMEM_TO_VMEM(paddr));
+                    {
+                        CriticalGuard cg(p->owned_pages.sl);
+                        p->owned_pages.add(pmemret);
+                    }
+                    cow_old.base = paddr;
+                    cow_old.length = VBLOCK_64k;
+                    cow_old.valid = true;
+                    paddr = pmemret.base;
+                }
+            }
+
             // break before make
             VMemBlock unmap_block;
             unmap_block.base = far & PAGE_VADDR_MASK;
             unmap_block.length = VBLOCK_64k;
             unmap_block.valid = true;
             vmem_unmap(unmap_block, umem->ttbr0, ~0ULL, false);
+
+            if(cow_old.valid)
+            {
+                // only now unmapped, so safe to drop our reference
+                CriticalGuard cg(p->owned_pages.sl);
+                p->owned_pages.release(cow_old);
+            }
         }
         else
         {
-            // Allocate one
-            auto pmemret = Pmem.acquire(VBLOCK_64k);
-            if(!pmemret.valid)
+            bool can_swap = umem == p->user_mem.get();
+            mem_pressure_poll();
+            if(Pmem.get_free_space() < GK_RECLAIM_LOW_WATER)
+                pf_reclaim(*p, can_swap, GK_RECLAIM_BATCH);
+
+            // Over its hard limit a process can only grow by swapping out its own pages
+            MemChargeGuard mcg(p);
+            if(!mcg.charge(1))
             {
-                klog("pf: OOM\n");
-                return user ? UserThreadFault() : SupervisorThreadFault();
+                size_t freed = 0;
+#if GK_ENABLE_ZRAM
+                if(can_swap)
+                    freed = zram_reclaim(*p, GK_RECLAIM_BATCH);
+#endif
+                if(!freed || !mcg.charge(1))
+                {
+                    klog("pf: %s over memory limit\n", p->name.c_str());
+                    return user ? UserThreadFault() : SupervisorThreadFault();
+                }
             }
-            paddr = pmemret.base;
 
+            if(pte == 0)
             {
-                CriticalGuard cg(p->owned_pages.sl);
-                p->owned_pages.add(pmemret);
+                // First touch - map the following pages too if they are also untouched
+                auto far_page = far & PAGE_VADDR_MASK;
+                auto window = pf_fault_window(*umem, uvblock, far_page);
+                if(window > 1)
+                    window = std::min(window - 1, p->MemHeadroom()) + 1;
+                if(window > 1 && Pmem.get_free_space() >= GK_RECLAIM_LOW_WATER &&
+                    mcg.charge(window - 1))
+                {
+                    auto nmapped = pf_fault_around(*p, *umem, uvblock, far_page, window, write);
+                    if(nmapped)
+                    {
+                        umem->fa_next = far_page + nmapped * VBLOCK_64k;
+                        umem->fault_stats.around += nmapped - 1;
+                        return 0;
+                    }
+                }
+                umem->fa_next = far_page + VBLOCK_64k;
+            }
+
+            // Read-only file pages are shared with other mappings through the page cache
+            if(pte == 0)
+            {
+                auto sp = uvblock.CachedPage(far & PAGE_VADDR_MASK);
+                if(sp)
+                {
+                    CriticalGuard cg(p->owned_pages.sl);
+                    if(p->owned_pages.add_shared(sp))
+                    {
+                        paddr = sp->paddr;
+                        pre_filled = true;
+                    }
+                }
+            }
+
+            if(!pre_filled)
+            {
+                // Allocate one, taking an already zeroed page if that is all FillFirst would do
+                auto pmemret = InvalidPMemBlock();
+                if(pte == 0 && uvblock.IsZeroFill())
+                {
+                    pmemret = zeropage_acquire();
+                    pre_filled = pmemret.valid;
+                }
+                if(!pmemret.valid)
+                    pmemret = Pmem.acquire(VBLOCK_64k);
+                if(!pmemret.valid && pf_reclaim(*p, can_swap, GK_RECLAIM_BATCH))
+                    pmemret = Pmem.acquire(VBLOCK_64k);
+                if(!pmemret.valid)
+                {
+                    klog("pf: OOM\n");
+                    return user ? UserThreadFault() : SupervisorThreadFault();
+                }
+                paddr = pmemret.base;
+
+                {
+                    CriticalGuard cg(p->owned_pages.sl);
+                    p->owned_pages.add(pmemret);
+                }
             }
         }
 
@@ -357,10 +538,19 @@ uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t far
                     klog("pf: FillSubsequent not defined\n");
                     return user ? UserThreadFault() : SupervisorThreadFault();
                 }
-                uvblock.FillSubsequent(far & PAGE_VADDR_MASK, paddr, uvblock);
+                if(pte & PTE_SWAP)
+                {
+                    uvblock.si.slot = PTE_SWAP_SLOT(pte);
+                    umem->fault_stats.swapins++;
+                }
+                if(uvblock.FillSubsequent(far & PAGE_VADDR_MASK, paddr, uvblock) != 0)
+                {
+                    klog("pf: FillSubsequent failed\n");
+                    return user ? UserThreadFault() : SupervisorThreadFault();
+                }
             }
         }
-        else
+        else if(!pre_filled)
         {
             // pte == 0
             if(!uvblock.FillFirst)
@@ -377,7 +567,7 @@ uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t far
         auto mret = vmem_map(far & PAGE_VADDR_MASK, paddr, uvblock.b.user, 
             pte ? uvblock.b.write : write,
             uvblock.b.exec,
-            umem->ttbr0, ~0ULL, nullptr, uvblock.b.memory_type);
+            umem->ttbr0, ~0ULL, nullptr, uvblock.b.memory_type, p);
         if(mret != 0)
         {
             klog("pf: vmem_map failed %d\n", mret);
@@ -392,3 +582,170 @@ uint64_t TranslationFault_Handler(bool user, bool write, bool exec, uint64_t far
 
     while(true);
 }
+
+/* Sequential faults, each landing on the page after the last run mapped, double the
+    window up to GK_FAULT_AROUND_MAX.  Anything else starts again.  Blocks advised as
+    random access map only the faulting page, sequential ones always the maximum. */
+static size_t pf_fault_window(Process::userspace_mem_t &umem, const MemBlock &mb, uintptr_t page_vaddr)
+{
+    if(mb.access_hint == MemBlock::access_hint_t::Random)
+        umem.fa_window = 1;
+    else if(mb.access_hint == MemBlock::access_hint_t::Sequential)
+        umem.fa_window = GK_FAULT_AROUND_MAX;
+    else if(page_vaddr == umem.fa_next)
+        umem.fa_window = std::min<size_t>(umem.fa_window * 2, GK_FAULT_AROUND_MAX);
+    else
+        umem.fa_window = GK_FAULT_AROUND_PAGES;
+    return umem.fa_window;
+}
+
+/* Map the untouched pages of mb from vaddr onwards, up to npages, rather than taking a
+    fault for each.  Zero-fill pages come from the zeroed pool, read-only file pages are
+    read ahead into the page cache and other file pages are filled with a single read
+    into one buddy block, which is then owned a page at a time.
+
+    All are mapped with the permissions of the faulting access.  Returns the number
+    mapped, which if non-zero includes vaddr itself, or 0 to leave the fault to the
+    single page path.  Called with umem.m held. */
+static size_t pf_fault_around(Process &p, Process::userspace_mem_t &umem, MemBlock &mb,
+    uintptr_t vaddr, size_t npages, bool write)
+{
+    size_t n = 0;
+    while(n < npages && vaddr + n * VBLOCK_64k < mb.b.data_end() &&
+        vmem_get_pte(vaddr + n * VBLOCK_64k, umem.ttbr0) == 0)
+    {
+        n++;
+    }
+    if(n < 2)
+        return 0;
+
+    auto map_page = [&](uintptr_t page_vaddr, uintptr_t paddr)
+    {
+        return vmem_map(page_vaddr, paddr, mb.b.user, write, mb.b.exec,
+            umem.ttbr0, ~0ULL, nullptr, mb.b.memory_type, &p) == 0;
+    };
+    auto page_at = [](uintptr_t paddr)
+    {
+        PMemBlock pb;
+        pb.base = paddr;
+        pb.length = VBLOCK_64k;
+        pb.valid = true;
+        return pb;
+    };
+
+    size_t mapped = 0;
+
+    if(mb.IsZeroFill())
+    {
+        for(; mapped < n; mapped++)
+        {
+            auto page_vaddr = vaddr + mapped * VBLOCK_64k;
+            auto pb = zeropage_acquire();
+            if(!pb.valid)
+            {
+                pb = Pmem.acquire(VBLOCK_64k);
+                if(!pb.valid)
+                    break;
+                mb.FillFirst(page_vaddr, pb.base, mb);
+            }
+            {
+                CriticalGuard cg(p.owned_pages.sl);
+                p.owned_pages.add(pb);
+            }
+            if(!map_page(page_vaddr, pb.base))
+            {
+                {
+                    CriticalGuard cg(p.owned_pages.sl);
+                    p.owned_pages.release(pb);
+                }
+                Pmem.release(pb);
+                break;
+            }
+        }
+        return mapped;
+    }
+
+#if GK_ENABLE_PAGECACHE
+    uint64_t file_id;
+    size_t foffset, flen;
+    if(mb.PageCacheKey(vaddr, &file_id, &foffset, &flen))
+    {
+        umem.fault_stats.readahead += pagecache_readahead(mb, vaddr, n);
+        for(; mapped < n; mapped++)
+        {
+            auto page_vaddr = vaddr + mapped * VBLOCK_64k;
+            auto sp = mb.CachedPage(page_vaddr);
+            if(!sp)
+                break;
+            {
+                CriticalGuard cg(p.owned_pages.sl);
+                if(!p.owned_pages.add_shared(sp))
+                    break;
+            }
+            if(!map_page(page_vaddr, sp->paddr))
+            {
+                CriticalGuard cg(p.owned_pages.sl);
+                p.owned_pages.release(page_at(sp->paddr));
+                break;
+            }
+        }
+        return mapped;
+    }
+#endif
+
+    // A power of two pages so that it is a single buddy block
+    n = 1ULL << (63 - __builtin_clzll(n));
+    auto pb = Pmem.acquire(n * VBLOCK_64k);
+    if(!pb.valid)
+        return 0;
+    if(mb.FillFirstRange(vaddr, pb.base, n) != 0)
+    {
+        Pmem.release(pb);
+        return 0;
+    }
+    if(mb.f)
+        umem.fault_stats.readahead += n;
+
+    for(; mapped < n; mapped++)
+    {
+        auto page = page_at(pb.base + mapped * VBLOCK_64k);
+        {
+            CriticalGuard cg(p.owned_pages.sl);
+            p.owned_pages.add(page);
+        }
+        if(!map_page(vaddr + mapped * VBLOCK_64k, page.base))
+        {
+            CriticalGuard cg(p.owned_pages.sl);
+            p.owned_pages.release(page);
+            break;
+        }
+    }
+    // give back whatever could not be mapped
+    for(auto i = mapped; i < n; i++)
+        Pmem.release(page_at(pb.base + i * VBLOCK_64k));
+    return mapped;
+}
+
+/* Free up to npages for a fault by p.  Unmapped page cache pages are the cheapest to
+    drop, after which p's own cold pages are compressed to zram (only possible when the
+    fault is on p's own lower half). */
+size_t pf_reclaim(Process &p, bool can_swap, size_t npages)
+{
+    size_t freed = 0;
+#if GK_ENABLE_PAGECACHE
+    freed += pagecache_reclaim(npages);
+#endif
+#if GK_ENABLE_ZRAM
+    if(freed < npages && can_swap)
+        freed += zram_reclaim(p, npages - freed);
+#endif
+    return freed;
+}
+
+size_t pf_prefault(Process &p, Process::userspace_mem_t &umem, MemBlock &mb,
+    uintptr_t vaddr, size_t npages)
+{
+    auto nmapped = pf_fault_around(p, umem, mb, vaddr, npages, false);
+    umem.fault_stats.around += nmapped;
+    return nmapped;
+}
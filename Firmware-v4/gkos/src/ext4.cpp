@@ -21,6 +21,7 @@
 #include "sdif.h"
 
 #include "block_dev.h"
+#include "pagecache.h"
 
 #include <sys/stat.h>
 #include <_sys_dirent.h>
@@ -280,6 +281,7 @@ int gk_ext4_write(ext4_file &e4f, const char *buf, int nbytes, int *_errno)
     int extret;
 
     extret = ext4_fwrite(&e4f, buf, nbytes, &bw);
+    pagecache_invalidate(lwext_pagecache_id(e4f));
 
     if(extret == EOK)
     {
@@ -310,6 +312,7 @@ int gk_ext4_ftruncate(ext4_file &e4f, off_t length, int *_errno)
     }
 
     auto extret = ext4_ftruncate(&e4f, length);
+    pagecache_invalidate(lwext_pagecache_id(e4f));
 
     if(extret == EOK)
     {
@@ -543,6 +546,7 @@ int gk_ext4_unmount(int *_errno)
 
     auto extret = ext4_umount("/");
     unmounted = true;
+    pagecache_invalidate_all();
     if(extret == EOK)
     {
         return 0;
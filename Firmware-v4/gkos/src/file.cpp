@@ -5,6 +5,11 @@ size_t File::Flen(int *_errno)
     return 0;
 }
 
+bool File::PageCacheId(uint64_t *id)
+{
+    return false;
+}
+
 int File::Isatty(int *_errno)
 {
     *_errno = ENOTTY;
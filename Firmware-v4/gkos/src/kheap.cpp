@@ -1,6 +1,11 @@
 #include "kheap.h"
 #include "osmutex.h"
 #include "vblock.h"
+#include "slab.h"
+#include "gk_conf.h"
+
+#include <cstring>
+#include <cerrno>
 
 // TODO: replace with a mutex
 static Spinlock sl_heap;
@@ -8,6 +13,51 @@ static Spinlock sl_heap;
 static VMemBlock be_heap { 0, 0, false };
 static uintptr_t sbrk_end;
 
+#if GK_KHEAP_SLAB
+/* Allocations up to kslab.max_size come from per-core slab magazines without
+    taking sl_heap; anything larger, or anything the slabs cannot satisfy, falls
+    back to newlib's allocator on be_heap */
+static VMemBlock be_slab { 0, 0, false };
+static SlabAllocator<Spinlock, GK_NUM_CORES> kslab;
+
+static void *slab_alloc(size_t size)
+{
+    if(size > kslab.max_size || !be_slab.valid)
+        return nullptr;
+    auto cpsr = DisableInterrupts();
+    auto ret = kslab.alloc(size, get_core_id());
+    RestoreInterrupts(cpsr);
+    return ret;
+}
+
+static bool slab_free(void *p)
+{
+    if(!kslab.owns(p))
+        return false;
+    auto cpsr = DisableInterrupts();
+    kslab.free(p, get_core_id());
+    RestoreInterrupts(cpsr);
+    return true;
+}
+
+void kheap_log_stats()
+{
+    klog("kheap: slab region used: %llx\n", (uint64_t)kslab.region_used());
+    for(unsigned int i = 0; i < kslab.nclasses; i++)
+    {
+        auto st = kslab.stats(i);
+        if(!st.allocs)
+            continue;
+        klog("kheap: slab %4llu: allocs %llu, frees %llu, refills %llu, flushes %llu, slabs %llu, depot %llu\n",
+            (uint64_t)kslab.class_sizes[i], st.allocs, st.frees, st.refills, st.flushes, st.slabs, st.depot_free);
+    }
+}
+#else
+static void *slab_alloc(size_t) { return nullptr; }
+static bool slab_free(void *) { return false; }
+void kheap_log_stats() {}
+#endif
+
 void init_kheap()
 {
     be_heap = vblock_alloc(VBLOCK_512M, false, true, false);
@@ -19,6 +69,19 @@ void init_kheap()
     klog("kheap: %llx - %llx\n", be_heap.base, be_heap.end());
 
     sbrk_end = be_heap.base;
+
+#if GK_KHEAP_SLAB
+    be_slab = vblock_alloc(VBLOCK_512M, false, true, false);
+    if(be_slab.valid)
+    {
+        kslab.init(be_slab.data_start(), be_slab.data_length());
+        klog("kheap: slabs %llx - %llx\n", be_slab.base, be_slab.end());
+    }
+    else
+    {
+        klog("kheap: failed to allocate slab region, using heap only\n");
+    }
+#endif
 }
 
 uintptr_t kheap_size()
@@ -75,32 +138,72 @@ void *__real_reallocarray(void *, size_t, size_t);
 
 void *__wrap_malloc(size_t size)
 {
+    if(auto ret = slab_alloc(size); ret)
+        return ret;
     CriticalGuard cg(sl_heap);
     return __real_malloc(size);
 }
 
 void __wrap_free(void *p)
 {
+    if(!p || slab_free(p))
+        return;
     CriticalGuard cg(sl_heap);
     __real_free(p);
 }
 
 void *__wrap_realloc(void *p, size_t size)
 {
+#if GK_KHEAP_SLAB
+    if(p && kslab.owns(p))
+    {
+        auto old_size = kslab.usable_size(p);
+        if(size <= old_size && size > old_size / 2)
+            return p;
+        auto ret = __wrap_malloc(size);
+        if(ret)
+        {
+            memcpy(ret, p, size < old_size ? size : old_size);
+            slab_free(p);
+        }
+        return ret;
+    }
+#endif
     CriticalGuard cg(sl_heap);
     return __real_realloc(p, size);
 }
 
 void *__wrap_calloc(size_t n, size_t size)
 {
+    size_t total;
+    if(!__builtin_mul_overflow(n, size, &total))
+    {
+        if(auto ret = slab_alloc(total); ret)
+        {
+            memset(ret, 0, total);
+            return ret;
+        }
+    }
     CriticalGuard cg(sl_heap);
     return __real_calloc(n, size);
 }
 
 void *__wrap_reallocarray(void *p, size_t n, size_t size)
 {
+#if GK_KHEAP_SLAB
+    if(p && kslab.owns(p))
+    {
+        size_t total;
+        if(__builtin_mul_overflow(n, size, &total))
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return __wrap_realloc(p, total);
+    }
+#endif
     CriticalGuard cg(sl_heap);
     return __real_reallocarray(p, n, size);
 }
 
-}
\ No newline at end of file
+}
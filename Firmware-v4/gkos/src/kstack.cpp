@@ -0,0 +1,143 @@
+#include "kstack.h"
+#include "vblock.h"
+#include "vmem.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "osmutex.h"
+#include "logger.h"
+#include "gk_conf.h"
+
+#include <cstring>
+
+static Spinlock sl_kstack_pool;
+static KernelStack kstack_pool[GK_KSTACK_POOL_SIZE];
+static unsigned int kstack_pool_count = 0;
+
+static size_t kstack_round(size_t commit)
+{
+    return (commit + VBLOCK_64k - 1) & ~(VBLOCK_64k - 1);
+}
+
+int kstack_grow(KernelStack &ks, uintptr_t addr)
+{
+    if(!ks.vb.valid)
+        return -1;
+
+    // keep the lowest page unmapped as a guard
+    addr &= ~(VBLOCK_64k - 1);
+    if(addr < ks.vb.data_start() + VBLOCK_64k)
+        addr = ks.vb.data_start() + VBLOCK_64k;
+
+    if(ks.bottom <= addr)
+        return 0;
+
+    if(vmem_map_range(addr, 0, ks.bottom - addr, false, true, false) != 0)
+    {
+        klog("kstack: could not grow stack at %llx\n", addr);
+
+        // drop whatever was mapped of the new part
+        VMemBlock unmap_block;
+        unmap_block.base = addr;
+        unmap_block.length = ks.bottom - addr;
+        unmap_block.valid = true;
+        vmem_unmap(unmap_block);
+        return -1;
+    }
+    memset((void *)addr, 0, ks.bottom - addr);
+    ks.bottom = addr;
+    return 0;
+}
+
+static void kstack_trim(KernelStack &ks, size_t commit)
+{
+    auto new_bottom = ks.top() - commit;
+    if(ks.bottom >= new_bottom)
+        return;
+
+    VMemBlock unmap_block;
+    unmap_block.base = ks.bottom;
+    unmap_block.length = new_bottom - ks.bottom;
+    unmap_block.valid = true;
+    vmem_unmap(unmap_block);
+    ks.bottom = new_bottom;
+}
+
+KernelStack kstack_alloc(size_t commit)
+{
+    KernelStack ks;
+    {
+        CriticalGuard cg(sl_kstack_pool);
+        if(kstack_pool_count)
+            ks = kstack_pool[--kstack_pool_count];
+    }
+
+    if(!ks.vb.valid)
+    {
+        ks.vb = vblock_alloc(VBLOCK_4M, false, true, false, GUARD_BITS_64k, GUARD_BITS_64k);
+        if(!ks.vb.valid)
+            return ks;
+        ks.bottom = ks.top();
+    }
+
+    if(kstack_grow(ks, ks.top() - kstack_round(commit)) != 0)
+    {
+        kstack_free(ks);
+        return KernelStack();
+    }
+    return ks;
+}
+
+void kstack_free(KernelStack &ks)
+{
+    if(!ks.vb.valid)
+        return;
+
+    kstack_trim(ks, GK_KSTACK_INITIAL);
+
+    // the next user relies on unused parts being zero
+    auto used = kstack_high_water(ks);
+    memset((void *)(ks.top() - used), 0, used);
+
+    {
+        CriticalGuard cg(sl_kstack_pool);
+        if(kstack_pool_count < GK_KSTACK_POOL_SIZE)
+        {
+            kstack_pool[kstack_pool_count++] = ks;
+            ks = KernelStack();
+            return;
+        }
+    }
+
+    vblock_free(ks.vb, vblock, true);
+    ks = KernelStack();
+}
+
+void kstack_check_headroom()
+{
+    auto t = GetCurrentThreadForCore();
+    if(!t)
+        return;
+
+    uintptr_t sp;
+    __asm__ volatile("mov %[sp], sp\n" : [sp] "=r" (sp) : : "memory");
+
+    auto &ks = t->mr_kernel_thread;
+    if(sp < ks.bottom || sp >= ks.top())
+        return;     // not on the thread stack (e.g. early boot)
+    if(sp - ks.bottom >= GK_KSTACK_HEADROOM)
+        return;
+
+    kstack_grow(ks, sp - GK_KSTACK_HEADROOM);
+}
+
+size_t kstack_high_water(const KernelStack &ks)
+{
+    if(!ks.vb.valid)
+        return 0;
+
+    auto p = (const uint64_t *)ks.bottom;
+    auto end = (const uint64_t *)ks.top();
+    while(p < end && *p == 0)
+        p++;
+    return ks.top() - (uintptr_t)p;
+}
@@ -99,6 +99,14 @@ size_t LwextFile::Flen(int *_errno)
     return f.fsize;
 }
 
+bool LwextFile::PageCacheId(uint64_t *id)
+{
+    if(is_dir || !f.mp)
+        return false;
+    *id = lwext_pagecache_id(f);
+    return true;
+}
+
 int LwextFile::ReadDir(dirent *de, int *_errno)
 {
     if(!is_dir)
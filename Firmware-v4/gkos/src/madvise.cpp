@@ -0,0 +1,82 @@
+#include "madvise.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "threadproclist.h"
+#include "osqueue.h"
+#include "osmutex.h"
+#include "vmem.h"
+#include "gk_conf.h"
+
+#include <algorithm>
+
+struct willneed_request
+{
+    id_t pid;
+    uintptr_t start, end;
+};
+
+static FixedQueue<willneed_request, GK_MADVISE_QUEUE> willneed_queue;
+
+static void *madvise_thread(void *);
+
+void init_madvise()
+{
+    Schedule(Thread::Create("madvise", madvise_thread, nullptr, true, GK_PRIORITY_LOW, p_kernel));
+}
+
+bool madvise_willneed(id_t pid, uintptr_t start, size_t len)
+{
+    return willneed_queue.Push({ .pid = pid, .start = start, .end = start + len });
+}
+
+/* Prefault one run from vaddr, advancing it past what was done.  umem.m is only held
+    for the run so that the process' own faults are not held up for long.  Returns
+    false once there is nothing more to do. */
+static bool willneed_step(Process &p, uintptr_t &vaddr, uintptr_t end)
+{
+    auto umem = p.user_mem.get();
+    MutexGuard mg(umem->m);
+
+    auto mb = umem->vblocks.NextFrom(vaddr);
+    if(!mb || mb->b.data_start() >= end)
+        return false;
+    vaddr = std::max<uintptr_t>(vaddr, mb->b.data_start());
+
+    // only file backed memory is read ahead, zero fill pages would just use memory
+    if(!mb->f || mb->pmem_is_shared || mb->pmem_is_drm_object)
+    {
+        vaddr = mb->b.end();
+        return true;
+    }
+
+    // leave the last of free memory, and the process' headroom, to real faults
+    if(Pmem.get_free_space() < GK_RECLAIM_LOW_WATER)
+        return false;
+    auto npages = std::min<size_t>((std::min(end, mb->b.data_end()) - vaddr) / VBLOCK_64k,
+        GK_FAULT_AROUND_MAX);
+    npages = std::min(npages, p.MemHeadroom());
+    MemChargeGuard mcg(&p);
+    if(!npages || !mcg.charge(npages))
+        return false;
+
+    auto nmapped = pf_prefault(p, *umem, *mb, vaddr, npages);
+    vaddr += std::max<size_t>(nmapped, 1) * VBLOCK_64k;
+    return true;
+}
+
+void *madvise_thread(void *)
+{
+    while(true)
+    {
+        willneed_request req;
+        if(!willneed_queue.Pop(&req))
+            continue;
+
+        auto p = ProcessList.Get(req.pid);
+        if(!p.v || p.has_ended || !p.v->user_mem)
+            continue;
+
+        auto vaddr = req.start;
+        while(vaddr < req.end && willneed_step(*p.v, vaddr, req.end));
+    }
+}
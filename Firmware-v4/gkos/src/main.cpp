@@ -28,6 +28,7 @@
 #include "pmic.h"
 #include "osnet.h"
 #include "cleanup.h"
+#include "madvise.h"
 #include "persistent.h"
 #include <memory>
 
@@ -163,6 +164,7 @@ extern "C" int mp_kmain(const gkos_boot_interface *_gbi, uint64_t magic)
     init_process_interface();
     init_klogbuffer_thread();
     init_cleanup();
+    init_madvise();
 
     init_btnled();
     btnled_setcolor(0x808080);
@@ -1,7 +1,6 @@
 #include "osmutex.h"
 #include "thread.h"
 #include "scheduler.h"
-#include "ipi.h"
 #include "threadproclist.h"
 #include "logger.h"
 #include "clocks.h"
@@ -65,9 +64,37 @@ int Mutex::_lock(ticket_t new_ticket, bool allow_deadlk)
     return 0;
 }
 
+void Mutex::spin_while_owner_running(id_t self)
+{
+    auto cur_owner = __atomic_load_n(&owner, __ATOMIC_RELAXED);
+    if(cur_owner == 0 || cur_owner == self || !sched.IsRunningElsewhere(cur_owner))
+        return;
+
+    uint64_t freq, start, now;
+    __asm__ volatile("mrs %[freq], cntfrq_el0\n"
+        "mrs %[start], cntpct_el0\n" : [freq] "=r" (freq), [start] "=r" (start) : : "memory");
+    auto spin_ticks = freq * GK_MUTEX_SPIN_US / 1000000ULL;
+
+    do
+    {
+        __asm__ volatile("yield\n" ::: "memory");
+
+        if(__atomic_load_n(&owner, __ATOMIC_RELAXED) != cur_owner)
+        {
+            stats.spin_acquired++;
+            return;
+        }
+
+        __asm__ volatile("mrs %[now], cntpct_el0\n" : [now] "=r" (now) : : "memory");
+    } while((now - start) < spin_ticks && sched.IsRunningElsewhere(cur_owner));
+}
+
 bool Mutex::try_lock(int *reason, bool block, kernel_time tout, ticket_t ticket, int *reason2)
 {
     auto t = GetCurrentThreadForCore();
+    if(block)
+        spin_while_owner_running(t->id);
+
     CriticalGuard cg(sl, t->locked_mutexes.sl);
 
     auto ret = _try_lock(reason, block, tout, ticket);
@@ -104,6 +131,7 @@ bool Mutex::_try_lock(int *reason, bool block, kernel_time tout, ticket_t ticket
     }
     else
     {
+        stats.contended++;
         if(kernel_time_is_valid(ticket))
         {
             if(ticket > owning_ticket)
@@ -124,6 +152,7 @@ bool Mutex::_try_lock(int *reason, bool block, kernel_time tout, ticket_t ticket
             klog("mutex: %s blocking on %p owned by %s\n",
                 t->name.c_str(), this, towner->name.c_str());
 #endif
+            stats.blocked++;
             t->blocking.block(towner, tout);
             waiting_threads.insert(t->id);
             Yield();
@@ -147,7 +176,6 @@ bool Mutex::unlock(int *reason, bool force)
         for(auto pwt : to_unlock)
         {
             pwt->blocking.unblock();
-            signal_thread_woken(pwt);
         }
     }
     return ret;
@@ -210,7 +238,6 @@ bool Mutex::try_delete(int *reason)
             if(pwt)
             {
                 pwt->blocking.unblock();
-                signal_thread_woken(pwt);
             }
         }
         waiting_threads.clear();
@@ -0,0 +1,237 @@
+#include "pagecache.h"
+#include "proc_vmem.h"
+#include "pmem.h"
+#include "vmem.h"
+#include "osspinlock.h"
+#include "gk_conf.h"
+
+#include <map>
+#include <tuple>
+#include <vector>
+
+struct pagecache_key
+{
+    uint64_t file_id;
+    size_t offset;
+    size_t len;
+
+    bool operator<(const pagecache_key &other) const
+    {
+        return std::tie(file_id, offset, len) < std::tie(other.file_id, other.offset, other.len);
+    }
+};
+
+static Spinlock sl_pc;
+static std::map<pagecache_key, PSharedPage> pc;
+static pagecache_key pc_clock{};
+static uint64_t pc_generation = 0;      // bumped on every invalidate
+
+static std::atomic<uint64_t> pc_hits = 0;
+static std::atomic<uint64_t> pc_misses = 0;
+static std::atomic<uint64_t> pc_reclaimed = 0;
+
+shared_page::~shared_page()
+{
+    PMemBlock pb;
+    pb.base = paddr;
+    pb.length = VBLOCK_64k;
+    pb.valid = true;
+    Pmem.release(pb);
+}
+
+PSharedPage pagecache_get(uint64_t file_id, size_t offset, size_t len,
+    MemBlock &mb, uintptr_t page_vaddr)
+{
+    pagecache_key k { file_id, offset, len };
+    uint64_t gen;
+    size_t cur_pages;
+    {
+        CriticalGuard cg(sl_pc);
+        auto iter = pc.find(k);
+        if(iter != pc.end())
+        {
+            iter->second->referenced = true;
+            pc_hits++;
+            return iter->second;
+        }
+        gen = pc_generation;
+        cur_pages = pc.size();
+    }
+    pc_misses++;
+
+    if(cur_pages >= GK_PAGECACHE_MAX_PAGES)
+        pagecache_reclaim(cur_pages + 1 - GK_PAGECACHE_MAX_PAGES);
+
+    // read outside the lock - this may block on the disk
+    auto pb = Pmem.acquire(VBLOCK_64k);
+    if(!pb.valid)
+        return nullptr;
+    auto sp = std::make_shared<shared_page>();
+    sp->paddr = pb.base;
+    if(mb.FillFirst(page_vaddr, pb.base, mb) != 0)
+        return nullptr;
+
+    PSharedPage ret = sp;
+    {
+        CriticalGuard cg(sl_pc);
+        if(pc_generation == gen)
+        {
+            auto [iter, inserted] = pc.try_emplace(k, sp);
+            if(!inserted)
+            {
+                // filled by someone else in the meantime - ours is freed on return
+                ret = iter->second;
+            }
+        }
+        /* else the file was written while we read it - hand out the page but do
+            not cache it */
+    }
+    return ret;
+}
+
+size_t pagecache_readahead(MemBlock &mb, uintptr_t page_vaddr, size_t npages)
+{
+    std::vector<pagecache_key> keys;
+    for(size_t i = 0; i < npages; i++)
+    {
+        pagecache_key k;
+        if(!mb.PageCacheKey(page_vaddr + i * VBLOCK_64k, &k.file_id, &k.offset, &k.len))
+            break;
+        keys.push_back(k);
+    }
+
+    uint64_t gen;
+    size_t cur_pages;
+    {
+        // only read up to the first page that is already there
+        CriticalGuard cg(sl_pc);
+        for(size_t i = 0; i < keys.size(); i++)
+        {
+            if(pc.count(keys[i]))
+            {
+                keys.resize(i);
+                break;
+            }
+        }
+        gen = pc_generation;
+        cur_pages = pc.size();
+    }
+
+    // a buddy block, which can then be released a page at a time
+    if(keys.size() < 2)
+        return 0;
+    auto n = 1ULL << (63 - __builtin_clzll(keys.size()));
+    keys.resize(n);
+
+    if(cur_pages + n > GK_PAGECACHE_MAX_PAGES)
+        pagecache_reclaim(cur_pages + n - GK_PAGECACHE_MAX_PAGES);
+
+    auto pb = Pmem.acquire(n * VBLOCK_64k);
+    if(!pb.valid)
+        return 0;
+    if(mb.FillFirstRange(page_vaddr, pb.base, n) != 0)
+    {
+        Pmem.release(pb);
+        return 0;
+    }
+    pc_misses += n;
+
+    std::vector<PSharedPage> pages;
+    for(size_t i = 0; i < n; i++)
+    {
+        auto sp = std::make_shared<shared_page>();
+        sp->paddr = pb.base + i * VBLOCK_64k;
+        pages.push_back(std::move(sp));
+    }
+
+    {
+        CriticalGuard cg(sl_pc);
+        if(pc_generation == gen)
+        {
+            for(size_t i = 0; i < n; i++)
+                pc.try_emplace(keys[i], pages[i]);
+        }
+    }
+    // anything not inserted is released here
+    return n;
+}
+
+void pagecache_invalidate(uint64_t file_id)
+{
+    std::vector<PSharedPage> to_free;
+    {
+        CriticalGuard cg(sl_pc);
+        pc_generation++;
+        auto iter = pc.lower_bound(pagecache_key { file_id, 0, 0 });
+        while(iter != pc.end() && iter->first.file_id == file_id)
+        {
+            to_free.push_back(std::move(iter->second));
+            iter = pc.erase(iter);
+        }
+    }
+}
+
+void pagecache_invalidate_all()
+{
+    std::map<pagecache_key, PSharedPage> to_free;
+    {
+        CriticalGuard cg(sl_pc);
+        pc_generation++;
+        std::swap(to_free, pc);
+    }
+}
+
+size_t pagecache_reclaim(size_t npages)
+{
+    std::vector<PSharedPage> to_free;
+    {
+        CriticalGuard cg(sl_pc);
+        auto iter = pc.lower_bound(pc_clock);
+        auto max_scan = pc.size() * 2;
+
+        for(size_t scanned = 0; scanned < max_scan && to_free.size() < npages; scanned++)
+        {
+            if(iter == pc.end())
+            {
+                if(pc.empty())
+                    break;
+                iter = pc.begin();
+            }
+
+            /* Mapped pages cannot be dropped.  Only the cache can add references, and
+                only with sl_pc held, so a count of 1 cannot go back up under us. */
+            if(iter->second.use_count() > 1)
+            {
+                iter++;
+                continue;
+            }
+            if(iter->second->referenced)
+            {
+                iter->second->referenced = false;
+                iter++;
+                continue;
+            }
+
+            to_free.push_back(std::move(iter->second));
+            iter = pc.erase(iter);
+        }
+
+        pc_clock = (iter == pc.end()) ? pagecache_key{} : iter->first;
+    }
+
+    pc_reclaimed += to_free.size();
+    return to_free.size();
+}
+
+pagecache_stats_t pagecache_stats()
+{
+    pagecache_stats_t ret;
+    ret.hits = pc_hits;
+    ret.misses = pc_misses;
+    ret.reclaimed = pc_reclaimed;
+    {
+        CriticalGuard cg(sl_pc);
+        ret.pages = pc.size();
+    }
+    return ret;
+}
@@ -3,9 +3,13 @@
 #include "vmem.h"
 #include "cache.h"
 #include "syscalls_int.h"
+#include "zram.h"
+#include "pagecache.h"
+#include "gk_conf.h"
 
 static int action_zerofill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb);
 static int action_filefill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb);
+static int filefill_range(uintptr_t page_vaddr, uintptr_t page_paddr, size_t len, MemBlock &mb);
 static int action_tlsfill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb);
 static int action_null(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb);
 static int action_filesync(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb);
@@ -143,6 +147,58 @@ MemBlock MemBlock::TLSMemory(uintptr_t src_len,
     return ret;
 }
 
+bool MemBlock::IsSwapBacked() const
+{
+    return FillSubsequent == action_swapfill && Sync == action_swapsync;
+}
+
+bool MemBlock::PageCacheKey(uintptr_t page_vaddr, uint64_t *file_id, size_t *offset, size_t *len)
+{
+#if GK_ENABLE_PAGECACHE
+    if(FillFirst != action_filefill || b.write || !f || !f->PageCacheId(file_id))
+        return false;
+
+    // same extent as action_filefill reads
+    auto block_offset = page_vaddr - b.data_start();
+    *offset = foffset + block_offset;
+    *len = (flen > block_offset) ? std::min(PAGE_SIZE, flen - block_offset) : 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::shared_ptr<shared_page> MemBlock::CachedPage(uintptr_t page_vaddr)
+{
+#if GK_ENABLE_PAGECACHE
+    uint64_t file_id;
+    size_t offset, len;
+    if(!PageCacheKey(page_vaddr, &file_id, &offset, &len))
+        return nullptr;
+    return pagecache_get(file_id, offset, len, *this, page_vaddr);
+#else
+    return nullptr;
+#endif
+}
+
+int MemBlock::FillFirstRange(uintptr_t page_vaddr, uintptr_t paddr, size_t npages)
+{
+    if(FillFirst == action_filefill)
+        return filefill_range(page_vaddr, paddr, npages * PAGE_SIZE, *this);
+
+    for(size_t i = 0; i < npages; i++)
+    {
+        if(FillFirst(page_vaddr + i * PAGE_SIZE, paddr + i * PAGE_SIZE, *this) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+bool MemBlock::IsZeroFill() const
+{
+    return FillFirst == action_zerofill;
+}
+
 static int action_zerofill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
 {
     for(uint64_t ptr = 0; ptr < VBLOCK_64k; ptr += CACHE_LINE_SIZE)
@@ -152,11 +208,13 @@ static int action_zerofill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock
     return 0;
 }
 
-static int action_filefill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
+/* Read len bytes of the block from page_vaddr into paddr, zeroing whatever lies past
+    the end of the file data */
+static int filefill_range(uintptr_t page_vaddr, uintptr_t page_paddr, size_t len, MemBlock &mb)
 {
     auto block_offset = page_vaddr - mb.b.data_start();
     auto file_offset = block_offset + mb.foffset;
-    auto file_to_read = (mb.flen > block_offset) ? std::min(PAGE_SIZE, mb.flen - block_offset) : 0;
+    auto file_to_read = (mb.flen > block_offset) ? std::min(len, mb.flen - block_offset) : 0;
     
     if(file_to_read)
     {
@@ -175,14 +233,19 @@ static int action_filefill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock
         file_to_read = (uintptr_t)fret;
     }
 
-    if(file_to_read != PAGE_SIZE)
+    if(file_to_read != len)
     {
-        auto zero_to_fill = PAGE_SIZE - file_to_read;
+        auto zero_to_fill = len - file_to_read;
         memset((void *)PMEM_TO_VMEM(page_paddr + file_to_read), 0, zero_to_fill);
     }
     return 0;
 }
 
+static int action_filefill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
+{
+    return filefill_range(page_vaddr, page_paddr, PAGE_SIZE, mb);
+}
+
 static int action_tlsfill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
 {
     auto block_offset = page_vaddr - mb.b.data_start();
@@ -230,12 +293,21 @@ static int action_filesync(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock
 
 static int action_swapfill(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
 {
-    klog("action: swapfill not yet implemented\n");
-    return -1;
+    auto ret = zram_load_page(mb.si.slot, page_paddr);
+    if(ret != 0)
+    {
+        klog("action: swapfill of slot %u for %llx failed\n", mb.si.slot, page_vaddr);
+        return ret;
+    }
+
+    // the page is mapped writeable again so the compressed copy is stale from here on
+    zram_free(mb.si.slot);
+    mb.si.slot = 0;
+    return 0;
 }
 
 static int action_swapsync(uintptr_t page_vaddr, uintptr_t page_paddr, MemBlock &mb)
 {
-    klog("action: swapsync not yet implemented\n");
-    return -1;
+    mb.si.slot = zram_store_page(page_paddr, mb.si.owner);
+    return mb.si.slot ? 0 : -1;
 }
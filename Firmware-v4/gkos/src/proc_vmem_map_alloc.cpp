@@ -1,7 +1,88 @@
 #include "proc_vmem.h"
 
+#include <algorithm>
+
 static MemBlock null_memblock{};
 
+uintptr_t MapVBlockAllocator::prev_end(std::map<uintptr_t, MemBlock>::iterator pos)
+{
+    return pos == l.begin() ? base : std::prev(pos)->second.b.end();
+}
+
+uintptr_t MapVBlockAllocator::next_start(std::map<uintptr_t, MemBlock>::iterator pos)
+{
+    return pos == l.end() ? base + length : pos->second.b.base;
+}
+
+// the free gap between two addresses, within [lo, hi)
+static void gap_between(uintptr_t from, uintptr_t to, uintptr_t lo, uintptr_t hi,
+    uintptr_t *start, uintptr_t *len)
+{
+    from = std::max(from, lo);
+    to = std::min(to, hi);
+    *start = from;
+    *len = (to > from) ? to - from : 0;
+}
+
+void MapVBlockAllocator::gaps_build()
+{
+    if(gaps_valid)
+        return;
+    gaps.clear();
+    uintptr_t from = base;
+    for(auto &b : l)
+    {
+        uintptr_t gs, gl;
+        gap_between(from, b.second.b.base, base, base + length, &gs, &gl);
+        gaps.insert(gs, gl);
+        from = std::max(from, (uintptr_t)b.second.b.end());
+    }
+    uintptr_t gs, gl;
+    gap_between(from, base + length, base, base + length, &gs, &gl);
+    gaps.insert(gs, gl);
+    gaps_valid = true;
+}
+
+// pos has just been inserted into what was a single gap
+void MapVBlockAllocator::gaps_inserted(std::map<uintptr_t, MemBlock>::iterator pos)
+{
+    auto pe = prev_end(pos);
+    auto ns = next_start(std::next(pos));
+    uintptr_t gs, gl;
+
+    gap_between(pe, ns, base, base + length, &gs, &gl);
+    if(gl)
+        gaps.erase(gs);
+    gap_between(pe, pos->second.b.base, base, base + length, &gs, &gl);
+    gaps.insert(gs, gl);
+    gap_between(pos->second.b.end(), ns, base, base + length, &gs, &gl);
+    gaps.insert(gs, gl);
+}
+
+// pos is about to be erased, merging the gaps either side
+void MapVBlockAllocator::gaps_erasing(std::map<uintptr_t, MemBlock>::iterator pos)
+{
+    auto pe = prev_end(pos);
+    auto ns = next_start(std::next(pos));
+    uintptr_t gs, gl;
+
+    gap_between(pe, pos->second.b.base, base, base + length, &gs, &gl);
+    if(gl)
+        gaps.erase(gs);
+    gap_between(pos->second.b.end(), ns, base, base + length, &gs, &gl);
+    if(gl)
+        gaps.erase(gs);
+    gap_between(pe, ns, base, base + length, &gs, &gl);
+    gaps.insert(gs, gl);
+}
+
+uintptr_t MapVBlockAllocator::LargestFree()
+{
+    MutexGuard cg(m);
+    gaps_build();
+    return gaps.largest();
+}
+
 int MapVBlockAllocator::Traverse(traversal_function_t tf)
 {
     MutexGuard cg(m);
@@ -15,6 +96,19 @@ int MapVBlockAllocator::Traverse(traversal_function_t tf)
     return 0;
 }
 
+MemBlock *MapVBlockAllocator::NextFrom(uintptr_t addr)
+{
+    MutexGuard cg(m);
+    auto iter = l.upper_bound(addr);
+    if(iter != l.begin())
+    {
+        auto prev = std::prev(iter);
+        if(addr < prev->second.b.end())
+            return &prev->second;
+    }
+    return iter == l.end() ? nullptr : &iter->second;
+}
+
 MemBlock &MapVBlockAllocator::IsAllocated(uintptr_t addr)
 {
     MutexGuard cg(m);
@@ -54,6 +148,7 @@ MemBlock &MapVBlockAllocator::IsAllocated(uintptr_t addr)
 VMemBlock MapVBlockAllocator::AllocFixed(MemBlock region)
 {
     MutexGuard cg(m);
+    gaps_build();
     // if there is an exact match then fail
     auto addr = region.b.base;
     auto addrend = region.b.end();
@@ -104,6 +199,7 @@ VMemBlock MapVBlockAllocator::AllocFixed(MemBlock region)
         return InvalidVMemBlock();
     }
 
+    gaps_inserted(cloc.first);
     ret.valid = true;
     return ret;
 }
@@ -111,11 +207,13 @@ VMemBlock MapVBlockAllocator::AllocFixed(MemBlock region)
 int MapVBlockAllocator::Dealloc(VMemBlock &region)
 {
     MutexGuard cg(m);
+    gaps_build();
 
     auto iter = l.find(region.base);
     if(iter != l.end())
     {
         // found
+        gaps_erasing(iter);
         l.erase(iter);
         return 0;
     }
@@ -131,122 +229,30 @@ int VBlockAllocator::Dealloc(MemBlock& region)
 
 VMemBlock MapVBlockAllocator::AllocAny(MemBlock region, bool lowest_first)
 {
+    MutexGuard cg(m);
+    gaps_build();
+
     auto len = (uintptr_t)region.b.length;
     region.b.valid = true;
 
-    // The following logic does not work with an empty map, special case this
-    if(l.size() == 0)
-    {
-        if(len > length)
-        {
-            return InvalidVMemBlock();
-        }
-        if(lowest_first)
-        {
-            region.b.base = base;
-        }
-        else
-        {
-            region.b.base = base + length - len;
-        }
-        l.insert_or_assign(region.b.base, region);
-        return region.b;
-    }
-
-    // for a map with 'n' used entries, there are potentially 'n+1' empty spaces
-    //  either side/between the used entries.  Iterate to check all of them
+    uintptr_t gstart, glen;
     if(lowest_first)
     {
-        for(auto iter = l.begin(); iter != l.end(); iter++)
-        {
-            // if begin, check from base to us, and from us to next
-            //  otherwise, just check from us to next
-
-            if (iter == l.begin())
-            {
-                auto prev = nullptr;
-                auto next = &iter->second;
-
-                auto [fr, saddr, _] = fits(len, prev, next);
-                if (fr)
-                {
-                    region.b.base = saddr;
-                    l.insert_or_assign(region.b.base, region);
-                    return region.b;
-                }
-            }
-
-            {
-                auto prev = &iter->second;
-                auto niter = std::next(iter);
-                auto next = (niter == l.end()) ? nullptr :
-                    &niter->second;
-
-                auto [fr, saddr, _] = fits(len, prev, next);
-                if (fr)
-                {
-                    region.b.base = saddr;
-                    l.insert_or_assign(region.b.base, region);
-                    return region.b;
-                }
-            }
-        }
+        if(!gaps.first_fit(len, &gstart, &glen))
+            return InvalidVMemBlock();
+        region.b.base = gstart;
     }
     else
     {
-        for(auto iter = l.rbegin(); iter != l.rend(); iter++)
-        {
-            // if rbegin, check from us to end, and from rnext to us
-            //  otherwise, just check from rnext to us
-
-            if (iter == l.rbegin())
-            {
-                auto next = nullptr;
-                auto prev = &iter->second;
-
-                auto [fr, _, eaddr] = fits(len, prev, next);
-                if (fr)
-                {
-                    region.b.base = eaddr - len;
-                    l.insert_or_assign(region.b.base, std::move(region));
-                    return region.b;
-                }
-            }
-
-            {
-                auto next = &iter->second;
-                auto piter = std::next(iter);
-                auto prev = (piter == l.rend()) ? nullptr :
-                    &piter->second;
-
-                auto [fr, _, eaddr] = fits(len, prev, next);
-                if (fr)
-                {
-                    region.b.base = eaddr - len;
-                    l.insert_or_assign(region.b.base, std::move(region));
-                    return region.b;
-                }
-            }
-        }
-    }
-
-    return InvalidVMemBlock();
-}
-
-std::tuple<bool, uintptr_t, uintptr_t> MapVBlockAllocator::fits(uintptr_t len,
-            MemBlock *prev,
-            MemBlock *next)
-{
-    auto bstart = prev ? (*prev).b.end() : base;
-    auto bend = next ? (*next).b.base : (base + length);
-
-    if(bstart >= bend)
-    {
-        return std::make_tuple(false, 0, 0);
+        if(!gaps.last_fit(len, &gstart, &glen))
+            return InvalidVMemBlock();
+        region.b.base = gstart + glen - len;
     }
 
-    auto blen = bend - bstart;
-    return std::make_tuple(blen >= len, bstart, bend);
+    auto ret = region.b;
+    auto iter = l.insert_or_assign(ret.base, std::move(region)).first;
+    gaps_inserted(iter);
+    return ret;
 }
 
 MemBlock &MapVBlockAllocator::Split(uintptr_t address)
@@ -3,7 +3,7 @@
 #include "vmem.h"
 #include "thread.h"
 #include "screen.h"
-#include "ipi.h"
+#include "scheduler.h"
 #include "cleanup.h"
 #include "process_interface.h"
 #include "_gk_memaddrs.h"
@@ -12,6 +12,8 @@
 #include "supervisor.h"
 #include "cm33_interface.h"
 #include "cpu.h"
+#include "zram.h"
+#include "pagecache.h"
 #include <atomic>
 
 #define DEBUG_PROCESS_PAGES     1
@@ -45,13 +47,13 @@ PProcess Process::Create(const std::string &_name, bool _is_privileged, PProcess
 
         {
             CriticalGuard cg(ret->owned_pages.sl);
-            ret->owned_pages.add(ttbr0_reg);
+            ret->owned_pages.add(ttbr0_reg, owned_page_kind::PageTable);
         }
 
         ret->user_mem = std::make_unique<userspace_mem_t>();
         {
             MutexGuard cg(ret->user_mem->m);
-            ret->user_mem->ttbr0 = ttbr0_reg.base | ((uint64_t)ret->id << 48);
+            ret->user_mem->ttbr0 = ttbr0_reg.base;       // ASID is added on switch in
         }
     }
 
@@ -77,7 +79,7 @@ PProcess Process::Create(const std::string &_name, bool _is_privileged, PProcess
     return ret;
 }
 
-void Process::owned_pages_t::add(const PMemBlock &b, bool is_gpu)
+void Process::owned_pages_t::add(const PMemBlock &b, owned_page_kind kind)
 {
     std::shared_ptr<shared_page> sp = nullptr;
     auto start = b.base & ~(VBLOCK_64k - 1ULL);
@@ -88,7 +90,7 @@ void Process::owned_pages_t::add(const PMemBlock &b, bool is_gpu)
     {
         klog("process: shared pages not yet implemented\n");
     }
-    if(is_gpu)
+    if(kind == owned_page_kind::Gpu)
     {
         auto ret = gpu_pages.p.AllocFixed({ (uintptr_t)start, (uintptr_t)length }, std::move(sp));
         if(ret == gpu_pages.p.end())
@@ -108,7 +110,7 @@ void Process::owned_pages_t::add(const PMemBlock &b, bool is_gpu)
         }
         return;
     }
-    else if(b.length != PAGE_SIZE || b.is_shared)
+    else if(b.length != PAGE_SIZE || b.is_shared || !p.in_range(start))
     {
         auto ret = other_pages.p.AllocFixed({ (uintptr_t)start, (uintptr_t)length }, std::move(sp));
         if(ret == other_pages.p.end())
@@ -126,27 +128,54 @@ void Process::owned_pages_t::add(const PMemBlock &b, bool is_gpu)
         return;
     }
 
-    while(start < end)
-    {
-        auto val = (uint32_t)(start >> 16);
-        p.insert(val);
-        start += VBLOCK_64k;
-    }
+    if(kind == owned_page_kind::PageTable)
+        pt.insert(start);
+    else
+        p.insert(start);
+}
+
+bool Process::owned_pages_t::add_shared(const std::shared_ptr<shared_page> &sp)
+{
+    /* Fails if this process already maps the page elsewhere - the caller then uses a
+        private copy instead */
+    auto ret = other_pages.p.AllocFixed({ (uintptr_t)sp->paddr, (uintptr_t)VBLOCK_64k },
+        std::shared_ptr<shared_page>(sp));
+    if(ret == other_pages.p.end())
+        return false;
+    other_pages.npages++;
+    other_pages.nshared++;
+    return true;
+}
+
+bool Process::owned_pages_t::is_shared(uintptr_t addr)
+{
+    auto iter = other_pages.p.IsAllocated(addr);
+    return iter != other_pages.p.end() && iter->second != nullptr;
 }
 
 void Process::owned_pages_t::release_all()
 {
-    for(auto curp : p)
+    auto release_run = [](uint64_t start, uint64_t length)
     {
-        auto addr = ((uint64_t)curp) << 16;
-        PMemBlock pb;
-        pb.base = addr;
-        pb.is_shared = false;
-        pb.length = VBLOCK_64k;
-        pb.valid = true;
-        Pmem.release(pb);
-    }
+        if(length == VBLOCK_64k)
+        {
+            // lone pages go back through the per-core cache
+            PMemBlock pb;
+            pb.base = start;
+            pb.is_shared = false;
+            pb.length = VBLOCK_64k;
+            pb.valid = true;
+            Pmem.release(pb);
+        }
+        else
+        {
+            Pmem.release_range(start, length);
+        }
+    };
+    p.for_each_run(release_run);
     p.clear();
+    pt.for_each_run(release_run);
+    pt.clear();
 
     for(auto l : { &other_pages, &gpu_pages })
     {
@@ -154,17 +183,15 @@ void Process::owned_pages_t::release_all()
         {
             if(iter->second)
             {
-                // shared pages not handled yet
-                iter++;
+                // just drop our reference to a shared page
+                l->npages -= iter->first.length / PAGE_SIZE;
+                l->nshared -= iter->first.length / PAGE_SIZE;
+                iter = l->p.erase(iter);
                 continue;
             }
 
-            PMemBlock pb;
-            pb.base = iter->first.start;
-            pb.length = iter->first.length;
-            pb.is_shared = false;
-            pb.valid = true;
-            Pmem.release(pb);
+            // may be a trimmed Pmem.acquire_aligned block rather than a buddy block
+            Pmem.release_range(iter->first.start, iter->first.length);
 
             l->npages -= iter->first.length / PAGE_SIZE;
             iter = l->p.erase(iter);
@@ -172,10 +199,10 @@ void Process::owned_pages_t::release_all()
     }
 }
 
-void Process::owned_pages_t::release(const PMemBlock &pb)
+bool Process::owned_pages_t::release(const PMemBlock &pb)
 {
     if(!pb.valid)
-        return;
+        return true;
     
     for(auto l : { &other_pages, &gpu_pages })
     {
@@ -195,24 +222,18 @@ void Process::owned_pages_t::release(const PMemBlock &pb)
         {
             klog("process: WARN: release only a portion off whole allocated physmem area\n");
         }
-        if(is_alloc->second)
-        {
-            klog("process: WARN: shared pages not yet implemented\n");
-        }
+        bool is_private = is_alloc->second == nullptr;
+        if(!is_private)
+            l->nshared -= is_alloc->first.length / PAGE_SIZE;
+        l->npages -= is_alloc->first.length / PAGE_SIZE;
         l->p.erase(is_alloc);
-        l->npages -= pb.length / PAGE_SIZE;
-        return;
+        return is_private;
     }
 
     bool released_all = true;
     for(auto pstart = pb.base; pstart < (pb.base + pb.length); pstart += PAGE_SIZE)
     {
-        auto is_alloc = p.find(pstart >> 16);
-        if(is_alloc != p.end())
-        {
-            p.erase(is_alloc);
-        }
-        else
+        if(!p.erase(pstart) && !pt.erase(pstart))
         {
             released_all = false;
         }
@@ -223,6 +244,7 @@ void Process::owned_pages_t::release(const PMemBlock &pb)
         klog("process: WARN: tried to release memory %llx - %llx which we have no record of\n",
             pb.base, pb.base + pb.length);
     }
+    return true;
 }
 
 bool Process::owned_pages_t::contains(uintptr_t addr, uintptr_t len)
@@ -243,7 +265,7 @@ bool Process::owned_pages_t::contains(uintptr_t addr, uintptr_t len)
         return ret;
     }
 
-    if(p.find(addr >> 16) != p.end())
+    if(p.contains(addr) || pt.contains(addr))
         return true;
     else if(gpu_pages.p.IsAllocated(addr) != gpu_pages.p.end())
         return true;
@@ -253,6 +275,121 @@ bool Process::owned_pages_t::contains(uintptr_t addr, uintptr_t len)
     return false;
 }
 
+void Process::owned_pages_t::pin(uintptr_t addr)
+{
+    pinned[addr & ~(VBLOCK_64k - 1)]++;
+}
+
+void Process::owned_pages_t::unpin(uintptr_t addr)
+{
+    auto iter = pinned.find(addr & ~(VBLOCK_64k - 1));
+    if(iter != pinned.end() && --iter->second == 0)
+        pinned.erase(iter);
+}
+
+bool Process::owned_pages_t::is_pinned(uintptr_t addr) const
+{
+    return pinned.find(addr & ~(VBLOCK_64k - 1)) != pinned.end();
+}
+
+Process::owned_pages_t::usage_t Process::owned_pages_t::usage() const
+{
+    usage_t ret;
+    ret.anon = p.size() + other_pages.npages - other_pages.nshared;
+    ret.file = other_pages.nshared;
+    ret.gpu = gpu_pages.npages;
+    ret.pt = pt.size();
+    return ret;
+}
+
+static Event mem_pressure_event(id_t pid, int level, size_t npages)
+{
+    Event ev;
+    ev.type = Event::event_type_t::MemoryPressure;
+    ev.mem_pressure_data.pid = pid;
+    ev.mem_pressure_data.level = level;
+    ev.mem_pressure_data.pages = npages;
+    return ev;
+}
+
+bool Process::MemCharge(size_t npages)
+{
+    auto level = mem_limits_t::pressure::None;
+    size_t total;
+    bool ret;
+    {
+        CriticalGuard cg(owned_pages.sl);
+        ret = mem_limits.charge(owned_pages.usage().total(), npages, &level, &total);
+    }
+
+    // sent once owned_pages.sl is dropped, Push takes the queue lock and wakes waiters
+    if(level != mem_limits_t::pressure::None)
+    {
+        auto ev = mem_pressure_event(id, level == mem_limits_t::pressure::Hard ?
+            GK_MEM_PRESSURE_HARD : GK_MEM_PRESSURE_SOFT, total);
+        events.Push(ev);
+        if(p_gksupervisor && p_gksupervisor.get() != this)
+            p_gksupervisor->events.Push(ev);
+    }
+    return ret;
+}
+
+void Process::MemUncharge(size_t npages)
+{
+    CriticalGuard cg(owned_pages.sl);
+    mem_limits.uncharge(npages);
+}
+
+size_t Process::MemHeadroom()
+{
+    CriticalGuard cg(owned_pages.sl);
+    return mem_limits.headroom(owned_pages.usage().total());
+}
+
+uintptr_t Process::PinUserPage(uintptr_t vaddr)
+{
+    if(!user_mem)
+        return 0;
+    auto paddr = vmem_vaddr_to_paddr(vaddr, user_mem->ttbr0);
+    if(!paddr)
+        return 0;
+    {
+        CriticalGuard cg(owned_pages.sl);
+        owned_pages.pin(paddr);
+    }
+
+    /* zram_reclaim unmaps a page before checking its pin, so if the mapping is still
+        there it will see the pin and leave the page alone */
+    if(vmem_vaddr_to_paddr(vaddr, user_mem->ttbr0) != paddr)
+    {
+        UnpinUserPage(paddr);
+        return 0;
+    }
+    return paddr;
+}
+
+void Process::UnpinUserPage(uintptr_t paddr)
+{
+    CriticalGuard cg(owned_pages.sl);
+    owned_pages.unpin(paddr);
+}
+
+void mem_pressure_poll()
+{
+    static std::atomic<bool> signalled = false;
+
+    auto free_space = Pmem.get_free_space();
+    if(free_space < GK_MEM_PRESSURE_LOW_WATER)
+    {
+        if(!signalled.exchange(true) && p_gksupervisor)
+            p_gksupervisor->events.Push(mem_pressure_event(0, GK_MEM_PRESSURE_LOW, free_space / PAGE_SIZE));
+    }
+    else if(free_space > GK_MEM_PRESSURE_LOW_WATER + GK_MEM_PRESSURE_LOW_WATER / 8)
+    {
+        signalled = false;
+    }
+}
+
 void Process::owned_pages_t::owned_page_list::dump()
 {
     for(const auto &cpp : p)
@@ -413,6 +550,9 @@ Process::~Process()
 
     // Release resources
     owned_pages.release_all();
+#if GK_ENABLE_ZRAM
+    zram_release_owner(id);
+#endif
 
     owned_conditions.clear();
     owned_mutexes.clear();
@@ -6,6 +6,10 @@
 #include "vmem.h"
 #include "kheap.h"
 #include "pmem.h"
+#include "zeropage.h"
+#include "zram.h"
+#include "pagecache.h"
+#include "kstack.h"
 #include <stm32mp2xx.h>
 
 adouble vsys, isys, psys;
@@ -211,23 +215,44 @@ void *pwr_thread(void *)
         {
             klog("MEM_DUMP: kheap:               %llx\n", kheap_size());
             klog("MEM_DUMP: phys_free:           %llx\n", Pmem.get_free_space());
+            kheap_log_stats();
+            auto zps = zeropage_stats();
+            klog("MEM_DUMP: zeropage:            %u pages, %llu hits, %llu misses, %llu filled\n",
+                zps.cur, zps.hits, zps.misses, zps.filled);
+            auto zrs = zram_stats();
+            klog("MEM_DUMP: zram:                %llu pages (%llu same-filled) in %llu bytes, %llu stores, %llu loads, %llu rejects\n",
+                zrs.stored_pages, zrs.same_filled, zrs.compressed_bytes, zrs.stores, zrs.loads, zrs.rejects);
+            auto pcs = pagecache_stats();
+            klog("MEM_DUMP: pagecache:           %u pages, %llu hits, %llu misses, %llu reclaimed\n",
+                (unsigned int)pcs.pages, pcs.hits, pcs.misses, pcs.reclaimed);
 
             {
                 CriticalGuard cg(ProcessList.sl);
-                for(auto &[ id, p ] : ProcessList.list)
+                ProcessList.list.for_each([](id_t id, const ProcessListMember &p)
                 {
                     if(!p.has_ended && p.v)
                     {
                         CriticalGuard cg2(p.v->sl, p.v->owned_pages.sl);
 
-                        auto gpu_pages = p.v->owned_pages.gpu_pages.npages;
-                        auto normal_pages = p.v->owned_pages.p.size() +
-                            p.v->owned_pages.other_pages.npages;
-                        klog("MEM_DUMP: %19s: %llx (gpu: %llx)\n", p.v->name.c_str(),
-                            (gpu_pages + normal_pages) * PAGE_SIZE,
-                            gpu_pages * PAGE_SIZE);
+                        auto u = p.v->owned_pages.usage();
+                        const auto &l = p.v->mem_limits;
+                        klog("MEM_DUMP: %19s: %llx (anon: %llx, file: %llx, gpu: %llx, pt: %llx)\n",
+                            p.v->name.c_str(), u.total() * PAGE_SIZE,
+                            u.anon * PAGE_SIZE, u.file * PAGE_SIZE, u.gpu * PAGE_SIZE,
+                            u.pt * PAGE_SIZE);
+                        if(l.soft || l.hard)
+                        {
+                            klog("MEM_DUMP: %19s  limits: soft %llx, hard %llx\n", "",
+                                l.soft * PAGE_SIZE, l.hard * PAGE_SIZE);
+                        }
+                        if(auto umem = p.v->user_mem.get(); umem)
+                        {
+                            const auto &fs = umem->fault_stats;
+                            klog("MEM_DUMP: %19s  faults: %llu (af: %llu, swapin: %llu), fault-around: %llu, readahead: %llu\n",
+                                "", fs.faults, fs.af, fs.swapins, fs.around, fs.readahead);
+                        }
                     }
-                }
+                });
             }
 
             last_mem_dump = clock_cur();
@@ -235,6 +260,42 @@ void *pwr_thread(void *)
 
 #endif
 
+#if GK_ENABLE_SCHED_DUMP
+        static kernel_time last_sched_dump = kernel_time_invalid();
+        if(clock_cur() >= (last_sched_dump + kernel_time_from_ms(5000)))
+        {
+            for(unsigned int i = 0; i < sched.ncores; i++)
+            {
+                klog("SCHED_DUMP: core %u: timer: %llu, sgi: %llu, idle wakeups: %llu\n", i,
+                    sched.wakeups[i].timer.load(), sched.wakeups[i].sgi.load(),
+                    sched.wakeups[i].idle.load());
+                klog("SCHED_DUMP: core %u: switches: %llu, fp saves: %llu, restores: %llu, traps: %llu\n", i,
+                    fp_stats[i].switches, fp_stats[i].saves, fp_stats[i].restores,
+                    fp_stats[i].traps);
+            }
+            for(int i = 0; i < sched.npriorities; i++)
+            {
+                auto n = sched.latency[i].count.load();
+                klog("SCHED_DUMP: prio %d: wakeups: %llu, mean latency: %llu us, max: %llu us\n", i,
+                    n, n ? sched.latency[i].total_us.load() / n : 0ULL,
+                    sched.latency[i].max_us.load());
+            }
+            {
+                CriticalGuard cg(ThreadList.sl);
+                ThreadList.list.for_each([](id_t id, const ThreadListMember &t)
+                {
+                    if(!t.has_ended && t.v && t.v->is_privileged)
+                    {
+                        klog("SCHED_DUMP: %19s: kernel stack used %llx of %llx\n",
+                            t.v->name.c_str(), kstack_high_water(t.v->mr_kernel_thread),
+                            t.v->mr_kernel_thread.committed());
+                    }
+                });
+            }
+            last_sched_dump = clock_cur();
+        }
+#endif
+
         Block(clock_cur() + kernel_time_from_ms(1000));
     }
 }
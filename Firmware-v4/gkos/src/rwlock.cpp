@@ -1,6 +1,5 @@
 #include "osmutex.h"
 #include "scheduler.h"
-#include "ipi.h"
 
 bool RwLock::try_rdlock(int *reason, bool block, kernel_time tout)
 {
@@ -108,7 +107,6 @@ bool RwLock::unlock(int *reason)
                 if(pwt)
                 {
                     pwt->blocking.unblock();
-                    signal_thread_woken(pwt);
                 }
             }
             waiting_threads.clear();
@@ -145,7 +143,6 @@ bool RwLock::unlock(int *reason)
             if(pwt)
             {
                 pwt->blocking.unblock();
-                signal_thread_woken(pwt);
             }
         }
         waiting_threads.clear();
@@ -168,7 +165,6 @@ void RwLock::force_release(id_t t)
                 if(pwt)
                 {
                     pwt->blocking.unblock();
-                    signal_thread_woken(pwt);
                 }
             }
             waiting_threads.clear();
@@ -194,7 +190,6 @@ void RwLock::force_release(id_t t)
             if(pwt)
             {
                 pwt->blocking.unblock();
-                signal_thread_woken(pwt);
             }
         }
         waiting_threads.clear();
@@ -3,7 +3,9 @@
 #include "gk_conf.h"
 #include "kernel_time.h"
 #include "cpu.h"
+#include "zeropage.h"
 #include <type_traits>
+#include <algorithm>
 
 #define DEBUG_SCHEDULER     0
 #define DEBUG_TASK_SWITCH   0
@@ -18,16 +20,34 @@ Scheduler sched;
 
 Scheduler::Scheduler()
 {
-    for(int i = 0; i < npriorities; i++)
-    {
-        new (&tlist[i]) IndexedThreadVector();
-    }
+    new (&threads) std::vector<PThread>();
     for(unsigned int i = 0; i < ncores; i++)
     {
+        new (&rq[i]) RunQueue<Thread, npriorities>();
+        for(int j = 0; j < npriorities; j++)
+        {
+            new (&tq[i][j]) TimeoutHeap<Thread, kernel_time>();
+        }
         new (&current_thread[i]) PThread;
         new (&next_thread[i]) PThread;
         new (&idle_threads[i]) PThread;
         scheduler_running[i] = false;
+        wakeups[i].timer = 0;
+        wakeups[i].sgi = 0;
+        wakeups[i].idle = 0;
+        idle_deadline_ns[i] = 0;
+        running_prio[i] = -1;
+        running_tid[i] = 0;
+    }
+    for(unsigned int i = 0; i < max_frame_threads; i++)
+    {
+        new (&frame_threads[i]) PThread;
+    }
+    for(int i = 0; i < npriorities; i++)
+    {
+        latency[i].count = 0;
+        latency[i].total_us = 0;
+        latency[i].max_us = 0;
     }
 }
 
@@ -43,55 +63,310 @@ void Scheduler::Schedule(PThread t)
         return;
     }
 
-    auto prio = t->base_priority;
-    if(prio >= npriorities)
+    size_t nthreads;
     {
-        prio = npriorities - 1;
+        CriticalGuard cg(sl_threads);
+        threads.push_back(t);
+        nthreads = threads.size();
     }
-    if(prio < 0)
+
+    // ensure blocking with a timeout never allocates in the task switch path
+    for(unsigned int c = 0; c < ncores; c++)
     {
-        prio = 0;
+        CriticalGuard cg(sl_rq[c]);
+        for(int i = 0; i < npriorities; i++)
+        {
+            tq[c][i].reserve(nthreads);
+        }
     }
 
+    // not yet scheduled, so in no queue and free to be rehomed
+    with_home_locked(t.get(), [&](unsigned int)
     {
-        CriticalGuard cg(tlist[prio].sl);
-        tlist[prio].v.push_back(t);
+        t->rq_self = t;
+        t->rq_core = pick_core(t.get(), GetCoreID());
+    });
 
-#if 0
-        klog("scheduler: thread added (%s), current threads:\n", t->name.c_str());
-        for(int i = 0; i < npriorities; i++)
+    with_home_locked(t.get(), [&](unsigned int)
+    {
+        t->rq_scheduled = true;
+        if(!t->rq_on_cpu)
+        {
+            requeue(t.get());
+        }
+    });
+
+    klog("scheduler: thread added (%s)\n", t->name.c_str());
+}
+
+void Scheduler::Wake(Thread *t)
+{
+    with_home_locked(t, [&](unsigned int core)
+    {
+        if(!t->rq_scheduled || t->rq_on_cpu)
+        {
+            // will be requeued when switched out
+            return;
+        }
+        tq_erase(core, t);
+        if(!t->rq.queued())
+        {
+            rq[core].push_back(t, t->base_priority);
+            t->rq_woken_us = clock_cur_us();
+            preempt_for(t, core, true);
+        }
+    });
+}
+
+uint32_t Scheduler::pick_core(const Thread *t, uint32_t pref) const
+{
+    const uint32_t valid = (1U << ncores) - 1U;
+    auto mask = t->affinity & valid;
+    if(!mask)
+    {
+        mask = valid;
+    }
+    if(mask & (1U << pref))
+    {
+        return pref;
+    }
+    return (uint32_t)__builtin_ctz(mask);
+}
+
+void Scheduler::enqueue(Thread *t)
+{
+    if(!t->rq_scheduled)
+    {
+        return;
+    }
+
+    unsigned int core = t->rq_core;
+    kernel_time tout = kernel_time_invalid();
+    bool on_thread = false;
+    auto is_b = t->blocking.is_blocking_nolock(&tout, &on_thread);
+
+    /* Threads blocked on another thread stay queued so get_blocker() can donate
+        their priority to it */
+    if((!is_b || on_thread) && !t->rq.queued())
+    {
+        rq[core].push_back(t, t->base_priority);
+        if(!is_b)
+        {
+            preempt_for(t, core, false);
+        }
+    }
+    if(is_b && kernel_time_is_valid(tout))
+    {
+        tq_insert(core, t, tout);
+    }
+}
+
+void Scheduler::requeue(Thread *t)
+{
+    t->rq_on_cpu = false;
+    enqueue(t);
+}
+
+void Scheduler::claim(uint32_t ncore, uint32_t home, Thread *t)
+{
+    rq[home].erase(t);
+    tq_erase(home, t);
+    t->rq_core = ncore;
+    t->rq_on_cpu = true;
+    next_thread[ncore] = t->rq_self.lock();
+}
+
+bool Scheduler::try_claim(uint32_t ncore, Thread *t, bool must_be_queued)
+{
+    while(true)
+    {
+        unsigned int home = t->rq_core;
+        CriticalGuard cg(sl_rq[home], sl_cur_next[ncore]);
+        if(t->rq_core != home)
         {
-            for(const auto &ct : tlist[i].v)
+            continue;
+        }
+        if(!t->rq_scheduled || t->rq_on_cpu ||
+            (must_be_queued && !t->rq.queued()) ||
+            !(t->affinity & (1U << ncore)))
+        {
+            return false;
+        }
+        claim(ncore, home, t);
+        return true;
+    }
+}
+
+Thread *Scheduler::steal(uint32_t ncore, int min_prio)
+{
+    for(unsigned int i = 1; i < ncores; i++)
+    {
+        auto victim = (ncore + i) % ncores;
+        CriticalGuard cg(sl_rq[victim], sl_cur_next[ncore]);
+        for(auto prio = rq[victim].highest(); prio >= min_prio && prio >= 0;
+            prio = rq[victim].next_below(prio))
+        {
+            for(auto t = rq[victim].front(prio); t; t = rq[victim].next(t))
             {
-                klog("scheduler: prio %d: %s\n", i, ct->name.c_str());
+                if(!(t->affinity & (1U << ncore)))
+                {
+                    continue;
+                }
+
+                // donors stay with their own core, which resolves their chain
+                if(t->blocking.is_blocking_nolock())
+                {
+                    continue;
+                }
+
+                claim(ncore, victim, t);
+                return t;
             }
         }
-#else
-        klog("scheduler: thread added (%s)\n", t->name.c_str());
-#endif
     }
+    return nullptr;
 }
 
-inline void Scheduler::set_timeout(const PThread new_t)
+void Scheduler::tq_insert(uint32_t core, Thread *t, kernel_time tout)
+{
+    tq[core][std::clamp(t->base_priority, 0, npriorities - 1)].insert(t, tout);
+    kick_idle(core, kernel_time_to_ns(tout));
+}
+
+void Scheduler::tq_erase(uint32_t core, Thread *t)
+{
+    if(t->tq.queued())
+    {
+        tq[core][std::clamp(t->base_priority, 0, npriorities - 1)].erase(t);
+    }
+}
+
+void Scheduler::kick_idle(uint32_t core, uint64_t when_ns)
+{
+    if(core != GetCoreID() && idle_deadline_ns[core] > when_ns)
+    {
+        // it reprograms its timer for whatever remains queued
+        idle_deadline_ns[core] = 0;
+        gic_send_sgi(GIC_SGI_YIELD, (int)core);
+    }
+}
+
+void Scheduler::preempt_for(const Thread *t, uint32_t home, bool include_self)
+{
+    /* Interrupt the core running the lowest priority thread that t outranks, preferring
+        its home core on a tie.  Idle cores rank below every thread. */
+    auto self = GetCoreID();
+    int target = -1;
+    int target_prio = t->base_priority;
+    for(unsigned int i = 0; i < ncores; i++)
+    {
+        auto core = (home + i) % ncores;
+        if((core == self && !include_self) || !(t->affinity & (1U << core)))
+        {
+            continue;
+        }
+        auto prio = idle_deadline_ns[core] ? -1 : running_prio[core].load();
+        if(prio < target_prio)
+        {
+            target = (int)core;
+            target_prio = prio;
+        }
+    }
+
+    if(target < 0)
+    {
+        return;
+    }
+    if(target_prio < 0)
+    {
+        // it reprograms its timer when it reschedules
+        idle_deadline_ns[target] = 0;
+    }
+    if((unsigned int)target == self)
+    {
+        Yield();
+    }
+    else
+    {
+        gic_send_sgi(GIC_SGI_YIELD, target);
+    }
+}
+
+void Scheduler::wake_timeouts(uint32_t ncore, kernel_time now)
+{
+    CriticalGuard cg(sl_rq[ncore]);
+
+    for(int i = 0; i < npriorities; i++)
+    {
+        while(true)
+        {
+            auto t = tq[ncore][i].top();
+            if(!t || now < t->tq.key)
+            {
+                break;
+            }
+            tq[ncore][i].pop();
+            if(!t->rq.queued() && !t->rq_on_cpu)
+            {
+                rq[ncore].push_back(t, t->base_priority);
+                t->rq_woken_us = kernel_time_to_us(now);
+            }
+        }
+    }
+}
+
+inline void Scheduler::set_timeout(uint32_t ncore, const PThread &new_t,
+    const PThread &old_t, kernel_time old_tout)
 {
     const uint32_t unmask_val = 0x1;
 
-    // Get earliest timeout in anything with higher priority than new_t
-    auto new_p = new_t->base_priority;
+    // Get earliest timeout in anything which would preempt new_t
+    auto first_p = new_t->is_idle_thread ? 0 : new_t->base_priority + 1;
     kernel_time earliest_blocker = kernel_time_invalid();
-    for(int i = new_p + 1; i < npriorities; i++)
+
+    /* The outgoing thread is not on a timeout heap until SetNextThread() requeues it */
+    if(old_t && old_t != new_t && old_t->base_priority >= first_p)
+    {
+        earliest_blocker = old_tout;
+    }
+
     {
-        if(kernel_time_is_valid(earliest_blockers[i]))
+        CriticalGuard cg(sl_rq[ncore]);
+        for(int i = std::max(first_p, 0); i < npriorities; i++)
         {
-            if(!kernel_time_is_valid(earliest_blocker) || earliest_blockers[i] < earliest_blocker)
+            auto t = tq[ncore][i].top();
+            if(t && (!kernel_time_is_valid(earliest_blocker) || t->tq.key < earliest_blocker))
             {
-                earliest_blocker = earliest_blockers[i];
+                earliest_blocker = t->tq.key;
             }
         }
+
+        /* Published under sl_rq so that tq_insert() on another core sees either the
+            deadline we are about to program or that we are not yet idle */
+        if(new_t->is_idle_thread)
+        {
+            idle_deadline_ns[ncore] = kernel_time_is_valid(earliest_blocker) ?
+                kernel_time_to_ns(earliest_blocker) : idle_no_deadline;
+        }
+        else
+        {
+            idle_deadline_ns[ncore] = 0;
+        }
     }
 
     const unsigned int sysclk = 64;   // 1 us = 64 ticks @ 64 MHz
-    unsigned int reload = 0;
+    unsigned int reload = sysclk * GK_MAXTIMESLICE_US;
+
+#if GK_TICKLESS
+    if(new_t->is_idle_thread && !kernel_time_is_valid(earliest_blocker))
+    {
+        // nothing to wait for - stop the tick, the core now only wakes for an IRQ or SGI
+        __asm__ volatile(
+            "msr cntp_ctl_el0, %[mask_timer]\n" : :
+            [mask_timer] "r" (0x3) : "memory");
+        return;
+    }
+#endif
 
     if(kernel_time_is_valid(earliest_blocker))
     {
@@ -112,18 +387,42 @@ inline void Scheduler::set_timeout(const PThread new_t)
         else
         {
             auto tdiff = earliest_blocker - now;
-            
-            if(tdiff < kernel_time_from_us(GK_MAXTIMESLICE_US))
+            auto max_tdiff = kernel_time_from_us(GK_MAXTIMESLICE_US);
+#if GK_TICKLESS
+            if(new_t->is_idle_thread)
+            {
+                /* Sleep right up to the deadline.  tval is a signed 32-bit count (~33 s),
+                    longer sleeps simply re-arm when it expires */
+                max_tdiff = kernel_time_from_us(0x7fffffffULL / sysclk);
+                reload = 0x7fffffffU;
+            }
+#endif
+
+            if(tdiff < max_tdiff)
             {
-                // core_clk/reload = 1/tdiff
-                // reload = core * tdiff(s)
-                reload = (unsigned int)(sysclk * kernel_time_to_us(tdiff));
+                // program the exact number of ticks, rounding up so we never fire early
+                reload = (unsigned int)((kernel_time_to_ns(tdiff) * sysclk + 999ULL) / 1000ULL);
+                if(reload == 0)
+                {
+                    reload = 1;
+                }
             }
         }
     }
-    if(reload == 0)
+
+    // don't let a boosted frame-paced thread overrun its budget
+    if(new_t->frame.budget_us)
     {
-        reload = sysclk * GK_MAXTIMESLICE_US;
+        uint64_t budget_left;
+        {
+            CriticalGuard cg(sl_frame);
+            budget_left = frame_budget_left(new_t.get(),
+                new_t == old_t ? clock_cur_us() - timeslice_start[ncore] : 0);
+        }
+        if(budget_left != ~0ULL && budget_left * sysclk < reload)
+        {
+            reload = std::max((unsigned int)(budget_left * sysclk), 1U);
+        }
     }
 
 #if DEBUG_SCHEDULER
@@ -137,11 +436,20 @@ inline void Scheduler::set_timeout(const PThread new_t)
         [unmask_timer] "r" (unmask_val) : "memory");
 }
 
+static inline void set_default_timeslice()
+{
+    __asm__ volatile(
+        "msr cntp_tval_el0, %[delay]\n" 
+        "msr cntp_ctl_el0, %[unmask_timer]\n" : :
+        [delay] "r" (64 * GK_MAXTIMESLICE_US),
+        [unmask_timer] "r" (0x1) : "memory");
+}
+
 Thread *Scheduler::GetNextThread(uint32_t ncore)
 {
     // If we are the golden thread then simply return
     {
-        CriticalGuard cg(sl_cur_next);
+        CriticalGuard cg(sl_cur_next[ncore]);
         auto tptr = GetCurrentThreadForCore();
         if(tptr && tptr == golden_thread[ncore].get())
         {
@@ -152,100 +460,190 @@ Thread *Scheduler::GetNextThread(uint32_t ncore)
     PThread cur_t;
     int cur_prio;
     bool cur_blocking;
+    bool cur_on_thread = false;
+    kernel_time cur_tout = kernel_time_invalid();
 
     // Get the priority of the currently running thread, or 0 if it is blocking
     {
-        CriticalGuard cg(sl_cur_next);
+        CriticalGuard cg(sl_cur_next[ncore]);
         cur_t = current_thread[ncore];
     }
-    cur_blocking = (cur_t == nullptr) ? true : cur_t->blocking.is_blocking();
+    cur_blocking = (cur_t == nullptr) ? true : cur_t->blocking.is_blocking(&cur_tout);
     cur_prio = cur_blocking ? 0 : cur_t->base_priority;
-
-#if GK_DYNAMIC_SYSTICK
-    // Get earliest blocker at each priority level
-    for(int i = 0; i < npriorities; i++)
+    if(cur_t && cur_blocking)
     {
-        kernel_time cur_earliest_blocker = kernel_time_invalid();
-        CriticalGuard cg(tlist[i].sl);
+        cur_t->blocking.is_blocking_nolock(nullptr, &cur_on_thread);
+    }
 
-        for(auto tthread : tlist[i].v)
+    // A frame-paced thread which has used its budget for this period drops its boost
+    if(cur_t && !cur_blocking && cur_t->frame.budget_us)
+    {
+        bool demote;
         {
-            kernel_time tthread_tout;
-            if(tthread->blocking.is_blocking(&tthread_tout))
+            CriticalGuard cg(sl_frame);
+            demote = frame_budget_left(cur_t.get(), clock_cur_us() - timeslice_start[ncore]) == 0;
+            if(demote)
             {
-                if(kernel_time_is_valid(tthread_tout))
-                {
-                    if(!kernel_time_is_valid(cur_earliest_blocker) ||
-                        tthread_tout < cur_earliest_blocker)
-                    {
-                        cur_earliest_blocker = tthread_tout;
-                    }                
-                }
+                cur_t->frame.boosted = false;
             }
         }
-
-        earliest_blockers[i] = cur_earliest_blocker;
+        if(demote)
+        {
+            with_home_locked(cur_t.get(), [&](unsigned int core)
+            {
+                set_priority_locked(cur_t.get(), core, cur_t->base_priority,
+                    cur_t->frame.normal_priority);
+            });
+            running_prio[ncore] = cur_t->base_priority;
+            cur_prio = cur_t->base_priority;
+        }
     }
-#endif
 
-    // now select a thread of higher priority than we currently have
-    for(int i = npriorities-1; i >= cur_prio; i--)
+    auto chosen = [&](const PThread &new_t)
     {
-        CriticalGuard cg(tlist[i].sl);
+#if GK_DYNAMIC_SYSTICK
+        set_timeout(ncore, new_t, cur_t, cur_tout);
+#else
+        set_default_timeslice();
+#endif
+        return new_t.get();
+    };
 
-        if(tlist[i].v.empty())
-        {
-            continue;
-        }
+    // Move any threads whose timeout has expired back to the run queue
+    wake_timeouts(ncore, clock_cur());
 
-        auto vsize = static_cast<int>(tlist[i].v.size());
+    /* Select a thread of equal or higher priority than we currently have from our own
+        run queue.  The common case is a single bitmap lookup and list pop.  Threads
+        blocked on another thread (mutex owners, join) stay queued and have their chain
+        followed outside the run queue lock, to allow priority escalation. */
+    constexpr unsigned int max_donors = 8;
+    constexpr int max_attempts = 4;
+    struct donor_t { id_t id; int prio; };
 
-        // Get the front most thread at highest priority
-        auto cur_idx = tlist[i].index;
+    for(int attempt = 0; attempt < max_attempts; attempt++)
+    {
+        donor_t donors[max_donors];
+        unsigned int ndonors = 0;
+        PThread cand;
+        int cand_prio = -1;
 
-        for(int basei = 0; basei < vsize; basei++)
+        if(cur_on_thread)
         {
-            auto iter = (basei + cur_idx + 1) % vsize;
-            auto cval = tlist[i].v[iter];
-
-            bool is_blocking;
-            std::tie(cval, is_blocking) = get_blocker(cval);
+            donors[ndonors++] = { cur_t->id, cur_t->base_priority };
+        }
 
-            if(!is_blocking)
+        {
+            CriticalGuard cg(sl_rq[ncore], sl_cur_next[ncore]);
+            auto &crq = rq[ncore];
+            for(auto prio = crq.highest(); prio >= cur_prio && prio >= 0 && !cand;
+                prio = crq.next_below(prio))
             {
-                bool can_pick = true;
+                for(auto t = crq.front(prio); t; t = crq.next(t))
                 {
-                    CriticalGuard cg2(sl_cur_next);
-                    // check we are not scheduling something already chosen for another core
-                    for(unsigned int core = 0U; core < ncores; core++)
+                    bool on_thread = false;
+                    if(t->blocking.is_blocking_nolock(nullptr, &on_thread) && on_thread)
                     {
-                        if(current_thread[core] == cval || next_thread[core] == cval)
+                        if(ndonors < max_donors)
                         {
-                            can_pick = false;
-                            break;
+                            donors[ndonors++] = { t->id, prio };
                         }
+                        continue;
                     }
 
-                    if(can_pick)
+                    if(ndonors == 0)
                     {
-                        next_thread[ncore] = cval;
-
-                        tlist[i].index = iter;
-#if GK_DYNAMIC_SYSTICK
-                        set_timeout(cval);
-#else
-                        // default timeslice
-                        __asm__ volatile(
-                            "msr cntp_tval_el0, %[delay]\n" 
-                            "msr cntp_ctl_el0, %[unmask_timer]\n" : :
-                            [delay] "r" (64 * GK_MAXTIMESLICE_US),
-                            [unmask_timer] "r" (0x1) : "memory");
-#endif
-                        return cval.get();
+                        // fast path - nothing to resolve
+                        claim(ncore, ncore, t);
+                        auto ret = next_thread[ncore];
+                        cg.unlock();
+                        return chosen(ret);
                     }
+
+                    cand = t->rq_self.lock();
+                    cand_prio = prio;
+                    break;
                 }
             }
         }
+
+        if(ndonors == 0)
+        {
+            // nothing runnable at >= cur_prio
+            break;
+        }
+
+        // highest priority first, keeping queue order within a priority
+        std::stable_sort(&donors[0], &donors[ndonors],
+            [](const donor_t &a, const donor_t &b) { return a.prio > b.prio; });
+
+        for(unsigned int i = 0; i < ndonors; i++)
+        {
+            if(cand && donors[i].prio < cand_prio)
+            {
+                break;
+            }
+
+            auto dt = ThreadList.Get(donors[i].id).v;
+            if(!dt)
+            {
+                continue;
+            }
+
+            auto [bt, is_blocking] = get_blocker(dt);
+            if(is_blocking)
+            {
+                continue;
+            }
+
+            if(bt == cur_t)
+            {
+                // our own block has finished - carry on running
+                return chosen(cur_t);
+            }
+
+            // the blocker may be homed on another core, in which case this migrates it
+            if(try_claim(ncore, bt.get(), false))
+            {
+                with_home_locked(dt.get(), [&](unsigned int core)
+                {
+                    rq[core].rotate(dt.get());
+                });
+                return chosen(bt);
+            }
+        }
+
+        if(!cand)
+        {
+            break;
+        }
+
+        if(try_claim(ncore, cand.get(), true))
+        {
+            return chosen(cand);
+        }
+
+        // lost a race with the other core - try again
+    }
+
+    /* Nothing suitable locally.  If we would otherwise idle, take any runnable thread from
+        another core, else only one which outranks the current thread.  Flag ourselves as
+        idle first so anything queued elsewhere during the scan sends us an SGI. */
+    if(ncores > 1)
+    {
+        if(cur_blocking)
+        {
+            idle_deadline_ns[ncore] = idle_no_deadline;
+        }
+        auto st = steal(ncore, cur_blocking ? 0 : cur_prio + 1);
+        if(st)
+        {
+            PThread ret;
+            {
+                CriticalGuard cg(sl_cur_next[ncore]);
+                ret = next_thread[ncore];
+            }
+            return chosen(ret);
+        }
     }
 
     // We didn't find any valid thread with equal or higher priority than the current one
@@ -255,21 +653,11 @@ Thread *Scheduler::GetNextThread(uint32_t ncore)
 
     if(new_t != cur_t)
     {
-        CriticalGuard cg(sl_cur_next);
+        CriticalGuard cg(sl_cur_next[ncore]);
         next_thread[ncore] = new_t;
     }
 
-#if GK_DYNAMIC_SYSTICK
-    set_timeout(new_t);
-#else
-    // default timeslice
-    __asm__ volatile(
-        "msr cntp_tval_el0, %[delay]\n" 
-        "msr cntp_ctl_el0, %[unmask_timer]\n" : :
-        [delay] "r" (64 * GK_MAXTIMESLICE_US),
-        [unmask_timer] "r" (0x1) : "memory");
-#endif
-    return new_t.get();
+    return chosen(new_t);
 }
 
 extern char _ecm4_stack;
@@ -277,9 +665,15 @@ extern char _ecm7_stack;
 
 static void *idle_thread(void *)
 {
+    auto &wakeups = sched.wakeups[GetCoreID()];
     while(true)
     {
+        // use idle time to top up the pre-zeroed page pool, one page at a time
+        if(zeropage_idle_fill())
+            continue;
+
         __asm__ volatile("wfi \n" ::: "memory");
+        wakeups.idle++;
     }
 }
 
@@ -290,8 +684,9 @@ void Scheduler::StartForCurrentCore [[noreturn]] ()
     // Create the idle thread for the current core
     extern PProcess p_kernel;
     idle_threads[core] = Thread::Create("idle_" + std::to_string(core),
-        idle_thread, nullptr, true, GK_PRIORITY_IDLE, p_kernel);
+        idle_thread, nullptr, true, GK_PRIORITY_IDLE, p_kernel, nullptr, GK_KSTACK_IDLE);
     idle_threads[core]->is_idle_thread = true;
+    idle_threads[core]->rq_core = core;
 
     scheduler_running[core] = true;
 
@@ -377,18 +772,21 @@ void Block(kernel_time until, PThread block_on)
 
 void Scheduler::Unschedule(PThread t)
 {
-    for(int i = 0; i < npriorities; i++)
+    with_home_locked(t.get(), [&](unsigned int core)
     {
-        CriticalGuard cg(tlist[i].sl);
-
-        auto &v = tlist[i].v;
+        rq[core].erase(t.get());
+        tq_erase(core, t.get());
+        t->rq_scheduled = false;
+    });
 
-        auto iter = v.begin();
-        while(iter != v.end())
+    {
+        CriticalGuard cg(sl_threads);
+        auto iter = threads.begin();
+        while(iter != threads.end())
         {
             if(*iter == t)
             {
-                iter = v.erase(iter);
+                iter = threads.erase(iter);
             }
             else
             {
@@ -397,16 +795,40 @@ void Scheduler::Unschedule(PThread t)
         }
     }
 
+    for(size_t i = 0; i < ncores; i++)
     {
-        CriticalGuard cg(sl_cur_next);
-        for(size_t i = 0; i < ncores; i++)
+        CriticalGuard cg(sl_cur_next[i]);
+        if(golden_thread[i].get() == t.get())
         {
-            if(golden_thread[i].get() == t.get())
-            {
-                golden_thread[i].reset();
-            }
+            golden_thread[i].reset();
+        }
+    }
+
+    SetFramePacing(t, 0, 0);
+}
+
+bool Scheduler::set_priority_locked(Thread *t, unsigned int core, int old_p, int new_p)
+{
+    // update base_priority, and move to the new lists if currently queued
+    auto had_tout = t->tq.queued();
+    auto tout = t->tq.key;
+    tq_erase(core, t);
+
+    t->base_priority = new_p;
+    if(t->rq.queued())
+    {
+        rq[core].erase(t);
+        rq[core].push_back(t, new_p);
+        if(new_p > old_p)
+        {
+            preempt_for(t, core, true);
         }
     }
+    if(had_tout)
+    {
+        tq_insert(core, t, tout);
+    }
+    return t->rq_on_cpu;
 }
 
 void Scheduler::ChangePriority(PThread t, int old_p, int new_p)
@@ -418,46 +840,45 @@ void Scheduler::ChangePriority(PThread t, int old_p, int new_p)
     if(old_p == new_p)
         return;
     
-    // Simultaneously lock thread and old/new priority lists
-    CriticalGuard cg(tlist[old_p].sl, tlist[new_p].sl);
-
-    auto &old_v = tlist[old_p].v;
-
-    for(auto iter = old_v.begin(); iter != old_v.end(); iter++)
+    bool scheduled = true;
+    bool running = false;
+    unsigned int running_core = 0;
+    with_home_locked(t.get(), [&](unsigned int core)
     {
-        if(*iter == t)
+        if(!t->rq_scheduled)
         {
-            // We found the thread in this scheduler instance, remove from old list, add to new
-            old_v.erase(iter);
-            auto &new_v = tlist[new_p].v;
-            new_v.push_back(t);
-
-            // update base_priority
-            t->base_priority = new_p;
+            scheduled = false;
+            return;
+        }
 
-            // if currently running, and has lowered priority, need to yield.  TODO pass message to other core if necessary
-            if(new_p < old_p && t.get() == GetCurrentThreadForCore())
+        if(set_priority_locked(t.get(), core, old_p, new_p))
+        {
+            running = true;
+            running_core = core;
+            if(running_prio[core] >= 0 && running_prio[core] < npriorities)
             {
-                #if 0
-                if(t->tss.running_on_core != GetCoreID() + 1)
-                {
-                    auto other_core = 1U - GetCoreID();
-                    ipi_messages[other_core].Write({ ipi_message::ThreadUnblocked, nullptr, .t = t });
-                    __SEV();
-                }
-                else
-                #endif
-                Yield();    // single core or dual core and running on this
+                running_prio[core] = new_p;
             }
-
-            return;
         }
+    });
+    if(!scheduled)
+    {
+        return;
+    }
+
+    // if currently running, and has lowered priority, its core needs to reschedule
+    if(new_p < old_p && running)
+    {
+        if(running_core == GetCoreID())
+            Yield();
+        else
+            gic_send_sgi(GIC_SGI_YIELD, (int)running_core);
     }
 }
 
 void Scheduler::SetNextThread(uint32_t ncore, Thread *t)
 {
-    CriticalGuard cg(sl_cur_next);
+    CriticalGuard cg(sl_cur_next[ncore]);
     if(t != next_thread[ncore].get())
     {
         // shouldn't get here
@@ -470,12 +891,38 @@ void Scheduler::SetNextThread(uint32_t ncore, Thread *t)
     *(id_t *)(0xfffffd0030000000 + ncore * 8) = t->id;
 #endif
 
+    /* Published for preempt_for() on other cores.  Golden threads are never preempted */
+    running_prio[ncore] = t->is_idle_thread ? -1 :
+        (t == golden_thread[ncore].get() ? npriorities : t->base_priority);
+    running_tid[ncore].store(t->id, std::memory_order_relaxed);
+
+    auto now = clock_cur_us();
+    bool demote_old = false;
+
+    /* Unblock-to-run latency */
+    auto woken = t->rq_woken_us.exchange(0);
+    if(woken && now >= woken)
+    {
+        auto &ls = latency[std::clamp(t->base_priority, 0, npriorities - 1)];
+        auto lat = now - woken;
+        ls.count++;
+        ls.total_us += lat;
+        if(lat > ls.max_us)
+        {
+            ls.max_us = lat;
+        }
+    }
+
     /* Update timeslices */
     if(current_thread[ncore])
     {
-        auto now = clock_cur_us();
         auto cur_thread_time = now - timeslice_start[ncore].exchange(now);
         current_thread[ncore]->thread_time_us += cur_thread_time;
+        if(current_thread[ncore]->frame.budget_us)
+        {
+            CriticalGuard cg_frame(sl_frame);
+            demote_old = frame_charge(current_thread[ncore].get(), cur_thread_time);
+        }
         auto is_idle = current_thread[ncore]->is_idle_thread;
 
         if(is_idle)
@@ -497,8 +944,31 @@ void Scheduler::SetNextThread(uint32_t ncore, Thread *t)
     }
 
     std::swap(current_thread[ncore], next_thread[ncore]);
+    auto old_t = std::move(next_thread[ncore]);
     next_thread[ncore].reset();
     cg.unlock();
+
+    /* The old thread's context is now saved, so it can be made available to other cores */
+    if(old_t)
+    {
+        auto target = pick_core(old_t.get(), ncore);
+        if(target != ncore)
+        {
+            // affinity changed while running - rehome it.  Still in no queue and on_cpu,
+            //  so Wake() leaves it alone until requeued below
+            CriticalGuard cg_rq(sl_rq[ncore]);
+            old_t->rq_core = target;
+        }
+        with_home_locked(old_t.get(), [&](unsigned int core)
+        {
+            if(demote_old)
+            {
+                set_priority_locked(old_t.get(), core, old_t->base_priority,
+                    old_t->frame.normal_priority);
+            }
+            requeue(old_t.get());
+        });
+    }
 }
 
 Thread *GetNextThreadForCore(uint32_t iar, void *, uint32_t irq)
@@ -506,7 +976,16 @@ Thread *GetNextThreadForCore(uint32_t iar, void *, uint32_t irq)
 #if DEBUG_TASK_SWITCH
     auto curt = GetCurrentPThreadForCore();
 #endif
-    auto ret = sched.GetNextThread(GetCoreID());
+    auto ncore = GetCoreID();
+    if(irq == GIC_PPI_NS_PHYS)
+        sched.wakeups[ncore].timer++;
+    else if(irq == GIC_SGI_YIELD)
+        sched.wakeups[ncore].sgi++;
+    auto ret = sched.GetNextThread(ncore);
+
+    // TaskSwitch loads tss.ttbr0 - make sure it carries a current ASID
+    if(ret->tss.ttbr0 && ret->asid)
+        ret->tss.ttbr0 = asid_ttbr0(ret->asid, ret->tss.ttbr0);
 #if DEBUG_SCHEDULER
     klog("sched: get_next_thread_for_core(%u): switch due to %x returning thread: %llx (%s), sp_el1: %llx\n, tss: %llx\n",
         GetCoreID(), iar,
@@ -523,9 +1002,20 @@ void SetNextThreadForCore(Thread *t)
     sched.SetNextThread(GetCoreID(), t);
 }
 
+bool Scheduler::IsRunningElsewhere(id_t id) const
+{
+    auto ncore = GetCoreID();
+    for(unsigned int i = 0; i < ncores; i++)
+    {
+        if(i != ncore && running_tid[i].load(std::memory_order_relaxed) == id)
+            return true;
+    }
+    return false;
+}
+
 PThread &Scheduler::GetCurThread(uint32_t ncore)
 {
-    CriticalGuard cg(sl_cur_next);
+    CriticalGuard cg(sl_cur_next[ncore]);
     return current_thread[ncore];
 }
 
@@ -542,9 +1032,22 @@ double Scheduler::CPUUsage(int core_id)
     }
     else if((unsigned int)core_id < ncores)
     {
-        CriticalGuard cg(sl_cur_next);
+        CriticalGuard cg(sl_cur_next[core_id]);
         if(golden_thread[core_id] != nullptr)
             return 1.0;
+
+        /* A tickless idle core may not switch for a long time, so also count the idle
+            time since it last did */
+        auto &ct = current_thread[core_id];
+        if(ct && ct->is_idle_thread)
+        {
+            auto idle_now = clock_cur_us() - timeslice_start[core_id];
+            auto total = idle_thread_times[core_id] + non_idle_thread_times[core_id] + idle_now;
+            if(total >= 1000000UL)
+            {
+                return (double)non_idle_thread_times[core_id] / (double)total;
+            }
+        }
         cg.unlock();
         return (double)cpu_usage[(unsigned int)core_id];
     }
@@ -554,6 +1057,22 @@ double Scheduler::CPUUsage(int core_id)
     }
 }
 
+void Scheduler::SetBasePriority(PThread t, int new_p)
+{
+    {
+        CriticalGuard cg(sl_frame);
+        if(t->frame.budget_us)
+        {
+            t->frame.normal_priority = new_p;
+            if(t->frame.boosted)
+            {
+                return;
+            }
+        }
+    }
+    ChangePriority(t, t->base_priority, new_p);
+}
+
 void Scheduler::SetGoldenThread(PThread t)
 {
     if(!t)
@@ -563,36 +1082,255 @@ void Scheduler::SetGoldenThread(PThread t)
     if(ncores == 1)
         return;
     
-    CriticalGuard cg(sl_cur_next);
-
-    // first determine how many golden threads are already allocated
-    size_t n_golden = 0;
-    for(const auto &curt : golden_thread)
+    unsigned int golden_core = ncores;
     {
-        if(curt)
-            n_golden++;
-    }
+        CriticalGuard cg_golden(sl_golden);
 
-    // if less than max, then just allocate somewhere
-    if(n_golden < (ncores - 1))
-    {
+        // first determine how many golden threads are already allocated
+        size_t n_golden = 0;
         for(size_t i = 0U; i < ncores; i++)
         {
-            if(golden_thread[i].get() == nullptr)
+            CriticalGuard cg(sl_cur_next[i]);
+            if(golden_thread[i])
+                n_golden++;
+        }
+
+        // if less than max, then just allocate somewhere, else allocate on top of an existing one
+        for(size_t i = 0U; i < ncores && golden_core == ncores; i++)
+        {
+            CriticalGuard cg(sl_cur_next[i]);
+            if((golden_thread[i].get() == nullptr) == (n_golden < (ncores - 1)))
             {
                 golden_thread[i] = t;
-                return;
+                golden_core = i;
             }
         }
     }
 
-    // else, allocate on top of an existing one
-    for(size_t i = 0U; i < ncores; i++)
+    // run queues are per-core, so pin it to make sure the golden core picks it up
+    if(golden_core < ncores)
     {
-        if(golden_thread[i].get())
+        SetAffinity(t, 1U << golden_core);
+    }
+}
+
+int Scheduler::SetAffinity(PThread t, uint32_t mask)
+{
+    mask &= (1U << ncores) - 1U;
+    if(!mask)
+    {
+        return -1;
+    }
+
+    bool migrate = false;
+    bool resched = false;
+    unsigned int running_core = 0;
+    with_home_locked(t.get(), [&](unsigned int core)
+    {
+        t->affinity = mask;
+        if(mask & (1U << core))
         {
-            golden_thread[i] = t;
             return;
         }
+
+        if(t->rq_on_cpu)
+        {
+            // SetNextThread() rehomes it when switched out
+            resched = true;
+            running_core = core;
+            return;
+        }
+
+        // leave the queues of a core it may no longer use
+        rq[core].erase(t.get());
+        tq_erase(core, t.get());
+        t->rq_core = pick_core(t.get(), core);
+        migrate = true;
+    });
+
+    if(migrate)
+    {
+        with_home_locked(t.get(), [&](unsigned int)
+        {
+            if(!t->rq_on_cpu)
+            {
+                enqueue(t.get());
+            }
+        });
     }
+
+    if(resched)
+    {
+        if(running_core == GetCoreID())
+            Yield();
+        else
+            gic_send_sgi(GIC_SGI_YIELD, (int)running_core);
+    }
+
+    return 0;
+}
+
+uint32_t Scheduler::GetAffinity(PThread t)
+{
+    return t->affinity & ((1U << ncores) - 1U);
+}
+
+int Scheduler::SetFramePacing(PThread t, unsigned int budget_us, unsigned int period_us)
+{
+    if(!t)
+    {
+        return -1;
+    }
+
+    bool was_boosted = false;
+    {
+        CriticalGuard cg(sl_frame);
+        unsigned int idx = 0;
+        while(idx < n_frame_threads && frame_threads[idx] != t)
+        {
+            idx++;
+        }
+
+        if(budget_us == 0)
+        {
+            if(idx == n_frame_threads)
+            {
+                return 0;
+            }
+            was_boosted = t->frame.boosted;
+            t->frame.budget_us = 0;
+            t->frame.boosted = false;
+            frame_threads[idx] = std::move(frame_threads[n_frame_threads - 1]);
+            frame_threads[n_frame_threads - 1].reset();
+            n_frame_threads--;
+        }
+        else
+        {
+            if(period_us == 0 || budget_us > period_us)
+            {
+                return -1;
+            }
+            if(idx == n_frame_threads)
+            {
+                if(n_frame_threads >= max_frame_threads)
+                {
+                    return -1;
+                }
+                frame_threads[n_frame_threads++] = t;
+                t->frame = Thread::frame_pacing_t{};
+                t->frame.normal_priority = t->base_priority;
+            }
+            t->frame.budget_us = budget_us;
+            t->frame.period_us = period_us;
+        }
+    }
+
+    if(was_boosted)
+    {
+        ChangePriority(t, frame_boost_priority, t->frame.normal_priority);
+    }
+    return 0;
+}
+
+bool Scheduler::frame_charge(Thread *t, uint64_t us)
+{
+    auto &f = t->frame;
+    if(!f.budget_us)
+    {
+        return false;
+    }
+    f.used_us += us;
+    if(f.boosted && f.used_us >= f.budget_us)
+    {
+        f.boosted = false;
+        return true;
+    }
+    return false;
+}
+
+uint64_t Scheduler::frame_budget_left(const Thread *t, uint64_t running_us) const
+{
+    auto &f = t->frame;
+    if(!f.boosted)
+    {
+        return ~0ULL;
+    }
+    auto used = f.used_us + running_us;
+    return used >= f.budget_us ? 0 : f.budget_us - used;
+}
+
+void Scheduler::FrameTick()
+{
+    PThread to_boost[max_frame_threads];
+    unsigned int n_boost = 0;
+    auto now = clock_cur_us();
+
+    {
+        CriticalGuard cg(sl_frame);
+        for(unsigned int i = 0; i < n_frame_threads; i++)
+        {
+            auto &f = frame_threads[i]->frame;
+
+            // allow a quarter period of jitter between vsync and the nominal period
+            if(f.period_start_us && now + f.period_us / 4 < f.period_start_us + f.period_us)
+            {
+                continue;
+            }
+
+            if(f.period_start_us && !f.completed)
+            {
+                f.misses++;
+            }
+            f.periods++;
+            f.period_start_us = now;
+            f.used_us = 0;
+            f.completed = false;
+
+            if(!f.boosted && f.normal_priority < frame_boost_priority)
+            {
+                f.boosted = true;
+                to_boost[n_boost++] = frame_threads[i];
+            }
+        }
+    }
+
+    for(unsigned int i = 0; i < n_boost; i++)
+    {
+        ChangePriority(to_boost[i], to_boost[i]->frame.normal_priority, frame_boost_priority);
+    }
+}
+
+void Scheduler::FrameComplete(Thread *t)
+{
+    if(!t || !t->frame.budget_us)
+    {
+        return;
+    }
+
+    bool demote = false;
+    {
+        CriticalGuard cg(sl_frame);
+        t->frame.completed = true;
+        if(t->frame.boosted)
+        {
+            t->frame.boosted = false;
+            demote = true;
+        }
+    }
+
+    // frame submitted - let background work have the rest of the period
+    if(demote)
+    {
+        auto pt = t->rq_self.lock();
+        if(pt)
+        {
+            ChangePriority(pt, frame_boost_priority, t->frame.normal_priority);
+        }
+    }
+}
+
+std::pair<uint64_t, uint64_t> Scheduler::GetFrameStats(PThread t)
+{
+    CriticalGuard cg(sl_frame);
+    return std::make_pair(t->frame.periods, t->frame.misses);
 }
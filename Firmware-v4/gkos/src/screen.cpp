@@ -187,12 +187,10 @@ void init_screen()
                     klog("screen: l1 unable to allocate kernel buffer\n");
                     while(true);
                 }
-                for(uintptr_t offset = 0; offset < scr_layer_size_bytes; offset += VBLOCK_64k)
-                {
-                    vmem_map(l1_priv[buf].data_start() + offset,
-                        scrs[layer].pm[buf].base + offset, false, true, false, ~0ULL, ~0ULL,
-                        nullptr, MT_NORMAL_WT);
-                }
+                // all of the buddy block, so that whole 2 MiB runs get the contiguous hint
+                vmem_map_range(l1_priv[buf].data_start(), scrs[layer].pm[buf].base,
+                    std::min<uint64_t>(scrs[layer].pm[buf].length, l1_priv[buf].data_length()),
+                    false, true, false, ~0ULL, ~0ULL, MT_NORMAL_WT);
             }
         }
     }
@@ -440,6 +438,8 @@ uintptr_t screen_update()
     auto layer = p->screen.screen_layer;
     auto buf = scrs[layer].update();
     fpsc[layer].Tick();
+    cg.unlock();
+    sched.FrameComplete(GetCurrentThreadForCore());
     return screen_buf_to_vaddr(layer, buf);
 }
 
@@ -458,6 +458,7 @@ int syscall_screenflip(unsigned int layer, unsigned int alpha, int *_errno)
     }
     auto buf = scrs[layer].update(alpha);
     fpsc[layer].Tick();
+    sched.FrameComplete(GetCurrentThreadForCore());
     return buf;
 }
 
@@ -902,6 +903,7 @@ void LTDC_IRQHandler()
         LTDC_VMEM->SRCR = LTDC_SRCR_IMR;
 
         scr_vsync.Signal();
+        sched.FrameTick();
     }
 
     if(LTDC_VMEM->ISR & LTDC_ISR_RRIF)
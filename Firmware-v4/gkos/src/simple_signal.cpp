@@ -1,7 +1,6 @@
 #include "osmutex.h"
 #include "clocks.h"
 #include "thread.h"
-#include "ipi.h"
 #include "scheduler.h"
 #include "gk_conf.h"
 
@@ -74,7 +73,6 @@ void SimpleSignal::Signal(SignalOperation op, uint32_t val)
     if(pwt)
     {
         pwt->blocking.unblock();
-        signal_thread_woken(pwt);
     }
 }
 
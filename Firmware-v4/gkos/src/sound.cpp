@@ -499,6 +499,8 @@ int syscall_audiosetmodeex(int nchan, int nbits, int freq, size_t buf_size_bytes
         {
             CriticalGuard cg2(p->owned_pages.sl);
             p->owned_pages.add(ac.p_sound);
+            // read by the audio DMA for the life of the process
+            p->owned_pages.pin(ac.p_sound.base);
         }
         if(ac.mr_sound.base >= UH_START)
         {
@@ -1,5 +1,19 @@
 #include "gk_conf.h"
 
+// count an event in fp_stats[core] (see FPTrap_Handler), uses x8-x9
+.macro fp_count off
+#if GK_ENABLE_SCHED_DUMP
+    mrs x8, mpidr_el1
+    and x8, x8, #0xff
+    adrp x9, fp_stats
+    add x9, x9, :lo12:fp_stats
+    add x9, x9, x8, lsl #5
+    ldr x8, [x9, #\off]
+    add x8, x8, #1
+    str x8, [x9, #\off]
+#endif
+.endm
+
 .section .text.TaskSwitch
 .global TaskSwitch
 .type TaskSwitch,%function
@@ -9,6 +23,7 @@ TaskSwitch:
     cmp x0, x1
     b.eq 4f             // if the same thread then do nothing
     cbz x1, 1f          // if zero in tpidr_el1 this is the first switch - don't save anything
+    fp_count 0
 
     /* At this point we have saved on the stack:
         x0-x18
@@ -23,7 +38,7 @@ TaskSwitch:
         sp_el1
         ttbr0_el1
         tpidr_el0
-        q8-15
+        q8-15, fpcr, fpsr (if in use)
     */
 
     // save registers to [x1]
@@ -38,15 +53,43 @@ TaskSwitch:
     mrs x2, ttbr0_el1
     str x2, [x1, #96]
 
-    /* store FPU regs.  We don't use lazy save/restore here as
-        it makes it more difficult to migrate a thread to the
-        other core.  We could use eager save/lazy restore but
-        other OSs have stopped doing this due to the high use
-        of vectorization code in user space libraries. */
+    /* store FPU regs.  These are saved eagerly, so a thread can be picked up by
+        the other core without needing anything from this one, but only if the
+        thread can have changed them since they were last saved or restored:
+        anything interrupted at EL1 may be part way through kernel (newlib) FP code,
+        and an EL0 thread only if cpacr_el1 let it at the FP/SIMD unit during this
+        timeslice.  Either way this core's registers then match the saved copy, so
+        record the thread as the core's fp_owner - if it comes back here before
+        anyone else loads theirs the restore (and trap) can be skipped. */
+    mrs x5, mpidr_el1
+    and x5, x5, #0xff
+    adrp x6, fp_owner
+    add x6, x6, :lo12:fp_owner
+    add x6, x6, x5, lsl #3  // &fp_owner[core]
+    add x5, x5, #1          // fp_flags[15:8] == core + 1 whose registers match
+
+    ldr x3, [sp, #176]      // spsr of the interrupted context
+    tst x3, #0xc            // M[3:2] != 0 - interrupted at EL1
+    b.ne 5f
+    mrs x3, cpacr_el1
+    ubfx x3, x3, #20, #2
+    cmp x3, #3              // FPEN == 0b11 - EL0 was not trapped
+    b.ne 1f
+5:
     stp q8, q9, [x1, #128]
     stp q10, q11, [x1, #160]
     stp q12, q13, [x1, #192]
     stp q14, q15, [x1, #224]
+    mrs x3, fpcr
+    mrs x4, fpsr
+    bfi x4, x3, #32, #32
+    str x4, [x1, #120]
+    ldr x2, [x1, #112]
+    orr x2, x2, #0x2        // THREAD_FP_SAVED
+    bfi x2, x5, #8, #8
+    str x2, [x1, #112]
+    str x1, [x6]
+    fp_count 8
 
 1:
     // load registers from [x0]
@@ -79,11 +122,51 @@ TaskSwitch:
     isb
 #endif
 
-    // restore fpu
+    /* restore fpu.  Nothing to do if this core's registers already hold the
+        thread's state.  Otherwise a thread resuming at EL1 needs it back now, but
+        one resuming at EL0 keeps EL0 FP/SIMD trapped, so FPTrap_Handler loads it
+        only if the thread actually uses FP during this timeslice. */
+    mrs x5, mpidr_el1
+    and x5, x5, #0xff
+    adrp x6, fp_owner
+    add x6, x6, :lo12:fp_owner
+    add x6, x6, x5, lsl #3  // &fp_owner[core]
+    add x5, x5, #1
+
+    ldr x2, [x0, #112]
+    mov x3, #(0x1 << 20)    // FPEN = 0b01, trap EL0 FP/SIMD
+    ldr x4, [x6]
+    cmp x4, x0
+    b.ne 5f
+    ubfx x4, x2, #8, #8
+    cmp x4, x5
+    b.ne 5f
+    tbz x2, #0, 6f          // live here - untrap if THREAD_FP_USED
+    mov x3, #(0x3 << 20)
+    b 6f
+5:
+    ldr x4, [sp, #176]      // spsr the thread resumes with
+    tst x4, #0xc
+    b.eq 6f                 // EL0 - leave it to FPTrap_Handler
+    str x0, [x6]            // EL1 code will use the registers, so they become ours
+    bfi x2, x5, #8, #8
+    str x2, [x0, #112]
+    tbz x2, #1, 7f          // THREAD_FP_SAVED
     ldp q8, q9, [x0, #128]
     ldp q10, q11, [x0, #160]
     ldp q12, q13, [x0, #192]
     ldp q14, q15, [x0, #224]
+    ldr x4, [x0, #120]
+    mov w7, w4
+    msr fpsr, x7
+    lsr x7, x4, #32
+    msr fpcr, x7
+    fp_count 16
+7:
+    tbz x2, #0, 6f          // THREAD_FP_USED
+    mov x3, #(0x3 << 20)
+6:
+    msr cpacr_el1, x3
 
     // set thread pointer
     msr tpidr_el1, x0
@@ -389,6 +389,22 @@ void SyscallHandler(syscall_no sno, void *r1, void *r2, void *r3, uintptr_t lr,
             }
             break;
 
+        case __syscall_futex_wait:
+            {
+                auto p = reinterpret_cast<__syscall_futex_wait_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_futex_wait(p->uaddr, p->val,
+                    p->clock_id, p->until, reinterpret_cast<int *>(r3));
+            }
+            break;
+
+        case __syscall_futex_wake:
+            {
+                auto p = reinterpret_cast<__syscall_futex_wake_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_futex_wake(p->uaddr, p->n,
+                    reinterpret_cast<int *>(r3));
+            }
+            break;
+
         case __syscall_getscreenmode:
             {
                 auto p = reinterpret_cast<__syscall_getscreenmode_params *>(r2);
@@ -476,6 +492,38 @@ void SyscallHandler(syscall_no sno, void *r1, void *r2, void *r3, uintptr_t lr,
             }
             break;
 
+        case __syscall_pthread_setaffinity_np:
+            {
+                auto p = reinterpret_cast<__syscall_pthread_setaffinity_np_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_pthread_setaffinity_np((pthread_t)(intptr_t)p->thread,
+                    p->cpusetsize, p->cpuset, reinterpret_cast<int *>(r3));
+            }
+            break;
+
+        case __syscall_pthread_getaffinity_np:
+            {
+                auto p = reinterpret_cast<__syscall_pthread_getaffinity_np_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_pthread_getaffinity_np((pthread_t)(intptr_t)p->thread,
+                    p->cpusetsize, p->cpuset, reinterpret_cast<int *>(r3));
+            }
+            break;
+
+        case __syscall_set_frame_pacing:
+            {
+                auto p = reinterpret_cast<__syscall_set_frame_pacing_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_set_frame_pacing((pthread_t)(intptr_t)p->thread,
+                    p->budget_us, p->period_us, reinterpret_cast<int *>(r3));
+            }
+            break;
+
+        case __syscall_get_frame_stats:
+            {
+                auto p = reinterpret_cast<__syscall_get_frame_stats_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_get_frame_stats((pthread_t)(intptr_t)p->thread,
+                    p->periods, p->misses, reinterpret_cast<int *>(r3));
+            }
+            break;
+
         case __syscall_get_pthread_dtors:
             {
                 auto p = reinterpret_cast<__syscall_get_pthread_dtors_params *>(r2);
@@ -774,6 +822,15 @@ void SyscallHandler(syscall_no sno, void *r1, void *r2, void *r3, uintptr_t lr,
             }
             break;
 
+        case __syscall_madvise:
+            {
+                ThreadDeletionPreventionGuard tdpg;
+                auto p = reinterpret_cast<__syscall_madvise_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_madvise(p->addr, p->len, p->advice,
+                    reinterpret_cast<int *>(r3));
+            }
+            break;
+
         case __syscall_getppid:
             {
                 auto pid = (int)(intptr_t)(r2);
@@ -1010,6 +1067,22 @@ void SyscallHandler(syscall_no sno, void *r1, void *r2, void *r3, uintptr_t lr,
             }
             break;
 
+        case __syscall_getprocessmemusage:
+            {
+                auto p = reinterpret_cast<__syscall_getprocessmemusage_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_getprocessmemusage(p->pid,
+                    p->usage, reinterpret_cast<int *>(r3));
+            }
+            break;
+
+        case __syscall_setprocessmemlimits:
+            {
+                auto p = reinterpret_cast<__syscall_setprocessmemlimits_params *>(r2);
+                *reinterpret_cast<int *>(r1) = syscall_setprocessmemlimits(p->pid,
+                    p->soft, p->hard, reinterpret_cast<int *>(r3));
+            }
+            break;
+
         case __syscall_setsupervisorvisibleex:
             {
                 auto p = reinterpret_cast<__syscall_setsupervisorvisibleex_params *>(r2);
@@ -697,6 +697,14 @@ int syscall_dmabuf_alloc(size_t len, int *_errno)
         return -1;
     }
 
+    auto p = GetCurrentPProcessForCore();
+    MemChargeGuard mcg(p.get());
+    if(!mcg.charge((len + PAGE_SIZE - 1) / PAGE_SIZE))
+    {
+        *_errno = ENOMEM;
+        return -1;
+    }
+
     auto pmb = Pmem.acquire(len);
     if(!pmb.valid)
     {
@@ -704,7 +712,6 @@ int syscall_dmabuf_alloc(size_t len, int *_errno)
         return -1;
     }
 
-    auto p = GetCurrentPProcessForCore();
     CriticalGuard cg(p->open_files.sl);
     auto fd = p->open_files.get_free_fildes();
     if(fd == -1)
@@ -718,7 +725,7 @@ int syscall_dmabuf_alloc(size_t len, int *_errno)
     cg.unlock();
 
     CriticalGuard cg2(p->owned_pages.sl);
-    p->owned_pages.add(pmb);
+    p->owned_pages.add(pmb, owned_page_kind::Gpu);
 
     return 0;
 }
@@ -0,0 +1,220 @@
+#include "syscalls_int.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "threadproclist.h"
+#include "vmem.h"
+#include "process.h"
+#include "osmutex.h"
+#include "futex.h"
+
+/* Futex-style wait/wake.  The kernel never interprets the futex word - userspace uses
+    it for the state of its mutexes, semaphores etc. and only calls in to sleep when
+    contended or to wake sleepers.  Waiters are matched on a futex_key (see futex.h). */
+
+/* Waiters are queued on their own Thread::futex node, so waiting needs no allocation
+    with the bucket lock held */
+struct futex_bucket
+{
+    Spinlock sl;
+    Thread *head = nullptr;
+    Thread *tail = nullptr;
+
+    void push_back(Thread *t)
+    {
+        auto &n = t->futex;
+        n.next = nullptr;
+        n.prev = tail;
+        if(tail)
+            tail->futex.next = t;
+        else
+            head = t;
+        tail = t;
+        n.queued = true;
+    }
+
+    void erase(Thread *t)
+    {
+        auto &n = t->futex;
+        if(n.prev)
+            n.prev->futex.next = n.next;
+        else
+            head = n.next;
+        if(n.next)
+            n.next->futex.prev = n.prev;
+        else
+            tail = n.prev;
+        n.next = nullptr;
+        n.prev = nullptr;
+        n.queued = false;
+    }
+};
+
+static constexpr unsigned int futex_bucket_bits = 6;
+static futex_bucket futex_buckets[1U << futex_bucket_bits];
+
+static futex_bucket &futex_get_bucket(const futex_key &key)
+{
+    auto h = ((key.addr >> 2) ^ ((uint64_t)key.pid << 40)) * 0x9e3779b97f4a7c15ULL;
+    return futex_buckets[h >> (64 - futex_bucket_bits)];
+}
+
+static uintptr_t futex_paddr(const uint32_t *uaddr)
+{
+    auto paddr = vmem_vaddr_to_paddr((uintptr_t)uaddr);
+    if(!paddr)
+    {
+        // not mapped yet - fault it in then try again
+        (void)*(volatile const uint32_t *)uaddr;
+        paddr = vmem_vaddr_to_paddr((uintptr_t)uaddr);
+    }
+    return paddr;
+}
+
+/* Also returns the process owning a private key's page, nullptr if none */
+static int futex_get_key(const uint32_t *uaddr, futex_key *key, Process **owner)
+{
+    *owner = nullptr;
+    auto p = GetCurrentProcessForCore();
+    if(p && p->user_mem && (uintptr_t)uaddr < LH_END)
+    {
+        MutexGuard mg(p->user_mem->m);
+        auto &mb = p->user_mem->vblocks.IsAllocated((uintptr_t)uaddr);
+        if(!mb.b.valid)
+            return -1;
+        if(!mb.pmem_is_shared && !mb.pmem_is_drm_object)
+        {
+            key->addr = (uintptr_t)uaddr;
+            key->pid = p->id;
+            *owner = p;
+            return 0;
+        }
+    }
+
+    key->addr = futex_paddr(uaddr);
+    key->pid = 0;
+    return key->addr ? 0 : -1;
+}
+
+int syscall_futex_wait(uint32_t *uaddr, uint32_t val, int clock_id, const timespec *until, int *_errno)
+{
+    ADDR_CHECK_STRUCT_R(uaddr);
+    if((uintptr_t)uaddr & 0x3)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    if(clock_id >= 0)
+        ADDR_CHECK_STRUCT_R(until);
+    auto tout = clock_id >= 0 ? kernel_time_from_timespec(until, clock_id) : kernel_time_invalid();
+
+    futex_key key;
+    Process *owner;
+    if(futex_get_key(uaddr, &key, &owner) != 0)
+    {
+        *_errno = EFAULT;
+        return -1;
+    }
+
+    auto t = GetCurrentThreadForCore();
+    auto &b = futex_get_bucket(key);
+    while(true)
+    {
+        auto paddr = owner ? futex_paddr(uaddr) : key.addr;
+        if(!paddr)
+        {
+            *_errno = EFAULT;
+            return -1;
+        }
+
+        CriticalGuard cg(b.sl);
+
+        /* A private page may have been swapped out or dropped since it was looked up,
+            and is pinned while it is read so that reclaim cannot free it meanwhile */
+        if(owner)
+        {
+            auto pinned = owner->PinUserPage((uintptr_t)uaddr);
+            if(pinned != paddr)
+            {
+                if(pinned)
+                    owner->UnpinUserPage(pinned);
+                continue;
+            }
+        }
+
+        /* Wakers update the word before taking the bucket lock, so checking it here
+            cannot miss a wakeup.  Read through the linear map so that a concurrent
+            munmap cannot fault us with the lock held. */
+        auto cur = __atomic_load_n((volatile uint32_t *)PMEM_TO_VMEM(paddr), __ATOMIC_ACQUIRE);
+        if(owner)
+            owner->UnpinUserPage(paddr);
+        if(cur != val)
+        {
+            *_errno = EAGAIN;
+            return -1;
+        }
+        if(clock_id == CLOCK_TRY_ONCE)
+        {
+            *_errno = ETIMEDOUT;
+            return -1;
+        }
+
+        t->futex.key = key;
+        b.push_back(t);
+        t->blocking.block((void *)&b, tout);
+        break;
+    }
+    Yield();
+
+    // still queued means we were not woken by futex_wake
+    {
+        CriticalGuard cg(b.sl);
+        if(!t->futex.queued)
+            return 0;
+        b.erase(t);
+    }
+    *_errno = (kernel_time_is_valid(tout) && clock_cur() >= tout) ? ETIMEDOUT : EINTR;
+    return -1;
+}
+
+int syscall_futex_wake(uint32_t *uaddr, int n, int *_errno)
+{
+    ADDR_CHECK_STRUCT_R(uaddr);
+    if((uintptr_t)uaddr & 0x3)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+
+    futex_key key;
+    Process *owner;
+    if(futex_get_key(uaddr, &key, &owner) != 0)
+    {
+        *_errno = EFAULT;
+        return -1;
+    }
+
+    auto &b = futex_get_bucket(key);
+    int nwoken = 0;
+
+    CriticalGuard cg(b.sl);
+    for(auto wt = b.head; wt && (n < 0 || nwoken < n);)
+    {
+        auto next = wt->futex.next;
+        if(wt->futex.key == key)
+        {
+            b.erase(wt);
+            wt->blocking.unblock();
+            nwoken++;
+        }
+        wt = next;
+    }
+    return nwoken;
+}
+
+void futex_cancel(Thread *t)
+{
+    auto &b = futex_get_bucket(t->futex.key);
+    CriticalGuard cg(b.sl);
+    if(t->futex.queued)
+        b.erase(t);
+}
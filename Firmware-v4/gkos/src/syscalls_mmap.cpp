@@ -4,6 +4,10 @@
 #include "vmem.h"
 #include "screen.h"
 #include "drifile.h"
+#include "madvise.h"
+#include "zram.h"
+
+#include <algorithm>
 
 int syscall_mmapv4(size_t len, void **retaddr, int is_sync,
     int is_read, int is_write, int is_exec, int fd, int is_fixed, size_t foffset, int *_errno)
@@ -234,3 +238,161 @@ int syscall_memdealloc(size_t len, const void *addr, int *_errno)
         return -1;
     }
 }
+
+/* Drop the pages of [start, end) within mb so that they are filled again on next access:
+    zeroed for anonymous memory, re-read (or shared from the page cache) for read-only
+    file mappings.  Anything else could lose data or is not ours to free.  Waiters on a
+    futex in the range are unaffected as private futexes are keyed on virtual address. */
+static int madvise_dontneed(Process &p, MemBlock &mb, uintptr_t start, uintptr_t end)
+{
+    if(mb.pmem_is_shared || mb.pmem_is_drm_object || !(mb.IsZeroFill() || (mb.f && !mb.b.write)))
+        return -1;
+
+    VMemBlock vb = InvalidVMemBlock();
+    vb.base = start;
+    vb.length = end - start;
+    vb.valid = true;
+    vmem_unmap(vb, p.user_mem->ttbr0, ~0ULL, true);
+    return 0;
+}
+
+/* Anonymous pages are made read-only and old rather than freed.  zram_reclaim treats
+    such pages as never written and drops them without compressing them, and reaches
+    them first as the clock hand is moved here.  A write before then takes a permission
+    fault that maps the page writeable again with its contents intact. */
+static int madvise_free(Process &p, MemBlock &mb, uintptr_t start, uintptr_t end)
+{
+#if GK_ENABLE_ZRAM
+    if(!mb.IsZeroFill() || !mb.IsSwapBacked() || mb.pmem_is_shared || mb.pmem_is_drm_object ||
+        mb.b.memory_type != MT_NORMAL || mb.b.exec)
+#endif
+    {
+        return madvise_dontneed(p, mb, start, end);
+    }
+
+#if GK_ENABLE_ZRAM
+    auto umem = p.user_mem.get();
+    for(auto vaddr = start; vaddr < end; vaddr += VBLOCK_64k)
+    {
+        auto ptep = vmem_get_pte_ptr(vaddr, umem->ttbr0);
+        if(!ptep)
+            continue;
+        auto pte = *ptep;
+
+        if(pte & PTE_SWAP)
+        {
+            // the compressed copy is no longer needed either
+            *ptep = 0;
+            zram_free(PTE_SWAP_SLOT(pte));
+            continue;
+        }
+        if((pte & DT_PAGE) != DT_PAGE || (pte & PAGE_CONTIGUOUS))
+            continue;
+        {
+            CriticalGuard cg(p.owned_pages.sl);
+            if(!p.owned_pages.p.contains(pte & PAGE_PADDR_MASK))
+                continue;
+        }
+
+        *ptep = (pte & ~(PAGE_PRIV_MASK | PAGE_ACCESS)) | (mb.b.user ? PAGE_USER_RO : PAGE_PRIV_RO);
+        vmem_invlpg(vaddr, umem->ttbr0);
+    }
+    umem->zram_clock = start;
+    return 0;
+#endif
+}
+
+int syscall_madvise(void *addr, size_t len, int advice, int *_errno)
+{
+    auto start = (uintptr_t)addr;
+    if(start & (PAGE_SIZE - 1))
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    len = (len + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+    auto end = start + len;
+    if(end < start || end > LH_END)
+    {
+        *_errno = ENOMEM;
+        return -1;
+    }
+
+    auto p = GetCurrentProcessForCore();
+    if(!p || !p->user_mem)
+    {
+        *_errno = EFAULT;
+        return -1;
+    }
+
+    auto hint = MemBlock::access_hint_t::Normal;
+    switch(advice)
+    {
+        case GK_MADV_NORMAL:
+            hint = MemBlock::access_hint_t::Normal;
+            break;
+        case GK_MADV_RANDOM:
+            hint = MemBlock::access_hint_t::Random;
+            break;
+        case GK_MADV_SEQUENTIAL:
+            hint = MemBlock::access_hint_t::Sequential;
+            break;
+        case GK_MADV_WILLNEED:
+            // advisory only, so a full queue is not an error
+            madvise_willneed(p->id, start, len);
+            return 0;
+        case GK_MADV_DONTNEED:
+        case GK_MADV_FREE:
+            break;
+        default:
+            *_errno = EINVAL;
+            return -1;
+    }
+
+    MutexGuard mg(p->user_mem->m);
+
+    /* Access hints apply to the whole of each block the range touches, as blocks cannot
+        be split.  As on other systems, any part of the range that is not mapped is an error
+        but the advice still applies to the rest. */
+    bool unmapped = false;
+    auto vaddr = start;
+    while(vaddr < end)
+    {
+        auto mb = p->user_mem->vblocks.NextFrom(vaddr);
+        if(!mb || mb->b.data_start() >= end)
+        {
+            unmapped = true;
+            break;
+        }
+        if(mb->b.data_start() > vaddr)
+            unmapped = true;
+
+        auto s = std::max<uintptr_t>(vaddr, mb->b.data_start());
+        auto e = std::min<uintptr_t>(end, mb->b.data_end());
+        if(s < e)
+        {
+            if(advice == GK_MADV_DONTNEED || advice == GK_MADV_FREE)
+            {
+                auto ret = (advice == GK_MADV_DONTNEED) ? madvise_dontneed(*p, *mb, s, e) :
+                    madvise_free(*p, *mb, s, e);
+                if(ret != 0)
+                {
+                    *_errno = EINVAL;
+                    return -1;
+                }
+            }
+            else
+            {
+                mb->access_hint = hint;
+            }
+        }
+        vaddr = mb->b.end();
+    }
+
+    if(unmapped)
+    {
+        *_errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include <sys/wait.h>
 #include "gk_conf.h"
 #include "supervisor.h"
+#include "zram.h"
 
 int syscall_proccreate(const char *fname, const proccreate_t *proc_info, pid_t *pid, int *_errno)
 {
@@ -506,3 +507,88 @@ int syscall_getprocessdata(pid_t pid, char *d, size_t len, int *_errno)
 
     return (int)len;
 }
+
+int syscall_getprocessmemusage(pid_t pid, gk_mem_usage *usage, int *_errno)
+{
+    auto pp = GetCurrentProcessForCore();
+    if(pp == nullptr || pid < 0)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    if((id_t)pid != pp->id && !is_parent_of(pid, pp->id))
+    {
+        *_errno = EPERM;
+        klog("syscall: invalid request for pid %d which is not a child of %d\n", pid, pp->id);
+        return -1;
+    }
+
+    auto p = ProcessList.Get(pid);
+    if(!p.v)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+
+    ADDR_CHECK_STRUCT_W(usage);
+
+    Process::owned_pages_t::usage_t u;
+    mem_limits_t l;
+    {
+        CriticalGuard cg(p.v->owned_pages.sl);
+        u = p.v->owned_pages.usage();
+        l = p.v->mem_limits;
+    }
+
+    usage->anon = u.anon * PAGE_SIZE;
+    usage->file = u.file * PAGE_SIZE;
+    usage->gpu = u.gpu * PAGE_SIZE;
+    usage->page_tables = u.pt * PAGE_SIZE;
+#if GK_ENABLE_ZRAM
+    usage->swap = zram_owner_pages(p.v->id) * PAGE_SIZE;
+#else
+    usage->swap = 0;
+#endif
+    usage->soft_limit = l.soft * PAGE_SIZE;
+    usage->hard_limit = l.hard * PAGE_SIZE;
+
+    return 0;
+}
+
+int syscall_setprocessmemlimits(pid_t pid, size_t soft, size_t hard, int *_errno)
+{
+    auto pp = GetCurrentProcessForCore();
+    if(pp == nullptr || pid < 0)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    if(hard && soft > hard)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+
+    // limits are set by the parent, a process may not lift its own unless privileged
+    if((id_t)pid == pp->id ? !pp->is_privileged : !is_parent_of(pid, pp->id))
+    {
+        *_errno = EPERM;
+        klog("syscall: invalid request to set limits for pid %d from %d\n", pid, pp->id);
+        return -1;
+    }
+
+    auto p = ProcessList.Get(pid);
+    if(!p.v)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+
+    CriticalGuard cg(p.v->owned_pages.sl);
+    p.v->mem_limits.soft = (soft + PAGE_SIZE - 1) / PAGE_SIZE;
+    p.v->mem_limits.hard = (hard + PAGE_SIZE - 1) / PAGE_SIZE;
+    p.v->mem_limits.soft_signalled = false;
+    p.v->mem_limits.hard_signalled = false;
+
+    return 0;
+}
@@ -619,7 +619,6 @@ int syscall_pthread_cond_timedwait(pthread_cond_t *cond,
             for(auto ttw : threads_to_wake)
             {
                 ttw->blocking.unblock();
-                signal_thread_woken(ttw);
             }
         }
     }
@@ -797,12 +796,7 @@ int syscall_set_thread_priority(pthread_t thread, int priority, int *_errno)
         return -1;
     }
     
-    if(priority == tthread->base_priority)
-        return 0;
-
-    auto from = tthread->base_priority;
-    
-    sched.ChangePriority(tthread, from, priority);
+    sched.SetBasePriority(tthread, priority);
 
     return 0;
 }
@@ -922,3 +916,106 @@ int syscall_setgoldenthread(pthread_t thread, int *_errno)
     sched.SetGoldenThread(t);
     return 0;
 }
+
+/* cpusets are a bitmask of cores in little endian byte order, as per cpu_set_t */
+int syscall_pthread_setaffinity_np(pthread_t thread, size_t cpusetsize, const void *cpuset, int *_errno)
+{
+    ADDR_CHECK_BUFFER_R(cpuset, cpusetsize);
+
+    auto t = GetCurrentThreadForCore();
+    auto tthread = thread ? ThreadList.Get(thread).v : GetCurrentPThreadForCore();
+    if(!tthread || tthread->p != t->p)
+    {
+        *_errno = ESRCH;
+        return -1;
+    }
+
+    uint32_t mask = 0;
+    auto cs = reinterpret_cast<const uint8_t *>(cpuset);
+    for(size_t i = 0; i < cpusetsize && i < sizeof(mask); i++)
+    {
+        mask |= (uint32_t)cs[i] << (i * 8);
+    }
+
+    if(sched.SetAffinity(tthread, mask) != 0)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int syscall_pthread_getaffinity_np(pthread_t thread, size_t cpusetsize, void *cpuset, int *_errno)
+{
+    ADDR_CHECK_BUFFER_W(cpuset, cpusetsize);
+
+    auto t = GetCurrentThreadForCore();
+    auto tthread = thread ? ThreadList.Get(thread).v : GetCurrentPThreadForCore();
+    if(!tthread || tthread->p != t->p)
+    {
+        *_errno = ESRCH;
+        return -1;
+    }
+    if(cpusetsize * 8 < sched.ncores)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+
+    auto mask = sched.GetAffinity(tthread);
+    auto cs = reinterpret_cast<uint8_t *>(cpuset);
+    for(size_t i = 0; i < cpusetsize; i++)
+    {
+        cs[i] = i < sizeof(mask) ? (uint8_t)(mask >> (i * 8)) : 0;
+    }
+    return 0;
+}
+
+int syscall_set_frame_pacing(pthread_t thread, unsigned int budget_us, unsigned int period_us, int *_errno)
+{
+    auto [ t, p ] = GetCurrentThreadProcessForCore();
+    auto tthread = thread ? ThreadList.Get(thread).v : GetCurrentPThreadForCore();
+    if(!tthread || tthread->p != t->p)
+    {
+        *_errno = ESRCH;
+        return -1;
+    }
+
+    // default to one frame at the process' screen refresh rate
+    if(budget_us && !period_us)
+    {
+        CriticalGuard cg(p->screen.sl);
+        period_us = 1000000U / std::max(p->screen.screen_refresh, 1U);
+    }
+
+    if(sched.SetFramePacing(tthread, budget_us, period_us) != 0)
+    {
+        *_errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int syscall_get_frame_stats(pthread_t thread, uint64_t *periods, uint64_t *misses, int *_errno)
+{
+    auto t = GetCurrentThreadForCore();
+    auto tthread = thread ? ThreadList.Get(thread).v : GetCurrentPThreadForCore();
+    if(!tthread || tthread->p != t->p)
+    {
+        *_errno = ESRCH;
+        return -1;
+    }
+
+    auto [ nperiods, nmisses ] = sched.GetFrameStats(tthread);
+    if(periods)
+    {
+        ADDR_CHECK_STRUCT_W(periods);
+        *periods = nperiods;
+    }
+    if(misses)
+    {
+        ADDR_CHECK_STRUCT_W(misses);
+        *misses = nmisses;
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "vmem.h"
 #include "threadproclist.h"
 #include "cleanup.h"
+#include "futex.h"
 
 void thread_stub(Thread::threadstart_t func, void *p)
 {
@@ -22,7 +23,8 @@ std::shared_ptr<Thread> Thread::Create(const std::string &name,
             void *p,
             bool is_priv, int priority,
             std::shared_ptr<Process> owning_process,
-            void *p2)
+            void *p2,
+            size_t kernel_stack_size)
 {
     auto t = ThreadList.Create();
 
@@ -40,20 +42,21 @@ std::shared_ptr<Thread> Thread::Create(const std::string &name,
     if(!owning_process->is_privileged)
         t->is_privileged = false;
 
-    // create a kernel stack for the thread
-    t->mr_kernel_thread = vblock_alloc(VBLOCK_4M, false, true, false, GUARD_BITS_64k, GUARD_BITS_64k);
-    if(!t->mr_kernel_thread.valid)
+    /* Create a kernel stack for the thread.  User threads only use theirs for syscalls and
+        exceptions, which grow it on entry (see kstack.h).  Kernel threads mostly run
+        without passing those checks so get a fixed size unless told otherwise. */
+    if(kernel_stack_size == 0)
+        kernel_stack_size = t->is_privileged ? GK_KSTACK_KERNEL : GK_KSTACK_INITIAL;
+    t->mr_kernel_thread = kstack_alloc(kernel_stack_size);
+    if(!t->mr_kernel_thread.vb.valid)
     {
         klog("thread_create: could not allocate kernel stack\n");
         return nullptr;
     }
-    klog("thread: %s kernel stack at %llx - %llx\n", name.c_str(), t->mr_kernel_thread.data_start(),
-        t->mr_kernel_thread.data_end());
+    klog("thread: %s kernel stack at %llx - %llx\n", name.c_str(), t->mr_kernel_thread.bottom,
+        t->mr_kernel_thread.top());
 
-    // ensure the entire kernel stack is allocated and mapped - page faults will try to use it
-    vmem_map(t->mr_kernel_thread, InvalidPMemBlock());
-    
-    auto kthread_ptr = (uint64_t *)(t->mr_kernel_thread.data_end());
+    auto kthread_ptr = (uint64_t *)(t->mr_kernel_thread.top());
 
     const uint64_t spsr_el1_return = 5; // el1 with el1 stack
     const uint64_t spsr_el0_return = 0; // el0 with el0 stack
@@ -102,6 +105,7 @@ std::shared_ptr<Thread> Thread::Create(const std::string &name,
         t->tss.sp_el0 = uthread_ptr;
 
         t->tss.ttbr0 = owning_process->user_mem->ttbr0;
+        t->asid = &owning_process->user_mem->asid;
 
         // userspace tls structure
         if(owning_process->vb_tls.valid)
@@ -170,7 +174,8 @@ int Thread::assume_user_thread_lower_half(PThread user_thread)
     if(lower_half_user_thread != 0)
         return -5;
     
-    tss.ttbr0 = user_thread->tss.ttbr0;
+    asid = user_thread->asid;
+    tss.ttbr0 = asid_ttbr0(asid, user_thread->tss.ttbr0);
     lower_half_user_thread = user_thread->id;
     uint64_t tcr_el1;
     __asm__ volatile(
@@ -205,6 +210,7 @@ int Thread::release_user_thread_lower_half()
         return -3;
 
     tss.ttbr0 = 0;
+    asid = nullptr;
     lower_half_user_thread = 0;
 
     uint64_t tcr_el1;
@@ -262,7 +268,6 @@ int Thread::Kill(id_t id, void *retval)
             *pt->join_thread_retval = retval;
         }
         jt->blocking.unblock();
-        signal_thread_woken(jt);
         pt->join_thread = 0;
     }
 
@@ -302,10 +307,18 @@ Thread::~Thread()
         }
     }
 
-    if(mr_kernel_thread.valid)
+    futex_cancel(this);
+
+    /* A later thread allocated at the same address must not be taken for the owner
+        of a core's FP registers.  Losing a race with a core switching in some other
+        thread just costs that thread a restore. */
+    for(auto &o : fp_owner)
     {
-        vblock_free(mr_kernel_thread, vblock, true);
+        if(o == this)
+            o = nullptr;
     }
+
+    kstack_free(mr_kernel_thread);
 }
 
 ThreadPrivilegeEscalationGuard::ThreadPrivilegeEscalationGuard()
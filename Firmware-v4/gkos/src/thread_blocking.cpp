@@ -1,6 +1,7 @@
 #include "thread.h"
 #include "clocks.h"
 #include "process.h"
+#include "scheduler.h"
 
 bool Thread::blocking_t::is_blocking(kernel_time *tout, PThread *bt)
 {
@@ -24,7 +25,7 @@ bool Thread::blocking_t::is_blocking(kernel_time *tout, PThread *bt)
         b_queue = nullptr;
         b_barrier = nullptr;
 #else
-        b_prim = true;
+        b_prim = false;
 #endif
         return false;
     }
@@ -49,6 +50,34 @@ bool Thread::blocking_t::is_blocking(kernel_time *tout, PThread *bt)
     return isb;
 }
 
+bool Thread::blocking_t::is_blocking_nolock(kernel_time *tout, bool *on_thread) const
+{
+    auto until = b_until;
+    if(kernel_time_is_valid(until) && until <= clock_cur())
+    {
+        return false;
+    }
+    auto isb = b_indefinite ||
+        kernel_time_is_valid(until) ||
+        b_thread ||
+#if GK_DEBUG_BLOCKING
+        b_condition ||
+        b_ss ||
+        b_uss ||
+        b_rwl ||
+        b_queue ||
+        b_barrier;
+#else
+        b_prim;
+#endif
+    if(isb)
+    {
+        if(tout) *tout = until;
+        if(on_thread) *on_thread = b_thread != 0;
+    }
+    return isb;
+}
+
 void Thread::blocking_t::unblock()
 {
     CriticalGuard cg(sl);
@@ -65,6 +94,10 @@ void Thread::blocking_t::unblock()
 #else
     b_prim = false;
 #endif
+    cg.unlock();
+
+    // put back on the run queue if the scheduler has already switched us out
+    sched.Wake(parent);
 }
 
 void Thread::blocking_t::block(PThread t, kernel_time tout)
@@ -1,6 +1,5 @@
 #include "osmutex.h"
 #include "scheduler.h"
-#include "ipi.h"
 
 bool UserspaceSemaphore::try_wait(int *reason, bool block, kernel_time tout)
 {
@@ -36,7 +35,6 @@ void UserspaceSemaphore::post(int n, bool add)
             if(pwt)
             {
                 pwt->blocking.unblock();
-                signal_thread_woken(pwt);
             }
         }
         waiting_threads.clear();
@@ -1,12 +1,15 @@
 #include "vblock.h"
-#include "pmem.h"
 #include "util.h"
+#if !__GK_UNIT_TEST__
 #include "pmem.h"
 #include "vmem.h"
 #include "logger.h"
 #include "osspinlock.h"
 #include "process.h"
 #include "thread.h"
+#else
+#include "unit_test.h"
+#endif
 
 /* This is a custom buddy implementation with three levels (512 MiB, 4 MiB, 64 kiB) to support upper half
     paging for gkos.
@@ -31,6 +34,12 @@
     At each level we store -
      - number of free pages/sublevels
      - most recently accessed page/sublevel
+     - summary bitmaps of which entries are free, and which point to a sublevel
+        with a free entry of each smaller size
+
+    The bitmaps mean finding a free block of any size is a few ctz operations
+    (searching onwards from the most recently accessed entry) rather than a scan
+    of every level that grows as the space fragments.
 */
 
 #define VBLOCK_START    0xffffff0000000000ULL
@@ -52,6 +61,8 @@ struct level2
     uint64_t free_count;
     uint64_t last_accessed_block;
     uint64_t last_accessed_buddy;
+    summary_bitmap<LEVEL2_COUNT> free_map;       // free 4 MiB entries
+    summary_bitmap<LEVEL2_COUNT> has_64k;        // level3 pointers with a free entry
     uint64_t b[LEVEL2_COUNT];
 };
 
@@ -59,6 +70,7 @@ struct level3
 {
     uint64_t free_count;
     uint64_t last_accessed_block;
+    summary_bitmap<LEVEL3_COUNT> free_map;
     uint64_t b[LEVEL3_COUNT];
 };
 
@@ -106,6 +118,7 @@ VMemBlock vblock_alloc_fixed(size_t size, uintptr_t addr, bool user, bool write,
         ret.lower_guard = lower_guard;
     }
 
+#if !__GK_UNIT_TEST__
     if(map)
     {
         auto p = GetCurrentProcessForCore();
@@ -134,6 +147,7 @@ VMemBlock vblock_alloc_fixed(size_t size, uintptr_t addr, bool user, bool write,
             }
         }
     }
+#endif
     return ret;
 }
 
@@ -160,10 +174,12 @@ int vblock_free(VMemBlock &v, VBlock &vb, bool unmap)
 
     if(!freed)
         return -1;
+#if !__GK_UNIT_TEST__
     if(unmap)
     {
         return vmem_unmap(v);
     }
+#endif
     return 0;
 }
 
@@ -182,10 +198,16 @@ void VBlock::init(uintptr_t _base, unsigned int free_pages, unsigned int _level1
         return;
     }
 
+    l1_free.reset();
+    l1_has_4M.reset();
+    l1_has_64k.reset();
     for(auto i = 0U; i < level1_count; i++)
     {
         if(i < free_pages)
+        {
             level1[i] = VBLOCK_BLOCK_FREE;
+            l1_free.set(i);
+        }
         else
             level1[i] = VBLOCK_UNAVAIL;
     }
@@ -255,13 +277,10 @@ size_t VBlock::GetFreeLevel1Index()
     if(level1_free == 0)
         return VBLOCK_UNAVAIL;
 
-    // loop offset from last accessed
-    for(size_t i = 0U; i < level1_count; i++)
-    {
-        auto idx = (i + level1_last_accessed_block) % level1_count;
-        if(level1[idx] == VBLOCK_BLOCK_FREE)
-            return idx;
-    }
+    // search onwards from last accessed
+    auto idx = l1_free.find_from(level1_last_accessed_block);
+    if(idx < level1_count)
+        return idx;
 
     // shouldn't get here
     klog("vblock: level1 free counter inaccurate\n");
@@ -273,12 +292,9 @@ size_t VBlock::GetFreeLevel2Index(size_t l1_idx)
 {
     auto l2 = (level2 *)level1[l1_idx];
 
-    for(size_t i = 0U; i < LEVEL2_COUNT; i++)
-    {
-        auto idx = (i + l2->last_accessed_block) % LEVEL2_COUNT;
-        if(l2->b[idx] == VBLOCK_BLOCK_FREE)
-            return idx;
-    }
+    auto idx = l2->free_map.find_from(l2->last_accessed_block);
+    if(idx < LEVEL2_COUNT)
+        return idx;
 
     // shouldn't get here
     klog("vblock: level2 free counter inaccurate\n");
@@ -291,12 +307,9 @@ size_t VBlock::GetFreeLevel3Index(size_t l1_idx, size_t l2_idx)
     auto l2 = (level2 *)level1[l1_idx];
     auto l3 = (level3 *)l2->b[l2_idx];
 
-    for(size_t i = 0U; i < LEVEL3_COUNT; i++)
-    {
-        auto idx = (i + l3->last_accessed_block) % LEVEL3_COUNT;
-        if(l3->b[idx] == VBLOCK_BLOCK_FREE)
-            return idx;
-    }
+    auto idx = l3->free_map.find_from(l3->last_accessed_block);
+    if(idx < LEVEL3_COUNT)
+        return idx;
 
     // shouldn't get here
     klog("vblock: level3 free counter inaccurate\n");
@@ -306,55 +319,46 @@ size_t VBlock::GetFreeLevel3Index(size_t l1_idx, size_t l2_idx)
 
 size_t VBlock::GetLevel1IndexToNotFullLevel2()
 {
-    // loop offset from last accessed
-    for(size_t i = 0U; i < level1_count; i++)
-    {
-        auto idx = (i + level1_last_accessed_pointer) % level1_count;
-        if(!(level1[idx] & VBLOCK_BLOCK_ALLOC) && level1[idx] != VBLOCK_UNAVAIL &&
-            level1[idx] != VBLOCK_BLOCK_FREE)
-        {
-            // potentially available
-            auto l2 = (level2 *)level1[idx];
-            if(l2->free_count > 0)
-                return idx;
-        }
-    }
+    auto idx = l1_has_4M.find_from(level1_last_accessed_pointer);
+    if(idx < level1_count)
+        return idx;
     return VBLOCK_UNAVAIL;
 }
 
 std::pair<size_t, size_t> VBlock::GetLevel12IndexToNotFullLevel3()
 {
-    // loop offset from last accessed
-    for(size_t i = 0U; i < level1_count; i++)
+    size_t idx = l1_has_64k.find_from(level1_last_accessed_pointer);
+    if(idx < level1_count)
     {
-        auto idx = (i + level1_last_accessed_pointer) % level1_count;
-        if(!(level1[idx] & VBLOCK_BLOCK_ALLOC) && level1[idx] != VBLOCK_UNAVAIL &&
-            level1[idx] != VBLOCK_BLOCK_FREE)
-        {
-            // potentially available
-            auto l2 = (level2 *)level1[idx];
-
-            for(size_t j = 0; j < LEVEL2_COUNT; j++)
-            {
-                auto idx2 = (j + l2->last_accessed_buddy) % LEVEL2_COUNT;
-                if(!(l2->b[idx2] & VBLOCK_BLOCK_ALLOC) && l2->b[idx2] != VBLOCK_UNAVAIL &&
-                    l2->b[idx2] != VBLOCK_BLOCK_FREE)
-                {
-                    // potentially available
-                    auto l3 = (level3 *)l2->b[idx2];
+        auto l2 = (level2 *)level1[idx];
+        auto idx2 = l2->has_64k.find_from(l2->last_accessed_buddy);
+        if(idx2 < LEVEL2_COUNT)
+            return std::make_pair(idx, idx2);
 
-                    if(l3->free_count > 0)
-                        return std::make_pair(idx, idx2);
-                }
-            }
-        }
+        klog("vblock: level2 summary inaccurate\n");
     }
 
     // if this far then no free level 3 buddies, get a spare level 2 instead
-    auto idx = GetLevel1IndexToNotFullLevel2();
+    idx = GetLevel1IndexToNotFullLevel2();
     return std::make_pair(idx, VBLOCK_UNAVAIL);
 }
 
+/* Keep the level 1 summaries in step with a level 2 after any of its entries change */
+void VBlock::Level2Changed(size_t l1_idx)
+{
+    auto l2 = (level2 *)level1[l1_idx];
+    l1_has_4M.set(l1_idx, l2->free_count > 0);
+    l1_has_64k.set(l1_idx, l2->has_64k.any());
+}
+
+void VBlock::Level3Changed(size_t l1_idx, size_t l2_idx)
+{
+    auto l2 = (level2 *)level1[l1_idx];
+    auto l3 = (level3 *)l2->b[l2_idx];
+    l2->has_64k.set(l2_idx, l3->free_count > 0);
+    Level2Changed(l1_idx);
+}
+
 VMemBlock VBlock::AllocLevel1(uint32_t tag)
 {
     CriticalGuard cg(sl);
@@ -365,6 +369,7 @@ VMemBlock VBlock::AllocLevel1(uint32_t tag)
     }
     level1[idx] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     level1_free--;
+    l1_free.clear(idx);
     level1_last_accessed_block = idx + 1;
 
 #if DEBUG_VBLOCK
@@ -392,6 +397,7 @@ VMemBlock VBlock::AllocFixedLevel1(uintptr_t addr, uint32_t tag)
 
     level1[idx] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     level1_free--;
+    l1_free.clear(idx);
     level1_last_accessed_block = idx + 1;
 
 #if DEBUG_VBLOCK
@@ -419,6 +425,7 @@ VMemBlock VBlock::AllocFixedLevel2(uintptr_t addr, uint32_t tag)
     {
         level1[idx] = PmemAllocLevel2();
         level1_free--;
+        l1_free.clear(idx);
     }
 
     auto idx2 = (addr % VBLOCK_512M) / VBLOCK_4M;
@@ -431,6 +438,8 @@ VMemBlock VBlock::AllocFixedLevel2(uintptr_t addr, uint32_t tag)
 
     l2->b[idx2] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     l2->free_count--;
+    l2->free_map.clear(idx2);
+    Level2Changed(idx);
     l2->last_accessed_block = idx2 + 1;
     level1_last_accessed_pointer = idx;
 
@@ -470,6 +479,7 @@ VMemBlock VBlock::AllocLevel2(uint32_t tag)
         level1[idx] = l2_pmem;
 
         level1_free--;
+        l1_free.clear(idx);
     }
     else
     {
@@ -484,6 +494,8 @@ VMemBlock VBlock::AllocLevel2(uint32_t tag)
     auto l2 = (level2 *)l2_pmem;
     l2->b[idx2] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     l2->free_count--;
+    l2->free_map.clear(idx2);
+    Level2Changed(idx);
     l2->last_accessed_block = idx2 + 1;
     level1_last_accessed_pointer = idx;
 
@@ -515,6 +527,7 @@ VMemBlock VBlock::AllocFixedLevel3(uintptr_t addr, uint32_t tag)
     {
         level1[idx] = PmemAllocLevel2();
         level1_free--;
+        l1_free.clear(idx);
     }
 
     auto idx2 = (addr % VBLOCK_512M) / VBLOCK_4M;
@@ -528,6 +541,7 @@ VMemBlock VBlock::AllocFixedLevel3(uintptr_t addr, uint32_t tag)
     {
         l2->b[idx2] = PmemAllocLevel3();
         l2->free_count--;
+        l2->free_map.clear(idx2);
     }
 
     auto idx3 = (addr % VBLOCK_4M) / VBLOCK_64k;
@@ -539,6 +553,8 @@ VMemBlock VBlock::AllocFixedLevel3(uintptr_t addr, uint32_t tag)
 
     l3->b[idx3] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     l3->free_count--;
+    l3->free_map.clear(idx3);
+    Level3Changed(idx, idx2);
     l3->last_accessed_block = idx3 + 1;
     level1_last_accessed_pointer = idx;
     l2->last_accessed_buddy = idx2;
@@ -581,6 +597,7 @@ VMemBlock VBlock::AllocLevel3(uint32_t tag)
         level1[idx] = l2_pmem;
 
         level1_free--;
+        l1_free.clear(idx);
     }
     else
     {
@@ -604,6 +621,7 @@ VMemBlock VBlock::AllocLevel3(uint32_t tag)
         l2->b[idx2] = l3_pmem;
 
         l2->free_count--;
+        l2->free_map.clear(idx2);
     }
     else
     {
@@ -611,7 +629,7 @@ VMemBlock VBlock::AllocLevel3(uint32_t tag)
     }
 
     auto idx3 = GetFreeLevel3Index(idx, idx2);
-    if(idx2 == VBLOCK_UNAVAIL)
+    if(idx3 == VBLOCK_UNAVAIL)
     {
         klog("vblock: expected available level3 buddy but none available\n");
         return InvalidVMemBlock();
@@ -620,6 +638,8 @@ VMemBlock VBlock::AllocLevel3(uint32_t tag)
     auto l3 = (level3 *)l3_pmem;
     l3->b[idx3] = VBLOCK_BLOCK_ALLOC | ((uint64_t)tag << 32);
     l3->free_count--;
+    l3->free_map.clear(idx3);
+    Level3Changed(idx, idx2);
     l3->last_accessed_block = idx3 + 1;
     level1_last_accessed_pointer = idx;
     l2->last_accessed_buddy = idx2;
@@ -659,8 +679,13 @@ uint64_t VBlock::PmemAllocLevel2()
     l2->free_count = LEVEL2_COUNT;
     l2->last_accessed_block = 0;
     l2->last_accessed_buddy = 0;
+    l2->free_map.reset();
+    l2->has_64k.reset();
     for(auto i = 0U; i < LEVEL2_COUNT; i++)
+    {
         l2->b[i] = VBLOCK_BLOCK_FREE;
+        l2->free_map.set(i);
+    }
     
     return ret;
 }
@@ -683,8 +708,12 @@ uint64_t VBlock::PmemAllocLevel3()
     auto l3 = (level3 *)ret;
     l3->free_count = LEVEL3_COUNT;
     l3->last_accessed_block = 0;
+    l3->free_map.reset();
     for(auto i = 0U; i < LEVEL3_COUNT; i++)
+    {
         l3->b[i] = VBLOCK_BLOCK_FREE;
+        l3->free_map.set(i);
+    }
     
     return ret;
 }
@@ -793,6 +822,8 @@ bool VBlock::FreeLevel1(VMemBlock &v)
     {
         // allocated
         level1[idx] = VBLOCK_BLOCK_FREE;
+        level1_free++;
+        l1_free.set(idx);
         v.valid = false;
         return true;
     }
@@ -824,6 +855,9 @@ bool VBlock::FreeLevel2(VMemBlock &v)
     if((l2->b[idx2] & VBLOCK_BLOCK_ALLOC_MASK) == VBLOCK_BLOCK_ALLOC)
     {
         l2->b[idx2] = VBLOCK_BLOCK_FREE;
+        l2->free_count++;
+        l2->free_map.set(idx2);
+        Level2Changed(idx);
         v.valid = false;
         return true;
     }
@@ -867,6 +901,9 @@ bool VBlock::FreeLevel3(VMemBlock &v)
     {
         // valid to free
         l3->b[idx3] = VBLOCK_BLOCK_FREE;
+        l3->free_count++;
+        l3->free_map.set(idx3);
+        Level3Changed(idx, idx2);
         v.valid = false;
         return true;
     }
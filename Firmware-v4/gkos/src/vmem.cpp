@@ -5,6 +5,9 @@
 #include "vblock.h"
 #include "scheduler.h"
 #include "process.h"
+#include "zram.h"
+
+#include <algorithm>
 
 static Spinlock sl_uh;
 
@@ -14,6 +17,14 @@ int vmem_map(const VMemBlock &vaddr, const PMemBlock &paddr, uintptr_t ttbr0, ui
 
     if(!vaddr.valid)
         return -1;
+
+    if(paddr.valid)
+    {
+        // allow Pmem < Vmem
+        auto len = std::min<uint64_t>(vaddr.data_length(), paddr.length & ~(VBLOCK_64k - 1));
+        return vmem_map_range(vaddr.data_start(), paddr.base, len, vaddr.user, vaddr.write, vaddr.exec,
+            ttbr0, ttbr1, vaddr.memory_type);
+    }
     
     while(ptr < vaddr.data_length())
     {
@@ -53,13 +64,19 @@ int vmem_map(const VMemBlock &vaddr, const PMemBlock &paddr, uintptr_t ttbr0, ui
 }
 
 static int vmem_map_int(uintptr_t vaddr, uintptr_t act_vaddr, uintptr_t paddr, bool user, bool write, bool exec, uintptr_t ttbr, uintptr_t *paddr_out = nullptr,
-    unsigned int memory_type = MT_NORMAL, bool is_global = false);
+    unsigned int memory_type = MT_NORMAL, bool is_global = false, Process *p = nullptr);
+static int vmem_map_range_int(uintptr_t vaddr, uintptr_t act_vaddr, uintptr_t paddr, size_t len,
+    bool user, bool write, bool exec, uintptr_t ttbr, unsigned int memory_type, bool is_global, Process *p);
 static int vmem_unmap_int(uintptr_t vaddr, uintptr_t len, uintptr_t ttbr, uintptr_t act_vaddr, bool release_page);
+static volatile uint64_t *vmem_get_pt(uintptr_t vaddr, uintptr_t act_vaddr, uintptr_t ttbr, Process *p);
+static uint64_t vmem_page_attr(bool user, bool write, bool exec, unsigned int memory_type, bool is_global);
+static void vmem_split_contiguous(volatile uint64_t *pt, uintptr_t l3_addr, uintptr_t act_vaddr);
+static volatile uint64_t *vmem_split_block(volatile uint64_t *pd, uintptr_t l2_addr, uintptr_t act_vaddr);
 static uintptr_t vmem_vaddr_to_paddr_int(uintptr_t vaddr, uintptr_t ttbr);
 static uint64_t vmem_get_pte_int(uintptr_t vaddr, uintptr_t ttbr);
 
 int vmem_map(uintptr_t vaddr, uintptr_t paddr, bool user, bool write, bool exec,
-    uintptr_t ttbr0, uintptr_t ttbr1, uintptr_t *paddr_out, unsigned int memory_type)
+    uintptr_t ttbr0, uintptr_t ttbr1, uintptr_t *paddr_out, unsigned int memory_type, Process *p)
 {
     uint64_t ttbr;
 
@@ -92,61 +109,39 @@ int vmem_map(uintptr_t vaddr, uintptr_t paddr, bool user, bool write, bool exec,
             ttbr = ttbr0;
         }
 
+        if(!p)
+            p = GetCurrentProcessForCore();
+
         // no lock here - already done in calling function
-        return vmem_map_int(vaddr, vaddr, paddr, user, write, exec, ttbr, paddr_out, memory_type, false);
+        return vmem_map_int(vaddr, vaddr, paddr, user, write, exec, ttbr, paddr_out, memory_type, false, p);
     }
 }
 
 static int vmem_map_int(uintptr_t vaddr, uintptr_t act_vaddr,
     uintptr_t paddr, bool user, bool write, bool exec, uintptr_t ttbr,
-    uintptr_t *paddr_out, unsigned int memory_type, bool is_global)
+    uintptr_t *paddr_out, unsigned int memory_type, bool is_global, Process *p)
 {
-    auto l2_addr = (vaddr >> 29) & 0x1fffULL;
     auto l3_addr = (vaddr >> 16) & 0x1fffULL;
 
-    auto p = GetCurrentProcessForCore();
-
-    auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr & 0xffffffffffffULL);
-    volatile uint64_t *pt;
-    if((pd[l2_addr] & 0x1) == 0)
-    {
-        // need to map pt
-
-        auto pt_be = Pmem.acquire(VBLOCK_64k);
-        if(!pt_be.valid)
-        {
-            klog("OOM\n");
-            return -1;
-        }
-
-        if(act_vaddr < UH_START && p)
-        {
-            p->owned_pages.add(pt_be);
-        }
-
-        auto pt_paddr = pt_be.base;
-        pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
-
-        quick_clear_64((void *)pt);
-
-        pd[l2_addr] = pt_paddr |
-            DT_PT |
-            PAGE_ACCESS;
-    }
-    else
-    {
-        auto pt_paddr = pd[l2_addr] & 0xffffffff0000ULL;
-        pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
-    }
+    auto pt = vmem_get_pt(vaddr, act_vaddr, ttbr, p);
+    if(!pt)
+        return -1;
 
     if(pt[l3_addr] & 0x1)
     {
         if(paddr == (pt[l3_addr] & PAGE_PADDR_MASK))
         {
             // its the same physical page - perhaps we are just changing permissions.
+            if(pt[l3_addr] & PAGE_CONTIGUOUS)
+                vmem_split_contiguous(pt, l3_addr, act_vaddr);
             pt[l3_addr] = 0;
             vmem_invlpg(act_vaddr, ttbr);
         }
+        else if(!paddr && act_vaddr >= UH_START)
+        {
+            // lazy map of a page that another core faulted in first
+            return 0;
+        }
         else
         {
             klog("vmem: trying to map already mapped page at %llx (new paddr: %llx, old paddr: %llx)\n",
@@ -179,6 +174,21 @@ static int vmem_map_int(uintptr_t vaddr, uintptr_t act_vaddr,
         paddr = paddr_be.base;
     }
 
+    pt[l3_addr] = (paddr & ~0xffffULL) | vmem_page_attr(user, write, exec, memory_type, is_global);
+
+    __asm__ volatile("dsb ish\n" ::: "memory");
+
+    if(paddr_out)
+        *paddr_out = paddr;
+
+//    klog("vmem: map vaddr %llx to paddr %llx %s%s%s%s\n",
+//        vaddr, paddr, user ? "U" : " ", write ? "W" : " ", exec ? "X" : " ", is_global ? "G" : " ");
+
+    return 0;
+}
+
+static uint64_t vmem_page_attr(bool user, bool write, bool exec, unsigned int memory_type, bool is_global)
+{
     uint64_t attr = PAGE_ACCESS | PAGE_INNER_SHAREABLE | DT_PAGE | PAGE_ATTR((uint64_t)memory_type);
     if(user)
     {
@@ -200,17 +210,268 @@ static int vmem_map_int(uintptr_t vaddr, uintptr_t act_vaddr,
     if(!is_global)
         attr |= PAGE_NG;
 
-    pt[l3_addr] = (paddr & ~0xffffULL) | attr;
+    return attr;
+}
+
+/* The level 3 table for vaddr, allocating it if needed or splitting a block mapping.
+    Lower half tables are owned by p. */
+static volatile uint64_t *vmem_get_pt(uintptr_t vaddr, uintptr_t act_vaddr, uintptr_t ttbr, Process *p)
+{
+    auto l2_addr = (vaddr >> 29) & 0x1fffULL;
+    auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr & 0xffffffffffffULL);
+
+    if((pd[l2_addr] & 0x3) == DT_BLOCK)
+    {
+        return vmem_split_block(pd, l2_addr, act_vaddr);
+    }
+    else if((pd[l2_addr] & 0x1) == 0)
+    {
+        // need to map pt
 
+        auto pt_be = Pmem.acquire(VBLOCK_64k);
+        if(!pt_be.valid)
+        {
+            klog("OOM\n");
+            return nullptr;
+        }
+
+        if(act_vaddr < UH_START && p)
+        {
+            p->owned_pages.add(pt_be, owned_page_kind::PageTable);
+        }
+
+        auto pt_paddr = pt_be.base;
+        auto pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
+
+        quick_clear_64((void *)pt);
+
+        pd[l2_addr] = pt_paddr |
+            DT_PT |
+            PAGE_ACCESS;
+        return pt;
+    }
+    else
+    {
+        auto pt_paddr = pd[l2_addr] & 0xffffffff0000ULL;
+        return (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
+    }
+}
+
+/* Clear the contiguous hint from the group containing l3_addr, so that part of it can be
+    changed.  The hint may only change with the entries invalid (break before make). */
+static void vmem_split_contiguous(volatile uint64_t *pt, uintptr_t l3_addr, uintptr_t act_vaddr)
+{
+    auto first = l3_addr & ~(VMEM_CONT_PAGES - 1ULL);
+    auto first_vaddr = (act_vaddr & ~(VMEM_CONT_PAGES * VBLOCK_64k - 1));
+    uint64_t ents[VMEM_CONT_PAGES];
+
+    for(unsigned int i = 0; i < VMEM_CONT_PAGES; i++)
+    {
+        ents[i] = pt[first + i];
+        pt[first + i] = 0;
+    }
+    __asm__ volatile("dsb ishst\n" ::: "memory");
+    for(unsigned int i = 0; i < VMEM_CONT_PAGES; i++)
+    {
+        __asm__ volatile("tlbi vaae1is, %[addr_enc]\n" : :
+            [addr_enc] "r" (((first_vaddr + i * VBLOCK_64k) >> 12) & 0xfffffffffffULL) : "memory");
+    }
+    __asm__ volatile("dsb ish\n" "isb\n" ::: "memory");
+    for(unsigned int i = 0; i < VMEM_CONT_PAGES; i++)
+    {
+        pt[first + i] = ents[i] & ~PAGE_CONTIGUOUS;
+    }
     __asm__ volatile("dsb ish\n" ::: "memory");
+}
 
-    if(paddr_out)
-        *paddr_out = paddr;
+/* Replace a 512 MiB block mapping with a table of the same pages, so that part of it can
+    be changed.  Upper half only. */
+static volatile uint64_t *vmem_split_block(volatile uint64_t *pd, uintptr_t l2_addr, uintptr_t act_vaddr)
+{
+    auto pt_be = Pmem.acquire(VBLOCK_64k);
+    if(!pt_be.valid)
+    {
+        klog("OOM\n");
+        return nullptr;
+    }
+    auto pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_be.base);
 
-//    klog("vmem: map vaddr %llx to paddr %llx %s%s%s%s\n",
-//        vaddr, paddr, user ? "U" : " ", write ? "W" : " ", exec ? "X" : " ", is_global ? "G" : " ");
+    auto blk = pd[l2_addr];
+    auto blk_paddr = blk & 0xffffe0000000ULL;
+    auto attr = (blk & ~0xffffe0000000ULL & ~0x3ULL) | DT_PAGE | PAGE_CONTIGUOUS;
+    for(uintptr_t i = 0; i < 0x2000ULL; i++)
+    {
+        pt[i] = (blk_paddr + i * VBLOCK_64k) | attr;
+    }
 
-    return 0;
+    // break before make
+    pd[l2_addr] = 0;
+    vmem_invlpg(act_vaddr & ~(VBLOCK_512M - 1), 0);
+    pd[l2_addr] = pt_be.base | DT_PT | PAGE_ACCESS;
+    __asm__ volatile("dsb ish\n" ::: "memory");
+
+    return pt;
+}
+
+int vmem_map_range(uintptr_t vaddr, uintptr_t paddr, size_t len, bool user, bool write, bool exec,
+    uintptr_t ttbr0, uintptr_t ttbr1, unsigned int memory_type, Process *p)
+{
+    uint64_t ttbr;
+
+    if(vaddr >= UH_START)
+    {
+        if(ttbr1 == ~0ULL)
+        {
+            __asm__ volatile("mrs %[ttbr], ttbr1_el1\n" : [ttbr] "=r" (ttbr) : : "memory");
+        }
+        else
+        {
+            ttbr = ttbr1;
+        }
+        vaddr -= UH_START;
+
+        {
+            CriticalGuard cg(sl_uh);
+            return vmem_map_range_int(vaddr, vaddr + UH_START, paddr, len, user, write, exec, ttbr,
+                memory_type, true, nullptr);
+        }
+    }
+    else
+    {
+        if(ttbr0 == ~0ULL)
+        {
+            klog("lower half address but ttbr0 not provided\n");
+            return -1;
+        }
+        else
+        {
+            ttbr = ttbr0;
+        }
+
+        if(!paddr)
+        {
+            klog("vmem_map_range: lower half without physical pages\n");
+            return -1;
+        }
+
+        if(!p)
+            p = GetCurrentProcessForCore();
+
+        // no lock here - already done in calling function
+        return vmem_map_range_int(vaddr, vaddr, paddr, len, user, write, exec, ttbr,
+            memory_type, false, p);
+    }
+}
+
+static int vmem_map_range_int(uintptr_t vaddr, uintptr_t act_vaddr, uintptr_t paddr, size_t len,
+    bool user, bool write, bool exec, uintptr_t ttbr, unsigned int memory_type, bool is_global,
+    Process *p)
+{
+    const uintptr_t cont_size = VMEM_CONT_PAGES * VBLOCK_64k;
+
+    vaddr &= ~(VBLOCK_64k - 1);
+    act_vaddr &= ~(VBLOCK_64k - 1);
+    auto npages = (len + VBLOCK_64k - 1) / VBLOCK_64k;
+    auto act_end = act_vaddr + npages * VBLOCK_64k;
+
+    auto attr = vmem_page_attr(user, write, exec, memory_type, is_global);
+
+    /* Large pages for the upper half only: lower half pages are remapped one at a time
+        by the page fault handler and zram */
+    bool can_cont = paddr && act_vaddr >= UH_START && ((act_vaddr ^ paddr) & (cont_size - 1)) == 0;
+    bool can_block = paddr && act_vaddr >= UH_START && ((act_vaddr ^ paddr) & (VBLOCK_512M - 1)) == 0;
+    auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr & 0xffffffffffffULL);
+
+    int ret = 0;
+    size_t done = 0;
+    while(done < npages)
+    {
+        // a whole, empty level 2 entry can be a single block
+        auto cur_vaddr = vaddr + done * VBLOCK_64k;
+        auto l2_addr = (cur_vaddr >> 29) & 0x1fffULL;
+        if(can_block && (cur_vaddr & (VBLOCK_512M - 1)) == 0 &&
+            (npages - done) * VBLOCK_64k >= VBLOCK_512M && pd[l2_addr] == 0)
+        {
+            pd[l2_addr] = ((paddr + done * VBLOCK_64k) & 0xffffe0000000ULL) |
+                (attr & ~0x3ULL) | DT_BLOCK;
+            done += VBLOCK_512M / VBLOCK_64k;
+            continue;
+        }
+
+        auto pt = vmem_get_pt(vaddr + done * VBLOCK_64k, act_vaddr, ttbr, p);
+        if(!pt)
+        {
+            ret = -1;
+            break;
+        }
+
+        // the rest of this table
+        auto l3_addr = ((vaddr + done * VBLOCK_64k) >> 16) & 0x1fffULL;
+        auto n = std::min<size_t>(npages - done, 0x2000ULL - l3_addr);
+
+        for(size_t i = 0; i < n; i++, done++)
+        {
+            auto cur_act_vaddr = act_vaddr + done * VBLOCK_64k;
+            uintptr_t cur_paddr;
+            if(paddr)
+            {
+                cur_paddr = paddr + done * VBLOCK_64k;
+            }
+            else
+            {
+                auto pb = Pmem.acquire(VBLOCK_64k);
+                if(!pb.valid)
+                {
+                    klog("OOM\n");
+                    ret = -1;
+                    break;
+                }
+                cur_paddr = pb.base;
+            }
+
+            auto old = pt[l3_addr + i];
+            if(old & 0x1)
+            {
+                if(cur_paddr != (old & PAGE_PADDR_MASK))
+                {
+                    klog("vmem: trying to map already mapped page at %llx (new paddr: %llx, old paddr: %llx)\n",
+                        cur_act_vaddr, cur_paddr, old & PAGE_PADDR_MASK);
+                    ret = -1;
+                    break;
+                }
+                // same physical page - changing permissions
+                if(old & PAGE_CONTIGUOUS)
+                    vmem_split_contiguous(pt, l3_addr + i, cur_act_vaddr);
+                pt[l3_addr + i] = 0;
+                vmem_invlpg(cur_act_vaddr, ttbr);
+            }
+
+            auto cur_attr = attr;
+            auto group = cur_act_vaddr & ~(cont_size - 1);
+            if(can_cont && group >= act_vaddr && group + cont_size <= act_end)
+                cur_attr |= PAGE_CONTIGUOUS;
+
+            pt[l3_addr + i] = (cur_paddr & ~0xffffULL) | cur_attr;
+        }
+        if(ret)
+            break;
+    }
+
+    __asm__ volatile("dsb ish\n" ::: "memory");
+
+    if(ret && can_cont)
+    {
+        // do not leave a partially filled contiguous group
+        auto group = (act_vaddr + done * VBLOCK_64k) & ~(cont_size - 1);
+        if(group >= act_vaddr && group + cont_size <= act_end)
+        {
+            auto pt = vmem_get_pt(vaddr + (group - act_vaddr), act_vaddr, ttbr, p);
+            if(pt)
+                vmem_split_contiguous(pt, ((vaddr + (group - act_vaddr)) >> 16) & 0x1fffULL, group);
+        }
+    }
+
+    return ret;
 }
 
 int vmem_unmap(const VMemBlock &_vaddr, uintptr_t ttbr0, uintptr_t ttbr1, bool release_page)
@@ -297,6 +558,22 @@ uint64_t vmem_get_pte(uintptr_t vaddr, uintptr_t ttbr0, uintptr_t ttbr1)
     }
 }
 
+volatile uint64_t *vmem_get_pte_ptr(uintptr_t vaddr, uintptr_t ttbr0)
+{
+    if(vaddr >= LH_END)
+        return nullptr;
+
+    auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr0 & PAGE_PADDR_MASK);
+    auto l2_addr = (vaddr >> 29) & 0x1fffULL;
+    auto pd_ent = pd[l2_addr];
+    if((pd_ent & 0x3) != 0x3)
+        return nullptr;
+
+    auto pt = (volatile uint64_t *)PMEM_TO_VMEM(pd_ent & 0xffffffff0000ULL);
+    auto l3_addr = (vaddr >> 16) & 0x1fffULL;
+    return &pt[l3_addr];
+}
+
 uintptr_t vmem_vaddr_to_paddr(uintptr_t vaddr, uintptr_t ttbr0, uintptr_t ttbr1)
 {
     if(vaddr >= UH_START)
@@ -342,6 +619,86 @@ uintptr_t vmem_vaddr_to_paddr(uintptr_t vaddr, uintptr_t ttbr0, uintptr_t ttbr1)
     }
 }
 
+/* Pages cleared from the page tables but possibly still held in a TLB.  They are
+    invalidated together, with one barrier for the batch, and only then released. */
+namespace {
+class unmap_batch
+{
+    public:
+        static constexpr unsigned int max_pages = 64;
+
+        unmap_batch(bool _release_page, bool _lower_half) :
+            release_page(_release_page), lower_half(_lower_half)
+        {
+            if(release_page && lower_half)
+            {
+                /* Ensure the ~Process() dtor cannot get called between Pmem.release and 
+                    removal from owned_pages */
+                p = GetCurrentPProcessForCore();
+            }
+        }
+
+        void add(uintptr_t vaddr, uintptr_t paddr)
+        {
+            if(n == max_pages)
+                flush();
+            vaddrs[n] = vaddr;
+            paddrs[n] = paddr;
+            n++;
+        }
+
+        void flush()
+        {
+            if(!n)
+                return;
+
+            __asm__ volatile("dsb ishst\n" ::: "memory");
+            for(unsigned int i = 0; i < n; i++)
+            {
+                __asm__ volatile("tlbi vaae1is, %[addr_enc]\n" : :
+                    [addr_enc] "r" ((vaddrs[i] >> 12) & 0xfffffffffffULL) : "memory");
+            }
+            __asm__ volatile("dsb ish\n" "isb\n" ::: "memory");
+
+            if(release_page)
+            {
+                for(unsigned int i = 0; i < n; i++)
+                {
+                    PMemBlock pb;
+                    pb.base = paddrs[i];
+                    pb.length = VBLOCK_64k;
+                    pb.valid = true;
+
+                    bool is_private = true;
+                    if(lower_half)
+                    {
+                        // shared (page cache) pages just lose this process's reference
+                        CriticalGuard cg(p->owned_pages.sl);
+                        is_private = p->owned_pages.release(pb);
+                    }
+
+                    if(is_private)
+                        Pmem.release(pb);
+                }
+            }
+            n = 0;
+        }
+
+        ~unmap_batch()
+        {
+            flush();
+        }
+
+    private:
+        uintptr_t vaddrs[max_pages];
+        uintptr_t paddrs[max_pages];
+        unsigned int n = 0;
+        bool release_page;
+        bool lower_half;
+        PProcess p;
+};
+}
+
 int vmem_unmap_int(uintptr_t vaddr, uintptr_t len, uintptr_t ttbr, uintptr_t act_vaddr, bool release_page)
 {
     auto end = vaddr + len;
@@ -351,61 +708,87 @@ int vmem_unmap_int(uintptr_t vaddr, uintptr_t len, uintptr_t ttbr, uintptr_t act
     act_vaddr &= ~(VBLOCK_64k - 1);
 
     auto vaddr_adjust = act_vaddr - vaddr;
+    auto start = vaddr;
+    unmap_batch batch(release_page, act_vaddr < UH_START);
 
+    auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr & PAGE_PADDR_MASK);
     while(vaddr < end)
     {
         // don't handle large pages here
         auto l2_addr = (vaddr >> 29) & 0x1fffULL;
         auto l3_addr = (vaddr >> 16) & 0x1fffULL;
 
-        auto pd = (volatile uint64_t *)PMEM_TO_VMEM(ttbr & PAGE_PADDR_MASK);
-        volatile uint64_t *pt;
-        if((pd[l2_addr] & DT_PT) == DT_PT)
-        {
-            auto pt_paddr = pd[l2_addr] & 0xffffffff0000ULL;
-            pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
+        // the rest of this table
+        auto table_end = std::min<uintptr_t>((vaddr | ((1ULL << 29) - 1)) + 1, end);
 
-            if((pt[l3_addr] & DT_PAGE) == DT_PAGE)
+        if((pd[l2_addr] & 0x3) == DT_BLOCK)
+        {
+            if((vaddr & (VBLOCK_512M - 1)) == 0 && table_end - vaddr == VBLOCK_512M)
             {
-                auto page = pt[l3_addr] & 0xffffffff0000ULL;
-
-                pt[l3_addr] = 0;
-
-                auto act_vpage = vaddr + vaddr_adjust;
-
-#if DEBUG_VMEM
-                klog("vmem_unmap: unmap page vaddr %llx paddr %llx\n", act_vpage, page);
-#endif
-
-                vmem_invlpg(act_vpage, ttbr);
-
+                // all of a block mapping
+                auto blk_paddr = pd[l2_addr] & 0xffffe0000000ULL;
+                pd[l2_addr] = 0;
+                batch.flush();
+                vmem_invlpg(vaddr + vaddr_adjust, ttbr);
                 if(release_page)
                 {
-                    /* Ensure the ~Process() dtor cannot get called between Pmem.release and 
-                        removal from owned_pages */
-                    PProcess p;
-                    if(act_vaddr < UH_START)
-                    {
-                        p = GetCurrentPProcessForCore();
-                    }
-
                     PMemBlock pb;
-                    pb.base = page;
-                    pb.length = VBLOCK_64k;
+                    pb.base = blk_paddr;
+                    pb.length = VBLOCK_512M;
                     pb.valid = true;
                     Pmem.release(pb);
+                }
+                vaddr = table_end;
+                continue;
+            }
+            if(!vmem_split_block(pd, l2_addr, vaddr + vaddr_adjust))
+                return -1;
+        }
+        if((pd[l2_addr] & DT_PT) != DT_PT)
+        {
+            // nothing mapped here
+            vaddr = table_end;
+            continue;
+        }
+
+        auto pt_paddr = pd[l2_addr] & 0xffffffff0000ULL;
+        auto pt = (volatile uint64_t *)PMEM_TO_VMEM(pt_paddr);
+
+        for(; vaddr < table_end; vaddr += VBLOCK_64k, l3_addr++)
+        {
+            auto pte = pt[l3_addr];
+            auto act_vpage = vaddr + vaddr_adjust;
 
-                    if(act_vaddr < UH_START)
+            if((pte & DT_PAGE) == DT_PAGE)
+            {
+                if(pte & PAGE_CONTIGUOUS)
+                {
+                    // only part of the group is going
+                    auto group = vaddr & ~(VMEM_CONT_PAGES * VBLOCK_64k - 1);
+                    if(group < start || group + VMEM_CONT_PAGES * VBLOCK_64k > end)
                     {
-                        CriticalGuard cg(p->owned_pages.sl);
-                        pb.valid = true;
-                        p->owned_pages.release(pb);
+                        vmem_split_contiguous(pt, l3_addr, act_vpage);
                     }
                 }
+
+                auto page = pte & 0xffffffff0000ULL;
+
+                pt[l3_addr] = 0;
+
+#if DEBUG_VMEM
+                klog("vmem_unmap: unmap page vaddr %llx paddr %llx\n", act_vpage, page);
+#endif
+
+                batch.add(act_vpage, page);
+            }
+            else if((pte & PTE_SWAP) && release_page && act_vaddr < UH_START)
+            {
+                // swapped out page - drop the compressed copy instead
+                auto slot = PTE_SWAP_SLOT(pte);
+                pt[l3_addr] = 0;
+                zram_free(slot);
             }
         }
-
-        vaddr += VBLOCK_64k;
     }
 
     return 0;
@@ -413,14 +796,18 @@ int vmem_unmap_int(uintptr_t vaddr, uintptr_t len, uintptr_t ttbr, uintptr_t act
 
 void vmem_invlpg(uintptr_t vaddr, uintptr_t ttbr)
 {
-    // All ttbr1 pages are marked as global, vae1s ignores the asid here and instead acts like vaae1s
+    /* All ttbr1 pages are marked as global.  Lower half ASIDs can be reassigned at
+        rollover (see asid.cpp) so rather than look up the current one we invalidate
+        the address for all ASIDs.  This needs to be broadcast as switching ttbr0 no
+        longer flushes the TLB, so the other core may still hold the old entry. */
+    (void)ttbr;
     __asm__ volatile(
-        "dsb ish\n"
-        "tlbi vae1, %[addr_enc]\n"
+        "dsb ishst\n"
+        "tlbi vaae1is, %[addr_enc]\n"
         "dsb ish\n"
         "isb\n"
         : :
-        [addr_enc] "r" ((vaddr >> 12) | (ttbr & 0xffff000000000000ULL))
+        [addr_enc] "r" ((vaddr >> 12) & 0xfffffffffffULL)
         : "memory"
     );
 }
@@ -164,6 +164,11 @@ _vtor_tbl_entry _lower32_serror
     # does not return here - can branch to TaskSwitchEnd
 
 2:
+    # EC 0x07 == trapped fp/simd access from EL0 (see switcher.s)
+    ubfx x2, x1, #26, #6
+    cmp x2, #0x07
+    b.eq 3f
+
     # continue as per irq_stub, ignore the option to be in EL3
     mrs x1, far_el1
     mov x2, \code
@@ -175,6 +180,38 @@ _vtor_tbl_entry _lower32_serror
  
     restore_regs
 
+    eret
+
+3:
+    # FPTrap_Handler deals with the frame copies of q0-7, q16-31 - do the rest
+    #  here, from the thread's saved state or zero for a first use
+    mov x0, sp
+    bl FPTrap_Handler
+    cbz x0, 4f
+    ldp q8, q9, [x0, #128]
+    ldp q10, q11, [x0, #160]
+    ldp q12, q13, [x0, #192]
+    ldp q14, q15, [x0, #224]
+    ldr x1, [x0, #120]
+    mov w2, w1
+    msr fpsr, x2
+    lsr x2, x1, #32
+    msr fpcr, x2
+    b 5f
+4:
+    movi v8.2d, #0
+    movi v9.2d, #0
+    movi v10.2d, #0
+    movi v11.2d, #0
+    movi v12.2d, #0
+    movi v13.2d, #0
+    movi v14.2d, #0
+    movi v15.2d, #0
+    msr fpcr, xzr
+    msr fpsr, xzr
+5:
+    restore_regs
+
     eret
 .endm
 
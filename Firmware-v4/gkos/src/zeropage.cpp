@@ -0,0 +1,96 @@
+#include "zeropage.h"
+#include "pmem.h"
+#include "vmem.h"
+#include "vblock.h"
+#include "osmutex.h"
+#include "cache.h"
+#include "gk_conf.h"
+
+#include <atomic>
+
+static Spinlock sl_zp;
+static uintptr_t zp_pool[GK_ZEROPAGE_POOL];
+static unsigned int zp_count = 0;
+
+static std::atomic<uint64_t> zp_hits = 0;
+static std::atomic<uint64_t> zp_misses = 0;
+static std::atomic<uint64_t> zp_filled = 0;
+
+PMemBlock zeropage_acquire()
+{
+    auto ret = InvalidPMemBlock();
+    {
+        CriticalGuard cg(sl_zp);
+        if(zp_count)
+        {
+            ret.base = zp_pool[--zp_count];
+            ret.length = VBLOCK_64k;
+            ret.valid = true;
+        }
+    }
+
+    if(ret.valid)
+        zp_hits++;
+    else
+        zp_misses++;
+    return ret;
+}
+
+bool zeropage_idle_fill()
+{
+    {
+        CriticalGuard cg(sl_zp);
+        if(zp_count >= GK_ZEROPAGE_POOL)
+            return false;
+    }
+
+    // don't hoard pages when memory is short
+    if(Pmem.get_free_space() < GK_ZEROPAGE_MIN_FREE)
+        return false;
+
+    auto pb = Pmem.acquire(VBLOCK_64k);
+    if(!pb.valid)
+        return false;
+
+    auto vaddr = PMEM_TO_VMEM(pb.base);
+    for(uint64_t ptr = 0; ptr < VBLOCK_64k; ptr += CACHE_LINE_SIZE)
+    {
+        __asm__ volatile("dc zva, %[addr]\n" : : [addr] "r" (vaddr + ptr) : "memory");
+    }
+    for(uint64_t ptr = 0; ptr < VBLOCK_64k; ptr += CACHE_LINE_SIZE)
+    {
+        __asm__ volatile("dc civac, %[addr]\n" : : [addr] "r" (vaddr + ptr) : "memory");
+    }
+    __asm__ volatile("dsb sy\n" ::: "memory");
+
+    {
+        CriticalGuard cg(sl_zp);
+        if(zp_count < GK_ZEROPAGE_POOL)
+        {
+            zp_pool[zp_count++] = pb.base;
+            pb.valid = false;
+        }
+    }
+
+    if(pb.valid)
+    {
+        // filled by the other core in the meantime
+        Pmem.release(pb);
+        return false;
+    }
+    zp_filled++;
+    return true;
+}
+
+zeropage_stats_t zeropage_stats()
+{
+    zeropage_stats_t ret;
+    ret.hits = zp_hits;
+    ret.misses = zp_misses;
+    ret.filled = zp_filled;
+    {
+        CriticalGuard cg(sl_zp);
+        ret.cur = zp_count;
+    }
+    return ret;
+}
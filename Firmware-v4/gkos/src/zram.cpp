@@ -0,0 +1,250 @@
+#include "zram.h"
+#include "lzpage.h"
+#include "pmem.h"
+#include "vmem.h"
+#include "process.h"
+#include "osspinlock.h"
+#include "gk_conf.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+static Spinlock sl_zram;
+static ZramStore zs;
+
+/* Slots are only loaded and freed by the owning process with its user_mem mutex held
+    (or once it has ended), so the data pointer can be used outside sl_zram */
+
+uint32_t zram_store_page(uintptr_t paddr, uint32_t owner)
+{
+    auto src = (const void *)PMEM_TO_VMEM(paddr);
+    void *buf = nullptr;
+    size_t clen = 0;
+    uint64_t fill = 0;
+
+    if(!lzpage_same_filled(src, PAGE_SIZE, &fill))
+    {
+        buf = malloc(ZramStore::max_stored);
+        if(buf)
+            clen = lzpage_compress(src, PAGE_SIZE, buf, ZramStore::max_stored);
+        if(!clen)
+        {
+            free(buf);
+            CriticalGuard cg(sl_zram);
+            zs.reject();
+            return 0;
+        }
+        if(auto shrunk = realloc(buf, clen); shrunk)
+            buf = shrunk;
+    }
+
+    uint32_t slot = 0;
+    {
+        CriticalGuard cg(sl_zram);
+        if(!zs.is_init() && !zs.init(GK_ZRAM_SLOTS))
+        {
+            klog("zram: could not allocate slot table\n");
+        }
+        else
+        {
+            slot = zs.insert(buf, clen, fill, owner);
+        }
+    }
+    if(!slot)
+        free(buf);
+    return slot;
+}
+
+int zram_load_page(uint32_t slot, uintptr_t paddr)
+{
+    void *data;
+    uint32_t clen;
+    uint64_t fill;
+    {
+        CriticalGuard cg(sl_zram);
+        auto s = zs.get(slot);
+        if(!s)
+            return -1;
+        data = s->data;
+        clen = s->clen;
+        fill = s->fill;
+    }
+
+    auto dest = (void *)PMEM_TO_VMEM(paddr);
+    if(!data)
+    {
+        auto d = (uint64_t *)dest;
+        for(size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+            d[i] = fill;
+        return 0;
+    }
+    return lzpage_decompress(data, clen, dest, PAGE_SIZE) ? 0 : -1;
+}
+
+void zram_free(uint32_t slot)
+{
+    void *data;
+    {
+        CriticalGuard cg(sl_zram);
+        data = zs.erase(slot);
+    }
+    free(data);
+}
+
+void zram_release_owner(uint32_t owner)
+{
+    CriticalGuard cg(sl_zram);
+    if(zs.is_init())
+        zs.release_owner(owner, [](void *d) { free(d); });
+}
+
+size_t zram_owner_pages(uint32_t owner)
+{
+    CriticalGuard cg(sl_zram);
+    return zs.is_init() ? zs.owner_pages(owner) : 0;
+}
+
+ZramStore::stats_t zram_stats()
+{
+    CriticalGuard cg(sl_zram);
+    return zs.stats();
+}
+
+/* Only plain anonymous memory is considered: no shared or gpu pages, nothing that a
+    device may access by physical address (non-MT_NORMAL) and nothing executable, as
+    the fill actions do no instruction cache maintenance. */
+static bool zram_candidate(const MemBlock &mb)
+{
+    return mb.b.valid && mb.IsSwapBacked() && !mb.pmem_is_shared && !mb.pmem_is_drm_object &&
+        mb.b.memory_type == MT_NORMAL && !mb.b.exec;
+}
+
+/* Release a page that is no longer mapped back to Pmem, if it is one of p's single pages */
+static bool zram_release_page(Process &p, uintptr_t paddr)
+{
+    PMemBlock pb;
+    pb.base = paddr;
+    pb.length = VBLOCK_64k;
+    pb.valid = true;
+    {
+        CriticalGuard cg(p.owned_pages.sl);
+        if(!p.owned_pages.p.contains(paddr))
+            return false;
+        p.owned_pages.release(pb);
+    }
+    Pmem.release(pb);
+    return true;
+}
+
+static bool zram_page_owned(Process &p, uintptr_t paddr)
+{
+    CriticalGuard cg(p.owned_pages.sl);
+    return p.owned_pages.p.contains(paddr);
+}
+
+static bool zram_page_pinned(Process &p, uintptr_t paddr)
+{
+    CriticalGuard cg(p.owned_pages.sl);
+    return p.owned_pages.is_pinned(paddr);
+}
+
+/* Second-chance clock over the pages of swap-backed blocks.  Pages with the access flag
+    set have it cleared (the next access takes an access flag fault, which sets it again)
+    and are skipped, as are pinned pages.  Pages found with it still clear are evicted: those never written
+    are simply dropped to be refilled by FillFirst, written ones are stored by Sync and
+    their entry replaced with a PTE_SWAP entry. */
+size_t zram_reclaim(Process &p, size_t npages)
+{
+    auto umem = p.user_mem.get();
+    if(!umem)
+        return 0;
+
+    size_t freed = 0;
+    size_t scanned = 0;
+    const size_t max_scan = npages * GK_ZRAM_SCAN_RATIO;
+    auto hand = umem->zram_clock;
+    bool wrapped = false;
+
+    while(freed < npages && scanned < max_scan)
+    {
+        auto mb = umem->vblocks.NextFrom(hand);
+        if(!mb)
+        {
+            if(wrapped)
+                break;
+            wrapped = true;
+            hand = 0;
+            continue;
+        }
+        if(!zram_candidate(*mb))
+        {
+            hand = mb->b.end();
+            continue;
+        }
+
+        uintptr_t vaddr = std::max<uintptr_t>(hand & ~(VBLOCK_64k - 1), mb->b.data_start());
+        for(; vaddr < mb->b.data_end() && freed < npages && scanned < max_scan; vaddr += VBLOCK_64k)
+        {
+            scanned++;
+            auto ptep = vmem_get_pte_ptr(vaddr, umem->ttbr0);
+            if(!ptep)
+                continue;
+            auto pte = *ptep;
+            if((pte & DT_PAGE) != DT_PAGE)
+                continue;
+
+            if(pte & PAGE_ACCESS)
+            {
+                *ptep = pte & ~PAGE_ACCESS;
+                vmem_invlpg(vaddr, umem->ttbr0);
+                continue;
+            }
+
+            auto paddr = pte & PAGE_PADDR_MASK;
+            if(!zram_page_owned(p, paddr))
+                continue;
+
+            // break before make, so nothing can write the page while it is compressed
+            *ptep = 0;
+            vmem_invlpg(vaddr, umem->ttbr0);
+
+            /* Leave pages the kernel or a device is using by physical address.  Checked
+                after the unmap so that Process::PinUserPage either sees the page gone or
+                has its pin seen here. */
+            if(zram_page_pinned(p, paddr))
+            {
+                *ptep = pte;
+                __asm__ volatile("dsb ishst\n" "isb\n" ::: "memory");
+                continue;
+            }
+
+            auto perm = pte & PAGE_PRIV_MASK;
+            if(perm == PAGE_USER_RO || perm == PAGE_PRIV_RO)
+            {
+                // never written since FillFirst
+                zram_release_page(p, paddr);
+                freed++;
+                continue;
+            }
+
+            mb->si.owner = p.id;
+            mb->si.slot = 0;
+            if(mb->Sync(vaddr, paddr, *mb) == 0 && mb->si.slot)
+            {
+                *ptep = PTE_SWAP_ENTRY(mb->si.slot, pte);
+                mb->si.slot = 0;
+                zram_release_page(p, paddr);
+                freed++;
+            }
+            else
+            {
+                *ptep = pte;
+                __asm__ volatile("dsb ishst\n" "isb\n" ::: "memory");
+            }
+        }
+        hand = (vaddr >= mb->b.data_end()) ? mb->b.end() : vaddr;
+    }
+
+    umem->zram_clock = hand;
+    return freed;
+}
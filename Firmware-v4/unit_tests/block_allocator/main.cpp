@@ -0,0 +1,360 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <vector>
+#include "block_allocator.h"
+#include "proc_vmem.h"
+
+constexpr uintptr_t page = 65536;
+
+/* The previous allocator: a map of blocks with AllocAny walking every gap in turn.
+    Used as the reference for placement and as the benchmark baseline. */
+class LinearAllocator
+{
+    protected:
+        std::map<uintptr_t, uintptr_t> l;      // start -> length
+        uintptr_t base, length;
+
+        bool fits(uintptr_t len, uintptr_t bstart, uintptr_t bend)
+        {
+            return bstart < bend && bend - bstart >= len;
+        }
+
+    public:
+        LinearAllocator(uintptr_t _base, uintptr_t _length) : base(_base), length(_length) {}
+
+        bool AllocFixed(uintptr_t start, uintptr_t len)
+        {
+            auto next = l.lower_bound(start);
+            if(next != l.end() && next->first < start + len)
+                return false;
+            if(next != l.begin() && std::prev(next)->first + std::prev(next)->second > start)
+                return false;
+            l[start] = len;
+            return true;
+        }
+
+        bool AllocAny(uintptr_t len, bool lowest_first, uintptr_t *start)
+        {
+            if(lowest_first)
+            {
+                auto bstart = base;
+                for(auto &b : l)
+                {
+                    if(fits(len, bstart, b.first))
+                        break;
+                    bstart = std::max(bstart, b.first + b.second);
+                }
+                auto bend = l.empty() ? base + length : l.lower_bound(bstart) == l.end() ?
+                    base + length : l.lower_bound(bstart)->first;
+                if(!fits(len, bstart, bend))
+                    return false;
+                *start = bstart;
+            }
+            else
+            {
+                auto bend = base + length;
+                for(auto iter = l.rbegin(); iter != l.rend(); iter++)
+                {
+                    if(fits(len, iter->first + iter->second, bend))
+                        break;
+                    bend = std::min(bend, iter->first);
+                }
+                auto iter = l.lower_bound(bend);
+                auto bstart = (iter == l.begin()) ? base : std::prev(iter)->first + std::prev(iter)->second;
+                if(!fits(len, bstart, bend))
+                    return false;
+                *start = bend - len;
+            }
+            l[*start] = len;
+            return true;
+        }
+
+        /* Brute force best fit, for checking */
+        bool BestFit(uintptr_t len, uintptr_t *start)
+        {
+            bool found = false;
+            uintptr_t best_len = 0;
+            auto bstart = base;
+            auto check = [&](uintptr_t gs, uintptr_t ge)
+            {
+                if(fits(len, gs, ge) && (!found || ge - gs < best_len))
+                {
+                    found = true;
+                    best_len = ge - gs;
+                    *start = gs;
+                }
+            };
+            for(auto &b : l)
+            {
+                check(bstart, b.first);
+                bstart = b.first + b.second;
+            }
+            check(bstart, base + length);
+            return found;
+        }
+
+        void Dealloc(uintptr_t start)
+        {
+            l.erase(start);
+        }
+
+        size_t size() const { return l.size(); }
+};
+
+struct op_t
+{
+    enum { any_low, any_high, best, fixed, free } type;
+    uintptr_t len;
+    uintptr_t addr;         // fixed address, or index into live blocks for free
+};
+
+static std::vector<op_t> make_ops(unsigned int n, uintptr_t space, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<op_t> ops;
+    for(unsigned int i = 0; i < n; i++)
+    {
+        op_t op;
+        auto r = rng() % 100;
+        if(r < 25)
+            op.type = op_t::any_low;
+        else if(r < 45)
+            op.type = op_t::any_high;
+        else if(r < 50)
+            op.type = op_t::best;
+        else if(r < 55)
+            op.type = op_t::fixed;
+        else
+            op.type = op_t::free;
+
+        // mostly small mmaps, the odd large one
+        op.len = ((rng() % 16 == 0) ? (1 + rng() % 256) : (1 + rng() % 8)) * page;
+        op.addr = (op.type == op_t::fixed) ? (rng() % (space / page)) * page : rng();
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+static void test_block_allocator()
+{
+    const uintptr_t base = 0x10000000, length = 0x40000000;
+    BlockAllocator<int> ba(base, length);
+    LinearAllocator ref(base, length);
+    std::vector<uintptr_t> live;
+
+    auto ops = make_ops(100000, length, 1);
+    unsigned int nfail = 0;
+    for(const auto &op : ops)
+    {
+        uintptr_t ref_start = 0;
+        bool ref_ok;
+        BlockAllocator<int>::iterator iter;
+
+        switch(op.type)
+        {
+            case op_t::any_low:
+            case op_t::any_high:
+                ref_ok = ref.AllocAny(op.len, op.type == op_t::any_low, &ref_start);
+                iter = ba.AllocAny(op.len, 0, op.type == op_t::any_low);
+                assert(ref_ok == (iter != ba.end()));
+                if(ref_ok)
+                {
+                    assert(iter->first.start == ref_start && iter->first.length == op.len);
+                    live.push_back(ref_start);
+                }
+                else
+                    nfail++;
+                break;
+
+            case op_t::best:
+                ref_ok = ref.BestFit(op.len, &ref_start);
+                iter = ba.AllocBest(op.len);
+                assert(ref_ok == (iter != ba.end()));
+                if(ref_ok)
+                {
+                    // several gaps may share the best length, lowest first
+                    assert(iter->first.start == ref_start);
+                    ref.AllocFixed(ref_start, op.len);
+                    live.push_back(ref_start);
+                }
+                break;
+
+            case op_t::fixed:
+                ref_ok = ref.AllocFixed(base + op.addr, op.len);
+                iter = ba.AllocFixed({ base + op.addr, op.len });
+                assert(ref_ok == (iter != ba.end()));
+                if(ref_ok)
+                    live.push_back(base + op.addr);
+                break;
+
+            case op_t::free:
+                if(live.empty())
+                    break;
+                {
+                    auto idx = op.addr % live.size();
+                    auto start = live[idx];
+                    live[idx] = live.back();
+                    live.pop_back();
+                    ref.Dealloc(start);
+                    ba.Dealloc(start);
+                }
+                break;
+        }
+    }
+
+    // everything freed leaves one gap of the whole space
+    for(auto start : live)
+        ba.Dealloc(start);
+    assert(ba.begin() == ba.end());
+    assert(ba.LargestFree() == length);
+
+    printf("block_allocator: BlockAllocator matches reference over %zu ops (%u full)\n", ops.size(), nfail);
+}
+
+static void test_vblock_allocator()
+{
+    MapVBlockAllocator va;
+    LinearAllocator ref(va.base, va.length);
+    std::vector<uintptr_t> live;
+
+    auto ops = make_ops(100000, 0x40000000, 2);
+    for(const auto &op : ops)
+    {
+        uintptr_t ref_start = 0;
+        bool ref_ok;
+        MemBlock mb;
+        mb.b.length = op.len;
+
+        switch(op.type)
+        {
+            case op_t::any_low:
+            case op_t::any_high:
+            case op_t::best:
+            {
+                bool low = op.type != op_t::any_high;
+                ref_ok = ref.AllocAny(op.len, low, &ref_start);
+                auto vb = va.AllocAny(mb, low);
+                assert(ref_ok == vb.valid);
+                if(ref_ok)
+                {
+                    assert(vb.base == ref_start);
+                    live.push_back(ref_start);
+                }
+                break;
+            }
+
+            case op_t::fixed:
+            {
+                mb.b.base = va.base + op.addr;
+                ref_ok = ref.AllocFixed(mb.b.base, op.len);
+                auto vb = va.AllocFixed(mb);
+                assert(ref_ok == vb.valid);
+                if(ref_ok)
+                    live.push_back(mb.b.base);
+                break;
+            }
+
+            case op_t::free:
+                if(live.empty())
+                    break;
+                {
+                    auto idx = op.addr % live.size();
+                    VMemBlock vb;
+                    vb.base = live[idx];
+                    live[idx] = live.back();
+                    live.pop_back();
+                    ref.Dealloc(vb.base);
+                    auto ret = va.Dealloc(vb);
+                    assert(ret == 0);
+                    (void)ret;
+                }
+                break;
+        }
+    }
+
+    printf("block_allocator: MapVBlockAllocator matches reference over %zu ops\n", ops.size());
+}
+
+/* Placement cost with many live blocks, as for a process doing thousands of mmaps */
+template <typename F> static double time_ops(F f)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+static void bench()
+{
+    const uintptr_t base = 0x10000000, length = 0x100000000ULL;
+    const unsigned int nops = 100000;
+
+    for(unsigned int nlive : { 1000U, 10000U })
+    {
+        std::mt19937 rng(3);
+        std::vector<uintptr_t> lens;
+        for(unsigned int i = 0; i < nlive + nops; i++)
+            lens.push_back((1 + rng() % 8) * page);
+
+        // alternately free a random live block and allocate a new one
+        auto run = [&](auto alloc, auto dealloc)
+        {
+            std::mt19937 r(4);
+            std::vector<uintptr_t> live;
+            for(unsigned int i = 0; i < nlive; i++)
+                live.push_back(alloc(lens[i], (i & 1) != 0));
+            for(unsigned int i = 0; i < nops; i++)
+            {
+                if(i & 1)
+                {
+                    auto idx = r() % live.size();
+                    dealloc(live[idx]);
+                    live[idx] = live.back();
+                    live.pop_back();
+                }
+                else
+                {
+                    live.push_back(alloc(lens[nlive + i], (i & 2) != 0));
+                }
+            }
+        };
+
+        LinearAllocator ref(base, length);
+        auto t_ref = time_ops([&]() {
+            run([&](uintptr_t len, bool low) {
+                    uintptr_t start = 0;
+                    if(!ref.AllocAny(len, low, &start))
+                        exit(1);
+                    return start;
+                },
+                [&](uintptr_t start) { ref.Dealloc(start); });
+        });
+
+        BlockAllocator<int> ba(base, length);
+        auto t_ba = time_ops([&]() {
+            run([&](uintptr_t len, bool low) {
+                    auto iter = ba.AllocAny(len, 0, low);
+                    if(iter == ba.end())
+                        exit(1);
+                    return iter->first.start;
+                },
+                [&](uintptr_t start) { ba.Dealloc(start); });
+        });
+
+        printf("block_allocator: %5u live blocks, %u ops: linear %8.2f us/op, gap indexed %6.2f us/op (%.1fx)\n",
+            nlive, nops, t_ref * 1e6 / nops, t_ba * 1e6 / nops, t_ref / t_ba);
+    }
+}
+
+int main()
+{
+    test_block_allocator();
+    test_vblock_allocator();
+    bench();
+
+    return 0;
+}
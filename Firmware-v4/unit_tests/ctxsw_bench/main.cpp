@@ -0,0 +1,345 @@
+#include "ostypes.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/* Replays the FP handling of TaskSwitch (switcher.s) and FPTrap_Handler (exceptions.cpp)
+    over a two-core schedule, against the old scheme of saving and restoring q8-15 on
+    every switch.
+
+    The register file is represented by a token per core and each thread checks it
+    finds its own token whenever it uses FP, so any schedule where the per-core owner
+    tracking hands a thread someone else's (or a stale) state fails.  The output is the
+    number of q8-15 saves, restores and FP traps per switch - what the switch path costs
+    on the target is these times the cost of each, which the kernel counts for real in
+    fp_stats with GK_ENABLE_SCHED_DUMP. */
+
+constexpr unsigned int ncores = 2;
+
+enum class kind { Kernel, FpHeavy, FpOccasional, NoFp };
+
+struct FakeThread
+{
+    thread_saved_state tss;
+    kind k;
+    unsigned int home;
+    bool at_el1;            // will resume within the kernel
+    uint64_t expect;        // token its registers should hold when it next uses them
+    bool has_state;         // expect is meaningful
+    bool running;
+};
+
+struct FakeCore
+{
+    uint64_t regs;          // stands in for q8-15, fpcr, fpsr
+    bool fpen;              // cpacr_el1 FPEN == 0b11
+    FakeThread *owner;
+};
+
+struct counts
+{
+    uint64_t switches, saves, restores, traps;
+};
+
+static uint64_t next_token = 1;
+
+static void save(FakeCore &c, FakeThread *t, counts &n)
+{
+    t->tss.fpu_regs[0] = c.regs;
+    t->tss.fp_flags |= THREAD_FP_SAVED;
+    n.saves++;
+}
+
+static void restore(FakeCore &c, const FakeThread *t, counts &n)
+{
+    c.regs = t->tss.fpu_regs[0];
+    n.restores++;
+}
+
+static void set_cpu(FakeThread *t, unsigned int core)
+{
+    t->tss.fp_flags = (t->tss.fp_flags & ~THREAD_FP_CPU_MASK) |
+        ((uint64_t)(core + 1) << THREAD_FP_CPU_SHIFT);
+}
+
+static bool is_cpu(const FakeThread *t, unsigned int core)
+{
+    return ((t->tss.fp_flags & THREAD_FP_CPU_MASK) >> THREAD_FP_CPU_SHIFT) == core + 1;
+}
+
+struct Eager
+{
+    static constexpr bool traps = false;
+
+    static void switch_out(FakeCore &c, unsigned int, FakeThread *t, counts &n)
+    {
+        save(c, t, n);
+    }
+
+    static void switch_in(FakeCore &c, unsigned int, FakeThread *t, counts &n)
+    {
+        if(t->tss.fp_flags & THREAD_FP_SAVED)
+            restore(c, t, n);
+        c.fpen = true;
+    }
+
+    static void trap(FakeCore &, unsigned int, FakeThread *, counts &)
+    {
+        assert(!"eager never traps");
+    }
+};
+
+struct Lazy
+{
+    static constexpr bool traps = true;
+
+    static void switch_out(FakeCore &c, unsigned int core, FakeThread *t, counts &n)
+    {
+        if(t->at_el1 || c.fpen)
+        {
+            save(c, t, n);
+            set_cpu(t, core);
+            c.owner = t;
+        }
+    }
+
+    static void switch_in(FakeCore &c, unsigned int core, FakeThread *t, counts &n)
+    {
+        if(c.owner == t && is_cpu(t, core))
+        {
+            c.fpen = (t->tss.fp_flags & THREAD_FP_USED) != 0;
+        }
+        else if(t->at_el1)
+        {
+            c.owner = t;
+            set_cpu(t, core);
+            if(t->tss.fp_flags & THREAD_FP_SAVED)
+                restore(c, t, n);
+            c.fpen = (t->tss.fp_flags & THREAD_FP_USED) != 0;
+        }
+        else
+        {
+            c.fpen = false;
+        }
+    }
+
+    static void trap(FakeCore &c, unsigned int core, FakeThread *t, counts &n)
+    {
+        n.traps++;
+        if(t->tss.fp_flags & THREAD_FP_USED)
+        {
+            if(t->tss.fp_flags & THREAD_FP_SAVED)
+                restore(c, t, n);
+        }
+        else
+        {
+            t->tss.fp_flags |= THREAD_FP_USED;
+            c.regs = 0;
+        }
+        set_cpu(t, core);
+        c.owner = t;
+        c.fpen = true;
+    }
+};
+
+/* Run t on core for one timeslice */
+template <typename Scheme> static void run(FakeCore &c, unsigned int core, FakeThread *t,
+    counts &n)
+{
+    bool use_fp;
+    switch(t->k)
+    {
+        case kind::Kernel:
+            use_fp = true;
+            break;
+        case kind::FpHeavy:
+            use_fp = true;
+            break;
+        case kind::FpOccasional:
+            use_fp = !(t->tss.fp_flags & THREAD_FP_USED) || (rand() % 20) == 0;
+            break;
+        default:
+            use_fp = false;
+            break;
+    }
+
+    // a user thread resuming inside a syscall finishes it first
+    if(t->at_el1 || t->k == kind::Kernel)
+    {
+        if(t->has_state)
+            assert(c.regs == t->expect);
+    }
+
+    if(use_fp && t->k != kind::Kernel)
+    {
+        if(!c.fpen)
+            Scheme::trap(c, core, t, n);
+        if(t->has_state)
+            assert(c.regs == t->expect);
+        else if(Scheme::traps)
+            assert(c.regs == 0);
+        t->has_state = true;
+        c.regs = t->expect = next_token++;
+    }
+
+    // preempted within the kernel (always for kernel threads) or at EL0
+    t->at_el1 = t->k == kind::Kernel || (rand() % 5) == 0;
+    if(t->at_el1)
+    {
+        t->has_state = true;
+        c.regs = t->expect = next_token++;
+    }
+}
+
+template <typename Scheme> static counts simulate(std::vector<FakeThread> &threads,
+    unsigned int iters, unsigned int seed)
+{
+    counts n{};
+    FakeCore cores[ncores]{};
+    FakeThread *cur[ncores]{};
+    next_token = 1;
+
+    for(auto &t : threads)
+    {
+        memset(&t.tss, 0, sizeof(t.tss));
+        t.at_el1 = t.k == kind::Kernel;
+        t.has_state = false;
+        t.expect = 0;
+        t.running = false;
+    }
+
+    srand(seed);
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        unsigned int core = i % ncores;
+
+        // mostly run threads homed here, with the occasional steal from the other core
+        FakeThread *next = nullptr;
+        bool steal = (rand() % 10) == 0;
+        while(!next)
+        {
+            auto t = &threads[(size_t)rand() % threads.size()];
+            if(!t->running && ((t->home == core) != steal))
+                next = t;
+        }
+
+        if(cur[core])
+        {
+            Scheme::switch_out(cores[core], core, cur[core], n);
+            cur[core]->running = false;
+        }
+        Scheme::switch_in(cores[core], core, next, n);
+        n.switches++;
+        next->running = true;
+        cur[core] = next;
+
+        run<Scheme>(cores[core], core, next, n);
+    }
+    return n;
+}
+
+static std::vector<FakeThread> make_threads(unsigned int nkernel, unsigned int nheavy,
+    unsigned int noccasional, unsigned int nnofp)
+{
+    std::vector<FakeThread> ret;
+    auto add = [&ret](kind k, unsigned int count)
+    {
+        for(unsigned int i = 0; i < count; i++)
+        {
+            FakeThread t{};
+            t.k = k;
+            t.home = (unsigned int)ret.size() % ncores;
+            ret.push_back(t);
+        }
+    };
+    add(kind::Kernel, nkernel);
+    add(kind::FpHeavy, nheavy);
+    add(kind::FpOccasional, noccasional);
+    add(kind::NoFp, nnofp);
+    return ret;
+}
+
+static void test_lazy()
+{
+    // the model itself asserts each thread only ever sees its own registers
+    for(unsigned int seed = 1; seed <= 20; seed++)
+    {
+        auto threads = make_threads(2, 2, 3, 3);
+        simulate<Lazy>(threads, 20000, seed);
+    }
+
+    // a lone FP thread alternating with a non-FP one keeps its registers live
+    {
+        FakeCore c{};
+        counts n{};
+        FakeThread a{}, b{};
+        a.k = kind::FpHeavy;
+        b.k = kind::NoFp;
+
+        Lazy::switch_in(c, 0, &a, n);
+        Lazy::trap(c, 0, &a, n);
+        for(int i = 0; i < 10; i++)
+        {
+            Lazy::switch_out(c, 0, &a, n);
+            Lazy::switch_in(c, 0, &b, n);
+            assert(!c.fpen);
+            Lazy::switch_out(c, 0, &b, n);
+            Lazy::switch_in(c, 0, &a, n);
+            assert(c.fpen);
+        }
+        assert(n.traps == 1);
+        assert(n.restores == 0);
+        assert(n.saves == 10);
+    }
+
+    // once migrated, stale registers on the old core are not trusted
+    {
+        FakeCore c[2]{};
+        counts n{};
+        FakeThread a{};
+        a.k = kind::FpHeavy;
+        a.tss.fp_flags = THREAD_FP_USED;
+
+        Lazy::switch_in(c[0], 0, &a, n);
+        Lazy::trap(c[0], 0, &a, n);
+        Lazy::switch_out(c[0], 0, &a, n);
+        Lazy::switch_in(c[1], 1, &a, n);
+        Lazy::trap(c[1], 1, &a, n);
+        Lazy::switch_out(c[1], 1, &a, n);
+        Lazy::switch_in(c[0], 0, &a, n);
+        assert(!c[0].fpen);
+    }
+
+    printf("ctxsw: lazy fp tests passed\n");
+}
+
+static void bench(const char *name, unsigned int nkernel, unsigned int nheavy,
+    unsigned int noccasional, unsigned int nnofp)
+{
+    const unsigned int iters = 1000000;
+
+    auto threads = make_threads(nkernel, nheavy, noccasional, nnofp);
+    auto e = simulate<Eager>(threads, iters, 1);
+    auto l = simulate<Lazy>(threads, iters, 1);
+
+    auto per = [](uint64_t v, const counts &n) { return (double)v / (double)n.switches; };
+    printf("ctxsw: %-28s eager: %.2f saves + %.2f restores, lazy: %.2f saves + %.2f restores + %.2f traps per switch\n",
+        name, per(e.saves, e), per(e.restores, e), per(l.saves, l), per(l.restores, l),
+        per(l.traps, l));
+}
+
+int main()
+{
+    test_lazy();
+
+    bench("1 game thread, idle-ish", 2, 1, 2, 4);
+    bench("2 game threads", 2, 2, 2, 4);
+    bench("no fp users", 2, 0, 0, 8);
+    bench("all fp heavy", 0, 8, 0, 0);
+    bench("many occasional", 2, 0, 16, 16);
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include "rcutable.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/* Mirrors ThreadProcListMember - a shared_ptr plus some plain fields, so copying
+    one out of a node touches the refcount of the pointed-to object */
+struct FakeObj
+{
+    static constexpr uint32_t live_magic = 0x600dcafe;
+    static constexpr uint32_t dead_magic = 0xdeadbeef;
+
+    uint32_t magic = live_magic;
+    unsigned int id;
+
+    FakeObj(unsigned int _id) : id(_id) {}
+    ~FakeObj() { magic = dead_magic; }
+};
+
+struct FakeMember
+{
+    std::shared_ptr<FakeObj> v{};
+    int retval = 0;
+    bool has_ended = false;
+};
+
+using table_t = RcuTable<unsigned int, FakeMember>;
+
+static std::atomic<int> live_objs = 0;
+
+struct CountedObj : public FakeObj
+{
+    CountedObj(unsigned int _id) : FakeObj(_id) { live_objs++; }
+    ~CountedObj() { live_objs--; }
+};
+
+static void test_basic()
+{
+    {
+        table_t t;
+        assert(!t.exists(1));
+        assert(t.get(1).v == nullptr);
+
+        for(unsigned int i = 1; i <= 1000; i++)
+            t.insert(i, FakeMember{ std::make_shared<CountedObj>(i) });
+        assert(t.size() == 1000);
+        assert(live_objs == 1000);
+
+        for(unsigned int i = 1; i <= 1000; i++)
+        {
+            auto v = t.get(i);
+            assert(v.v && v.v->id == i);
+        }
+
+        // update publishes a copy, the old value stays alive until reclaimed
+        assert(t.update(5, [](FakeMember &m) { m.retval = 42; m.has_ended = true; }));
+        assert(t.get(5).retval == 42);
+        assert(t.get(5).v->id == 5);
+        assert(!t.update(5000, [](FakeMember &) { }));
+
+        // as TIDList::Release
+        assert(t.update(6, [](FakeMember &m) { m.v = nullptr; }));
+        assert(t.exists(6));
+        assert(t.get(6).v == nullptr);
+        assert(live_objs == 1000);
+        table_t::free_nodes(t.reclaim());
+        assert(live_objs == 999);
+
+        FakeMember old;
+        assert(t.erase(7, &old));
+        assert(old.v->id == 7);
+        assert(!t.exists(7));
+        assert(!t.erase(7));
+        assert(t.size() == 999);
+        old = FakeMember();
+        table_t::free_nodes(t.reclaim());
+        assert(live_objs == 998);
+
+        unsigned int n = 0;
+        t.for_each([&](unsigned int id, const FakeMember &) { n++; assert(id != 7); });
+        assert(n == 999);
+    }
+    assert(live_objs == 0);
+
+    printf("rcutable: basic tests passed\n");
+}
+
+/* Writer constantly creating, updating and deleting entries while readers look
+    them up.  The magic check catches a reader copying out of a freed node or
+    keeping a pointer to a destroyed object. */
+static void test_stress()
+{
+    const unsigned int nreaders = 3;
+    const unsigned int nops = 200000;
+    const unsigned int window = 512;
+
+    table_t t;
+    std::atomic<unsigned int> next_id = 1;
+    std::atomic<bool> done = false;
+    std::atomic<unsigned long> hits = 0, lookups = 0;
+
+    auto reader = [&](unsigned int seed)
+    {
+        unsigned long lhits = 0, llookups = 0;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            seed = seed * 1103515245U + 12345U;
+            auto top = next_id.load(std::memory_order_relaxed);
+            auto id = top - (seed >> 8) % window;
+            auto v = t.get(id);
+            if(v.v)
+            {
+                assert(v.v->magic == FakeObj::live_magic);
+                assert(v.v->id == id);
+                lhits++;
+            }
+            llookups++;
+        }
+        hits += lhits;
+        lookups += llookups;
+    };
+
+    std::vector<std::thread> readers;
+    for(unsigned int i = 0; i < nreaders; i++)
+        readers.emplace_back(reader, i + 1);
+
+    srand(3);
+    std::vector<unsigned int> live;
+    for(unsigned int i = 0; i < nops; i++)
+    {
+        switch(rand() % 4)
+        {
+            case 0:
+            case 1:
+            {
+                auto id = next_id.load();
+                t.insert(id, FakeMember{ std::make_shared<CountedObj>(id) });
+                next_id.store(id + 1);
+                live.push_back(id);
+                break;
+            }
+            case 2:
+                if(!live.empty())
+                {
+                    auto idx = rand() % live.size();
+                    t.update(live[idx], [](FakeMember &m) { m.has_ended = true; });
+                }
+                break;
+            case 3:
+                if(!live.empty())
+                {
+                    auto idx = rand() % live.size();
+                    assert(t.erase(live[idx]));
+                    live[idx] = live.back();
+                    live.pop_back();
+                }
+                break;
+        }
+        table_t::free_nodes(t.reclaim());
+    }
+
+    done = true;
+    for(auto &r : readers)
+        r.join();
+
+    assert(t.size() == live.size());
+    table_t::free_nodes(t.reclaim());
+    assert(live_objs == (int)live.size());
+
+    printf("rcutable: stress test passed (%lu lookups, %lu hits)\n", lookups.load(), hits.load());
+}
+
+/* Previous IDList: std::map behind a spinlock */
+struct LockedMap
+{
+    std::map<unsigned int, FakeMember> list;
+    std::atomic<bool> sl = false;
+
+    void lock() { while(sl.exchange(true, std::memory_order_acquire)); }
+    void unlock() { sl.store(false, std::memory_order_release); }
+
+    FakeMember get(unsigned int id)
+    {
+        lock();
+        auto iter = list.find(id);
+        auto ret = iter == list.end() ? FakeMember() : iter->second;
+        unlock();
+        return ret;
+    }
+};
+
+template <typename Get> static double run_bench(unsigned int nthreads, unsigned int nids, Get get)
+{
+    const unsigned int iters = 1000000;
+    std::atomic<bool> go = false;
+    std::vector<std::thread> threads;
+
+    for(unsigned int i = 0; i < nthreads; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            while(!go.load());
+            unsigned int seed = i + 1;
+            for(unsigned int j = 0; j < iters; j++)
+            {
+                seed = seed * 1103515245U + 12345U;
+                auto v = get((seed >> 8) % nids + 1);
+                assert(v.v);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for(auto &t : threads)
+        t.join();
+    auto end = std::chrono::steady_clock::now();
+
+    auto secs = std::chrono::duration<double>(end - start).count();
+    return (double)iters * nthreads / secs / 1e6;
+}
+
+static void bench(unsigned int nthreads, unsigned int nids)
+{
+    table_t t;
+    LockedMap m;
+    for(unsigned int i = 1; i <= nids; i++)
+    {
+        FakeMember fm{ std::make_shared<FakeObj>(i) };
+        t.insert(i, fm);
+        m.list[i] = fm;
+    }
+
+    auto map_mops = run_bench(nthreads, nids, [&](unsigned int id) { return m.get(id); });
+    auto rcu_mops = run_bench(nthreads, nids, [&](unsigned int id) { return t.get(id); });
+
+    printf("rcutable: %u threads, %5u ids: locked map %7.2f Mlookups/s, rcu table %7.2f Mlookups/s\n",
+        nthreads, nids, map_mops, rcu_mops);
+}
+
+int main()
+{
+    test_basic();
+    test_stress();
+
+    for(auto nthreads : { 1U, 2U })
+    {
+        for(auto nids : { 16U, 256U, 4096U })
+        {
+            bench(nthreads, nids);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "slab.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/* Stands in for the kernel Spinlock, which is what the depots and the previous
+    kheap wrapper (sl_heap around newlib malloc) use */
+struct HostSpinlock
+{
+    std::atomic<bool> v = false;
+
+    bool lock() { while(v.exchange(true, std::memory_order_acquire)); return true; }
+    void unlock() { v.store(false, std::memory_order_release); }
+};
+
+constexpr unsigned int ncores = 2;
+using slab_t = SlabAllocator<HostSpinlock, ncores>;
+
+static void *alloc_region(size_t len)
+{
+    auto ret = std::aligned_alloc(slab_t::slab_size, len);
+    assert(ret);
+    return ret;
+}
+
+static void test_basic()
+{
+    const size_t region_len = 16 * 1024 * 1024;
+    auto region = alloc_region(region_len);
+    auto s = new slab_t();
+    s->init((uintptr_t)region, region_len);
+
+    struct alloc_t
+    {
+        unsigned char *p;
+        size_t size;
+        unsigned char fill;
+    };
+    std::vector<alloc_t> allocs;
+
+    srand(1);
+    for(unsigned int i = 0; i < 200000; i++)
+    {
+        auto core = rand() % ncores;
+        if(allocs.empty() || (allocs.size() < 4000 && rand() % 2))
+        {
+            auto size = (size_t)(rand() % (slab_t::max_size + 1));
+            auto p = (unsigned char *)s->alloc(size, core);
+            assert(p);
+            assert(s->owns(p));
+            assert(((uintptr_t)p & 15) == 0);
+            assert(s->usable_size(p) >= size);
+            auto fill = (unsigned char)rand();
+            memset(p, fill, size);
+            allocs.push_back({ p, size, fill });
+        }
+        else
+        {
+            // free from either core, regardless of which allocated it
+            auto idx = rand() % allocs.size();
+            auto &a = allocs[idx];
+            for(size_t j = 0; j < a.size; j++)
+                assert(a.p[j] == a.fill);
+            s->free(a.p, core);
+            allocs[idx] = allocs.back();
+            allocs.pop_back();
+        }
+    }
+
+    uint64_t allocs_total = 0, frees_total = 0;
+    for(unsigned int i = 0; i < s->nclasses; i++)
+    {
+        auto st = s->stats(i);
+        allocs_total += st.allocs;
+        frees_total += st.frees;
+    }
+    assert(allocs_total - frees_total == allocs.size());
+
+    assert(s->alloc(slab_t::max_size + 1, 0) == nullptr);
+    assert(!s->owns(&allocs));
+
+    delete s;
+    std::free(region);
+
+    printf("slab: basic tests passed\n");
+}
+
+static void test_exhaust()
+{
+    // map slab plus two usable slabs
+    const size_t region_len = 3 * slab_t::slab_size;
+    auto region = alloc_region(region_len);
+    auto s = new slab_t();
+    s->init((uintptr_t)region, region_len);
+
+    std::vector<void *> v;
+    while(auto p = s->alloc(4096, 0))
+        v.push_back(p);
+    assert(v.size() == 2 * slab_t::slab_size / 4096);
+
+    // other size classes cannot get a slab either
+    assert(s->alloc(16, 1) == nullptr);
+
+    // but freed objects are reused
+    s->free(v.back(), 1);
+    assert(s->alloc(4000, 1) == v.back());
+
+    delete s;
+    std::free(region);
+
+    printf("slab: exhaustion tests passed\n");
+}
+
+/* Previous kheap wrapper: the general allocator behind one global spinlock */
+struct LockedHeap
+{
+    HostSpinlock sl;
+
+    void *alloc(size_t size, unsigned int)
+    {
+        sl.lock();
+        auto ret = malloc(size);
+        sl.unlock();
+        return ret;
+    }
+
+    void free(void *p, unsigned int)
+    {
+        sl.lock();
+        ::free(p);
+        sl.unlock();
+    }
+};
+
+template <typename Heap> static double run_bench(Heap &h, unsigned int nthreads)
+{
+    const unsigned int iters = 2000000;
+    const unsigned int working_set = 1024;
+    std::atomic<bool> go = false;
+    std::vector<std::thread> threads;
+
+    for(unsigned int i = 0; i < nthreads; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            // mostly small objects - shared_ptr control blocks, map nodes, net_msgs
+            std::vector<size_t> sizes(iters);
+            unsigned int seed = i + 1;
+            for(auto &sz : sizes)
+            {
+                seed = seed * 1103515245U + 12345U;
+                auto r = (seed >> 8) % 100;
+                sz = r < 70 ? 16 + (r % 8) * 16 : (r < 95 ? 256 + r * 8 : 1536 + r * 16);
+            }
+            std::vector<void *> slots(working_set, nullptr);
+
+            while(!go.load());
+            for(unsigned int j = 0; j < iters; j++)
+            {
+                auto &slot = slots[(j * 7919U) % working_set];
+                if(slot)
+                    h.free(slot, i);
+                slot = h.alloc(sizes[j], i);
+                *(volatile char *)slot = 0;
+            }
+            for(auto p : slots)
+            {
+                if(p)
+                    h.free(p, i);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for(auto &t : threads)
+        t.join();
+    auto end = std::chrono::steady_clock::now();
+
+    auto secs = std::chrono::duration<double>(end - start).count();
+    return (double)iters * nthreads / secs / 1e6;
+}
+
+static void bench(unsigned int nthreads)
+{
+    LockedHeap lh;
+    auto locked_mops = run_bench(lh, nthreads);
+
+    const size_t region_len = 64 * 1024 * 1024;
+    auto region = alloc_region(region_len);
+    auto s = new slab_t();
+    s->init((uintptr_t)region, region_len);
+    auto slab_mops = run_bench(*s, nthreads);
+
+    printf("slab: %u threads: locked heap %6.2f Mops/s, slab magazines %6.2f Mops/s\n",
+        nthreads, locked_mops, slab_mops);
+    for(unsigned int i = 0; i < s->nclasses; i++)
+    {
+        auto st = s->stats(i);
+        if(!st.allocs)
+            continue;
+        printf("slab:   %4zu: allocs %9llu, refills %6llu, flushes %6llu, slabs %4llu, depot %6llu\n",
+            s->class_sizes[i], (unsigned long long)st.allocs, (unsigned long long)st.refills,
+            (unsigned long long)st.flushes, (unsigned long long)st.slabs,
+            (unsigned long long)st.depot_free);
+    }
+
+    delete s;
+    std::free(region);
+}
+
+int main()
+{
+    test_basic();
+    test_exhaust();
+
+    bench(1);
+    bench(2);
+
+    return 0;
+}
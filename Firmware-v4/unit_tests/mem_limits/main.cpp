@@ -0,0 +1,109 @@
+#include "mem_limits.h"
+
+#include <cassert>
+#include <cstdio>
+
+using pressure = mem_limits_t::pressure;
+
+static pressure charge(mem_limits_t &l, size_t resident, size_t npages, bool expect)
+{
+    auto level = pressure::None;
+    size_t total = 0;
+    auto ret = l.charge(resident, npages, &level, &total);
+    assert(ret == expect);
+    (void)ret;
+    return level;
+}
+
+static void test_unlimited()
+{
+    mem_limits_t l;
+    assert(l.headroom(1000000) == SIZE_MAX);
+    for(auto i = 0U; i < 100; i++)
+    {
+        auto level = charge(l, i * 1000, 1000, true);
+        assert(level == pressure::None);
+        (void)level;
+    }
+    printf("mem_limits: unlimited tests passed\n");
+}
+
+/* Reservations count against the limit until released, so concurrent charges made
+    before any of the pages are resident cannot overshoot it together */
+static void test_reservation()
+{
+    mem_limits_t l{ 0, 100 };
+
+    for(auto i = 0U; i < 10; i++)
+        charge(l, 50, 5, true);
+    assert(l.reserved == 50);
+    assert(l.headroom(50) == 0);
+    charge(l, 50, 1, false);
+    assert(l.reserved == 50);
+
+    // a fault-around window sized from headroom is then charged in full
+    l.uncharge(20);
+    auto window = l.headroom(50);
+    assert(window == 20);
+    charge(l, 50, window, true);
+    charge(l, 50, 1, false);
+
+    // once pages are resident their reservation is dropped, keeping the total the same
+    l.uncharge(50);
+    assert(l.reserved == 0);
+    assert(l.headroom(100) == 0);
+    assert(l.headroom(80) == 20);
+
+    // over-release is clamped
+    l.uncharge(5);
+    assert(l.reserved == 0);
+
+    printf("mem_limits: reservation tests passed\n");
+}
+
+static void test_hysteresis()
+{
+    mem_limits_t l{ 800, 1600 };
+
+    // soft: once when crossed, not again until an eighth below
+    assert(charge(l, 700, 100, true) == pressure::None);
+    l.uncharge(100);
+    assert(charge(l, 800, 1, true) == pressure::Soft);
+    l.uncharge(1);
+    assert(charge(l, 900, 1, true) == pressure::None);
+    l.uncharge(1);
+    assert(charge(l, 750, 1, true) == pressure::None);
+    l.uncharge(1);
+    assert(charge(l, 850, 1, true) == pressure::None);
+    l.uncharge(1);
+    assert(charge(l, 698, 1, true) == pressure::None);     // 699 < 800 - 100
+    l.uncharge(1);
+    assert(charge(l, 800, 1, true) == pressure::Soft);
+    l.uncharge(1);
+
+    // hard: charge fails, signalled once
+    assert(charge(l, 1600, 1, false) == pressure::Hard);
+    assert(charge(l, 1600, 1, false) == pressure::None);
+    assert(charge(l, 1500, 1, true) == pressure::None);
+    l.uncharge(1);
+    assert(charge(l, 1600, 1, false) == pressure::None);
+    assert(charge(l, 1398, 1, true) == pressure::None);     // 1399 < 1600 - 200
+    l.uncharge(1);
+    assert(charge(l, 1600, 1, false) == pressure::Hard);
+
+    // reservations count towards the levels as well
+    mem_limits_t r{ 100, 0 };
+    assert(charge(r, 0, 60, true) == pressure::None);
+    assert(charge(r, 0, 60, true) == pressure::Soft);
+    assert(r.reserved == 120);
+
+    printf("mem_limits: hysteresis tests passed\n");
+}
+
+int main()
+{
+    test_unlimited();
+    test_reservation();
+    test_hysteresis();
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include "pmem.h"
+#include "page_bitmap.h"
+
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <unordered_set>
+#include <vector>
+
+static void init_buddy(PmemAllocator &pm, uint64_t ddr_start, uint64_t ddr_end)
+{
+    uint64_t buddy_start = ddr_start & ~(pm.MaxBuddySize() - 1);
+    uint64_t buddy_end = (ddr_end + (pm.MaxBuddySize() - 1)) & ~(pm.MaxBuddySize() - 1);
+
+    auto total_length = buddy_end - buddy_start;
+    auto mem = new uint8_t[pm.BuddyMemSize(total_length)];
+    pm.init(mem, total_length);
+
+    while(ddr_start < ddr_end)
+    {
+        auto max_size = 1ULL << std::countr_zero(ddr_start);
+        while(max_size > pm.MaxBuddySize())
+            max_size /= 2ULL;
+        while((ddr_start + max_size) > ddr_end)
+            max_size /= 2ULL;
+
+        PMemBlock pb;
+        pb.base = ddr_start;
+        pb.length = max_size;
+        pb.valid = true;
+        pm.release(pb);
+
+        ddr_start += max_size;
+    }
+}
+
+/* Random inserts and erases against a std::set, including the runs seen on teardown */
+static void test_page_bitmap()
+{
+    page_bitmap<PMEM_BASE> pbm;
+    std::set<uint64_t> ref;
+    std::mt19937 rng(1);
+
+    assert(!pbm.insert(PMEM_BASE - 65536));
+    assert(!pbm.insert(PMEM_BASE + 8 * 512ULL * 1024 * 1024));
+    assert(pbm.size() == 0);
+
+    for(auto i = 0U; i < 200000; i++)
+    {
+        // clustered, so that runs form and cross the 512 MiB leaves
+        auto addr = PMEM_BASE + 512ULL * 1024 * 1024 * (rng() % 8) - 65536ULL * 64 + 65536ULL * (rng() % 1024);
+        if(addr < PMEM_BASE)
+            addr += 65536ULL * 1024;
+        bool ret, expected;
+        if(rng() % 3)
+        {
+            ret = pbm.insert(addr);
+            expected = true;
+            ref.insert(addr);
+        }
+        else
+        {
+            ret = pbm.erase(addr);
+            expected = ref.erase(addr) != 0;
+        }
+        assert(ret == expected);
+        (void)ret;
+        (void)expected;
+        assert(pbm.contains(addr) == (ref.count(addr) != 0));
+        assert(pbm.size() == ref.size());
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> runs, ref_runs;
+    pbm.for_each_run([&](uint64_t start, uint64_t length) { runs.emplace_back(start, length); });
+    for(auto addr : ref)
+    {
+        if(!ref_runs.empty() && ref_runs.back().first + ref_runs.back().second == addr)
+            ref_runs.back().second += 65536;
+        else
+            ref_runs.emplace_back(addr, 65536);
+    }
+    assert(runs == ref_runs);
+
+    pbm.clear();
+    assert(pbm.size() == 0);
+    pbm.for_each_run([](uint64_t, uint64_t) { assert(false); });
+
+    printf("owned_pages: page_bitmap tests passed (%zu runs)\n", ref_runs.size());
+}
+
+/* The previous owned page set */
+struct hash_pages
+{
+    std::unordered_set<uint32_t> p;
+
+    void add(uint64_t addr) { p.insert((uint32_t)(addr >> 16)); }
+    bool release(uint64_t addr) { return p.erase((uint32_t)(addr >> 16)) != 0; }
+    void release_all(PmemAllocator &pm)
+    {
+        for(auto curp : p)
+        {
+            PMemBlock pb;
+            pb.base = ((uint64_t)curp) << 16;
+            pb.length = 65536;
+            pb.valid = true;
+            pm.release(pb);
+        }
+        p.clear();
+    }
+};
+
+struct bitmap_pages
+{
+    page_bitmap<PMEM_BASE> p;
+
+    void add(uint64_t addr) { p.insert(addr); }
+    bool release(uint64_t addr) { return p.erase(addr); }
+    void release_all(PmemAllocator &pm)
+    {
+        // as Process::owned_pages_t::release_all
+        p.for_each_run([&](uint64_t start, uint64_t length)
+        {
+            if(length == 65536)
+            {
+                PMemBlock pb;
+                pb.base = start;
+                pb.length = 65536;
+                pb.valid = true;
+                pm.release(pb);
+            }
+            else
+            {
+                pm.release_range(start, length);
+            }
+        });
+        p.clear();
+    }
+};
+
+/* Several processes faulting in 16k pages each, interleaved as on a real system, one
+    of them unmapping some of its pages, then all of them exiting.  With fault-around
+    each fault maps a run of pages split from one buddy block. */
+template <typename T> static void bench(const char *name, unsigned int run)
+{
+    const unsigned int nprocs = 3, npages = 16384;
+
+    PmemAllocator pm;
+    init_buddy(pm, PMEM_BASE, PMEM_BASE + 0x100000000ULL);
+    auto free_start = pm.get_free_space();
+
+    std::vector<T> procs(nprocs);
+    std::vector<std::vector<uint64_t>> pages(nprocs);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for(auto i = 0U; i < npages; i += run)
+    {
+        for(auto j = 0U; j < nprocs; j++)
+        {
+            auto pb = pm.acquire(65536 * run);
+            assert(pb.valid);
+            for(auto k = 0U; k < run; k++)
+            {
+                procs[j].add(pb.base + k * 65536);
+                pages[j].push_back(pb.base + k * 65536);
+            }
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    for(auto i = 0U; i < npages; i += 4)
+    {
+        auto ret = procs[0].release(pages[0][i]);
+        assert(ret);
+        (void)ret;
+        PMemBlock pb;
+        pb.base = pages[0][i];
+        pb.length = 65536;
+        pb.valid = true;
+        pm.release(pb);
+    }
+
+    auto t2 = std::chrono::steady_clock::now();
+    for(auto &p : procs)
+        p.release_all(pm);
+    auto t3 = std::chrono::steady_clock::now();
+
+    assert(pm.get_free_space() == free_start);
+
+    auto us = [](auto a, auto b) { return std::chrono::duration<double, std::micro>(b - a).count(); };
+    printf("owned_pages: %-14s %u x %u pages, %2u per fault: fault %6.1f ns/page, exit %8.0f us\n",
+        name, nprocs, npages, run, us(t0, t1) * 1000.0 / (nprocs * npages), us(t2, t3));
+}
+
+int main()
+{
+    test_page_bitmap();
+
+    for(auto run : { 1U, 16U })
+    {
+        bench<hash_pages>("unordered_set", run);
+        bench<bitmap_pages>("page_bitmap", run);
+    }
+
+    return 0;
+}
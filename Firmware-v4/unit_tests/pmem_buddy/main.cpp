@@ -1,14 +1,19 @@
 #include "pmem.h"
 #include "block_allocator.h"
 
+#include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
+#include <thread>
 #include <vector>
 
-int main()
-{
-	PmemAllocator Pmem;
+/* Same layout as Pmem but with no per-core page caches, for comparison */
+using UncachedPmemAllocator = BuddyAllocator<65536, 0x20000000, 0x80000000, PMemBlock, 0>;
 
+template <typename Allocator> static void init_buddy(Allocator &Pmem, uint64_t *_ba_start, uint64_t *_ba_end,
+    bool verbose = true)
+{
 	auto ddr_start = 0x80123456ull;
 	auto ddr_end = 0x100000000ull;
 
@@ -20,8 +25,9 @@ int main()
     auto mem_required = Pmem.BuddyMemSize(total_length);
     mem_required = (mem_required + 65535ULL) & ~65535ULL;
 
-    klog("pmem: buddy from %llx to %llx needs %llx bytes.  Allocating at %llx.\n",
-        buddy_start, buddy_end, mem_required, ddr_start);
+    if (verbose)
+        klog("pmem: buddy from %llx to %llx needs %llx bytes.  Allocating at %llx.\n",
+            buddy_start, buddy_end, mem_required, ddr_start);
 
     auto mem = new uint8_t[mem_required];
 
@@ -56,11 +62,23 @@ int main()
 
         Pmem.release(pb);
 
-        klog("pmem: release %llx - %llx\n", ddr_start, ddr_start + max_size);
+        if (verbose)
+            klog("pmem: release %llx - %llx\n", ddr_start, ddr_start + max_size);
 
         ddr_start += max_size;
     }
 
+    *_ba_start = ba_start;
+    *_ba_end = ba_end;
+}
+
+static void test_random()
+{
+    PmemAllocator Pmem;
+    uint64_t ba_start, ba_end;
+    init_buddy(Pmem, &ba_start, &ba_end);
+    auto initial_free = Pmem.get_free_space();
+
     // init complete, now run some tests
 
     // use a block allocator for checking we don't allocate stuff
@@ -127,5 +145,220 @@ int main()
         }
     }
 
+    for (const auto &pmb : alloced)
+        Pmem.release(pmb);
+    assert(Pmem.get_free_space() == initial_free);
+
+    // everything should have coalesced back once the page caches are drained
+    auto big = Pmem.acquire(Pmem.MaxBuddySize());
+    assert(big.valid);
+    Pmem.release(big);
+
+    printf("pmem: random tests passed\n");
+}
+
+/* Fault-around reads several pages into one block and then frees them one at a time */
+static void test_split_release()
+{
+    auto Pmem = new PmemAllocator();
+    uint64_t ba_start, ba_end;
+    init_buddy(*Pmem, &ba_start, &ba_end, false);
+    auto initial_free = Pmem->get_free_space();
+
+    for (unsigned int npages : { 2U, 4U, 16U })
+    {
+        auto pmb = Pmem->acquire(npages * Pmem->MinBuddySize());
+        assert(pmb.valid && pmb.length == npages * Pmem->MinBuddySize());
+
+        // release out of order and from different cores
+        for (unsigned int i = 0; i < npages; i++)
+        {
+            unit_test_core_id = i % 2;
+            auto idx = (i * 7U) % npages;
+            PMemBlock page;
+            page.base = pmb.base + idx * Pmem->MinBuddySize();
+            page.length = Pmem->MinBuddySize();
+            page.valid = true;
+            Pmem->release(page);
+        }
+    }
+    unit_test_core_id = 0;
+    assert(Pmem->get_free_space() == initial_free);
+    auto big = Pmem->acquire(Pmem->MaxBuddySize());
+    assert(big.valid);
+    delete Pmem;
+
+    printf("pmem: split release tests passed\n");
+}
+
+/* Large page friendly requests: aligned beyond their size, trimmed to their length */
+static void test_aligned()
+{
+    auto Pmem = new PmemAllocator();
+    uint64_t ba_start, ba_end;
+    init_buddy(*Pmem, &ba_start, &ba_end, false);
+    auto initial_free = Pmem->get_free_space();
+
+    const uint64_t align_2m = 2ULL * 1024 * 1024;
+    std::vector<PMemBlock> blocks;
+    for (uint64_t len : { 65536ULL, 3ULL * 65536, 6ULL * 1024 * 1024, 2ULL * 1024 * 1024 + 1 })
+    {
+        auto pmb = Pmem->acquire_aligned(len, align_2m);
+        assert(pmb.valid);
+        assert((pmb.base & (align_2m - 1)) == 0);
+        assert(pmb.length == ((len + 65535ULL) & ~65535ULL));
+        blocks.push_back(pmb);
+    }
+
+    // only the trimmed lengths are in use
+    uint64_t used = 0;
+    for (const auto &pmb : blocks)
+        used += pmb.length;
+    assert(Pmem->get_free_space() == initial_free - used);
+
+    // and the trimmed tails can be handed out again
+    auto small = Pmem->acquire(65536);
+    assert(small.valid);
+    Pmem->release(small);
+
+    // a page at a time and as a range are both fine
+    for (uint64_t i = 0; i < blocks[2].length; i += 65536)
+    {
+        PMemBlock page;
+        page.base = blocks[2].base + i;
+        page.length = 65536;
+        page.valid = true;
+        Pmem->release(page);
+    }
+    for (auto i : { 0, 1, 3 })
+        Pmem->release_range(blocks[i].base, blocks[i].length);
+
+    assert(Pmem->get_free_space() == initial_free);
+    auto big = Pmem->acquire(Pmem->MaxBuddySize());
+    assert(big.valid);
+    delete Pmem;
+
+    printf("pmem: aligned tests passed\n");
+}
+
+/* Allocate every single page, free a random half of them and then see how much
+    can still be allocated in large blocks */
+template <typename Allocator> static void bench_fragmentation(const char *name)
+{
+    auto Pmem = new Allocator();
+    uint64_t ba_start, ba_end;
+    init_buddy(*Pmem, &ba_start, &ba_end, false);
+    auto initial_free = Pmem->get_free_space();
+
+    std::vector<PMemBlock> pages;
+    while (true)
+    {
+        unit_test_core_id = pages.size() % 2;
+        auto pmb = Pmem->acquire(Pmem->MinBuddySize());
+        if (!pmb.valid)
+            break;
+        pages.push_back(pmb);
+    }
+    assert(pages.size() * Pmem->MinBuddySize() == initial_free);
+
+    srand(2);
+    std::vector<PMemBlock> kept;
+    for (const auto &pmb : pages)
+    {
+        unit_test_core_id = rand() % 2;
+        if (rand() % 2)
+            Pmem->release(pmb);
+        else
+            kept.push_back(pmb);
+    }
+
+    uint64_t big_allocs = 0;
+    std::vector<PMemBlock> bigs;
+    while (true)
+    {
+        auto pmb = Pmem->acquire(4 * Pmem->MinBuddySize());
+        if (!pmb.valid)
+            break;
+        bigs.push_back(pmb);
+        big_allocs++;
+    }
+
+    for (const auto &pmb : kept)
+        Pmem->release(pmb);
+    for (const auto &pmb : bigs)
+        Pmem->release(pmb);
+    unit_test_core_id = 0;
+    assert(Pmem->get_free_space() == initial_free);
+    auto max_block = Pmem->acquire(Pmem->MaxBuddySize());
+    assert(max_block.valid);
+
+    printf("pmem: %-8s fragmentation: %zu pages, half freed randomly, then %llu 256 kiB allocations\n",
+        name, pages.size(), (unsigned long long)big_allocs);
+    delete Pmem;
+}
+
+/* Page fault style load: each thread repeatedly maps and unmaps single pages out
+    of its own working set, with the odd larger allocation mixed in */
+template <typename Allocator> static void bench_throughput(const char *name, unsigned int nthreads)
+{
+    const unsigned int iters = 1000000;
+    const unsigned int working_set = 256;
+
+    auto Pmem = new Allocator();
+    uint64_t ba_start, ba_end;
+    init_buddy(*Pmem, &ba_start, &ba_end, false);
+
+    std::atomic<bool> go = false;
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < nthreads; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            unit_test_core_id = i;
+            std::vector<PMemBlock> slots(working_set);
+            while (!go.load());
+            for (unsigned int j = 0; j < iters; j++)
+            {
+                auto &slot = slots[(j * 7919U) % working_set];
+                if (slot.valid)
+                    Pmem->release(slot);
+                slot = Pmem->acquire((j % 64) ? Pmem->MinBuddySize() : 16 * Pmem->MinBuddySize());
+                assert(slot.valid);
+            }
+            for (const auto &pmb : slots)
+            {
+                if (pmb.valid)
+                    Pmem->release(pmb);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &t : threads)
+        t.join();
+    auto end = std::chrono::steady_clock::now();
+
+    auto secs = std::chrono::duration<double>(end - start).count();
+    printf("pmem: %-8s throughput: %u threads, %6.2f Mops/s\n", name, nthreads,
+        (double)iters * nthreads / secs / 1e6);
+    delete Pmem;
+}
+
+int main()
+{
+    test_random();
+    test_split_release();
+    test_aligned();
+
+    bench_fragmentation<UncachedPmemAllocator>("uncached");
+    bench_fragmentation<PmemAllocator>("cached");
+
+    for (auto nthreads : { 1U, 2U })
+    {
+        bench_throughput<UncachedPmemAllocator>("uncached", nthreads);
+        bench_throughput<PmemAllocator>("cached", nthreads);
+    }
+
     return 0;
 }
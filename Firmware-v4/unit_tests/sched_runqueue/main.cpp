@@ -0,0 +1,249 @@
+#include "runqueue.h"
+#include "timeoutheap.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+constexpr int npriorities = 5;
+
+struct FakeThread
+{
+    RunQueueNode<FakeThread> rq;
+    int prio;
+    bool blocked = false;
+    std::atomic<bool> sl{false};
+};
+
+using rq_t = RunQueue<FakeThread, npriorities>;
+
+/* Previous scheduler algorithm: scan every thread at every priority from the top,
+    taking a lock and checking the blocking state of each candidate */
+struct LinearScheduler
+{
+    struct list_t
+    {
+        std::vector<FakeThread *> v;
+        int index = -1;
+    };
+    list_t tlist[npriorities];
+    FakeThread *running = nullptr;
+
+    void add(FakeThread *t) { tlist[t->prio].v.push_back(t); }
+
+    FakeThread *pick()
+    {
+        for(int i = npriorities - 1; i >= 0; i--)
+        {
+            auto vsize = static_cast<int>(tlist[i].v.size());
+            for(int basei = 0; basei < vsize; basei++)
+            {
+                auto iter = (basei + tlist[i].index + 1) % vsize;
+                auto t = tlist[i].v[iter];
+
+                // emulate is_blocking() taking the thread's blocking spinlock
+                while(t->sl.exchange(true, std::memory_order_acquire));
+                auto is_blocking = t->blocked;
+                t->sl.store(false, std::memory_order_release);
+
+                if(!is_blocking && t != running)
+                {
+                    tlist[i].index = iter;
+                    return t;
+                }
+            }
+        }
+        return nullptr;
+    }
+};
+
+static void test_basic()
+{
+    rq_t q;
+    FakeThread t[6];
+    for(int i = 0; i < 6; i++)
+        t[i].prio = i % 3 + 1;
+
+    assert(q.empty());
+    assert(q.highest() == -1);
+
+    for(auto &ct : t)
+        q.push_back(&ct, ct.prio);
+
+    assert(q.size() == 6);
+    assert(q.highest() == 3);
+    assert(q.next_below(3) == 2);
+    assert(q.next_below(2) == 1);
+    assert(q.next_below(1) == -1);
+
+    // round robin order within a priority
+    assert(q.front(3) == &t[2]);
+    q.rotate(&t[2]);
+    assert(q.front(3) == &t[5]);
+    assert(rq_t::next(&t[5]) == &t[2]);
+
+    // erase from the middle and ends
+    q.erase(&t[5]);
+    assert(!t[5].rq.queued());
+    assert(q.front(3) == &t[2]);
+    q.erase(&t[2]);
+    assert(q.highest() == 2);
+    assert(q.size(3) == 0);
+
+    // double erase is harmless
+    q.erase(&t[2]);
+    assert(q.size() == 4);
+
+    assert(q.pop_front(2) == &t[1]);
+    assert(q.pop_front(2) == &t[4]);
+    assert(q.pop_front(2) == nullptr);
+    assert(q.highest() == 1);
+
+    // out of range priorities are clamped
+    q.push_back(&t[2], 99);
+    assert(q.highest() == npriorities - 1);
+    q.erase(&t[2]);
+    q.push_back(&t[2], -5);
+    assert(q.front(0) == &t[2]);
+
+    printf("runqueue: basic tests passed\n");
+}
+
+struct FakeSleeper
+{
+    TimeoutHeapNode<uint64_t> tq;
+};
+
+static void test_timeout_heap()
+{
+    TimeoutHeap<FakeSleeper, uint64_t> h;
+    std::vector<FakeSleeper> s(1000);
+    std::vector<FakeSleeper *> ref;
+
+    srand(2);
+    h.reserve(s.size());
+
+    for(unsigned int i = 0; i < 20000; i++)
+    {
+        auto &cs = s[rand() % s.size()];
+        switch(rand() % 3)
+        {
+            case 0:
+                // insert or change timeout
+                h.insert(&cs, rand() % 100000);
+                if(std::find(ref.begin(), ref.end(), &cs) == ref.end())
+                    ref.push_back(&cs);
+                break;
+            case 1:
+                // early wakeup
+                h.erase(&cs);
+                std::erase(ref, &cs);
+                assert(!cs.tq.queued());
+                break;
+            case 2:
+                // expiry
+                if(!ref.empty())
+                {
+                    auto min_iter = std::min_element(ref.begin(), ref.end(),
+                        [](auto a, auto b) { return a->tq.key < b->tq.key; });
+                    auto t = h.pop();
+                    assert(t);
+                    assert(t->tq.key == (*min_iter)->tq.key);
+                    std::erase(ref, t);
+                }
+                else
+                {
+                    assert(h.pop() == nullptr);
+                }
+                break;
+        }
+        assert(h.size() == ref.size());
+    }
+
+    printf("timeoutheap: tests passed\n");
+}
+
+template <typename Pick, typename Wake, typename Block>
+static double run_bench(std::vector<FakeThread> &threads, unsigned int iters,
+    Pick pick, Wake wake, Block block)
+{
+    srand(1);
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        // wake a random thread, and block whatever is running, so the number of runnable
+        //  threads stays roughly constant as the total grows
+        auto &wt = threads[rand() % threads.size()];
+        if(wt.blocked)
+            wake(&wt);
+
+        auto t = pick();
+        if(t)
+            block(t);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (double)iters;
+}
+
+static void bench(size_t nthreads)
+{
+    const unsigned int iters = 200000;
+    const size_t nrunnable = 4;
+
+    auto make_threads = [&]()
+    {
+        std::vector<FakeThread> threads(nthreads);
+        for(size_t i = 0; i < nthreads; i++)
+        {
+            threads[i].prio = (int)(i % 3) + 1;
+            threads[i].blocked = i >= nrunnable;
+        }
+        return threads;
+    };
+
+    // linear scan
+    auto lthreads = make_threads();
+    LinearScheduler ls;
+    for(auto &t : lthreads)
+        ls.add(&t);
+    auto lin_ns = run_bench(lthreads, iters,
+        [&]() { return ls.running = ls.pick(); },
+        [&](FakeThread *t) { t->blocked = false; },
+        [&](FakeThread *t) { t->blocked = true; });
+
+    // run queue
+    auto qthreads = make_threads();
+    rq_t q;
+    for(auto &t : qthreads)
+    {
+        if(!t.blocked)
+            q.push_back(&t, t.prio);
+    }
+    auto rq_ns = run_bench(qthreads, iters,
+        [&]() -> FakeThread * {
+            auto prio = q.highest();
+            return prio >= 0 ? q.pop_front(prio) : nullptr;
+        },
+        [&](FakeThread *t) { t->blocked = false; q.push_back(t, t->prio); },
+        [&](FakeThread *t) { t->blocked = true; });
+
+    printf("runqueue: %4zu threads: linear scan %8.1f ns/pick, run queue %6.1f ns/pick\n",
+        nthreads, lin_ns, rq_ns);
+}
+
+int main()
+{
+    test_basic();
+    test_timeout_heap();
+
+    for(auto n : { 10, 25, 50, 100, 250, 500 })
+    {
+        bench((size_t)n);
+    }
+
+    return 0;
+}
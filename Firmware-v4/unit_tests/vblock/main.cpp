@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+#include "vblock.h"
+
+constexpr uintptr_t base = 0xffffff0000000000ULL;
+
+static VMemBlock alloc(VBlock &vb, size_t len)
+{
+    auto ret = vb.Alloc(len);
+    if(ret.valid)
+    {
+        assert(ret.length == len);
+        assert((ret.base % len) == 0);
+    }
+    return ret;
+}
+
+static void free_block(VBlock &vb, uintptr_t addr, size_t len)
+{
+    VMemBlock v = InvalidVMemBlock();
+    v.base = addr;
+    v.length = len;
+    v.valid = true;
+    auto ret = vb.Free(v);
+    assert(ret);
+    (void)ret;
+}
+
+/* Fill each level until allocation fails, then check freed blocks are found again */
+static void test_exhaust()
+{
+    for(auto len : { VBLOCK_512M, VBLOCK_4M, VBLOCK_64k })
+    {
+        VBlock vb;
+        vb.init(base, 2);
+
+        std::vector<uintptr_t> blocks;
+        while(true)
+        {
+            auto b = alloc(vb, len);
+            if(!b.valid)
+                break;
+            blocks.push_back(b.base);
+        }
+        assert(blocks.size() == 2 * (VBLOCK_512M / len));
+
+        // freed blocks come back, in whatever order
+        std::set<uintptr_t> freed;
+        for(auto i = 0U; i < blocks.size(); i += 37)
+        {
+            free_block(vb, blocks[i], len);
+            freed.insert(blocks[i]);
+        }
+        while(!freed.empty())
+        {
+            auto b = alloc(vb, len);
+            assert(b.valid && freed.count(b.base));
+            freed.erase(b.base);
+        }
+        assert(!alloc(vb, len).valid);
+    }
+
+    printf("vblock: exhaust tests passed\n");
+}
+
+/* Random mix of sizes against a map of live blocks */
+static void test_random()
+{
+    VBlock vb;
+    vb.init(base, 64);
+
+    std::mt19937 rng(1);
+    std::map<uintptr_t, size_t> live;
+    std::vector<uintptr_t> live_addrs;
+    unsigned int nfail = 0;
+
+    for(auto i = 0U; i < 200000; i++)
+    {
+        if(rng() % 5 < 3 || live_addrs.empty())
+        {
+            auto r = rng() % 100;
+            auto len = r < 70 ? VBLOCK_64k : r < 98 ? VBLOCK_4M : VBLOCK_512M;
+            auto b = alloc(vb, len);
+            if(!b.valid)
+            {
+                nfail++;
+                continue;
+            }
+
+            // must not overlap its neighbours
+            auto next = live.lower_bound(b.base);
+            assert(next == live.end() || next->first >= b.base + len);
+            assert(next == live.begin() || std::prev(next)->first + std::prev(next)->second <= b.base);
+            live[b.base] = len;
+            live_addrs.push_back(b.base);
+
+            auto [vbv, tag] = vb.Valid(b.base + len - 1);
+            assert(vbv.valid && vbv.base == b.base && vbv.length == len);
+        }
+        else
+        {
+            auto idx = rng() % live_addrs.size();
+            auto addr = live_addrs[idx];
+            live_addrs[idx] = live_addrs.back();
+            live_addrs.pop_back();
+            free_block(vb, addr, live[addr]);
+            live.erase(addr);
+            assert(!vb.Valid(addr).first.valid);
+        }
+    }
+
+    printf("vblock: random tests passed (%zu live, %u full)\n", live.size(), nfail);
+}
+
+/* Free a random live block of len and allocate another in its place, n times.  The
+    freed slot is rarely the next free one after the last accessed entry, so each
+    allocation has to search */
+static double time_refill(VBlock &vb, std::vector<uintptr_t> &live, size_t len, unsigned int n,
+    std::mt19937 &rng)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for(auto i = 0U; i < n; i++)
+    {
+        auto idx = rng() % live.size();
+        free_block(vb, live[idx], len);
+        auto b = alloc(vb, len);
+        assert(b.valid);
+        live[idx] = b.base;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+}
+
+/* As time_refill, returning the most bitmap words any one allocation examined */
+static uint64_t max_examined(VBlock &vb, std::vector<uintptr_t> &live, size_t len, unsigned int n,
+    std::mt19937 &rng)
+{
+    uint64_t ret = 0;
+    for(auto i = 0U; i < n; i++)
+    {
+        auto idx = rng() % live.size();
+        free_block(vb, live[idx], len);
+        auto before = summary_bitmap_words_examined;
+        auto b = alloc(vb, len);
+        assert(b.valid);
+        ret = std::max(ret, summary_bitmap_words_examined - before);
+        live[idx] = b.base;
+    }
+    return ret;
+}
+
+/* Best of several runs after a warm-up, alternating between the two allocators so that
+    host noise hits both alike */
+static std::pair<double, double> time_refill_min(VBlock &a, std::vector<uintptr_t> &live_a,
+    VBlock &b, std::vector<uintptr_t> &live_b, size_t len, unsigned int n)
+{
+    const unsigned int nruns = 5;
+    std::mt19937 rng(3);
+
+    time_refill(a, live_a, len, n, rng);
+    time_refill(b, live_b, len, n, rng);
+
+    double ta = 0.0, tb = 0.0;
+    for(auto i = 0U; i < nruns; i++)
+    {
+        auto ra = time_refill(a, live_a, len, n, rng);
+        auto rb = time_refill(b, live_b, len, n, rng);
+        ta = i ? std::min(ta, ra) : ra;
+        tb = i ? std::min(tb, rb) : rb;
+    }
+    return { ta, tb };
+}
+
+static uintptr_t take_random(std::vector<uintptr_t> &v, std::mt19937 &rng)
+{
+    auto idx = rng() % v.size();
+    auto ret = v[idx];
+    v[idx] = v.back();
+    v.pop_back();
+    return ret;
+}
+
+/* Allocation time should not depend on how full or fragmented the space is */
+static void test_fragmented()
+{
+    const unsigned int n = 20000;
+
+    // a few live blocks of each size in an otherwise empty space
+    VBlock fresh;
+    fresh.init(base, 2040);
+    std::vector<uintptr_t> fresh_4M, fresh_64k;
+    for(auto i = 0U; i < 64; i++)
+    {
+        auto b = alloc(fresh, VBLOCK_4M);
+        assert(b.valid);
+        fresh_4M.push_back(b.base);
+        b = alloc(fresh, VBLOCK_64k);
+        assert(b.valid);
+        fresh_64k.push_back(b.base);
+    }
+
+    // fill the whole space with 4 MiB blocks, punch sparse holes and fill those
+    //  with 64 kiB blocks, then free a scattering of each
+    VBlock vb;
+    vb.init(base, 2040);
+    std::vector<uintptr_t> all4M, b4M, b64k;
+    while(true)
+    {
+        auto b = alloc(vb, VBLOCK_4M);
+        if(!b.valid)
+            break;
+        all4M.push_back(b.base);
+    }
+    for(auto i = 0U; i < all4M.size(); i++)
+    {
+        if(i % 97)
+            b4M.push_back(all4M[i]);
+        else
+            free_block(vb, all4M[i], VBLOCK_4M);
+    }
+    while(true)
+    {
+        auto b = alloc(vb, VBLOCK_64k);
+        if(!b.valid)
+            break;
+        b64k.push_back(b.base);
+    }
+    assert(!alloc(vb, VBLOCK_4M).valid);
+
+    std::mt19937 rng(2);
+    for(auto i = 0U; i < 200; i++)
+    {
+        free_block(vb, take_random(b64k, rng), VBLOCK_64k);
+        free_block(vb, take_random(b4M, rng), VBLOCK_4M);
+    }
+
+    /* Each search is a few find_from calls over at most a few bitmap words whatever the
+        fill, rather than a scan which grows with the entries at each level.  None at all
+        means the searches no longer go through the bitmaps. */
+    const uint64_t max_words = 32;
+    std::mt19937 rng_ex(4);
+    auto ex_64k = max_examined(vb, b64k, VBLOCK_64k, n, rng_ex);
+    auto ex_4M = max_examined(vb, b4M, VBLOCK_4M, n, rng_ex);
+    printf("vblock: most bitmap words examined per fragmented alloc: 64 kiB %llu, 4 MiB %llu\n",
+        (unsigned long long)ex_64k, (unsigned long long)ex_4M);
+    assert(ex_64k > 0 && ex_64k <= max_words);
+    assert(ex_4M > 0 && ex_4M <= max_words);
+
+    auto [empty_64k, frag_64k] = time_refill_min(fresh, fresh_64k, vb, b64k, VBLOCK_64k, n);
+    auto [empty_4M, frag_4M] = time_refill_min(fresh, fresh_4M, vb, b4M, VBLOCK_4M, n);
+
+    printf("vblock: space filled with %zu 4 MiB and %zu 64 kiB blocks\n", b4M.size(), b64k.size());
+    printf("vblock: 64 kiB free+alloc: empty %.0f ns, fragmented %.0f ns\n", empty_64k, frag_64k);
+    printf("vblock: 4 MiB free+alloc: empty %.0f ns, fragmented %.0f ns\n", empty_4M, frag_4M);
+
+    /* A scan of the level arrays is orders of magnitude slower when fragmented, so a
+        loose relative bound on the best runs catches it without depending on the host */
+    assert(frag_64k < empty_64k * 50);
+    assert(frag_4M < empty_4M * 50);
+    printf("vblock: fragmented tests passed\n");
+}
+
+int main()
+{
+    test_exhaust();
+    test_random();
+    test_fragmented();
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef UNIT_TEST_H
+#define UNIT_TEST_H
+
+#include <cstdlib>
+#include <string>
+#include "ostypes.h"
+
+#define PMEM_TO_VMEM(a) ((uintptr_t)(a))
+
+class CriticalGuard
+{
+	Spinlock &s;
+
+public:
+	CriticalGuard(Spinlock &_s) : s(_s) { s.lock(); }
+	~CriticalGuard() { s.unlock(); }
+};
+
+// the level tables are the only physical pages vblock asks for
+struct UnitTestPmem
+{
+	PMemBlock acquire(size_t len)
+	{
+		PMemBlock ret;
+		ret.base = (uint64_t)aligned_alloc(len, len);
+		ret.length = len;
+		ret.valid = ret.base != 0;
+		return ret;
+	}
+};
+
+inline UnitTestPmem Pmem;
+
+#endif
@@ -0,0 +1,276 @@
+#include "lzpage.h"
+#include "zram.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+constexpr size_t page_size = ZramStore::page_size;
+
+struct page_t
+{
+    alignas(64) uint8_t d[page_size];
+};
+
+static void fill_zero(page_t &p, unsigned int)
+{
+    memset(p.d, 0, page_size);
+}
+
+static void fill_pattern(page_t &p, unsigned int seed)
+{
+    auto v = 0x0123456789abcdefULL * (seed + 1);
+    auto d = (uint64_t *)p.d;
+    for(size_t i = 0; i < page_size / 8; i++)
+        d[i] = v;
+}
+
+static void fill_random(page_t &p, unsigned int seed)
+{
+    for(size_t i = 0; i < page_size; i++)
+    {
+        seed = seed * 1103515245U + 12345U;
+        p.d[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+static void fill_text(page_t &p, unsigned int seed)
+{
+    static const char *words[] = { "the ", "process ", "page ", "fault ", "memory ", "kernel ",
+        "thread ", "mutex ", "of ", "and ", "to ", "a ", "in ", "is ", "file ", "swap ",
+        "\n", "buffer ", "zero ", "block " };
+    size_t i = 0;
+    while(i < page_size)
+    {
+        seed = seed * 1103515245U + 12345U;
+        auto w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        while(*w && i < page_size)
+            p.d[i++] = (uint8_t)*w++;
+    }
+}
+
+/* Typical user heap: small structs of pointers, counters and flags with some
+    zeroed free space */
+static void fill_heap(page_t &p, unsigned int seed)
+{
+    memset(p.d, 0, page_size);
+    auto d = (uint64_t *)p.d;
+    for(size_t i = 0; i < page_size / 8 * 3 / 4; i += 8)
+    {
+        seed = seed * 1103515245U + 12345U;
+        d[i] = 0x0000007f80010000ULL + ((seed >> 8) & 0xfff0);
+        d[i + 1] = 0x0000007f80010000ULL + ((seed >> 12) & 0xfff0);
+        d[i + 2] = (seed >> 20) & 0xff;
+        d[i + 3] = 1;
+        d[i + 4] = 0x3ff0000000000000ULL;
+    }
+}
+
+/* Random bytes in the first half, zeros in the second */
+static void fill_half(page_t &p, unsigned int seed)
+{
+    fill_random(p, seed);
+    memset(&p.d[page_size / 2], 0, page_size / 2);
+}
+
+struct generator_t
+{
+    const char *name;
+    void (*fill)(page_t &p, unsigned int seed);
+    bool compressible;
+};
+
+static const generator_t generators[] =
+{
+    { "zero", fill_zero, true },
+    { "pattern", fill_pattern, true },
+    { "text", fill_text, true },
+    { "heap", fill_heap, true },
+    { "half", fill_half, true },
+    { "random", fill_random, false },
+};
+
+static void test_roundtrip()
+{
+    auto src = new page_t;
+    auto out = new page_t;
+    std::vector<uint8_t> buf(page_size * 2);
+
+    for(const auto &g : generators)
+    {
+        for(unsigned int seed = 0; seed < 16; seed++)
+        {
+            g.fill(*src, seed);
+
+            auto clen = lzpage_compress(src->d, page_size, buf.data(), buf.size());
+            assert(clen);
+            if(g.compressible)
+                assert(clen <= ZramStore::max_stored);
+            else
+                assert(lzpage_compress(src->d, page_size, buf.data(), ZramStore::max_stored) == 0);
+
+            memset(out->d, 0xa5, page_size);
+            assert(lzpage_decompress(buf.data(), clen, out->d, page_size));
+            assert(memcmp(src->d, out->d, page_size) == 0);
+
+            // truncated or wrongly sized input must fail rather than overrun
+            assert(!lzpage_decompress(buf.data(), clen - 1, out->d, page_size));
+            assert(!lzpage_decompress(buf.data(), clen, out->d, page_size - 1));
+        }
+    }
+
+    // short and odd-sized inputs
+    for(size_t len : { (size_t)1, (size_t)7, (size_t)12, (size_t)13, (size_t)100, (size_t)4097 })
+    {
+        fill_text(*src, (unsigned int)len);
+        auto clen = lzpage_compress(src->d, len, buf.data(), buf.size());
+        assert(clen);
+        assert(lzpage_decompress(buf.data(), clen, out->d, len));
+        assert(memcmp(src->d, out->d, len) == 0);
+    }
+
+    uint64_t fill;
+    fill_pattern(*src, 3);
+    assert(lzpage_same_filled(src->d, page_size, &fill) && fill == ((uint64_t *)src->d)[0]);
+    src->d[page_size - 1] ^= 1;
+    assert(!lzpage_same_filled(src->d, page_size, &fill));
+
+    delete src;
+    delete out;
+
+    printf("zram: lzpage round trip tests passed\n");
+}
+
+static void test_store()
+{
+    ZramStore zs;
+    const uint32_t nslots = 64;
+    assert(zs.init(nslots));
+
+    // slot 0 is reserved, so one fewer usable
+    std::vector<uint32_t> slots;
+    for(uint32_t i = 0; i < nslots - 1; i++)
+    {
+        auto d = malloc(16);
+        auto slot = zs.insert(d, 16, 0, i % 3);
+        assert(slot != 0 && slot < nslots);
+        slots.push_back(slot);
+    }
+    assert(zs.insert(nullptr, 0, 0, 0) == 0);
+    assert(zs.stats().rejects == 1);
+    assert(zs.stats().stored_pages == nslots - 1);
+
+    auto s = zs.get(slots[5]);
+    assert(s && s->clen == 16 && s->owner == 5 % 3);
+    assert(zs.get(0) == nullptr);
+
+    free(zs.erase(slots[5]));
+    assert(zs.get(slots[5]) == nullptr);
+    assert(zs.erase(slots[5]) == nullptr);
+
+    // freed slot is reused, same-filled pages hold no buffer
+    auto slot = zs.insert(nullptr, 0, 0x1234, 1);
+    assert(slot == slots[5]);
+    assert(zs.get(slot)->fill == 0x1234);
+    assert(zs.stats().same_filled == 1);
+
+    // owner 0 had slots 0, 3, 6... minus none erased
+    assert(zs.owner_pages(0) == 21 && zs.owner_pages(1) == 22 && zs.owner_pages(2) == 20);
+    unsigned int nfreed = 0;
+    auto n = zs.release_owner(0, [&](void *d) { free(d); nfreed++; });
+    assert(n == 21 && nfreed == 21);
+    assert(zs.stats().stored_pages == nslots - 1 - 21);
+    assert(zs.owner_pages(0) == 0);
+
+    printf("zram: slot store tests passed\n");
+}
+
+static void bench()
+{
+    const unsigned int npages = 64;
+    auto src = new page_t[npages];
+    auto out = new page_t;
+    std::vector<uint8_t> buf(page_size);
+
+    for(const auto &g : generators)
+    {
+        for(unsigned int i = 0; i < npages; i++)
+            g.fill(src[i], i);
+
+        const unsigned int reps = 8;
+        size_t total_clen = 0;
+        unsigned int stored = 0;
+        double ctime = 0.0, dtime = 0.0;
+
+        for(unsigned int r = 0; r < reps; r++)
+        {
+            for(unsigned int i = 0; i < npages; i++)
+            {
+                uint64_t fill;
+                auto t0 = std::chrono::steady_clock::now();
+                size_t clen = 0;
+                bool same = lzpage_same_filled(src[i].d, page_size, &fill);
+                if(!same)
+                    clen = lzpage_compress(src[i].d, page_size, buf.data(), ZramStore::max_stored);
+                auto t1 = std::chrono::steady_clock::now();
+                ctime += std::chrono::duration<double>(t1 - t0).count();
+
+                if(!same && !clen)
+                {
+                    // rejected - stays resident
+                    total_clen += page_size;
+                    continue;
+                }
+                total_clen += same ? sizeof(fill) : clen;
+                stored++;
+
+                t0 = std::chrono::steady_clock::now();
+                if(same)
+                {
+                    auto d = (uint64_t *)out->d;
+                    for(size_t j = 0; j < page_size / 8; j++)
+                        d[j] = fill;
+                }
+                else if(!lzpage_decompress(buf.data(), clen, out->d, page_size))
+                {
+                    printf("zram: %s: decompress failed\n", g.name);
+                    exit(1);
+                }
+                t1 = std::chrono::steady_clock::now();
+                dtime += std::chrono::duration<double>(t1 - t0).count();
+                if(memcmp(out->d, src[i].d, page_size))
+                {
+                    printf("zram: %s: round trip mismatch\n", g.name);
+                    exit(1);
+                }
+            }
+        }
+
+        auto n = npages * reps;
+        printf("zram: %-8s ratio %6.2f:1, %3u%% stored, compress %7.1f us/page, decompress %6.1f us/page\n",
+            g.name, (double)page_size * n / (double)total_clen, stored * 100 / n,
+            ctime * 1e6 / n, stored ? dtime * 1e6 / stored : 0.0);
+    }
+
+    // compare against the cost of a page copy
+    auto t0 = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < npages; i++)
+        memcpy(out->d, src[i].d, page_size);
+    auto t1 = std::chrono::steady_clock::now();
+    printf("zram: memcpy %6.1f us/page\n", std::chrono::duration<double>(t1 - t0).count() * 1e6 / npages);
+
+    delete[] src;
+    delete out;
+}
+
+int main()
+{
+    test_roundtrip();
+    test_store();
+    bench();
+
+    return 0;
+}